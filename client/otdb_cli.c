@@ -17,6 +17,7 @@
 // Local Headers
 #include "otdb_cli.h"
 #include <otdb_cfg.h>
+#include <otdb_frame.h>
 
 // HB Library Headers
 #include <otfs.h>           
@@ -40,6 +41,8 @@ typedef struct {
     int     connected;
     uint8_t* rxbuf;
     size_t  rxbuf_size;
+    bool    binary;
+    uint32_t reqid;
 } otdb_handle_t;
 
 
@@ -149,6 +152,81 @@ static int sub_docmd(void* handle, const char* cmd, size_t cmdsize) {
 
 
 
+static int sub_doframe(void* handle, otdb_framecmd_t cmd, const char* args, const uint8_t* data, size_t datasize) {
+/// Sends a binary frame request and receives the response payload into
+/// rxbuf.  Returns the payload length, or a negative error code.
+    otdb_handle_t* otdb = handle;
+    otdb_frame_t frame;
+    uint8_t hdr[OTDB_FRAME_HDRSIZE];
+    uint8_t* txbuf;
+    size_t argsize;
+    size_t txsize;
+    ssize_t bytes_in;
+    int rc;
+    
+    if (otdb == NULL) {
+        return -1;
+    }
+    
+    /// Arguments are 0-terminated when raw data follows them
+    argsize         = (args != NULL) ? strlen(args) : 0;
+    frame.cmd       = (uint8_t)cmd;
+    frame.status    = 0;
+    frame.reqid     = ++otdb->reqid;
+    frame.length    = (uint32_t)(argsize + ((data != NULL) ? (1 + datasize) : 0));
+    txsize          = OTDB_FRAME_HDRSIZE + frame.length;
+    
+    txbuf = malloc(txsize);
+    if (txbuf == NULL) {
+        return -2;
+    }
+    otdb_frame_pack(txbuf, &frame);
+    memcpy(&txbuf[OTDB_FRAME_HDRSIZE], args, argsize);
+    if (data != NULL) {
+        txbuf[OTDB_FRAME_HDRSIZE+argsize] = 0;
+        memcpy(&txbuf[OTDB_FRAME_HDRSIZE+argsize+1], data, datasize);
+    }
+    
+    rc = otdb_connect(otdb);
+    if (rc >= 0) {
+        send(otdb->sockfd, txbuf, txsize, 0);
+        
+        ///@todo add a timeout to recv() somehow
+        bytes_in = recv(otdb->sockfd, hdr, OTDB_FRAME_HDRSIZE, MSG_WAITALL);
+        if ((bytes_in != OTDB_FRAME_HDRSIZE) || (otdb_frame_unpack(&frame, hdr) != 0)) {
+            rc = -3;
+        }
+        else if (frame.status < 0) {
+            rc = frame.status;
+        }
+        else {
+            // Payload that doesn't fit in rxbuf is received and dropped
+            size_t keep = (frame.length < otdb->rxbuf_size) ? frame.length : otdb->rxbuf_size;
+            size_t drop = frame.length - keep;
+            
+            bytes_in = (keep > 0) ? recv(otdb->sockfd, otdb->rxbuf, keep, MSG_WAITALL) : 0;
+            rc       = (bytes_in == (ssize_t)keep) ? (int)keep : -3;
+            while ((rc >= 0) && (drop > 0)) {
+                uint8_t scratch[256];
+                bytes_in = recv(otdb->sockfd, scratch, (drop < sizeof(scratch)) ? drop : sizeof(scratch), 0);
+                if (bytes_in <= 0) {
+                    rc = -3;
+                }
+                else {
+                    drop -= (size_t)bytes_in;
+                }
+            }
+        }
+        
+        otdb_disconnect(handle);
+    }
+    
+    free(txbuf);
+    return rc;
+}
+
+
+
 static int sub_get_errcode(void* handle) {
 /// Extract an error code from a file operation
     otdb_handle_t* otdb = handle;
@@ -196,6 +274,9 @@ void* otdb_init(sa_family_t socktype, const char* sockpath, size_t rxbuf_size) {
     handle->sockaddr.sun_family = socktype;
     strncpy(handle->sockaddr.sun_path, sockpath, sizeof(handle->sockaddr.sun_path)-1);
     
+    handle->binary  = false;
+    handle->reqid   = 0;
+    
     otdb_init_END:
     handle->connected = -1;
     return (void*)handle;
@@ -268,6 +349,34 @@ int otdb_disconnect(void* handle) {
 
 
 
+int otdb_binarymode(void* handle, bool enable) {
+    otdb_handle_t* otdb = handle;
+    int rc;
+    
+    if (otdb == NULL) {
+        return -1;
+    }
+    
+    otdb->binary = false;
+    if (enable == false) {
+        return 0;
+    }
+    
+    /// A server that doesn't support frames will not answer with a frame
+    rc = sub_doframe(handle, OTDB_FRAME_hello, NULL, NULL, 0);
+    if ((rc >= 1) && (otdb->rxbuf[0] >= OTDB_FRAME_VERSION)) {
+        otdb->binary = true;
+        rc = 0;
+    }
+    else {
+        rc = -1;
+    }
+    
+    return rc;
+}
+
+
+
 int otdb_newdevice(void* handle, uint64_t device_id, const char* tmpl_path) {
     int rc;
     char argstring[256];
@@ -538,6 +647,21 @@ int otdb_read(void* handle, otdb_filedata_t* output_data,
     //limit  -= cpylen; 
 
     *cursor++   = 0;
+    
+    /// In binary mode the data is received raw, without hex conversion.
+    /// The command name is not part of the frame arguments.
+    if (((otdb_handle_t*)handle)->binary) {
+        rc = sub_doframe(handle, OTDB_FRAME_r, argstring+2, NULL, 0);
+        if ((rc >= 0) && (output_data != NULL)) {
+            output_data->ptr    = ((otdb_handle_t*)handle)->rxbuf;
+            output_data->block  = block;
+            output_data->fileid = file_id;
+            output_data->offset = read_offset;
+            output_data->length = rc;
+        }
+        return (rc < 0) ? rc : 0;
+    }
+    
     rc          = sub_docmd(handle, (const char*)argstring, (size_t)(cursor-argstring));
     
     if (rc > 0) {
@@ -602,16 +726,27 @@ int otdb_readall(void* handle, otdb_filehdr_t* output_hdr, otdb_filedata_t* outp
     //limit  -= cpylen; 
 
     *cursor++   = 0;
-    rc          = sub_docmd(handle, (const char*)argstring, (size_t)(cursor-argstring));
+    
+    if (((otdb_handle_t*)handle)->binary) {
+        rc = sub_doframe(handle, OTDB_FRAME_rall, argstring+3, NULL, 0);
+    }
+    else {
+        rc = sub_docmd(handle, (const char*)argstring, (size_t)(cursor-argstring));
+    }
     
     if (rc > 0) {
         int totalsize;
         otdb_handle_t* otdb = handle;
     
-        rc = sub_get_errcode(handle);
-    
-        // Received Header is 10 bytes
-        totalsize   = sub_readhex(otdb->rxbuf, (char*)otdb->rxbuf, (size_t)rc);
+        // Received Header is 10 bytes.  In binary mode it is already raw.
+        if (otdb->binary) {
+            totalsize   = rc;
+            rc          = 0;
+        }
+        else {
+            rc          = sub_get_errcode(handle);
+            totalsize   = sub_readhex(otdb->rxbuf, (char*)otdb->rxbuf, (size_t)rc);
+        }
 
         if (output_hdr != NULL) {
             memset(output_hdr, 0, sizeof(otdb_filehdr_t));
@@ -712,19 +847,30 @@ int otdb_readhdr(void* handle, otdb_filehdr_t* output_hdr, uint64_t device_id, o
     //limit  -= cpylen; 
 
     *cursor++   = 0;
-    rc          = sub_docmd(handle, (const char*)argstring, (size_t)(cursor-argstring));
+    
+    if (((otdb_handle_t*)handle)->binary) {
+        rc = sub_doframe(handle, OTDB_FRAME_rh, argstring+3, NULL, 0);
+    }
+    else {
+        rc = sub_docmd(handle, (const char*)argstring, (size_t)(cursor-argstring));
+    }
     
     ///@todo read-out error code
     if (rc > 0) {
-        rc = sub_get_errcode(handle);
+        int totalsize;
+        otdb_handle_t* otdb = handle;
+        
+        // Received Header is 10 bytes.  In binary mode it is already raw.
+        if (otdb->binary) {
+            totalsize   = rc;
+            rc          = 0;
+        }
+        else {
+            rc          = sub_get_errcode(handle);
+            totalsize   = sub_readhex(otdb->rxbuf, (char*)otdb->rxbuf, (size_t)rc);
+        }
 
         if (output_hdr != NULL) {
-            int totalsize;
-            otdb_handle_t* otdb = handle;
-            
-            // Received Header is 10 bytes
-            totalsize   = sub_readhex(otdb->rxbuf, (char*)otdb->rxbuf, (size_t)rc);
-            
             memset(output_hdr, 0, sizeof(otdb_filehdr_t));
             
             if (totalsize >= 10) {
@@ -825,6 +971,14 @@ int otdb_writedata(void* handle, uint64_t device_id, otdb_fblock_enum block, uns
     cpylen  = snprintf(cursor, limit, "%u ", file_id);
     cursor += cpylen;
     limit  -= cpylen; 
+    
+    /// In binary mode the data follows the arguments raw, instead of Bintex
+    if (((otdb_handle_t*)handle)->binary) {
+        *cursor = 0;
+        rc      = sub_doframe(handle, OTDB_FRAME_w, argstring+2, writedata, data_size);
+        free(argstring);
+        return (rc < 0) ? rc : 0;
+    }
 
     *cursor++   = '[';
     cursor      = sub_printhex(cursor, writedata, data_size);
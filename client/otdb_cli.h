@@ -64,6 +64,18 @@ int otdb_disconnect(void* handle);
 int otdb_connect(void* handle);
 
 
+/** @brief Enables or disables binary frame mode
+  * @param handle       (void*) Handle to otdb client instance
+  * @param enable       (bool) true to use binary frames
+  * @retval             Returns 0 on success, negative if OTDB doesn't support frames
+  *
+  * In binary mode, read (r, r*, rh) and write (w) operations exchange raw
+  * binary data with OTDB instead of hex text.  Enabling it negotiates with
+  * the server, and binary mode stays off if the server doesn't support it.
+  */
+int otdb_binarymode(void* handle, bool enable);
+
+
 
 /** @brief Loads new device FS in the database
   * @param handle       (void*) Handle to otdb client instance
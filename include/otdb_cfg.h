@@ -32,6 +32,9 @@
 #ifndef OTDB_FEATURE_CLIENT
 #   define OTDB_FEATURE_CLIENT      DISABLED
 #endif
+#ifndef OTDB_FEATURE_BENCH
+#   define OTDB_FEATURE_BENCH       DISABLED
+#endif
 #ifndef OTDB_FEATURE_DEBUG
 #   if defined(__DEBUG__) || defined(DEBUG) || defined (_DEBUG)
 #       define OTDB_FEATURE_DEBUG   ENABLED
@@ -57,6 +60,90 @@
 #ifndef OTDB_PARAM_MMAP_PAGESIZE
 #   define OTDB_PARAM_MMAP_PAGESIZE (128*1024)
 #endif
+#ifndef OTDB_PARAM_LISTEN_BACKLOG
+#   define OTDB_PARAM_LISTEN_BACKLOG 128
+#endif
+#ifndef OTDB_PARAM_WORKERS
+#   define OTDB_PARAM_WORKERS       4
+#endif
+#ifndef OTDB_PARAM_OUTBUF_INIT
+#   define OTDB_PARAM_OUTBUF_INIT   (4*1024)
+#endif
+#ifndef OTDB_PARAM_OUTBUF_MAX
+#   define OTDB_PARAM_OUTBUF_MAX    (256*1024)
+#endif
+#ifndef OTDB_PARAM_OUTBUF_CHUNK
+#   define OTDB_PARAM_OUTBUF_CHUNK  (16*1024)
+#endif
+#ifndef OTDB_PARAM_OUTQUEUE_MAX
+#   define OTDB_PARAM_OUTQUEUE_MAX  (1024*1024)
+#endif
+#ifndef OTDB_PARAM_FRAME_MAX
+#   define OTDB_PARAM_FRAME_MAX     (128*1024)
+#endif
+#ifndef OTDB_PARAM_CONN_BUFINIT
+#   define OTDB_PARAM_CONN_BUFINIT  (4*1024)
+#endif
+#ifndef OTDB_PARAM_CONN_BUFMAX
+#   define OTDB_PARAM_CONN_BUFMAX   (OTDB_PARAM_FRAME_MAX + (4*1024))
+#endif
+#ifndef OTDB_PARAM_BATCH_MAX
+#   define OTDB_PARAM_BATCH_MAX     64
+#endif
+#ifndef OTDB_PARAM_DEVMGR_TIMEOUT
+#   define OTDB_PARAM_DEVMGR_TIMEOUT 3000
+#endif
+#ifndef OTDB_PARAM_DEVMGR_RETRY
+#   define OTDB_PARAM_DEVMGR_RETRY  800
+#endif
+#ifndef OTDB_PARAM_DEVMGR_WINDOW
+#   define OTDB_PARAM_DEVMGR_WINDOW 16
+#endif
+#ifndef OTDB_PARAM_INGEST_BATCH
+#   define OTDB_PARAM_INGEST_BATCH  64
+#endif
+#ifndef OTDB_PARAM_INGEST_FLUSH
+#   define OTDB_PARAM_INGEST_FLUSH  20
+#endif
+#ifndef OTDB_PARAM_SAVE_WORKERS
+#   define OTDB_PARAM_SAVE_WORKERS  32
+#endif
+#ifndef OTDB_PARAM_LOAD_WORKERS
+#   define OTDB_PARAM_LOAD_WORKERS  32
+#endif
+#ifndef OTDB_PARAM_LOAD_AHEAD
+#   define OTDB_PARAM_LOAD_AHEAD    256
+#endif
+#ifndef OTDB_PARAM_WAL_SYNC
+#   define OTDB_PARAM_WAL_SYNC      1
+#endif
+#ifndef OTDB_PARAM_WAL_FLUSH
+#   define OTDB_PARAM_WAL_FLUSH     10
+#endif
+#ifndef OTDB_PARAM_WAL_BUFMAX
+#   define OTDB_PARAM_WAL_BUFMAX    (1024*1024)
+#endif
+#ifndef OTDB_PARAM_LOCKSHARDS
+#   define OTDB_PARAM_LOCKSHARDS    64
+#endif
+#ifndef OTDB_PARAM_COW_RESERVE
+#   define OTDB_PARAM_COW_RESERVE   8192
+#endif
+#ifndef OTDB_PARAM_TXN_MAX
+#   define OTDB_PARAM_TXN_MAX       256
+#endif
+#ifndef OTDB_PARAM_TXN_WRITES
+#   define OTDB_PARAM_TXN_WRITES    32
+#endif
+#ifndef OTDB_PARAM_TXN_TIMEOUT
+#   define OTDB_PARAM_TXN_TIMEOUT   60
+#endif
+#ifndef OTDB_PARAM_QUERY_WORKERS
+#   define OTDB_PARAM_QUERY_WORKERS 32
+#endif
+#ifndef OTDB_PARAM_FIDX_MAX
+#   define OTDB_PARAM_FIDX_MAX      16
+#endif
 
 /// Automatic Checks
 
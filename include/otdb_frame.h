@@ -0,0 +1,103 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef otdb_frame_h
+#define otdb_frame_h
+
+#include <stdint.h>
+
+
+/** OTDB Binary Frame Protocol
+  * -------------------------------------------------------------------------
+  * Binary frames may be sent on the same socket as text and JSON commands.
+  * A frame starts with OTDB_FRAME_MAGIC, which can't start a text command,
+  * and it has a fixed 12 byte header.  Multi-byte fields are big endian.
+  *
+  * Byte 0      Magic (0xF5)
+  * Byte 1      Command ID (otdb_framecmd_t)
+  * Bytes 2:3   Status (int16).  0 in requests, 0 or negative error code in
+  *             responses.
+  * Bytes 4:7   Request ID (uint32).  Chosen by the client, echoed by OTDB.
+  * Bytes 8:11  Payload length (uint32)
+  *
+  * Request payload is the command arguments as text (e.g. "-i 1234 -r 0:16
+  * 3"), as used by the text protocol.  For w and pub, the arguments are
+  * terminated by a 0 byte and followed by the raw file data, which replaces
+  * the Bintex data argument.
+  *
+  * Response payload is raw binary:
+  * <LI> r:      File data </LI>
+  * <LI> r*:     File header (vl_header_t) followed by file data </LI>
+  * <LI> rh:     File header (vl_header_t) </LI>
+  * <LI> w, pub: Empty </LI>
+  * <LI> hello:  One byte, OTDB_FRAME_VERSION </LI>
+  *
+  * A client negotiates binary mode by sending a hello frame.  A server that
+  * doesn't support frames replies with a text error instead.
+  */
+
+#define OTDB_FRAME_MAGIC        0xF5
+#define OTDB_FRAME_VERSION      1
+#define OTDB_FRAME_HDRSIZE      12
+
+typedef enum {
+    OTDB_FRAME_hello    = 0,
+    OTDB_FRAME_r        = 1,
+    OTDB_FRAME_rall     = 2,    // r*
+    OTDB_FRAME_rh       = 3,
+    OTDB_FRAME_w        = 4,
+    OTDB_FRAME_pub      = 5,
+    OTDB_FRAME_MAX
+} otdb_framecmd_t;
+
+typedef struct {
+    uint8_t     cmd;
+    int16_t     status;
+    uint32_t    reqid;
+    uint32_t    length;
+} otdb_frame_t;
+
+
+static inline void otdb_frame_pack(uint8_t* dst, const otdb_frame_t* frame) {
+    dst[0]  = OTDB_FRAME_MAGIC;
+    dst[1]  = frame->cmd;
+    dst[2]  = (uint8_t)((uint16_t)frame->status >> 8);
+    dst[3]  = (uint8_t)((uint16_t)frame->status);
+    dst[4]  = (uint8_t)(frame->reqid >> 24);
+    dst[5]  = (uint8_t)(frame->reqid >> 16);
+    dst[6]  = (uint8_t)(frame->reqid >> 8);
+    dst[7]  = (uint8_t)(frame->reqid);
+    dst[8]  = (uint8_t)(frame->length >> 24);
+    dst[9]  = (uint8_t)(frame->length >> 16);
+    dst[10] = (uint8_t)(frame->length >> 8);
+    dst[11] = (uint8_t)(frame->length);
+}
+
+static inline int otdb_frame_unpack(otdb_frame_t* frame, const uint8_t* src) {
+    if (src[0] != OTDB_FRAME_MAGIC) {
+        return -1;
+    }
+    frame->cmd      = src[1];
+    frame->status   = (int16_t)(((uint16_t)src[2] << 8) | src[3]);
+    frame->reqid    = ((uint32_t)src[4] << 24) | ((uint32_t)src[5] << 16)
+                    | ((uint32_t)src[6] << 8)  | (uint32_t)src[7];
+    frame->length   = ((uint32_t)src[8] << 24) | ((uint32_t)src[9] << 16)
+                    | ((uint32_t)src[10] << 8) | (uint32_t)src[11];
+    return 0;
+}
+
+
+#endif
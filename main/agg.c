@@ -0,0 +1,262 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "agg.h"
+
+// Standard C & POSIX Libraries
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/// Vector kernels are built for x86 with target attributes, so the rest of
+/// OTDB needs no special flags, and are picked at runtime.
+#if defined(__x86_64__) || defined(__i386__)
+#   define AGG_X86      1
+#   include <immintrin.h>
+#else
+#   define AGG_X86      0
+#endif
+
+
+typedef struct {
+    const query_field_t* field;
+    double*     column;
+} agg_gather_t;
+
+
+
+
+static void sub_gatheraction(const otfs_t* dev, size_t i, void* arg) {
+    agg_gather_t* gather = arg;
+
+    if (query_number(&gather->column[i], dev->base, gather->field) == false) {
+        gather->column[i] = NAN;
+    }
+}
+
+
+size_t agg_gather(double* column, const otfs_t* dev, size_t devices, const query_field_t* field) {
+    agg_gather_t gather = {
+        .field  = field,
+        .column = column,
+    };
+    size_t count = 0;
+
+    /// Each device has its own slot, so the gather is parallel.  Slots of
+    /// devices without the field are NaN, and removed after.
+    query_parallel(dev, devices, &sub_gatheraction, &gather);
+    for (size_t i=0; i<devices; i++) {
+        if (isnan(column[i]) == 0) {
+            column[count++] = column[i];
+        }
+    }
+    return count;
+}
+
+
+
+
+static void sub_reduce_scalar(agg_result_t* result, const double* column, size_t count, size_t i) {
+/// Reduces column[i] onwards into result, which is already started
+    for (; i<count; i++) {
+        double value = column[i];
+        result->min  = (value < result->min) ? value : result->min;
+        result->max  = (value > result->max) ? value : result->max;
+        result->sum += value;
+    }
+}
+
+
+static void sub_histogram_scalar(uint64_t* hist, int bins, double lo, double hi, const double* column, size_t count, size_t i) {
+    double scale = (hi > lo) ? ((double)bins / (hi - lo)) : 0;
+
+    for (; i<count; i++) {
+        double value = column[i];
+        if ((value >= lo) && (value <= hi)) {
+            int bin = (int)((value - lo) * scale);
+            hist[(bin < bins) ? bin : (bins-1)]++;
+        }
+    }
+}
+
+
+#if AGG_X86
+__attribute__((target("sse2")))
+static void sub_reduce_sse2(agg_result_t* result, const double* column, size_t count) {
+    __m128d vmin0 = _mm_set1_pd(column[0]);
+    __m128d vmax0 = vmin0;
+    __m128d vmin1 = vmin0;
+    __m128d vmax1 = vmin0;
+    __m128d vsum0 = _mm_setzero_pd();
+    __m128d vsum1 = _mm_setzero_pd();
+    double lane[2];
+    size_t i;
+
+    /// Two accumulators, so that the adds of one don't wait on the other
+    for (i=0; (i+4)<=count; i+=4) {
+        __m128d a = _mm_loadu_pd(&column[i]);
+        __m128d b = _mm_loadu_pd(&column[i+2]);
+        vsum0 = _mm_add_pd(vsum0, a);
+        vsum1 = _mm_add_pd(vsum1, b);
+        vmin0 = _mm_min_pd(vmin0, a);
+        vmin1 = _mm_min_pd(vmin1, b);
+        vmax0 = _mm_max_pd(vmax0, a);
+        vmax1 = _mm_max_pd(vmax1, b);
+    }
+
+    _mm_storeu_pd(lane, _mm_min_pd(vmin0, vmin1));
+    result->min = (lane[0] < lane[1]) ? lane[0] : lane[1];
+    _mm_storeu_pd(lane, _mm_max_pd(vmax0, vmax1));
+    result->max = (lane[0] > lane[1]) ? lane[0] : lane[1];
+    _mm_storeu_pd(lane, _mm_add_pd(vsum0, vsum1));
+    result->sum = lane[0] + lane[1];
+
+    sub_reduce_scalar(result, column, count, i);
+}
+
+
+__attribute__((target("avx2")))
+static void sub_reduce_avx2(agg_result_t* result, const double* column, size_t count) {
+    __m256d vmin0 = _mm256_set1_pd(column[0]);
+    __m256d vmax0 = vmin0;
+    __m256d vmin1 = vmin0;
+    __m256d vmax1 = vmin0;
+    __m256d vsum0 = _mm256_setzero_pd();
+    __m256d vsum1 = _mm256_setzero_pd();
+    double lane[4];
+    size_t i;
+
+    for (i=0; (i+8)<=count; i+=8) {
+        __m256d a = _mm256_loadu_pd(&column[i]);
+        __m256d b = _mm256_loadu_pd(&column[i+4]);
+        vsum0 = _mm256_add_pd(vsum0, a);
+        vsum1 = _mm256_add_pd(vsum1, b);
+        vmin0 = _mm256_min_pd(vmin0, a);
+        vmin1 = _mm256_min_pd(vmin1, b);
+        vmax0 = _mm256_max_pd(vmax0, a);
+        vmax1 = _mm256_max_pd(vmax1, b);
+    }
+
+    _mm256_storeu_pd(lane, _mm256_min_pd(vmin0, vmin1));
+    result->min = lane[0];
+    for (int k=1; k<4; k++) {
+        result->min = (lane[k] < result->min) ? lane[k] : result->min;
+    }
+    _mm256_storeu_pd(lane, _mm256_max_pd(vmax0, vmax1));
+    result->max = lane[0];
+    for (int k=1; k<4; k++) {
+        result->max = (lane[k] > result->max) ? lane[k] : result->max;
+    }
+    _mm256_storeu_pd(lane, _mm256_add_pd(vsum0, vsum1));
+    result->sum = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+
+    sub_reduce_scalar(result, column, count, i);
+}
+
+
+__attribute__((target("avx2")))
+static void sub_histogram_avx2(uint64_t* hist, int bins, double lo, double hi, const double* column, size_t count) {
+/// Bins are computed four at a time.  The counts are still added one by one,
+/// because a gather/scatter of counts is no faster at these bin counts.
+    __m256d vlo     = _mm256_set1_pd(lo);
+    __m256d vhi     = _mm256_set1_pd(hi);
+    __m256d vscale  = _mm256_set1_pd((hi > lo) ? ((double)bins / (hi - lo)) : 0);
+    __m128i vlast   = _mm_set1_epi32(bins - 1);
+    int32_t bin[4];
+    size_t i;
+
+    for (i=0; (i+4)<=count; i+=4) {
+        __m256d value = _mm256_loadu_pd(&column[i]);
+        __m256d inrange = _mm256_and_pd(_mm256_cmp_pd(value, vlo, _CMP_GE_OQ), _mm256_cmp_pd(value, vhi, _CMP_LE_OQ));
+        int mask = _mm256_movemask_pd(inrange);
+        __m128i vbin;
+
+        /// Out of range values are masked before they're converted
+        value   = _mm256_blendv_pd(vlo, value, inrange);
+        vbin    = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_sub_pd(value, vlo), vscale));
+        vbin    = _mm_min_epi32(vbin, vlast);
+        _mm_storeu_si128((__m128i*)bin, vbin);
+        for (int k=0; k<4; k++) {
+            hist[bin[k]] += (mask >> k) & 1;
+        }
+    }
+
+    sub_histogram_scalar(hist, bins, lo, hi, column, count, i);
+}
+#endif
+
+
+
+
+agg_kernel_t agg_kernel(void) {
+#if AGG_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return AGG_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return AGG_sse2;
+    }
+#endif
+    return AGG_scalar;
+}
+
+
+const char* agg_kernelname(agg_kernel_t kernel) {
+    static const char* name[AGG_MAX] = { "scalar", "sse2", "avx2" };
+    return ((unsigned)kernel < AGG_MAX) ? name[kernel] : "";
+}
+
+
+void agg_reduce(agg_result_t* result, const double* column, size_t count, agg_kernel_t kernel) {
+    result->count   = count;
+    result->min     = 0;
+    result->max     = 0;
+    result->sum     = 0;
+    if (count == 0) {
+        return;
+    }
+
+    switch (kernel) {
+#   if AGG_X86
+        case AGG_avx2:  sub_reduce_avx2(result, column, count);
+                        break;
+        case AGG_sse2:  sub_reduce_sse2(result, column, count);
+                        break;
+#   endif
+        default:        result->min = column[0];
+                        result->max = column[0];
+                        sub_reduce_scalar(result, column, count, 0);
+                        break;
+    }
+}
+
+
+void agg_histogram(uint64_t* hist, int bins, double lo, double hi, const double* column, size_t count, agg_kernel_t kernel) {
+    if (bins <= 0) {
+        return;
+    }
+    memset(hist, 0, bins * sizeof(uint64_t));
+
+#   if AGG_X86
+    if (kernel == AGG_avx2) {
+        sub_histogram_avx2(hist, bins, lo, hi, column, count);
+        return;
+    }
+#   endif
+    sub_histogram_scalar(hist, bins, lo, hi, column, count, 0);
+}
@@ -0,0 +1,101 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef agg_h
+#define agg_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Local Headers
+#include "query.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/** Field Aggregation
+  * -------------------------------------------------------------------------
+  * Aggregates of one number field over many devices.  The field is first
+  * gathered from the device images into a column of doubles, in parallel,
+  * and the column is then reduced by a vector kernel.  Every number type
+  * fits a double exactly, except 64 bit integers beyond 2^53.
+  *
+  * Kernels are chosen at runtime: AVX2 or SSE2 on x86, else scalar.
+  */
+
+typedef struct {
+    size_t      count;
+    double      min;
+    double      max;
+    double      sum;
+} agg_result_t;
+
+typedef enum {
+    AGG_scalar = 0,
+    AGG_sse2,
+    AGG_avx2,
+    AGG_MAX
+} agg_kernel_t;
+
+
+/** @brief Gathers a field of many devices into a column
+  * @param column   (double*) Output column, with room for all the devices
+  * @param dev      (const otfs_t*) Devices
+  * @param devices  (size_t) Number of devices
+  * @param field    (const query_field_t*) Number field
+  * @retval         Number of values in the column.  Devices that don't have
+  *                 the field are left out.
+  */
+size_t agg_gather(double* column, const otfs_t* dev, size_t devices, const query_field_t* field);
+
+
+/** @brief Best kernel supported by this CPU
+  */
+agg_kernel_t agg_kernel(void);
+
+/** @brief Name of a kernel, for output
+  */
+const char* agg_kernelname(agg_kernel_t kernel);
+
+
+/** @brief Reduces a column to count, min, max and sum
+  * @param result   (agg_result_t*) Output
+  * @param column   (const double*) Column
+  * @param count    (size_t) Values in the column
+  * @param kernel   (agg_kernel_t) Kernel, from agg_kernel(), or AGG_scalar
+  */
+void agg_reduce(agg_result_t* result, const double* column, size_t count, agg_kernel_t kernel);
+
+
+/** @brief Histogram of a column, in equal bins over [lo, hi]
+  * @param hist     (uint64_t*) Output counts, one per bin
+  * @param bins     (int) Number of bins
+  * @param lo       (double) Low edge of the first bin
+  * @param hi       (double) High edge of the last bin, which includes it
+  * @param column   (const double*) Column
+  * @param count    (size_t) Values in the column
+  * @param kernel   (agg_kernel_t) Kernel, from agg_kernel(), or AGG_scalar
+  */
+void agg_histogram(uint64_t* hist, int bins, double lo, double hi, const double* column, size_t count, agg_kernel_t kernel);
+
+
+#endif
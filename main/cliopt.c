@@ -16,6 +16,9 @@
 
 
 #include "cliopt.h"
+#include "otdb_cfg.h"
+
+#include <unistd.h>
 
 
 static cliopt_t* master;
@@ -30,6 +33,16 @@ cliopt_t* cliopt_init(cliopt_t* new_master) {
     
     master->timeout_ms  = 1000;
     
+    // Socket interface parameters may be set prior to init.  Zero or
+    // negative values get defaults.
+    if (master->backlog <= 0) {
+        master->backlog = OTDB_PARAM_LISTEN_BACKLOG;
+    }
+    if (master->workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        master->workers = (cpus > 0) ? (int)cpus : OTDB_PARAM_WORKERS;
+    }
+    
     return master;
 }
 
@@ -63,3 +76,11 @@ void cliopt_settimeout(int timeout_ms) {
     master->timeout_ms = timeout_ms;
 }
 
+int cliopt_getbacklog(void) {
+    return master->backlog;
+}
+
+int cliopt_getworkers(void) {
+    return master->workers;
+}
+
@@ -44,6 +44,9 @@ typedef struct {
     
     size_t      mempool_size;
     int         timeout_ms;
+    
+    int         backlog;
+    int         workers;
 } cliopt_t;
 
 
@@ -62,6 +65,10 @@ void cliopt_setpoolsize(size_t poolsize);
 int cliopt_gettimeout(void);
 void cliopt_settimeout(int timeout_ms);
 
+int cliopt_getbacklog(void);
+
+int cliopt_getworkers(void);
+
 
 
 
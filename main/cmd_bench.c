@@ -0,0 +1,396 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "agg.h"
+#include "cmds.h"
+#include "dterm.h"
+#include "devcache.h"
+#include "hashmix.h"
+#include "query.h"
+#include "otdb_cfg.h"
+
+#if OTDB_FEATURE(BENCH)
+
+// HB Headers/Libraries
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define BENCH_LOOKUPS       1000000
+#define BENCH_AGGVALUES     10000000
+#define BENCH_MAXSIZES      8
+
+
+typedef int (*bench_t)(dterm_handle_t* dth, char* dst, size_t dstmax, const size_t* sizes, int count);
+
+typedef struct {
+    const char* name;
+    bench_t     fn;
+    size_t      sizes[BENCH_MAXSIZES];  // default sizes, 0 terminated
+} bench_item_t;
+
+
+
+
+static uint64_t sub_rand(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+
+static uint64_t sub_mkuid(uint64_t i) {
+/// Spreads sequential indices over the UID space, as real UIDs are
+    uint64_t uid = hashmix_u64(i + 1);
+    return (uid == 0) ? 1 : uid;
+}
+
+
+static double sub_nsper(const struct timespec* t0, const struct timespec* t1, size_t ops) {
+    double ns;
+    ns  = (double)(t1->tv_sec - t0->tv_sec) * 1e9;
+    ns += (double)(t1->tv_nsec - t0->tv_nsec);
+    return ns / (double)ops;
+}
+
+
+static void sub_nofree(void* ctx) {
+/// Bench devices share the template image, which isn't theirs to free
+}
+
+
+
+
+static int sub_bench_setfs(dterm_handle_t* dth, char* dst, size_t dstmax, const size_t* sizes, int count) {
+/// Device switch latency, through libotfs and through the device cache, for
+/// random devices, for the active device, and for unknown UIDs.  The cache
+/// passes switches to random devices through to libotfs, so that pair only
+/// shows what the cache adds to a switch.
+    TALLOC_CTX* heap;
+    const otfs_t* tmpl_fs = dth->ext->tmpl_fs;
+    devcache_t cache = NULL;
+    uint64_t* uids;
+    uint64_t active_uid = 0;
+    int written = 0;
+    int rc = 0;
+
+    if ((tmpl_fs == NULL) || (dth->ext->db == NULL)) {
+        return -1;
+    }
+    heap = talloc_new(dth->tctx);
+    if (heap == NULL) {
+        return -2;
+    }
+    if (devcache_init(&cache) != 0) {
+        talloc_free(heap);
+        return -3;
+    }
+
+    /// Veelite has one active device, so the active device of the open DB is
+    /// restored when done.
+    otfs_activeuid(dth->ext->db, (uint8_t*)&active_uid);
+
+    for (int s=0; (rc==0) && (s<count); s++) {
+        void* db = NULL;
+        size_t devices = sizes[s];
+        struct timespec t0, t1;
+        double ns[6];
+        uint64_t seed;
+        otfs_t fs;
+        volatile int sink = 0;
+
+        uids = talloc_array(heap, uint64_t, devices);
+        if ((uids == NULL) || (otfs_init(&db) != 0)) {
+            rc = -4;
+            break;
+        }
+        devcache_reset(cache, db);
+        for (size_t i=0; i<devices; i++) {
+            uids[i]     = sub_mkuid(i);
+            fs.uid.u64  = uids[i];
+            fs.alloc    = tmpl_fs->alloc;
+            fs.base     = tmpl_fs->base;
+            if (otfs_new(db, &fs) != 0) {
+                rc = -5;
+                break;
+            }
+            devcache_add(cache, db, &fs);
+        }
+
+        if (rc == 0) {
+            /// 0,1: random devices
+            seed = 88172645463325252ULL;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t i=0; i<BENCH_LOOKUPS; i++) {
+                sink += otfs_setfs(db, NULL, (uint8_t*)&uids[sub_rand(&seed) % devices]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[0] = sub_nsper(&t0, &t1, BENCH_LOOKUPS);
+
+            seed = 88172645463325252ULL;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t i=0; i<BENCH_LOOKUPS; i++) {
+                sink += devcache_setfs(cache, db, NULL, (uint8_t*)&uids[sub_rand(&seed) % devices]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[1] = sub_nsper(&t0, &t1, BENCH_LOOKUPS);
+
+            /// 2,3: the active device again
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t i=0; i<BENCH_LOOKUPS; i++) {
+                sink += otfs_setfs(db, NULL, (uint8_t*)&uids[devices/2]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[2] = sub_nsper(&t0, &t1, BENCH_LOOKUPS);
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t i=0; i<BENCH_LOOKUPS; i++) {
+                sink += devcache_setfs(cache, db, NULL, (uint8_t*)&uids[devices/2]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[3] = sub_nsper(&t0, &t1, BENCH_LOOKUPS);
+
+            /// 4,5: unknown UIDs, from a small set, as in a stale ID list
+            seed = 88172645463325252ULL;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t i=0; i<BENCH_LOOKUPS; i++) {
+                uint64_t uid = sub_mkuid(devices + (sub_rand(&seed) % 256));
+                sink += otfs_setfs(db, NULL, (uint8_t*)&uid);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[4] = sub_nsper(&t0, &t1, BENCH_LOOKUPS);
+
+            seed = 88172645463325252ULL;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t i=0; i<BENCH_LOOKUPS; i++) {
+                uint64_t uid = sub_mkuid(devices + (sub_rand(&seed) % 256));
+                sink += devcache_setfs(cache, db, NULL, (uint8_t*)&uid);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[5] = sub_nsper(&t0, &t1, BENCH_LOOKUPS);
+
+            written += snprintf(&dst[written], dstmax-written,
+                        "setfs devices=%zu: random otfs=%.1fns cache-passthrough=%.1fns, "
+                        "active otfs=%.1fns cache=%.1fns, unknown otfs=%.1fns cache=%.1fns\n",
+                        devices, ns[0], ns[1], ns[2], ns[3], ns[4], ns[5]);
+            if (written >= (int)dstmax) {
+                written = (int)dstmax - 1;
+            }
+        }
+
+        devcache_reset(cache, NULL);
+        otfs_deinit(db, &sub_nofree);
+        talloc_free(uids);
+    }
+
+    if (active_uid != 0) {
+        otfs_setfs(dth->ext->db, NULL, (uint8_t*)&active_uid);
+    }
+    devcache_deinit(cache);
+    talloc_free(heap);
+
+    return (rc != 0) ? rc : written;
+}
+
+
+
+
+static int sub_bench_agg(dterm_handle_t* dth, char* dst, size_t dstmax, const size_t* sizes, int count) {
+/// Aggregation of a double field, by a loop that reads and reduces each
+/// device in turn, and by agg: the parallel gather, then the reduction by the
+/// scalar kernel and by the best kernel of the CPU.  Devices are minimal
+/// images with one ISF file, so they don't need a template or a DB.
+    const size_t hdrsize = sizeof(vlFSHEADER) + sizeof(vl_header_t);
+    const size_t imgsize = (hdrsize + sizeof(double) + 7) & ~(size_t)7;
+    const query_field_t field = {
+        .name       = "bench.value",
+        .block_id   = VL_ISF_BLOCKID,
+        .file_id    = 0,
+        .pos        = 0,
+        .bitpos     = 0,
+        .type       = { .index = TYPE_double, .bits = 64 },
+    };
+    agg_kernel_t kernel = agg_kernel();
+    int written = 0;
+    int rc = 0;
+
+    for (int s=0; (rc==0) && (s<count); s++) {
+        size_t devices = sizes[s];
+        size_t reps = (devices < BENCH_AGGVALUES) ? (BENCH_AGGVALUES / devices) : 1;
+        struct timespec t0, t1;
+        double ns[4];
+        uint64_t seed = 88172645463325252ULL;
+        vlFSHEADER fshdr;
+        vl_header_t fhdr;
+        agg_result_t result;
+        uint8_t* images;
+        otfs_t* dev;
+        double* column;
+        size_t values;
+        volatile double sink = 0;
+
+        images  = talloc_zero_size(dth->tctx, devices * imgsize);
+        dev     = talloc_array(dth->tctx, otfs_t, devices);
+        column  = talloc_array(dth->tctx, double, devices);
+        if ((images == NULL) || (dev == NULL) || (column == NULL)) {
+            talloc_free(images);
+            talloc_free(dev);
+            talloc_free(column);
+            rc = -4;
+            break;
+        }
+
+        memset(&fshdr, 0, sizeof(fshdr));
+        memset(&fhdr, 0, sizeof(fhdr));
+        fshdr.isf.alloc = 1;
+        fshdr.isf.used  = 1;
+        fhdr.length     = sizeof(double);
+        fhdr.alloc      = sizeof(double);
+        fhdr.base       = (uint16_t)(imgsize - sizeof(double));
+        for (size_t i=0; i<devices; i++) {
+            uint8_t* image = &images[i * imgsize];
+            double value = (double)(sub_rand(&seed) % 100000) / 100.0;
+
+            memcpy(image, &fshdr, sizeof(fshdr));
+            memcpy(image + sizeof(fshdr), &fhdr, sizeof(fhdr));
+            memcpy(image + fhdr.base, &value, sizeof(value));
+            dev[i].uid.u64  = sub_mkuid(i);
+            dev[i].alloc    = imgsize;
+            dev[i].base     = image;
+        }
+
+        /// 0: naive loop, each device read and reduced in turn
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (size_t r=0; r<reps; r++) {
+            double min = INFINITY, max = -INFINITY, sum = 0;
+            for (size_t i=0; i<devices; i++) {
+                double value;
+                if (query_number(&value, dev[i].base, &field)) {
+                    min  = (value < min) ? value : min;
+                    max  = (value > max) ? value : max;
+                    sum += value;
+                }
+            }
+            sink += min + max + sum;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[0] = sub_nsper(&t0, &t1, devices * reps);
+
+        /// 1: gather into the column
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (size_t r=0; r<reps; r++) {
+            values = agg_gather(column, dev, devices, &field);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[1] = sub_nsper(&t0, &t1, devices * reps);
+
+        /// 2,3: reduction of the column, scalar and vector
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (size_t r=0; r<reps; r++) {
+            agg_reduce(&result, column, values, AGG_scalar);
+            sink += result.sum;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[2] = sub_nsper(&t0, &t1, devices * reps);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (size_t r=0; r<reps; r++) {
+            agg_reduce(&result, column, values, kernel);
+            sink += result.sum;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[3] = sub_nsper(&t0, &t1, devices * reps);
+
+        written += snprintf(&dst[written], dstmax-written,
+                    "agg devices=%zu: naive=%.2fns, gather=%.2fns, reduce scalar=%.2fns %s=%.2fns, per device\n",
+                    devices, ns[0], ns[1], ns[2], agg_kernelname(kernel), ns[3]);
+        if (written >= (int)dstmax) {
+            written = (int)dstmax - 1;
+        }
+
+        talloc_free(images);
+        talloc_free(dev);
+        talloc_free(column);
+    }
+
+    return (rc != 0) ? rc : written;
+}
+
+
+
+
+static const bench_item_t otdb_benches[] = {
+    { "agg",    &sub_bench_agg,     { 1000, 100000, 1000000, 0 } },
+    { "setfs",  &sub_bench_setfs,   { 1000, 100000, 1000000, 0 } },
+};
+
+
+int cmd_bench(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    char argbuf[256];
+    char* name;
+    char* tok;
+    char* tokctx;
+    size_t sizes[BENCH_MAXSIZES];
+    int count = 0;
+    int rc;
+
+    /// dt == NULL is the initialization case.
+    if (dth == NULL) {
+        return 0;
+    }
+    if ((src == NULL) || (dst == NULL) || (dstmax == 0)) {
+        *inbytes = 0;
+        return -1;
+    }
+
+    /// Arguments are plain: bench name [devices ...]
+    rc = (*inbytes < (int)sizeof(argbuf)) ? *inbytes : (int)sizeof(argbuf)-1;
+    memcpy(argbuf, src, rc);
+    argbuf[rc] = 0;
+
+    name = strtok_r(argbuf, " \t\r\n", &tokctx);
+    while ((count < BENCH_MAXSIZES) && ((tok = strtok_r(NULL, " \t\r\n", &tokctx)) != NULL)) {
+        sizes[count] = strtoull(tok, NULL, 10);
+        count += (sizes[count] != 0);
+    }
+
+    for (int i=0; i<(sizeof(otdb_benches)/sizeof(bench_item_t)); i++) {
+        if ((name != NULL) && (strcmp(name, otdb_benches[i].name) == 0)) {
+            if (count == 0) {
+                for (; otdb_benches[i].sizes[count] != 0; count++) {
+                    sizes[count] = otdb_benches[i].sizes[count];
+                }
+            }
+            rc = otdb_benches[i].fn(dth, (char*)dst, dstmax, sizes, count);
+            return (rc < 0) ? cmd_jsonout_err((char*)dst, dstmax, false, rc, "bench") : rc;
+        }
+    }
+
+    return cmd_jsonout_err((char*)dst, dstmax, false, -1, "bench");
+}
+
+#endif
@@ -18,6 +18,7 @@
 #include "cmds.h"
 #include "dterm.h"
 #include "cliopt.h"
+#include "devimage.h"
 #include "otdb_cfg.h"
 #include "debug.h"
 
@@ -82,7 +83,7 @@ extern struct arg_end*  end_man;
 
 
 static void sub_tfree(void* ctx) {
-    talloc_free(ctx);
+    devimage_free(ctx);
 }
 
 
@@ -115,7 +116,7 @@ int cmd_devnew(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
     
     /// Make sure the device doesn't already exist
     if (arglist.devid != 0) {
-        rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+        rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
         if (rc == 0) {
             rc = ERRCODE(otfs, otfs_setfs, rc);
             goto cmd_devnew_END;
@@ -128,20 +129,20 @@ int cmd_devnew(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
     if (strcmp(arglist.archive_path, "NULL") == 0) {
         newfs.uid.u64   = arglist.devid;
         newfs.alloc     = ((otfs_t*)dth->ext->tmpl_fs)->alloc;
-        newfs.base      = talloc_size(dth->pctx, newfs.alloc);
+        newfs.base      = devimage_new(dth->pctx, dth->ext->tmpl_fs, NULL, newfs.alloc);
         if (newfs.base == NULL) {
             ///@todo error casting
             rc = -2;
             goto cmd_devnew_END;
         }
         
-        memcpy(newfs.base, ((otfs_t*)dth->ext->tmpl_fs)->base, newfs.alloc);
         rc = otfs_new(dth->ext->db, &newfs);
         if (rc != 0) {
-            talloc_free(newfs.base);
+            devimage_free(newfs.base);
             rc = ERRCODE(otfs, otfs_new, rc);
             goto cmd_devnew_END;
         }
+        devcache_add(dth->ext->devcache, dth->ext->db, &newfs);
     }
     else {
         struct stat st;
@@ -154,7 +155,10 @@ int cmd_devnew(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
             rc = -4;
             goto cmd_devnew_END;
         }
-        rc = cmdsub_datafile(dth, dst, dstmax, dth->ext->tmpl, NULL, arglist.archive_path, arglist.devid, false);
+        rc = cmdsub_datafile(dth, dst, dstmax, dth->ext->schema, NULL, arglist.archive_path, arglist.devid, false);
+    }
+    if (rc == 0) {
+        rc = cmd_journaldev(dth, arglist.devid);
     }
 
     cmd_devnew_END:
@@ -179,7 +183,7 @@ int cmd_devdel(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
         DEBUGPRINT("cmd_devdel():\n  device_id=%016"PRIx64"\n", arglist.devid);
         
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, &delfs, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, &delfs, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = ERRCODE(otfs, otfs_setfs, rc);
                 goto cmd_devdel_END;
@@ -187,10 +191,16 @@ int cmd_devdel(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
             
             ///@todo delete the file!
             rc = otfs_del(dth->ext->db, &delfs, &sub_tfree);
+            devcache_del(dth->ext->devcache, dth->ext->db, arglist.devid);
             if (rc != 0) {
                 rc = ERRCODE(otfs, otfs_del, rc);
                 goto cmd_devdel_END;
             }
+            wal_rec_t rec = {
+                .op     = WAL_devdel,
+                .uid    = arglist.devid,
+            };
+            rc = cmd_journal(dth, &rec, NULL, 0);
         }
     }
 
@@ -215,7 +225,7 @@ int cmd_devset(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
         DEBUGPRINT("cmd_devset():\n  device_id=%016"PRIx64"\n", arglist.devid);
         
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
             }
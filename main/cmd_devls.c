@@ -83,7 +83,7 @@ static int devls_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t
     int rc;
     
     if (arglist->jsonout_flag) {
-        rc = snprintf((char*)dst, dstmax, "\"%"PRIx64"\",", devfs->uid.u64);
+        rc = snprintf((char*)dst, dstmax, "%s\"%"PRIx64"\"", (index > 1) ? "," : "", devfs->uid.u64);
     }
     else {
         rc = snprintf((char*)dst, dstmax, "%i. %"PRIx64"\n", index, devfs->uid.u64);
@@ -101,7 +101,7 @@ static int devls_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t
 int cmd_devls(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     int rc;
     uint8_t* dstcurs;
-    int dstlimit;
+    size_t dstlimit;
     int newchars;
     
     cmd_arglist_t arglist = {
@@ -127,48 +127,48 @@ int cmd_devls(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, siz
     DEBUGPRINT("cmd_devls()\n");
     
     /// Start formatting of command output.
+    /// The list is streamed by the iterator, so it may be much longer than
+    /// dstmax.
     dstcurs = dst;
-    dstlimit = (int)dstmax - 1;     // -1 accounts for null string terminator
-    DEBUGPRINT("dstcurs=%016llX, newchars=%i, dstlimit=%i\n", (uint64_t)dstcurs, 0, dstlimit);
+    dstlimit = dstmax - 1;          // -1 accounts for null string terminator
     
     if (arglist.jsonout_flag) {
-        dstlimit   -= 2;  // -2 accounts for JSON termination ("]}")
         newchars    = snprintf((char*)dstcurs, dstlimit, "{\"cmd\":\"dev-ls\", \"idlist\":[");
-        dstcurs    += newchars;
-        dstlimit   -= newchars;
-        DEBUGPRINT("dstcurs=%016llX, newchars=%i, dstlimit=%i\n", (uint64_t)dstcurs, newchars, dstlimit);
-        
         if (newchars < 0) {
             rc = -3;        ///@todo change to write error
             goto cmd_devls_END;
         }
-        if (dstlimit < 0) {
+        if (newchars >= (int)dstlimit) {
             rc = -4;        ///@todo change to buffer overflow error
             goto cmd_devls_END;
         }
+        dstcurs    += newchars;
+        dstlimit   -= newchars;
+        DEBUGPRINT("dstcurs=%016llX, newchars=%i, dstlimit=%zu\n", (uint64_t)dstcurs, newchars, dstlimit);
     }
     
-    rc = iterator_uids(dth, dstcurs, inbytes, &src, (size_t)dstlimit, &arglist, &devls_action);
+    rc = iterator_uids(dth, &dstcurs, inbytes, &src, &dstlimit, &arglist, &devls_action);
     if (rc < 0) {
         goto cmd_devls_END;
     }
-    if (rc > 0) {
-        dstcurs += rc - 1;      // -1 eats last comma
-    }
     if (arglist.jsonout_flag) {
+        dstcurs = dtwriter_advance(dth->out, dstcurs, &dstlimit, 3);
+        if (dstcurs == NULL) {
+            rc = -4;
+            goto cmd_devls_END;
+        }
         dstcurs += sprintf((char*)dstcurs, "]}");
-        DEBUGPRINT("dstcurs=%016llX, newchars=%i, dstlimit=%i\n", (uint64_t)dstcurs, 2, dstlimit-2);
     }
     
-    rc = (int)(dstcurs - dst);
+    /// Return the output still pending at the writer cursor
+    rc = (int)(dstcurs - dtwriter_cursor(dth->out, NULL));
     
     cmd_devls_END:
     if ((rc < 0) && arglist.jsonout_flag) {
-        rc = snprintf((char*)dst, dstmax-1, "{\"type\":\"otdb\", \"cmd\":\"dev-ls\", \"err\":%d}", rc);
+        dst = dtwriter_cursor(dth->out, &dstmax);
+        rc  = snprintf((char*)dst, dstmax-1, "{\"type\":\"otdb\", \"cmd\":\"dev-ls\", \"err\":%d}", rc);
     }
     
     return rc;
 }
 
-
-
@@ -31,12 +31,14 @@
 ///
 /// Error/Ack outputs will include an "sid" field in event that a message
 /// was sent to the network.  If sid exists, devmgr should wait for the
-/// rxstat containing a matching sid.
+/// rxstat containing a matching sid.  The matching is done by dm_mux.c, so
+/// that many commands may be waiting on devmgr at once.
 
 // Local Headers
 #include "cliopt.h"
 #include "cmds.h"
 #include "debug.h"
+#include "dm_mux.h"
 #include "dterm.h"
 #include "otdb_cfg.h"
 #include "popen2.h"
@@ -57,6 +59,7 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <poll.h>
+#include <pthread.h>
 
 #ifdef __linux__
 #   include <stdio_ext.h>
@@ -107,22 +110,6 @@ extern struct arg_end*  end_man;
 #endif
 
 
-static struct timespec diff_timespec(struct timespec start, struct timespec end) {
-    struct timespec result;
- 
-    if (end.tv_nsec < start.tv_nsec) {
-        result.tv_nsec = 1000000000 + end.tv_nsec - start.tv_nsec;
-        result.tv_sec = end.tv_sec - 1 - start.tv_sec;
-    }
-    else {
-        result.tv_nsec = end.tv_nsec - start.tv_nsec;
-        result.tv_sec = end.tv_sec - start.tv_sec;
-    }
- 
-    return result;
-}
-
-
 ///@note DEPRECATED
 static int sub_devmgr_subproc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     struct pollfd fds[1];
@@ -253,240 +240,6 @@ static int sub_devmgr_subproc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, u
 
 
 
-static cJSON* sub_json_gettype(cJSON* top, const char* typename) {
-    top = cJSON_GetObjectItemCaseSensitive(top, "type");
-    if (cJSON_IsString(top)) {
-        if (strcmp(top->valuestring, typename) == 0) {
-            return top;
-        }
-    }
-    
-    return NULL;
-}
-
-
-static int sub_json_getack(cJSON* top, uint32_t* sid) {
-    uint32_t sidval = 0;
-    int errval = -1;
-
-    cJSON* obj;
-
-    top = cJSON_GetObjectItemCaseSensitive(top, "data");
-    if (cJSON_IsObject(top)) {
-        obj = cJSON_GetObjectItemCaseSensitive(top, "err");
-        if (cJSON_IsNumber(obj)) {
-            errval = obj->valueint;
-            
-            if (sid != NULL) {
-                obj = cJSON_GetObjectItemCaseSensitive(top, "sid");
-                if (cJSON_IsNumber(obj)) {
-                    sidval = obj->valueint;
-                }
-                *sid = sidval;
-            }
-        }
-    }
-    
-    return errval;
-}
-
-
-
-static int sub_json_getframe(cJSON* top, cJSON** frame, int* qualtest) {
-    int sid = -1;
-
-    cJSON* obj;
-
-    top = cJSON_GetObjectItemCaseSensitive(top, "data");
-    if (cJSON_IsObject(top)) {
-        obj = cJSON_GetObjectItemCaseSensitive(top, "sid");
-        if (cJSON_IsNumber(obj)) {
-            sid = obj->valueint;
-            
-            if (qualtest != NULL) {
-                obj = cJSON_GetObjectItemCaseSensitive(top, "qual");
-                if (cJSON_IsNumber(obj)) {
-                    *qualtest = obj->valueint;
-                }
-            }
-            if (frame != NULL) {
-                *frame = cJSON_GetObjectItemCaseSensitive(top, "frame");
-            }
-        }
-    }
-    
-    return sid;
-}
-
-
-static int sub_devmgr_socket(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
-    uint8_t dout[1024];
-    
-    int rc;
-    int state;
-    int qualtest;
-    int cmd_err;
-    uint32_t cmd_sid;
-    struct timespec ref;
-    struct timespec test;
-    sp_reader_t reader;
-    
-    /// @todo timeout variables should be cliopt-style variables.  Currently fixed.
-    cJSON* resp             = NULL;
-    sp_handle_t sp_handle   = dth->ext->devmgr;
-    void* ctx               = talloc_new(dth->tctx);
-    int global_timeout      = 3000;
-    int read_timeout        = 800;
-    
-    ///1. Create the synchronous reader instance for sockpush module
-    reader = sp_reader_create(ctx, sp_handle);
-    if (reader == NULL) {
-        rc = -3;
-        goto sub_devmgr_socket_END;
-    }
-    
-    ///2. Set-up timeout reference
-    ref.tv_sec   = 0;
-    ref.tv_nsec  = 0;
-    if (clock_gettime(CLOCK_MONOTONIC, &ref) != 0) {
-        rc = -5;
-        goto sub_devmgr_socket_TERM;
-    }
-    
-    ///3. Write the output command to the socket.  This is the easy part
-    sub_devmgr_socket_SENDCMD:
-    DEBUG_PRINTF("Sending %i bytes to sp_sendcmd():\n%.*s\n", *inbytes, *inbytes, src);
-    rc = sp_sendcmd(sp_handle, src, (size_t)*inbytes);
-    if (rc < 0) {
-        rc = -6;
-        goto sub_devmgr_socket_TERM;
-    }
-    
-    ///4. Wait for a message to come back on the socket.  We may need to get
-    ///   more than one message.  There's a timeout enforced
-    state = 0;
-    cmd_sid = -1;
-    while (1) {
-        rc = sp_read(reader, dout, sizeof(dout), read_timeout);
-        if (rc <= 0) {
-            ERR_PRINTF("sp_read() timeout in cmd_devmgr(): %i ms\n", read_timeout);
-            rc = -4; //-4 == retry
-        }
-        else {
-            DEBUG_PRINTF("Read %i bytes from sp_read():\n%.*s\n", rc, rc, dout);
-            rc = -1;
-            qualtest = 0;
-            resp = cJSON_Parse((const char*)dout);
-            if (resp != NULL) {
-                switch (state) {
-                // State 0: looking for an ACK that has cmd string and sid int
-                //{"type":"ack", "data":{"cmd":"(STRING)", "err":0, "sid":(INT)}}
-                // - If err is non-zero, there was a problem with the command
-                // - If sid is zero, this command doesn't have a packet, and
-                //   thus the operation is complete.
-                case 0:
-                    if (sub_json_gettype(resp, "ack") != NULL) {
-                        cmd_err = sub_json_getack(resp, &cmd_sid);
-                        if (cmd_err != 0) {
-                            ///@todo better error reporting
-                            rc = -256 - abs(cmd_err);
-                            goto sub_devmgr_socket_TERM;
-                        }
-                        if (cmd_sid == 0) {
-                            rc = 0;
-                            goto sub_devmgr_socket_TERM;
-                        }
-                        
-                        // Success + wait for rxstat packet
-                        state = 1;
-                    }
-                    break;
-                
-                // State 1: looking for an RXSTAT that has the saved sid value
-                // {"type":"rxstat", "data":{"sid":(INT) ...
-                // - If sid does not match saved sid, ignore
-                // - If qualtest!=0, then data is corrupted: retry.
-                // - If the frame is somehow invalid: retry
-                // - If the frame is valid, rc set accordingly, and exit.
-                case 1:
-                    if (sub_json_gettype(resp, "rxstat") != NULL) {
-                        cJSON* frame = NULL;
-                    
-                        if (cmd_sid == sub_json_getframe(resp, &frame, &qualtest)) {
-                            state   = 2;
-                            rc      = -4;   //-4 == retry
-                            
-                            if ((qualtest == 0) && (frame != NULL)) {
-                                if ((cJSON_IsString(frame)) && (frame->valuestring != NULL)) {
-                                    rc = (int)strlen(frame->valuestring);
-                                    if (rc > (int)dstmax - 1) {
-                                        ///@todo dstmax too small, flag error
-                                        rc = (int)dstmax - 1;
-                                    }
-                                    memcpy(dst, frame->valuestring, rc+1);
-                                }
-                            }
-                        }
-                    }
-                    break;
-                    
-                default: break;
-                }
-            
-                // Received a message, and it is valid JSON, but it doesn't match
-                // what we are looking for
-                // ----------------------------------------------------------------
-                ///@todo could do something here to propagate message to a console
-                
-                
-                // ----------------------------------------------------------------
-            
-                cJSON_Delete(resp);
-                resp = NULL;
-            }
-        
-            // Received a message, but it's not JSON.
-        }
-        
-        // Escape loop if the read is finished
-        if (rc >= 0) {
-            break;
-        }
-        
-        // Retract the timeout
-        if (clock_gettime(CLOCK_MONOTONIC, &test) != 0) {
-            rc = -5;
-            break;
-        }
-        test            = diff_timespec(ref, test);
-        global_timeout -= (test.tv_sec * 1000) + (test.tv_nsec / 1000000);
-        
-        // Escape loop if:
-        // - there's a timeout (goto termination)
-        // - rc == -4, a reception error (retry the command)
-        if (global_timeout <= 0) {
-            goto sub_devmgr_socket_TERM;
-        }
-        if (rc == -4) {
-//fprintf(stderr, "Retrying...\n");
-            goto sub_devmgr_socket_SENDCMD;
-        }
-    }
-    
-    sub_devmgr_socket_TERM:
-    cJSON_Delete(resp);
-    sp_reader_destroy(reader);
-    
-    sub_devmgr_socket_END:
-    talloc_free(ctx);
-    
-//fprintf(stderr, "Returning %i\n", rc);
-    return rc;
-}
-
-
-
-
 ///@note: this function got mangled by git merge
 int cmd_devmgr(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     int rc;
@@ -498,8 +251,13 @@ int cmd_devmgr(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
         return -2;
     }
     
+    /// Waiting on the device manager does not touch the DB, so the engine is
+    /// yielded and other commands can run meanwhile.  Transactions from all
+    /// commands share the device manager socket through the multiplexer.
     if (dth->ext->use_socket) {
-        rc = sub_devmgr_socket(dth, dst, inbytes, src, dstmax);
+        dblock_yield(dth->dblock, &dth->lock, dth->ext->db);
+        rc = dm_mux_transact(dth->ext->devmux, src, (size_t)*inbytes, dst, dstmax);
+        dblock_resume(dth->dblock, &dth->lock, dth->ext->db);
     }
     else {
         rc = sub_devmgr_subproc(dth, dst, inbytes, src, dstmax);
@@ -19,6 +19,8 @@
 #include "dm_printf.h"
 #include "dterm.h"
 #include "cliopt.h"
+#include "iterator.h"
+#include "sflight.h"
 #include "otdb_cfg.h"
 #include "debug.h"
 
@@ -33,6 +35,7 @@
 #include <math.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <dirent.h>
@@ -50,6 +53,7 @@ extern struct arg_lit*  soft_opt;
 // used by file commands
 extern struct arg_str*  devid_opt;
 extern struct arg_str*  devidlist_opt;
+extern struct arg_str*  devidset_opt;
 extern struct arg_int*  fileage_opt;
 extern struct arg_str*  fileblock_opt;
 extern struct arg_str*  filerange_opt;
@@ -57,6 +61,7 @@ extern struct arg_int*  fileid_man;
 extern struct arg_str*  fileperms_man;
 extern struct arg_int*  filealloc_man;
 extern struct arg_str*  filedata_man;
+extern struct arg_str*  filelist_man;
 
 // used by all commands
 extern struct arg_lit*  help_man;
@@ -97,7 +102,7 @@ int cmd_del(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
                 arglist.devid, arglist.block_id, arglist.file_id);
                 
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_del_END;
@@ -108,6 +113,14 @@ int cmd_del(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
         if (rc != 0) {
             rc = -512 - rc;
         }
+        else {
+            wal_rec_t rec = {
+                .op     = WAL_del,
+                .block  = arglist.block_id,
+                .file   = arglist.file_id,
+            };
+            rc = cmd_journal(dth, &rec, NULL, 0);
+        }
     }
     
     cmd_del_END:
@@ -134,7 +147,7 @@ int cmd_new(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
                 arglist.devid, arglist.block_id, arglist.file_id, arglist.file_perms, arglist.file_alloc);
         
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_new_END;
@@ -146,6 +159,16 @@ int cmd_new(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
         if (rc != 0) {
             rc = -512 - rc;
         }
+        else {
+            wal_rec_t rec = {
+                .op     = WAL_new,
+                .block  = arglist.block_id,
+                .file   = arglist.file_id,
+                .perms  = arglist.file_perms,
+                .alloc  = arglist.file_alloc,
+            };
+            rc = cmd_journal(dth, &rec, NULL, 0);
+        }
     }
     
     cmd_new_END:
@@ -154,6 +177,90 @@ int cmd_new(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
 
 
 
+static int sub_read_span(vlFILE* fp, int range_lo, int range_hi, size_t dstmax) {
+/// Bytes of the file that a read of the range returns, which is limited by
+/// the file length and by the output space.
+    int span = range_hi - range_lo;
+    
+    if ((fp->length-range_lo) <= 0) {
+        span = 0;
+    }
+    else if ((fp->length-range_lo) < span) {
+        span = (fp->length-range_lo);
+    }
+    if (dstmax < span) {
+        span = (int)dstmax;
+    }
+    return span;
+}
+
+
+static int sub_read_refresh(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, AUTH_level minauth,
+                            uint64_t uid, uint8_t block_id, uint8_t file_id) {
+/// Fetches a file from its device and stores it in the DB.  The DB locks are
+/// released while the device manager fetches the file, so an unreachable
+/// device doesn't hold-up other commands.  They are taken back exclusive to
+/// store the result, and the file is looked-up again, because it may have
+/// changed meanwhile.
+    vaddr header;
+    vlFILE* fp;
+    ot_uni16 frlen;
+    int cmdbytes;
+    int rc;
+    
+    cmdbytes = dm_xnprintf_unlocked(dth, DBLOCK_devwrite, dst, dstmax, minauth, uid, "file r %u", file_id);
+    if (cmdbytes < 0) {
+        ///@todo coordinate error codes with debug macros
+        return cmdbytes;
+    }
+    rc = vl_getheader_vaddr(&header, block_id, file_id, VL_ACCESS_R, NULL);
+    if (rc != 0) {
+        return -512 - rc;
+    }
+    fp = vl_open_file(header);
+    if (fp == NULL) {
+        return -512 - 255;
+    }
+    
+    // Convert to binary.
+    // 5 bytes of file header
+    cmdbytes = cmd_hexnread(dst, (const char*)dst, dstmax);
+    if (cmdbytes <= 9) {
+        ///@todo error code for file error
+        rc = -768 - 1;
+        goto sub_read_refresh_CLOSE;
+    }
+    
+    ///@todo Validation of File Protocol headers (first 5 bytes)
+    
+    // Read length value is big endian, bytes 3:4
+    frlen.ubyte[UPPER] = dst[4+3];
+    frlen.ubyte[LOWER] = dst[4+4];
+    
+    // store new data to the local cache file.
+    // This will also change any file attributes, such as the
+    // file modtime on close
+    rc = vl_store(fp, frlen.ushort, &dst[4+5]);
+    if (rc != 0) {
+        ///@todo error code for store error (means file write is too big)
+        rc = -1024 - 1;
+        goto sub_read_refresh_CLOSE;
+    }
+    {   wal_rec_t rec = {
+            .op     = WAL_store,
+            .uid    = uid,
+            .block  = block_id,
+            .file   = file_id,
+        };
+        rc = cmd_journal(dth, &rec, &dst[4+5], frlen.ushort);
+    }
+    
+    sub_read_refresh_CLOSE:
+    vl_close(fp);
+    return rc;
+}
+
+
 int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     int rc;
     cmd_arglist_t arglist = {
@@ -169,12 +276,13 @@ int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     if (rc == 0) {
         vaddr header;
         vlFILE* fp;
+        uint8_t* grown;
         
         DEBUG_PRINTF("r (read cmd):\n  device_id=%016"PRIx64"\n  block=%d\n  file_id=%d\n  file_range=%d:%d\n",
                 arglist.devid, arglist.block_id, arglist.file_id, arglist.range_lo, arglist.range_hi);
 
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             DEBUG_PRINTF("otfs_setfs() = %i, [id = %016"PRIx64"]\n", rc, arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
@@ -190,16 +298,14 @@ int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
         
         fp = vl_open_file(header);
         if (fp != NULL) {
-            span = arglist.range_hi - arglist.range_lo;
-            if (dstmax < span) {
-                span = (int)dstmax;
-            }
-            if ((fp->length-arglist.range_lo) <= 0) {
-                span = 0;
-            }
-            else if ((fp->length-arglist.range_lo) < span) {
-                span = (fp->length-arglist.range_lo);
+            /// Grow the output to fit the span.  JSON output is in hex, so it
+            /// needs twice the span.  If that fails, the read is truncated.
+            span    = sub_read_span(fp, arglist.range_lo, arglist.range_hi, dstmax);
+            grown   = dtwriter_advance(dth->out, dst, &dstmax, (2*span) + LINESIZE);
+            if (grown != NULL) {
+                dst = grown;
             }
+            span    = sub_read_span(fp, arglist.range_lo, arglist.range_hi, dstmax);
             
             /// Beginning of Read synchronization section --------------------
             /// Check if age parameter is in acceptable range.
@@ -207,8 +313,6 @@ int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
             ///@todo this section could be broken-out into its own function
             ///@note file age is only at 1s resolution in the filesystem
             if ((arglist.soft_flag == 0) && (dth->ext->devmgr != NULL)) {
-                int cmdbytes;
-                ot_uni16 frlen;
                 AUTH_level minauth;
                 uint64_t uid = 0;
                 struct timespec now;
@@ -224,40 +328,46 @@ int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
                 DEBUG_PRINTF("Now: %lli, file-age: %lli, Age-param: %lli\n", now_ms, file_age, request_age);
                 
                 if (file_age > request_age) {
+                    void* flight;
+                    bool leader;
+                    
                     otfs_activeuid(dth->ext->db, (uint8_t*)&uid);
                     minauth  = cmd_minauth_get(fp, VL_ACCESS_W);
-                    cmdbytes = dm_xnprintf(dth, dst, dstmax, minauth, uid, "file r %u", arglist.file_id);
+                    vl_close(fp);
+                    fp       = NULL;
                     
-                    if (cmdbytes < 0) {
-                        ///@todo coordinate error codes with debug macros
-                        rc = cmdbytes;
-                        goto cmd_read_CLOSE;
+                    /// Concurrent reads of the same stale file share one
+                    /// refresh.  The first one fetches the file, and the
+                    /// others wait for it without their locks, because it
+                    /// needs the device lock to store the file.  Either way,
+                    /// the file is then read again from the DB.
+                    flight = sflight_join(dth->ext->sflight, uid, arglist.block_id, arglist.file_id, &leader);
+                    if (leader) {
+                        rc = sub_read_refresh(dth, dst, dstmax, minauth, uid, arglist.block_id, arglist.file_id);
+                        sflight_land(dth->ext->sflight, flight, rc);
                     }
-                    
-                    // Convert to binary.
-                    // 5 bytes of file header
-                    cmdbytes = cmd_hexnread(dst, (const char*)dst, dstmax);
-                    if (cmdbytes <= 9) {
-                        ///@todo error code for file error
-                        rc = -768 - 1;
-                        goto cmd_read_CLOSE;
+                    else {
+                        bool suspended = (dblock_suspend(dth->dblock, &dth->lock) == 0);
+                        rc = sflight_wait(dth->ext->sflight, flight);
+                        if (suspended && (dblock_reacquire(dth->dblock, &dth->lock, DBLOCK_devread, &dth->ext->db) != 0)) {
+                            rc = -8;
+                        }
+                    }
+                    if (rc < 0) {
+                        goto cmd_read_END;
                     }
                     
-                    ///@todo Validation of File Protocol headers (first 5 bytes)
-                    
-                    // Read length value is big endian, bytes 3:4
-                    frlen.ubyte[UPPER] = dst[4+3];
-                    frlen.ubyte[LOWER] = dst[4+4];
-                    
-                    // store new data to the local cache file.
-                    // This will also change any file attributes, such as the
-                    // file modtime on close
-                    rc = vl_store(fp, frlen.ushort, &dst[4+5]);
+                    rc = vl_getheader_vaddr(&header, arglist.block_id, arglist.file_id, VL_ACCESS_R, NULL);
                     if (rc != 0) {
-                        ///@todo error code for store error (means file write is too big)
-                        rc = -1024 - 1;
-                        goto cmd_read_CLOSE;
+                        rc = -512 - rc;
+                        goto cmd_read_END;
+                    }
+                    fp = vl_open_file(header);
+                    if (fp == NULL) {
+                        rc = -512 - 255;
+                        goto cmd_read_END;
                     }
+                    span = sub_read_span(fp, arglist.range_lo, arglist.range_hi, dstmax);
                 }
             }
             
@@ -269,10 +379,13 @@ int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
                 dat_ptr += arglist.range_lo;
             }
             
-            cmd_read_CLOSE:
             vl_close(fp);
         }
         
+        /// The output is made from the image without the engine.  The device
+        /// lock keeps the image in place.
+        dblock_yield(dth->dblock, &dth->lock, dth->ext->db);
+        
         if (arglist.jsonout_flag == false)  {
             if (dat_ptr != NULL) {
                 memcpy(dst, dat_ptr, span);
@@ -295,6 +408,365 @@ int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
 }
 
 
+int cmd_readstats(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT,
+    };
+    void* args[] = {help_man, jsonout_opt, end_man};
+    uint64_t flights;
+    uint64_t joined;
+    int inflight;
+
+    rc = cmd_extract_args(&arglist, args, "rstat", (const char*)src, inbytes);
+    if (rc != 0) {
+        return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "rstat");
+    }
+
+    sflight_stats(dth->ext->sflight, &flights, &joined, &inflight);
+    if (arglist.jsonout_flag) {
+        return snprintf((char*)dst, dstmax-1, "{\"cmd\":\"rstat\", \"refreshes\":%"PRIu64", \"coalesced\":%"PRIu64", \"inflight\":%d}",
+                        flights, joined, inflight);
+    }
+    return snprintf((char*)dst, dstmax-1, "refreshes=%"PRIu64" coalesced=%"PRIu64" inflight=%d\n", flights, joined, inflight);
+}
+
+
+static int readmulti_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t** srcp, size_t dstmax,
+                        int index, cmd_arglist_t* arglist, otfs_t* devfs) {
+/// Writes one record for the device.  A device without the file gets a record
+/// with an error, rather than ending the iteration.
+    vaddr header;
+    vlFILE* fp;
+    uint8_t* dat_ptr = NULL;
+    int span = 0;
+    int err;
+    int rc;
+    
+    err = vl_getheader_vaddr(&header, arglist->block_id, arglist->file_id, VL_ACCESS_R, NULL);
+    if (err == 0) {
+        fp = vl_open_file(header);
+        if (fp == NULL) {
+            err = 255;
+        }
+        else {
+            /// Record framing and, for JSON, hex encoding take space from the
+            /// chunk the iterator gives each device.
+            span    = sub_read_span(fp, arglist->range_lo, arglist->range_hi,
+                                    arglist->jsonout_flag ? (dstmax-LINESIZE)/2 : dstmax-11);
+            dat_ptr = vl_memptr(fp);
+            if (dat_ptr != NULL) {
+                dat_ptr += arglist->range_lo;
+            }
+            else {
+                span = 0;
+            }
+            vl_close(fp);
+        }
+    }
+    
+    if (arglist->jsonout_flag) {
+        char* cursor = (char*)dst;
+        rc = snprintf(cursor, dstmax-1, "%s{\"devid\":\"%"PRIx64"\"", (index > 1) ? "," : "", devfs->uid.u64);
+        cursor += rc;
+        dstmax -= rc;
+        if (err != 0) {
+            rc += snprintf(cursor, dstmax-1, ", \"err\":%d}", -512 - err);
+        }
+        else {
+            rc = cmd_jsonout_data(&cursor, &dstmax, true, rc, dat_ptr, arglist->range_lo, span);
+        }
+    }
+    else {
+        /// Binary record: UID[8], status[1], length[2], data.  Multibyte
+        /// fields are big endian.
+        for (int i=0; i<8; i++) {
+            dst[i] = (uint8_t)(devfs->uid.u64 >> (56 - (8*i)));
+        }
+        dst[8]  = (uint8_t)err;
+        dst[9]  = (uint8_t)(span >> 8);
+        dst[10] = (uint8_t)span;
+        if (span > 0) {
+            memcpy(&dst[11], dat_ptr, span);
+        }
+        rc = 11 + span;
+    }
+    
+    return rc;
+}
+
+
+int cmd_readmulti(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    uint8_t* dstcurs;
+    size_t dstlimit;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDSET | ARGFIELD_BLOCKID | ARGFIELD_FILERANGE | ARGFIELD_FILEID,
+    };
+    void* args[] = {help_man, jsonout_opt, devidset_opt, fileblock_opt, filerange_opt, fileid_man, end_man};
+    
+    if (dth->ext->db == NULL) {
+        return cmd_jsonout_err((char*)dst, dstmax, false, -1, "r+");
+    }
+    if (dstmax == 0) {
+        return 0;
+    }
+    
+    /// Extract arguments into arglist struct
+    rc = cmd_extract_args(&arglist, args, "r+", (const char*)src, inbytes);
+    if (rc != 0) {
+        goto cmd_readmulti_END;
+    }
+    
+    DEBUG_PRINTF("r+ (read multi cmd):\n  device_ids=%s\n  block=%d\n  file_id=%d\n  file_range=%d:%d\n",
+            (arglist.devid_set != NULL) ? arglist.devid_set : "all",
+            arglist.block_id, arglist.file_id, arglist.range_lo, arglist.range_hi);
+    
+    /// Records are streamed by the iterator, so the output may be much longer
+    /// than dstmax.
+    dstcurs     = dst;
+    dstlimit    = dstmax - 1;
+    if (arglist.jsonout_flag) {
+        rc = snprintf((char*)dstcurs, dstlimit, "{\"cmd\":\"r+\", \"block\":%d, \"id\":%d, \"records\":[",
+                arglist.block_id, arglist.file_id);
+        dstcurs    += rc;
+        dstlimit   -= rc;
+    }
+    
+    rc = iterator_uids(dth, &dstcurs, inbytes, &src, &dstlimit, &arglist, &readmulti_action);
+    if (rc < 0) {
+        goto cmd_readmulti_END;
+    }
+    if (arglist.jsonout_flag) {
+        dstcurs = dtwriter_advance(dth->out, dstcurs, &dstlimit, 3);
+        if (dstcurs == NULL) {
+            rc = -4;
+            goto cmd_readmulti_END;
+        }
+        dstcurs += sprintf((char*)dstcurs, "]}");
+    }
+    
+    /// Return the output still pending at the writer cursor
+    rc = (int)(dstcurs - dtwriter_cursor(dth->out, NULL));
+    
+    cmd_readmulti_END:
+    if (rc < 0) {
+        dst = dtwriter_cursor(dth->out, &dstmax);
+        rc  = cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "r+");
+    }
+    
+    return rc;
+}
+
+
+
+typedef struct {
+    uint8_t     block_id;
+    uint8_t     file_id;
+    uint16_t    range_lo;
+    uint16_t    range_hi;
+    int         err;
+    vaddr       header;
+    uint8_t*    dat_ptr;
+    int         span;
+} readlist_file_t;
+
+
+static int sub_parse_filespec(readlist_file_t* file, const char* spec) {
+/// Spec is [block:]FileID[:X:Y], where X and Y may be empty as in the -r arg
+    char buf[32];
+    char* tok;
+    char* ctx;
+    
+    snprintf(buf, sizeof(buf), "%s", spec);
+    file->block_id  = VL_ISF_BLOCKID;
+    file->range_lo  = 0;
+    file->range_hi  = 65535;
+    file->err       = 0;
+    
+    tok = strtok_r(buf, ":", &ctx);
+    if (tok == NULL) {
+        return -1;
+    }
+    if (isalpha(tok[0])) {
+        if (strncmp(tok, "isf", 3) == 0) {
+            file->block_id = VL_ISF_BLOCKID;
+        }
+        else if (strncmp(tok, "iss", 3) == 0) {
+            file->block_id = VL_ISS_BLOCKID;
+        }
+        else if (strncmp(tok, "gfb", 3) == 0) {
+            file->block_id = VL_GFB_BLOCKID;
+        }
+        else {
+            return -1;
+        }
+        tok = strtok_r(NULL, ":", &ctx);
+        if (tok == NULL) {
+            return -1;
+        }
+    }
+    file->file_id = (uint8_t)(strtoul(tok, NULL, 10) & 255);
+    
+    /// The range follows the ID, and its empty ends keep their defaults
+    if (*ctx != 0) {
+        tok = ctx;
+        ctx = strchr(tok, ':');
+        if (ctx != NULL) {
+            *ctx++ = 0;
+            if (*ctx != 0) {
+                file->range_hi = (uint16_t)strtoul(ctx, NULL, 10);
+            }
+        }
+        if (*tok != 0) {
+            file->range_lo = (uint16_t)strtoul(tok, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+
+int cmd_readlist(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDOPT | ARGFIELD_FILELIST,
+    };
+    void* args[] = {help_man, jsonout_opt, devid_opt, filelist_man, end_man};
+    readlist_file_t* files = NULL;
+    uint8_t* dstcurs;
+    
+    if (dstmax == 0) {
+        return 0;
+    }
+    
+    /// Extract arguments into arglist struct
+    rc = cmd_extract_args(&arglist, args, "rl", (const char*)src, inbytes);
+    if (rc != 0) {
+        goto cmd_readlist_END;
+    }
+    
+    files = talloc_array(dth->tctx, readlist_file_t, arglist.filespec_list_size);
+    if (files == NULL) {
+        rc = -2;
+        goto cmd_readlist_END;
+    }
+    for (int i=0; i<arglist.filespec_list_size; i++) {
+        if (sub_parse_filespec(&files[i], arglist.filespec_list[i]) != 0) {
+            rc = -9;
+            goto cmd_readlist_END;
+        }
+    }
+    
+    /// The device is selected once for all files
+    if (arglist.devid != 0) {
+        rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+        if (rc != 0) {
+            rc = -256 + rc;
+            goto cmd_readlist_END;
+        }
+    }
+    else {
+        otfs_activeuid(dth->ext->db, (uint8_t*)&arglist.devid);
+    }
+    
+    /// Resolve all the files, then write them out in list order.  A file
+    /// that isn't found gets an error record, rather than failing the
+    /// command.  The output is made from the image without the engine.
+    for (int i=0; i<arglist.filespec_list_size; i++) {
+        readlist_file_t* file = &files[i];
+        vlFILE* fp = NULL;
+        
+        file->dat_ptr   = NULL;
+        file->span      = 0;
+        file->err       = vl_getheader_vaddr(&file->header, file->block_id, file->file_id, VL_ACCESS_R, NULL);
+        if (file->err == 0) {
+            fp = vl_open_file(file->header);
+            file->err = (fp == NULL) ? 255 : 0;
+        }
+        if (fp != NULL) {
+            file->span      = sub_read_span(fp, file->range_lo, file->range_hi, 65535);
+            file->dat_ptr   = vl_memptr(fp);
+            if (file->dat_ptr != NULL) {
+                file->dat_ptr += file->range_lo;
+            }
+            else {
+                file->span = 0;
+            }
+            vl_close(fp);
+        }
+    }
+    dblock_yield(dth->dblock, &dth->lock, dth->ext->db);
+    
+    dstcurs = dst;
+    if (arglist.jsonout_flag) {
+        dstcurs += snprintf((char*)dstcurs, dstmax-1, "{\"cmd\":\"rl\", \"devid\":\"%"PRIx64"\", \"files\":[", arglist.devid);
+    }
+    
+    for (int i=0; i<arglist.filespec_list_size; i++) {
+        readlist_file_t* file = &files[i];
+        uint8_t* dat_ptr = file->dat_ptr;
+        int span = file->span;
+        
+        /// Each file is committed to the writer before the next, so the
+        /// response isn't limited to one output buffer.
+        dstcurs = dtwriter_advance(dth->out, dstcurs, &dstmax, (2*span) + LINESIZE);
+        if (dstcurs == NULL) {
+            rc = -4;
+            goto cmd_readlist_END;
+        }
+        
+        if (arglist.jsonout_flag) {
+            char* cursor = (char*)dstcurs;
+            rc = snprintf(cursor, dstmax-1, "%s{\"block\":%d, \"id\":%d", (i > 0) ? "," : "", file->block_id, file->file_id);
+            cursor += rc;
+            dstmax -= rc;
+            if (file->err != 0) {
+                cursor += snprintf(cursor, dstmax-1, ", \"err\":%d}", -512 - file->err);
+            }
+            else {
+                cmd_jsonout_data(&cursor, &dstmax, true, rc, dat_ptr, file->range_lo, span);
+            }
+            dstcurs = (uint8_t*)cursor;
+        }
+        else {
+            /// Binary record: block[1], id[1], status[1], length[2], data.
+            /// Length is big endian.
+            dstcurs[0] = file->block_id;
+            dstcurs[1] = file->file_id;
+            dstcurs[2] = (uint8_t)file->err;
+            dstcurs[3] = (uint8_t)(span >> 8);
+            dstcurs[4] = (uint8_t)span;
+            if (span > 0) {
+                memcpy(&dstcurs[5], dat_ptr, span);
+            }
+            dstcurs += 5 + span;
+        }
+    }
+    
+    if (arglist.jsonout_flag) {
+        dstcurs = dtwriter_advance(dth->out, dstcurs, &dstmax, 3);
+        if (dstcurs == NULL) {
+            rc = -4;
+            goto cmd_readlist_END;
+        }
+        dstcurs += sprintf((char*)dstcurs, "]}");
+    }
+    
+    /// Return the output still pending at the writer cursor
+    rc = (int)(dstcurs - dtwriter_cursor(dth->out, NULL));
+    
+    cmd_readlist_END:
+    talloc_free(files);
+    if (rc < 0) {
+        dst = dtwriter_cursor(dth->out, &dstmax);
+        rc  = cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "rl");
+    }
+    
+    return rc;
+}
+
+
+
 ///@todo this needs to be able to hit the device.  Refer to cmd_read()
 int cmd_readall(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     int rc;
@@ -314,13 +786,14 @@ int cmd_readall(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, s
     if (rc == 0) {
         vaddr header;
         vlFILE* fp;
+        uint8_t* grown;
         void* ptr;
             
         DEBUG_PRINTF("r* (read all cmd):\n  device_id=%016"PRIx64"\n  block=%d\n  file_id=%d\n  file_range=%d:%d\n",
                 arglist.devid, arglist.block_id, arglist.file_id, arglist.range_lo, arglist.range_hi);
         
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_readall_END;
@@ -344,15 +817,22 @@ int cmd_readall(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, s
         fp = vl_open_file(header);
         if (fp != NULL) {
             span = arglist.range_hi - arglist.range_lo;
-            if (dstmax < span) {
-                span = (int)dstmax;
-            }
             if ((fp->length-arglist.range_lo) <= 0) {
                 span = 0;
             }
             else if ((fp->length-arglist.range_lo) < span) {
                 span = (fp->length-arglist.range_lo);
             }
+            
+            /// Grow the output to fit the span.  JSON output is in hex, so it
+            /// needs twice the span.  If that fails, the read is truncated.
+            grown = dtwriter_advance(dth->out, dst, &dstmax, (2*span) + LINESIZE);
+            if (grown != NULL) {
+                dst = grown;
+            }
+            if (dstmax < span) {
+                span = (int)dstmax;
+            }
         
             dat_ptr = vl_memptr(fp);
             if (dat_ptr != NULL) {
@@ -361,6 +841,7 @@ int cmd_readall(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, s
             }
             vl_close(fp);
         }
+        dblock_yield(dth->dblock, &dth->lock, dth->ext->db);
         
         if (arglist.jsonout_flag == false)  {
             memcpy(dst, hdr_ptr, sizeof(vl_header_t));
@@ -406,7 +887,7 @@ int cmd_restore(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, s
                 arglist.devid, arglist.block_id, arglist.file_id, arglist.range_lo, arglist.range_hi);
         
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_restore_END;
@@ -448,7 +929,7 @@ int cmd_readhdr(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, s
         }
         
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_readhdr_END;
@@ -504,7 +985,7 @@ int cmd_readperms(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src,
                 arglist.devid, arglist.block_id, arglist.file_id, arglist.range_lo, arglist.range_hi);
                 
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_readperms_END;
@@ -543,11 +1024,21 @@ int cmd_write(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, siz
         .fields = ARGFIELD_JSONOUT | ARGFIELD_SOFTMODE | ARGFIELD_DEVICEIDOPT | ARGFIELD_BLOCKID | ARGFIELD_FILERANGE | ARGFIELD_FILEID | ARGFIELD_FILEDATA,
     };
     void* args[] = {help_man, jsonout_opt, soft_opt, devid_opt, fileblock_opt, filerange_opt, fileid_man, filedata_man, end_man};
+    void* args_raw[] = {help_man, jsonout_opt, soft_opt, devid_opt, fileblock_opt, filerange_opt, fileid_man, end_man};
     
-    /// Extract arguments into arglist struct
-    arglist.filedata        = dst;
-    arglist.filedata_size   = (int)dstmax;
-    rc                      = cmd_extract_args(&arglist, args, "w", (const char*)src, inbytes);
+    /// Extract arguments into arglist struct.  File data from a binary frame
+    /// is used as-is, in place of the Bintex argument.
+    if (dth->rawdata != NULL) {
+        arglist.fields         &= ~ARGFIELD_FILEDATA;
+        rc                      = cmd_extract_args(&arglist, args_raw, "w", (const char*)src, inbytes);
+        arglist.filedata        = (uint8_t*)dth->rawdata;
+        arglist.filedata_size   = dth->rawdata_size;
+    }
+    else {
+        arglist.filedata        = dst;
+        arglist.filedata_size   = (int)dstmax;
+        rc                      = cmd_extract_args(&arglist, args, "w", (const char*)src, inbytes);
+    }
     
     /// On successful extraction, write
     if (rc == 0) {
@@ -560,7 +1051,7 @@ int cmd_write(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, siz
                 arglist.devid, arglist.block_id, arglist.file_id, arglist.range_lo, arglist.range_hi, arglist.filedata_size);
                 
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_write_END;
@@ -614,22 +1105,40 @@ int cmd_write(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, siz
         if (span > 0) {
             memcpy(&dptr[arglist.range_lo], arglist.filedata, span);
         }
+        {   wal_rec_t rec = {
+                .op     = WAL_write,
+                .block  = arglist.block_id,
+                .file   = arglist.file_id,
+                .offset = arglist.range_lo,
+            };
+            rc = cmd_journal(dth, &rec, arglist.filedata, (span > 0) ? span : 0);
+        }
         
         if ((arglist.soft_flag == 0) && (dth->ext->devmgr != NULL)) {
             AUTH_level min_auth;
             uint64_t uid = 0;
             int cmdbytes;
-            char hexbuf[513];
+            char* hexbuf;
             
+            hexbuf = talloc_size(dth->tctx, (2*span)+1);
+            if (hexbuf == NULL) {
+                rc = -1;
+                goto cmd_write_CLOSE;
+            }
             cmd_hexwrite(hexbuf, arglist.filedata, span);
             otfs_activeuid(dth->ext->db, (uint8_t*)&uid);
             min_auth = cmd_minauth_get(fp, VL_ACCESS_W);
-            cmdbytes = dm_xnprintf(dth, dst, dstmax, min_auth, uid,
+            
+            /// The local write is complete, so the file is closed and the DB
+            /// locks are released while the device manager forwards it.
+            vl_close(fp);
+            cmdbytes = dm_xnprintf_unlocked(dth, DBLOCK_devwrite, dst, dstmax, min_auth, uid,
                         "file w %u -r %u:%u [%s]", arglist.file_id, arglist.range_lo, arglist.range_hi, hexbuf);
             if (cmdbytes < 0) {
                 ///@todo this means there's a write error.  Could try again, or
                 /// flag some type of error.
             }
+            goto cmd_write_END;
         }
         
         /// Closing the file will update its modification and access timestamps
@@ -665,7 +1174,7 @@ int cmd_writeperms(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src
                     arglist.devid, arglist.block_id, arglist.file_id, arglist.file_perms);
                     
             if (arglist.devid != 0) {
-                rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+                rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
                 if (rc != 0) {
                     rc = -256 + rc;
                     goto cmd_writeperms_END;
@@ -681,6 +1190,13 @@ int cmd_writeperms(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src
                             NULL    );
             if (rc == 0) {
                 ///@todo update the timestamp on this file, and on the device instance.
+                wal_rec_t rec = {
+                    .op     = WAL_chmod,
+                    .block  = arglist.block_id,
+                    .file   = arglist.file_id,
+                    .perms  = arglist.file_perms,
+                };
+                rc = cmd_journal(dth, &rec, NULL, 0);
             }
             else {
                 rc = -512 - rc;
@@ -702,11 +1218,21 @@ int cmd_pub(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
         .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDOPT | ARGFIELD_BLOCKID | ARGFIELD_FILERANGE | ARGFIELD_FILEID | ARGFIELD_FILEDATA,
     };
     void* args[] = {help_man, jsonout_opt, devid_opt, fileblock_opt, filerange_opt, fileid_man, filedata_man, end_man};
+    void* args_raw[] = {help_man, jsonout_opt, devid_opt, fileblock_opt, filerange_opt, fileid_man, end_man};
     
-    /// Extract arguments into arglist struct
-    arglist.filedata        = dst;
-    arglist.filedata_size   = (int)dstmax;
-    rc                      = cmd_extract_args(&arglist, args, "pub", (const char*)src, inbytes);
+    /// Extract arguments into arglist struct.  File data from a binary frame
+    /// is used as-is, in place of the Bintex argument.
+    if (dth->rawdata != NULL) {
+        arglist.fields         &= ~ARGFIELD_FILEDATA;
+        rc                      = cmd_extract_args(&arglist, args_raw, "pub", (const char*)src, inbytes);
+        arglist.filedata        = (uint8_t*)dth->rawdata;
+        arglist.filedata_size   = dth->rawdata_size;
+    }
+    else {
+        arglist.filedata        = dst;
+        arglist.filedata_size   = (int)dstmax;
+        rc                      = cmd_extract_args(&arglist, args, "pub", (const char*)src, inbytes);
+    }
     
     /// On successful extraction, publish
     if (rc == 0) {
@@ -719,7 +1245,7 @@ int cmd_pub(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
                 arglist.devid, arglist.block_id, arglist.file_id, arglist.range_lo, arglist.range_hi, arglist.filedata_size);
                 
         if (arglist.devid != 0) {
-            rc = otfs_setfs(dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+            rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
             if (rc != 0) {
                 rc = -256 + rc;
                 goto cmd_pub_END;
@@ -771,6 +1297,14 @@ int cmd_pub(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
         if (span > 0) {
             memcpy(&dptr[arglist.range_lo], arglist.filedata, span);
         }
+        {   wal_rec_t rec = {
+                .op     = WAL_write,
+                .block  = arglist.block_id,
+                .file   = arglist.file_id,
+                .offset = arglist.range_lo,
+            };
+            rc = cmd_journal(dth, &rec, arglist.filedata, (span > 0) ? span : 0);
+        }
         
         /// Closing the file will update its modification and access timestamps
         cmd_pub_CLOSE:
@@ -18,9 +18,17 @@
 #include "cmds.h"
 #include "dterm.h"
 #include "cliopt.h"
+#include "devimage.h"
+#include "dirty.h"
+#include "fidx.h"
 #include "otdb_cfg.h"
 #include "json_tools.h"
+#include "query.h"
+#include "schema.h"
+#include "snapshot.h"
 #include "test.h"
+#include "wal.h"
+#include "workpool.h"
 #include "debug.h"
 
 // HB Headers/Libraries
@@ -101,7 +109,7 @@ extern struct arg_end*  end_man;
 
 
 static void sub_tfree(void* ctx) {
-    talloc_free(ctx);
+    devimage_free(ctx);
 }
 
 
@@ -165,27 +173,27 @@ size_t dirent_buf_size(DIR * dirp) {
 
 
 
-int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
-                        cJSON* fstmpl, DIR* devdir, const char* path, uint64_t uid,
-                        bool export_tmp) {
+static int sub_dataread(TALLOC_CTX* heap, cJSON** data, DIR* devdir, const char* path) {
+/// Aggregates the data .json files of a device directory.  This only does
+/// file I/O and parsing, so it is safe to call from any thread.
     int rc                  = 0;
     struct dirent *devent   = NULL;
     struct dirent *entbuf   = NULL;
-    cJSON* data             = NULL;
-    cJSON* dataobj;
-    vlFILE* fp;
-    TALLOC_CTX* cmdsub_datafile_heap;
+    DIR* opendir_p          = NULL;
     
-    cmdsub_datafile_heap = talloc_new(dth->tctx);
-    if (cmdsub_datafile_heap == NULL) {
-    ///@todo better error code for out of memory
-        return -1;
+    *data = NULL;
+    if (devdir == NULL) {
+        devdir = opendir_p = opendir(path);
+        if (devdir == NULL) {
+            return -8;
+        }
     }
     
     // Allocate directory traversal buffer -- fast exit if fails
-    entbuf = talloc_size(cmdsub_datafile_heap, dirent_buf_size(devdir));
+    entbuf = talloc_size(heap, dirent_buf_size(devdir));
     if (entbuf == NULL) {
-        return -1;
+        rc = -1;
+        goto sub_dataread_END;
     }
     
     // Loop through files in the device directory, and aggregate them.
@@ -196,14 +204,31 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
         }
         if (devent->d_type == DT_REG) {
             DEBUGPRINT("%s %d :: json=%s/%s\n", __FUNCTION__, __LINE__, path, devent->d_name);
-            rc = jst_aggregate_json(cmdsub_datafile_heap, &data, path, devent->d_name);
+            rc = jst_aggregate_json(heap, data, path, devent->d_name);
             if (rc != 0) {
+                cJSON_Delete(*data);
+                *data = NULL;
                 rc = -9;
-                goto cmdsub_datafile_CLOSE;
+                break;
             }
         }
     }
     
+    sub_dataread_END:
+    talloc_free(entbuf);
+    if (opendir_p != NULL) {
+        closedir(opendir_p);
+    }
+    return rc;
+}
+
+
+
+static int sub_dataapply(dterm_handle_t* dth, tmpl_schema_t* schema, cJSON* data, uint64_t uid, bool export_tmp) {
+/// Applies aggregated device data to the active device FS.
+    cJSON* dataobj;
+    vlFILE* fp;
+    
     ///@note Prior to this function being called, otfs_new() or otfs_setfs()
     /// must be used in the calling function to select the device fs.
     
@@ -234,8 +259,7 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
     
     // If there's no custom data to write, move on
     if (data == NULL) {
-        rc = 0;
-        goto cmdsub_datafile_CLOSE;
+        return 0;
     }
 
     // Correlate elements from data files with their metadata from the
@@ -245,8 +269,8 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
     // per-device data.
     for (dataobj=data->child; dataobj!=NULL; dataobj=dataobj->next) {
         cJSON* obj;
-        cJSON* fileobj;
         cJSON* datacontent;
+        const tmpl_file_t* tfile;
         vlFILE* fp;
         filemeta_t dmeta;
         uint8_t* fdat;
@@ -278,35 +302,28 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
         
         // Get the template meta defaults for this file, matched on the file name
         // Make sure that template metadata is aligned with file metadata
-        fileobj = cJSON_GetObjectItemCaseSensitive(fstmpl, dataobj->string);
-        DEBUGPRINT("%s %d :: Object \"%s\" found in TMPL = %d\n", __FUNCTION__, __LINE__, dataobj->string, (fileobj!=NULL));
-        if (cJSON_IsObject(fileobj) == false) {
-            continue;
-        }
-        obj = cJSON_GetObjectItemCaseSensitive(fileobj, "_meta");
-        DEBUGPRINT("%s %d :: Object \"_meta\" found in FileObject = %d\n", __FUNCTION__, __LINE__, (obj!=NULL));
-        if (cJSON_IsObject(obj) == false) {
+        tfile = schema_findfile(schema, dataobj->string);
+        DEBUGPRINT("%s %d :: Object \"%s\" found in TMPL = %d\n", __FUNCTION__, __LINE__, dataobj->string, (tfile!=NULL));
+        if (tfile == NULL) {
             continue;
         }
 
         // block, fileid, and size must match in template and file
-        if ((dmeta.block != jst_extract_blockid(obj))
-        ||  (dmeta.fileid != jst_extract_id(obj))
-        ||  (dmeta.size != jst_extract_size(obj))) {
+        if ((dmeta.block != tfile->block)
+        ||  (dmeta.fileid != tfile->id)
+        ||  (dmeta.size != tfile->size)) {
             DEBUGPRINT("%s %d :: Metadata mismatch on %s\n", __FUNCTION__, __LINE__, dataobj->string);
             continue;
         }
     
         // "stock" parameter must be taken from template only
-        dmeta.stock = jst_extract_stock(obj);
+        dmeta.stock = tfile->stock;
     
         // "ctype" parameter is retained from file
         // "modtime" parameter is retained from file
         
-        // Get the template content, and open
-        obj = cJSON_GetObjectItemCaseSensitive(fileobj, "_content");
-        DEBUGPRINT("%s %d :: Object \"_content\" found in FileObject = %d\n", __FUNCTION__, __LINE__, (obj!=NULL));
-        if (cJSON_IsObject(obj) == false) {
+        // The template must have content
+        if (tfile->has_content == false) {
             continue;
         }
         fp = vl_open( (vlBLOCK)dmeta.block, dmeta.fileid, VL_ACCESS_RW, NULL);
@@ -345,44 +362,43 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
         }
         ///@todo might benefit from recursive treatment
         else {  // CONTENT_struct
-            for (obj=obj->child; obj!=NULL; obj=obj->next) {
+            const tmpl_field_t* field = &schema->field[tfile->field_first];
+            
+            for (int f=0; f<tfile->field_count; f++, field++) {
                 cJSON*  d_elem;
-                cJSON*  t_meta;
-                cJSON*  t_content;
                 int     bytepos;
                 int     bytesout;
                 
-                DEBUGPRINT("%s %d :: Working on Struct element=%s\n", __FUNCTION__, __LINE__, obj->string);
+                DEBUGPRINT("%s %d :: Working on Struct element=%s\n", __FUNCTION__, __LINE__, field->name);
                 
                 // Make sure object is in both data and tmpl.
                 // If object yields another object, we need to drill
                 // into the hierarchy
-                d_elem  = cJSON_GetObjectItemCaseSensitive(datacontent, obj->string);
+                d_elem  = cJSON_GetObjectItemCaseSensitive(datacontent, field->name);
                 if (d_elem != NULL) {
-                    t_meta      = cJSON_GetObjectItemCaseSensitive(obj, "_meta");
-                    t_content   = cJSON_GetObjectItemCaseSensitive(obj, "_content");
-                    if (cJSON_IsObject(t_meta) && cJSON_IsObject(t_content) && cJSON_IsObject(datacontent)) {
-                        bytepos     = (int)jst_extract_pos(t_meta);
-                        bytesout    = (int)jst_extract_size(t_meta);
+                    if (field->nested) {
+                        const tmpl_subfield_t* sub = &schema->sub[field->imp_first];
+                        bytepos     = field->nest_pos;
+                        bytesout    = field->nest_size;
 
-                        for (t_content=t_content->child; t_content!=NULL; t_content=t_content->next) {
+                        for (int k=0; k<field->imp_count; k++, sub++) {
                             cJSON* d_subelem;
-                            d_subelem  = cJSON_GetObjectItemCaseSensitive(d_elem, t_content->string);
+                            d_subelem  = cJSON_GetObjectItemCaseSensitive(d_elem, sub->name);
                             if (d_subelem != NULL) {
-                                jst_load_element( &fdat[bytepos],
+                                jst_load_typed( &fdat[bytepos],
                                     bytesout,
-                                    (unsigned int)jst_extract_bitpos(t_content),
-                                    jst_extract_string(t_content, "type"),
+                                    (unsigned int)sub->bitpos,
+                                    &sub->type,
                                     d_subelem);
                             }
                         }
                     }
                     else {
-                        bytepos = (int)jst_extract_pos(obj);
-                        bytesout = jst_load_element( &fdat[bytepos],
+                        bytepos = field->pos;
+                        bytesout = jst_load_typed( &fdat[bytepos],
                                         (int)dmeta.size - bytepos,
-                                        (unsigned int)jst_extract_bitpos(obj),
-                                        jst_extract_string(obj, "type"),
+                                        (unsigned int)field->bitpos,
+                                        &field->type,
                                         d_elem);
                     }
                     
@@ -417,14 +433,187 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
         }
     }
 
-    cmdsub_datafile_CLOSE:
+    return 0;
+}
+
+
+
+int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
+                        tmpl_schema_t* schema, DIR* devdir, const char* path, uint64_t uid,
+                        bool export_tmp) {
+    int rc;
+    cJSON* data = NULL;
+    TALLOC_CTX* cmdsub_datafile_heap;
+    
+    cmdsub_datafile_heap = talloc_new(dth->tctx);
+    if (cmdsub_datafile_heap == NULL) {
+    ///@todo better error code for out of memory
+        return -1;
+    }
+    
+    rc = sub_dataread(cmdsub_datafile_heap, &data, devdir, path);
+    if (rc == 0) {
+        rc = sub_dataapply(dth, schema, data, uid, export_tmp);
+    }
+    
     cJSON_Delete(data);
     talloc_free(cmdsub_datafile_heap);
+    return rc;
+}
+
+
+
+
+/** Load Pipeline
+  * -------------------------------------------------------------------------
+  * OPEN and LOAD of an archive with many devices are bound by reading and
+  * parsing the device data files.  The device directories are scanned first,
+  * then a workpool reads and parses them, and the command thread
+  * commits each parsed device to the DB in scan order.  Workers don't get
+  * more than OTDB_PARAM_LOAD_AHEAD devices ahead of the commits, which
+  * limits the memory used by parsed data.
+  */
+
+typedef struct {
+    uint64_t    uid;
+    char*       path;
+    TALLOC_CTX* heap;
+    cJSON*      data;
+    int         rc;
+    bool        ready;
+} load_dev_t;
+
 
+
+
+static int sub_loadscan(TALLOC_CTX* heap, load_dev_t** devs, const char* root, const char** uidlist, size_t listsize) {
+/// Lists the device directories in an archive: those with hex names that are
+/// in the uidlist, if there is one.  Returns the number of devices.
+    DIR* dir;
+    struct dirent *ent      = NULL;
+    struct dirent *entbuf;
+    size_t alloc            = 64;
+    size_t devices          = 0;
+    
+    dir = opendir(root);
+    if (dir == NULL) {
+        return -6;
+    }
+    entbuf  = talloc_size(heap, dirent_buf_size(dir));
+    *devs   = talloc_array(heap, load_dev_t, alloc);
+    if ((entbuf == NULL) || (*devs == NULL)) {
+        closedir(dir);
+        return -7;
+    }
+    
+    while (1) {
+        load_dev_t* dev;
+        char* endptr;
+        uint64_t uid;
+        
+        readdir_r(dir, entbuf, &ent);
+        if (ent == NULL) {
+            break;
+        }
+        
+        // Name of directory should be a pure hex number: skip others
+        if (ent->d_type != DT_DIR) {
+            continue;
+        }
+        endptr  = NULL;
+        uid     = strtoull(ent->d_name, &endptr, 16);
+        if (((*ent->d_name != '\0') && (*endptr == '\0')) == 0) {
+            continue;
+        }
+        if ((listsize > 0) && (uid_in_list(uidlist, listsize, uid) == false)) {
+            continue;
+        }
+        
+        if (devices == alloc) {
+            alloc  *= 2;
+            *devs   = talloc_realloc(heap, *devs, load_dev_t, alloc);
+            if (*devs == NULL) {
+                closedir(dir);
+                return -7;
+            }
+        }
+        dev         = &(*devs)[devices++];
+        dev->uid    = uid;
+        dev->path   = talloc_asprintf(heap, "%s/%s", root, ent->d_name);
+        dev->heap   = NULL;
+        dev->data   = NULL;
+        dev->rc     = 0;
+        dev->ready  = false;
+        if (dev->path == NULL) {
+            closedir(dir);
+            return -7;
+        }
+    }
+    
+    closedir(dir);
+    talloc_free(entbuf);
+    return (int)devices;
+}
+
+
+static int sub_loadaction(void* arg, void* job) {
+/// Each device is parsed on its own heap, which is handed to the committer
+/// with the parsed data.  The cJSON nodes come from talloc, as they do on the
+/// command thread, which frees them.  Read buffers are freed here.
+    load_dev_t* dev = job;
+    TALLOC_CTX* scratch;
+    TALLOC_CTX* prev;
+    int rc;
+
+    dev->heap   = talloc_new(NULL);
+    scratch     = talloc_new(dev->heap);
+    if (scratch == NULL) {
+        return -1;
+    }
+    prev    = dterm_isolate(dev->heap);
+    rc      = sub_dataread(scratch, &dev->data, NULL, dev->path);
+    dterm_isolate(prev);
+    talloc_free(scratch);
     return rc;
 }
 
 
+static void sub_loadfree(load_dev_t* dev) {
+    talloc_free(dev->heap);
+    dev->heap = NULL;
+    dev->data = NULL;
+}
+
+
+static void sub_loaddone(void* arg, void* job, int rc) {
+    load_dev_t* dev = job;
+    dev->rc     = rc;
+    dev->ready  = true;
+}
+
+
+static load_dev_t* sub_loadget(workpool_t pool, load_dev_t* devs, size_t devices, size_t* queued, size_t i) {
+/// Waits for device i to be parsed.  Devices are put into the pool in scan
+/// order, up to OTDB_PARAM_LOAD_AHEAD ahead of the one that is committed.
+    while ((*queued < devices) && (*queued < (i + OTDB_PARAM_LOAD_AHEAD))) {
+        workpool_put(pool, &devs[(*queued)++]);
+    }
+    workpool_wait(pool, &devs[i].ready);
+    return &devs[i];
+}
+
+
+static void sub_loadfinish(workpool_t pool, load_dev_t* devs, size_t devices) {
+/// Stops the pool, which may not have finished if a commit failed, and frees
+/// any data that wasn't committed.
+    workpool_finish(pool, true);
+    for (size_t i=0; i<devices; i++) {
+        sub_loadfree(&devs[i]);
+    }
+}
+
+
+
 
 
 
@@ -434,6 +623,135 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
 
 
 
+static int sub_walapply(void* arg, const wal_rec_t* rec, const uint8_t* data) {
+/// Replays a record of the write-ahead log into the DB.  Changes that are
+/// replayed are changes since the archive, so they are marked dirty.
+    dterm_handle_t* dth = arg;
+    uint64_t uid        = rec->uid;
+    otfs_t devfs;
+    vlFILE* fp;
+    uint8_t* fdat;
+    int rc;
+    
+    if (rec->op == WAL_devimage) {
+        if (devcache_setfs(dth->ext->devcache, dth->ext->db, &devfs, (uint8_t*)&uid) == 0) {
+            if (devfs.alloc == rec->size) {
+                devimage_copy(devfs.base, data, rec->size);
+                dirty_markdev(dth->ext->dirty, uid);
+                return 0;
+            }
+            otfs_del(dth->ext->db, &devfs, &sub_tfree);
+            devcache_del(dth->ext->devcache, dth->ext->db, uid);
+        }
+        devfs.uid.u64   = uid;
+        devfs.alloc     = rec->size;
+        devfs.base      = devimage_new(dth->pctx, dth->ext->tmpl_fs, data, rec->size);
+        if (devfs.base == NULL) {
+            return -1;
+        }
+        rc = otfs_new(dth->ext->db, &devfs);
+        if (rc != 0) {
+            devimage_free(devfs.base);
+            return ERRCODE(otfs, otfs_new, rc);
+        }
+        devcache_add(dth->ext->devcache, dth->ext->db, &devfs);
+        dirty_markdev(dth->ext->dirty, uid);
+        return 0;
+    }
+    
+    if (rec->op == WAL_devdel) {
+        if (devcache_setfs(dth->ext->devcache, dth->ext->db, &devfs, (uint8_t*)&uid) == 0) {
+            otfs_del(dth->ext->db, &devfs, &sub_tfree);
+            devcache_del(dth->ext->devcache, dth->ext->db, uid);
+            dirty_markdev(dth->ext->dirty, uid);
+        }
+        return 0;
+    }
+    
+    /// A transaction is replayed as its writes, once all of them are known
+    ///  to fit in the record.
+    if (rec->op == WAL_txn) {
+        wal_rec_t wrec = *rec;
+        wal_txw_t txw;
+        uint32_t pos;
+        
+        for (pos=0; (rec->size - pos) >= sizeof(wal_txw_t); pos+=sizeof(wal_txw_t)+txw.size) {
+            memcpy(&txw, &data[pos], sizeof(wal_txw_t));
+            if (txw.size > (rec->size - pos - sizeof(wal_txw_t))) {
+                break;
+            }
+        }
+        if (pos != rec->size) {
+            return -5;
+        }
+        for (pos=0; pos<rec->size; pos+=sizeof(wal_txw_t)+txw.size) {
+            memcpy(&txw, &data[pos], sizeof(wal_txw_t));
+            wrec.op     = WAL_write;
+            wrec.size   = txw.size;
+            wrec.offset = txw.offset;
+            wrec.block  = txw.block;
+            wrec.file   = txw.file;
+            sub_walapply(arg, &wrec, &data[pos+sizeof(wal_txw_t)]);
+        }
+        return 0;
+    }
+    
+    /// File changes
+    if (devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&uid) != 0) {
+        return -2;
+    }
+    switch (rec->op) {
+        case WAL_write:
+        case WAL_store:
+            fp = vl_open((vlBLOCK)rec->block, rec->file, VL_ACCESS_RW, NULL);
+            if (fp == NULL) {
+                return -3;
+            }
+            fdat = vl_memptr(fp);
+            if ((fdat == NULL) || ((rec->offset + rec->size) > fp->alloc)) {
+                vl_close(fp);
+                return -3;
+            }
+            if (rec->op == WAL_store) {
+                vl_store(fp, rec->size, (uint8_t*)data);
+            }
+            else {
+                if (rec->offset > fp->length) {
+                    memset(&fdat[fp->length], 0, rec->offset - fp->length);
+                }
+                memcpy(&fdat[rec->offset], data, rec->size);
+                if (fp->length < (rec->offset + rec->size)) {
+                    fp->length = rec->offset + rec->size;
+                }
+            }
+            vl_setmodtime(fp, (ot_u32)rec->modtime);
+            vl_close(fp);
+            break;
+            
+        case WAL_chmod:
+            vl_chmod((vlBLOCK)rec->block, rec->file, rec->perms, NULL);
+            break;
+            
+        case WAL_new:
+            fp = NULL;
+            vl_new(&fp, (vlBLOCK)rec->block, rec->file, rec->perms, rec->alloc, NULL);
+            vl_close(fp);
+            break;
+            
+        case WAL_del:
+            vl_delete((vlBLOCK)rec->block, rec->file, NULL);
+            break;
+            
+        default:
+            return -4;
+    }
+    
+    dirty_mark(dth->ext->dirty, uid, rec->block, rec->file);
+    return 0;
+}
+
+
+
 
 int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     int rc;
@@ -449,6 +767,7 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     cJSON* tmpl_export      = NULL;
     cJSON* data             = NULL;
     cJSON* obj              = NULL;
+    tmpl_schema_t* schema   = NULL;
     void* db                = NULL;
     
     // Function Heap
@@ -458,6 +777,12 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     otfs_t* tmpl_fs;
     otfs_t data_fs;
     vlFSHEADER fshdr;
+    
+    // Device data loading
+    workpool_t pool;
+    load_dev_t* devs;
+    size_t devices;
+    size_t queued = 0;
     vl_header_t *gfbhdr, *isshdr, *isfhdr;
     
     // Argument handling
@@ -485,6 +810,14 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     if (rc != 0) {
         goto cmd_open_CLOSE;
     }
+    
+    /// Binary snapshots are loaded directly, without the JSON import below.
+    /// They finish the same way, so the open is atomic in either case.
+    if (snapshot_test(arglist.archive_path)) {
+        rc = snapshot_read(dth->pctx, arglist.archive_path, &tmpl, tmpl_fs, &db);
+        rc = (rc < 0) ? (-16 + rc) : 0;
+        goto cmd_open_CLOSE;
+    }
  
     /// On successful extraction, create a new device in the database
     DEBUGPRINT("cmd_open():\n  json=%d, archive=%s\n", arglist.jsonout_flag, arglist.archive_path);
@@ -903,48 +1236,43 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     // The pathbuf already contains the root directory, from step 2, but we 
     // need to clip the _TMPL part.
     *rtpath = 0;
-    dir     = opendir(pathbuf);
-    if (dir == NULL) {
-        rc = -6;
+    rc = sub_loadscan(cmd_open_heap, &devs, pathbuf, NULL, 0);
+    if (rc < 0) {
         goto cmd_open_CLOSE;
     }
-    entbuf = talloc_size(cmd_open_heap, dirent_buf_size(dir));
-    if (entbuf == NULL) {
-        rc = -6;
+    
+    /// Device data is imported through a schema of the local template.  It
+    /// is compiled again from the exported template, below.
+    schema = schema_compile(dth->pctx, tmpl);
+    if (schema == NULL) {
+        rc = -7;
         goto cmd_open_CLOSE;
     }
+    devices = (size_t)rc;
+    rc      = 0;
     
-    while (rc >= 0) {
-        char* endptr;
-  
-        readdir_r(dir, entbuf, &ent);
-        if (ent == NULL) {
-            break;
-        }
-        
-        // If entity is not a Directory, go to next entity in the dir
-        DEBUGPRINT("%s %d :: d_name=%s\n", __FUNCTION__, __LINE__, ent->d_name);           
-        if (ent->d_type != DT_DIR) {
-            continue;
-        }
+    if (workpool_start(&pool, OTDB_PARAM_LOAD_WORKERS, (long)devices, OTDB_PARAM_LOAD_AHEAD,
+                        &sub_loadaction, &sub_loaddone, NULL) != 0) {
+        rc = -7;
+        goto cmd_open_CLOSE;
+    }
+    for (size_t i=0; (rc>=0) && (i<devices); i++) {
+        load_dev_t* dev = sub_loadget(pool, devs, devices, &queued, i);
         
-        // Name of directory should be a pure hex number: skip others
-        endptr = NULL;
-        data_fs.uid.u64 = strtoull(ent->d_name, &endptr, 16);
-        if (((*ent->d_name != '\0') && (*endptr == '\0')) == 0) {
-            continue;
+        rc = dev->rc;
+        if (rc != 0) {
+            break;
         }
         
         // Create new FS using defaults from template
         ///@note data_fs goes on the permanent memory context
+        data_fs.uid.u64 = dev->uid;
         data_fs.alloc   = tmpl_fs->alloc;
-        data_fs.base    = talloc_size(dth->pctx, tmpl_fs->alloc);
+        data_fs.base    = devimage_new(dth->pctx, tmpl_fs, NULL, tmpl_fs->alloc);
         if (data_fs.base == NULL) {
             rc = -7;
         }
         else {
-            memcpy(data_fs.base, tmpl_fs->base, tmpl_fs->alloc);
-        
             // Create new FS based on device id and template FS
             DEBUGPRINT("%s %d :: ID=%"PRIx64"\n", __FUNCTION__, __LINE__, data_fs.uid.u64);
             rc = otfs_new(db, &data_fs);
@@ -952,19 +1280,8 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
                 rc = ERRCODE(otfs, otfs_new, rc);
             }
             else {
-                // Enter Device Directory: max is 16 hex chars long (8 bytes)
-                snprintf(rtpath, 16, "/%s", ent->d_name);
-                DEBUGPRINT("%s %d :: devdir=%s\n", __FUNCTION__, __LINE__, pathbuf);
-                devdir = opendir(pathbuf);
-                if (devdir == NULL) {
-                    rc = -8;
-                }
-                else {
-                    ///@todo verify that final argument is indeed what we want to do
-                    rc = cmdsub_datafile(dth, dst, dstmax, tmpl, devdir, pathbuf, data_fs.uid.u64, true);
-                    closedir(devdir);
-                    devdir = NULL;
-                }
+                ///@todo verify that final argument is indeed what we want to do
+                rc = sub_dataapply(dth, schema, dev->data, data_fs.uid.u64, true);
             }
             
             // free data_fs.base allocation if there's an error
@@ -975,9 +1292,9 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
                 DEBUGPRINT("%s %d :: otfs_del() passed\n", __FUNCTION__, __LINE__);
             }
         }
+        sub_loadfree(dev);
     }
-    closedir(dir);
-    dir = NULL;
+    sub_loadfinish(pool, devs, devices);
     
 //if (gfbhdr != NULL) {
 //fprintf(stderr, "GFB BASE = %u\n", gfbhdr[0].base);
@@ -1023,6 +1340,16 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
                     rc = -10;
                     goto cmd_open_ENDGAME;
                 }
+                
+                /// Schema references the exported template, so it replaces
+                /// the local one that was used for the import.
+                talloc_free(schema);
+                schema = schema_compile(dth->pctx, tmpl_export);
+                if (schema == NULL) {
+                    ///@todo error code
+                    rc = -11;
+                    goto cmd_open_ENDGAME;
+                }
             }
             
             DEBUGPRINT("%s %d :: cJSON_Delete\n", __FUNCTION__, __LINE__);
@@ -1060,12 +1387,40 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     ///
     if (rc >= 0) {
         dth->ext->db = db;
+        devcache_reset(dth->ext->devcache, db);
         talloc_free(dth->ext->tmpl);
         dth->ext->tmpl = tmpl_export;
+        talloc_free(dth->ext->schema);
+        dth->ext->schema = schema;
         
         talloc_free(dth->ext->tmpl_fs);
         dth->ext->tmpl_fs = tmpl_fs;
         
+        /// The opened archive is the baseline for incremental saves.  A
+        /// snapshot can't be saved incrementally, so it isn't one.
+        if (snapshot_test(arglist.archive_path)) {
+            dirty_reset(dth->ext->dirty, NULL);
+        }
+        else {
+            dirty_reset(dth->ext->dirty, arglist.archive_path);
+        }
+        
+        /// Changes made after the archive was saved are replayed from its
+        /// write-ahead log, which then continues to log new changes.
+        {   int replayed = wal_attach(dth->ext->wal, arglist.archive_path, &sub_walapply, dth);
+            if (replayed < 0) {
+                DEBUG_PRINTF("Write-ahead log of %s cannot be used (%i)\n", arglist.archive_path, replayed);
+            }
+        }
+        
+        /// Declared field indexes are rebuilt from the new DB, in parallel,
+        /// once the log has been replayed.
+        {   size_t devices;
+            otfs_t* dev = query_alldevices(dth->tctx, db, &devices);
+            fidx_rebuild(dth->ext->fidx, schema, dev, devices);
+            talloc_free(dev);
+        }
+        
 //        if (dth->ext->devmgr != NULL) {
 //            uint8_t pushargs[] = "";
 //            int argslen = sizeof("");
@@ -1073,6 +1428,7 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
 //        }
     }
     else {
+        talloc_free(schema);
         talloc_free(tmpl_fs);
         cJSON_Delete(tmpl);
         otfs_deinit(db, &sub_tfree);
@@ -1095,12 +1451,11 @@ int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
 
 int cmd_load(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     int rc;
+    int jrc;
     
     // POSIX Filesystem and JSON handles
     DIR* dir                = NULL;
     DIR* devdir             = NULL;
-    struct dirent *ent      = NULL;
-    struct dirent *entbuf   = NULL;
     char* endptr;
     TALLOC_CTX* cmd_load_heap;
     
@@ -1150,12 +1505,6 @@ int cmd_load(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
         rc = -3;
         goto cmd_load_CLOSE;
     }
-    entbuf = talloc_size(cmd_load_heap, dirent_buf_size(dir));
-    if (entbuf == NULL) {
-        rc = -3;
-        goto cmd_load_CLOSE;
-    }
-    
     endptr = NULL;
     active_id.u64 = strtoull(arglist.archive_path, &endptr, 16);
     if ((*endptr == '\0') && (*arglist.archive_path != '\0')) {
@@ -1168,66 +1517,46 @@ int cmd_load(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
         }
         
         // Activate the chosen ID.  If it is not in the database, skip it.
-        if (otfs_setfs(dth->ext->db, NULL, &active_id.u8[0]) == 0) {
-            rc = cmdsub_datafile(dth, dst, dstmax, dth->ext->tmpl, devdir, arglist.archive_path, active_id.u64, false);
+        if (devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, &active_id.u8[0]) == 0) {
+            rc = cmdsub_datafile(dth, dst, dstmax, dth->ext->schema, devdir, arglist.archive_path, active_id.u64, false);
+            jrc = cmd_journaldev(dth, active_id.u64);
+            rc  = (rc == 0) ? jrc : rc;
         }
     }
     else {
-        char pathbuf[256];
-        char* rtpath;
-    
-        // the input archive folder is not a hex number: must contain subfolders
+        workpool_t pool;
+        load_dev_t* devs;
+        size_t devices;
+        size_t queued = 0;
         
-        // Go into each directory that isn't "_TMPL"
-        // The pathbuf already contains the root directory, from step 2, but we
-        // need to clip the _TMPL part.
-        rtpath  = stpncpy(pathbuf, arglist.archive_path, (sizeof(pathbuf) - (32+1)) );
-        *rtpath = 0;
+        // the input archive folder is not a hex number: must contain subfolders
+        // Go into each directory that isn't "_TMPL".  If there is a device ID
+        // list, only the folders in the list are used.
+        rc = sub_loadscan(cmd_load_heap, &devs, arglist.archive_path, arglist.devid_strlist, arglist.devid_strlist_size);
+        if (rc < 0) {
+            goto cmd_load_CLOSE;
+        }
+        devices = (size_t)rc;
+        rc      = 0;
         
-        while (rc == 0) {
-            readdir_r(dir, entbuf, &ent);
-            if (ent == NULL) {
-                break;
-            }
-            
-            // If entity is not a Directory, go to next entity in the dir
-            DEBUGPRINT("%s %d :: d_name=%s\n", __FUNCTION__, __LINE__, ent->d_name);
-            if (ent->d_type != DT_DIR) {
-                continue;
-            }
-            
-            // Name of directory must be a pure hex number.
-            endptr          = NULL;
-            active_id.u64   = strtoull(ent->d_name, &endptr, 16);
-            if (((*ent->d_name != '\0') && (*endptr == '\0')) == 0) {
-                continue;
-            }
-            
-            // If there is a device ID list, we need to make sure the UID of the
-            // input folder is in the list.  If there is no device ID list, we
-            // use all input folders.
-            if (arglist.devid_strlist_size > 0) {
-                if (uid_in_list(arglist.devid_strlist, arglist.devid_strlist_size, active_id.u64) == false) {
-                    continue;
-                }
-            }
+        if (workpool_start(&pool, OTDB_PARAM_LOAD_WORKERS, (long)devices, OTDB_PARAM_LOAD_AHEAD,
+                            &sub_loadaction, &sub_loaddone, NULL) != 0) {
+            rc = -7;
+            goto cmd_load_CLOSE;
+        }
+        for (size_t i=0; (rc==0) && (i<devices); i++) {
+            load_dev_t* dev = sub_loadget(pool, devs, devices, &queued, i);
             
-            // - Enter Device Directory: max is 16 hex chars long (8 bytes)
-            // - Activate the chosen ID.  If it is not in the database, skip it.
-            snprintf(rtpath, 16, "/%s", ent->d_name);
-            DEBUGPRINT("%s %d :: devdir=%s\n", __FUNCTION__, __LINE__, pathbuf);
-            devdir = opendir(pathbuf);
-            if (devdir == NULL) {
-                rc = -8;
-            }
-            else {
-                if (otfs_setfs(dth->ext->db, NULL, &active_id.u8[0]) == 0) {
-                    rc = cmdsub_datafile(dth, dst, dstmax, dth->ext->tmpl, devdir, pathbuf, active_id.u64, false);
-                }
-                closedir(devdir);
-                devdir = NULL;
+            // Activate the chosen ID.  If it is not in the database, skip it.
+            rc = dev->rc;
+            if ((rc == 0) && (devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&dev->uid) == 0)) {
+                rc = sub_dataapply(dth, dth->ext->schema, dev->data, dev->uid, false);
+                jrc = cmd_journaldev(dth, dev->uid);
+                rc  = (rc == 0) ? jrc : rc;
             }
+            sub_loadfree(dev);
         }
+        sub_loadfinish(pool, devs, devices);
     }
     
     // 7. Close and Free all dangling memory elements
@@ -132,9 +132,7 @@ static int push_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t*
     const char* arg_b;
     
     int rc = 0;
-    int dstlim;
     vl_header_t* fhdr;
-    int wrbytes;
     int touched=0;
     int num_files=-1;
     
@@ -151,29 +149,49 @@ static int push_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t*
     fhdr = sub_resolveblock(&num_files, &arg_b, arglist, devfs);
     if (fhdr != NULL) {
         /// 3. Write each file to the target.  DO NOT write to files that require
-        ///    root access.
-        dstlim = (int)dstmax;
-        for (int i=0; i<num_files; i++) {
-            AUTH_level minauth;
-            ot_uni16 idmod;
-            vlFILE* fp;
-            uint8_t* dptr;
+        ///    root access.  The writes are submitted a window at a time, so
+        ///    devmgr can have several of them in flight.
+        for (int base=0; base<num_files; base+=OTDB_PARAM_DEVMGR_WINDOW) {
+            dm_txn_t txn[OTDB_PARAM_DEVMGR_WINDOW];
+            uint8_t* txbuf[OTDB_PARAM_DEVMGR_WINDOW];
+            int window = num_files - base;
             
-            // File Access Check: no root operation allowed
-            idmod.ushort = fhdr[i].idmod;
-            if ((idmod.ubyte[1] & 0x12) == 0) {
-                continue;
+            if (window > OTDB_PARAM_DEVMGR_WINDOW) {
+                window = OTDB_PARAM_DEVMGR_WINDOW;
             }
             
-            // Open File pointer and check also that memptr call worked
-            fp = vl_open(arglist->block_id, idmod.ubyte[0], VL_ACCESS_SU, NULL);
-            if (fp != NULL) {
-                dptr    = vl_memptr(fp);
-                wrbytes = cmd_hexnwrite(outbuf, dptr, fp->length, 512);
-                minauth = (idmod.ubyte[1] & 0x02) ? AUTH_guest : AUTH_user;
-                wrbytes = dm_xnprintf(dth, dst, dstmax, minauth, devfs->uid.u64, "file w -b %s %i [%s]", arg_b, idmod.ubyte[0], outbuf);
-                touched+= (wrbytes > 0);
-                vl_close(fp);
+            for (int k=0; k<window; k++) {
+                AUTH_level minauth;
+                ot_uni16 idmod;
+                vlFILE* fp;
+                uint8_t* dptr;
+                
+                // File Access Check: no root operation allowed
+                txbuf[k]        = NULL;
+                idmod.ushort    = fhdr[base+k].idmod;
+                if ((idmod.ubyte[1] & 0x12) == 0) {
+                    continue;
+                }
+                
+                // Open File pointer and check also that memptr call worked
+                fp = vl_open(arglist->block_id, idmod.ubyte[0], VL_ACCESS_SU, NULL);
+                if (fp != NULL) {
+                    txbuf[k] = talloc_size(dth->tctx, 1024);
+                    if (txbuf[k] != NULL) {
+                        dptr    = vl_memptr(fp);
+                        cmd_hexnwrite(outbuf, dptr, fp->length, 512);
+                        minauth = (idmod.ubyte[1] & 0x02) ? AUTH_guest : AUTH_user;
+                        dm_xnsubmit(dth, &txn[k], txbuf[k], 1024, minauth, devfs->uid.u64, "file w -b %s %i [%s]", arg_b, idmod.ubyte[0], outbuf);
+                    }
+                    vl_close(fp);
+                }
+            }
+            
+            for (int k=0; k<window; k++) {
+                if (txbuf[k] != NULL) {
+                    touched += (dm_xnwait(dth, &txn[k]) > 0);
+                    talloc_free(txbuf[k]);
+                }
             }
         }
     }
@@ -181,8 +199,8 @@ static int push_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t*
     /// 4. Add results to output manifest
     ///@todo add hex output option
     if (arglist->jsonout_flag) {
-        rc = snprintf((char*)dst, dstmax, "{\"devid\":\"%"PRIx64"\", \"block\":%i, \"files\":%i, \"touched\":%i},",
-                        devfs->uid.u64, arglist->block_id, num_files, touched);
+        rc = snprintf((char*)dst, dstmax, "%s{\"devid\":\"%"PRIx64"\", \"block\":%i, \"files\":%i, \"touched\":%i}",
+                        (index > 1) ? "," : "", devfs->uid.u64, arglist->block_id, num_files, touched);
     }
     else {
         rc = snprintf((char*)dst, dstmax, "devid:%"PRIx64", block:%i, files:%i, touched:%i\n",
@@ -201,11 +219,10 @@ static int pull_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t*
     const char* arg_b;
     
     int rc = 0;
-    int dstlim;
     vl_header_t* fhdr;
     int touched=0;
     int num_files=-1;
-    int i;
+    bool failed=false;
     
     /// 1. Do input check on devfs, which is provided by the iterator function.
     ///    The other arguments are passed-though from the caller, so it is up
@@ -217,40 +234,89 @@ static int pull_action(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t*
     ///    This does some low-level operations on the veelite binary image.
     fhdr = sub_resolveblock(&num_files, &arg_b, arglist, devfs);
     if (fhdr != NULL) {
+        /// The command only has the DB shared, so the device it stores to is
+        /// locked against device commands.
+        dblock_lockdev(dth->dblock, &dth->lock, devfs->uid.u64, dth->ext->db);
+        
         /// 3. Read each file from the target.  Use Root if necessary.
-        dstlim = (int)dstmax;
-        for (i=0; i<num_files; i++) {
-            AUTH_level minauth;
-            vlFILE* fp;
-            int wrbytes;
+        ///    The reads are submitted a window at a time, so devmgr can have
+        ///    several of them in flight.  Files are not held open while
+        ///    waiting, so they are opened again to store the results.
+        for (int base=0; (base<num_files) && !failed; base+=OTDB_PARAM_DEVMGR_WINDOW) {
+            dm_txn_t txn[OTDB_PARAM_DEVMGR_WINDOW];
+            uint8_t* txbuf[OTDB_PARAM_DEVMGR_WINDOW];
+            size_t txmax[OTDB_PARAM_DEVMGR_WINDOW];
+            int window = num_files - base;
             
-            // Open File pointer and check also that memptr call worked
-            fp = vl_open(arglist->block_id, i, VL_ACCESS_R, NULL);
-            if (fp != NULL) {
-                ot_int binary_bytes;
-                minauth = cmd_minauth_get(fp, VL_ACCESS_R);
-                wrbytes = dm_xnprintf(dth, dst, dstmax, minauth, devfs->uid.u64, "file r -b %s %i", arg_b, i);
-                if (wrbytes <= 0) {
+            if (window > OTDB_PARAM_DEVMGR_WINDOW) {
+                window = OTDB_PARAM_DEVMGR_WINDOW;
+            }
+            
+            for (int k=0; k<window; k++) {
+                AUTH_level minauth;
+                vlFILE* fp;
+                
+                txbuf[k] = NULL;
+                fp = vl_open(arglist->block_id, base+k, VL_ACCESS_R, NULL);
+                if (fp != NULL) {
+                    // Response is hex, with the ALP and file read headers
+                    txmax[k] = (2 * (size_t)fp->alloc) + 128;
+                    txbuf[k] = talloc_size(dth->tctx, txmax[k]);
+                    if (txbuf[k] != NULL) {
+                        minauth = cmd_minauth_get(fp, VL_ACCESS_R);
+                        dm_xnsubmit(dth, &txn[k], txbuf[k], txmax[k], minauth, devfs->uid.u64, "file r -b %s %i", arg_b, base+k);
+                    }
                     vl_close(fp);
-                    break;
                 }
-                touched++;
-                binary_bytes = cmd_hexread(dst, (char*)dst);
+            }
+            
+            for (int k=0; k<window; k++) {
+                vlFILE* fp;
+                int wrbytes;
+                
+                if (txbuf[k] == NULL) {
+                    continue;
+                }
+                wrbytes = dm_xnwait(dth, &txn[k]);
+                if (wrbytes <= 0) {
+                    failed = true;
+                }
+                else if ((fp = vl_open(arglist->block_id, base+k, VL_ACCESS_R, NULL)) != NULL) {
+                    ot_int binary_bytes;
+                    binary_bytes = cmd_hexread(txbuf[k], (char*)txbuf[k]);
                     
-                ///@todo the +9,-9 is a hack to bypass the alp & file read headers.
-                ///@todo Verify the ALP ID of the return message
-                ///@todo Verify the alignment of the file read vs. local file
-                vl_store(fp, binary_bytes-9, dst+9);
-                vl_close(fp);
+                    ///@todo the +9,-9 is a hack to bypass the alp & file read headers.
+                    ///@todo Verify the ALP ID of the return message
+                    ///@todo Verify the alignment of the file read vs. local file
+                    if (binary_bytes > 9) {
+                        wal_rec_t rec = {
+                            .op     = WAL_store,
+                            .uid    = devfs->uid.u64,
+                            .block  = arglist->block_id,
+                            .file   = base+k,
+                        };
+                        vl_store(fp, binary_bytes-9, txbuf[k]+9);
+                        if (cmd_journal(dth, &rec, txbuf[k]+9, binary_bytes-9) != 0) {
+                            rc = CMD_ERR_JOURNAL;
+                        }
+                        touched++;
+                    }
+                    vl_close(fp);
+                }
+                talloc_free(txbuf[k]);
             }
         }
+        dblock_unlockdev(dth->dblock, &dth->lock);
+    }
+    if (rc != 0) {
+        return rc;
     }
     
     /// 4. Add results to output manifest
     ///@todo add hex output option
     if (arglist->jsonout_flag) {
-        rc = snprintf((char*)dst, dstmax, "{\"devid\":\"%"PRIx64"\", \"block\":%i, \"files\":%i, \"touched\":%i},",
-                        devfs->uid.u64, arglist->block_id, num_files, touched);
+        rc = snprintf((char*)dst, dstmax, "%s{\"devid\":\"%"PRIx64"\", \"block\":%i, \"files\":%i, \"touched\":%i}",
+                        (index > 1) ? "," : "", devfs->uid.u64, arglist->block_id, num_files, touched);
     }
     else {
         rc = snprintf((char*)dst, dstmax, "devid:%"PRIx64", block:%i, files:%i, touched:%i\n",
@@ -279,7 +345,7 @@ static int sub_testbuffer(int segbytes, int dstlimit) {
 static int sub_pushpull(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax, const char* cmdname, iteraction_t action) {
     int rc;
     uint8_t* dstcurs;
-    int dstlimit;
+    size_t dstlimit;
     int newchars;
     cmd_arglist_t arglist = {
         .fields = ARGFIELD_JSONOUT | ARGFIELD_BLOCKID | ARGFIELD_DEVICEIDLIST,
@@ -296,7 +362,7 @@ static int sub_pushpull(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t
     
     /// Set cursors and limits. -1 on dstlimit accounts for null string terminator
     dstcurs     = dst;
-    dstlimit    = (int)dstmax - 1;
+    dstlimit    = dstmax - 1;
     
     /// Extract arguments into arglist struct
     rc = cmd_extract_args(&arglist, args, cmdname, (const char*)src, inbytes);
@@ -308,30 +374,34 @@ static int sub_pushpull(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t
     /// Preliminary writeout
     ///@todo this could be a cmd library function
     if (arglist.jsonout_flag) {
-        dstlimit   -= 2;  // -2 accounts for JSON termination ("]}")
         newchars    = snprintf((char*)dstcurs, dstlimit, "{\"cmd\":\"%s\", \"fbatch\":[", cmdname);
-        dstcurs    += newchars;
-        dstlimit   -= newchars;
-        rc          = sub_testbuffer(newchars, dstlimit);
+        rc          = sub_testbuffer(newchars, (int)dstlimit - newchars);
         if (rc < 0) {
             goto sub_pushpull_END;
         }
+        dstcurs    += newchars;
+        dstlimit   -= newchars;
     }
     
-    rc = iterator_uids(dth, dstcurs, inbytes, &src, (size_t)dstlimit, &arglist, action);
-    if (rc > 0) {
-        dstcurs += rc-1;    //-1 to eat last comma
+    /// The manifest is streamed by the iterator, so it is not limited by dstmax
+    rc = iterator_uids(dth, &dstcurs, inbytes, &src, &dstlimit, &arglist, action);
+    if ((rc >= 0) && arglist.jsonout_flag) {
+        dstcurs = dtwriter_advance(dth->out, dstcurs, &dstlimit, 3);
+        if (dstcurs == NULL) {
+            rc = -4;
+        }
     }
     
     sub_pushpull_END:
-    if (arglist.jsonout_flag) {
-        if (rc < 0) {
-            rc = cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, cmdname);
-        }
-        else {
+    if (rc < 0) {
+        dst = dtwriter_cursor(dth->out, &dstmax);
+        rc  = cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, cmdname);
+    }
+    else {
+        if (arglist.jsonout_flag) {
             dstcurs+= sprintf((char*)dstcurs, "]}");
-            rc      = (int)(dstcurs - dst);
         }
+        rc = (int)(dstcurs - dtwriter_cursor(dth->out, NULL));
     }
     
     return rc;
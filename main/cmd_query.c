@@ -0,0 +1,522 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "agg.h"
+#include "cmds.h"
+#include "dterm.h"
+#include "fidx.h"
+#include "iterator.h"
+#include "query.h"
+#include "schema.h"
+#include "otdb_cfg.h"
+#include "debug.h"
+
+// HB Headers/Libraries
+#include <argtable3.h>
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// used by DB manipulation commands
+extern struct arg_lit*  jsonout_opt;
+
+// used by file commands
+extern struct arg_str*  devidset_opt;
+extern struct arg_str*  query_man;
+extern struct arg_str*  project_opt;
+extern struct arg_str*  fieldname_man;
+extern struct arg_int*  bins_opt;
+
+// used by all commands
+extern struct arg_lit*  help_man;
+extern struct arg_end*  end_man;
+
+
+#define QUERY_MAXFIELDS     16
+
+
+
+
+static otfs_t* sub_devices(dterm_handle_t* dth, const uint64_t* uid, size_t count, size_t* devices) {
+/// Resolves UIDs to their FS images.  UIDs that aren't in the DB are skipped.
+/// The images stay valid as long as the DB lock of the command is held.
+    otfs_t* dev;
+    size_t i = 0;
+
+    dev = talloc_array(dth->tctx, otfs_t, count + 1);
+    for (size_t j=0; (dev != NULL) && (j < count); j++) {
+        if (devcache_setfs(dth->ext->devcache, dth->ext->db, &dev[i], (uint8_t*)&uid[j]) == 0) {
+            i++;
+        }
+    }
+
+    *devices = i;
+    return dev;
+}
+
+
+static int sub_putfield(char* dst, size_t dstmax, const void* image, const query_field_t* field, bool json) {
+/// Writes name:value of a field, or name=value for text output.  Fields that
+/// a device doesn't have are null.
+    const uint8_t* src = query_locate(image, field);
+    const char* sep = json ? "\":" : "=";
+    double number;
+    int rc;
+
+    rc = snprintf(dst, dstmax, "%s%s", json ? "\"" : "", field->name);
+    if (src == NULL) {
+        rc += snprintf(&dst[rc], dstmax-rc, "%snull", sep);
+    }
+    else if (jst_read_number(&number, src, field->type.index, field->bitpos, field->type.bits)) {
+        rc += snprintf(&dst[rc], dstmax-rc, "%s%.15g", sep, number);
+    }
+    else if (field->type.index == TYPE_hex) {
+        rc += snprintf(&dst[rc], dstmax-rc, "%s\"", sep);
+        rc += cmd_hexnwrite(&dst[rc], src, field->type.bits/8, dstmax-rc-2);
+        rc += snprintf(&dst[rc], dstmax-rc, "\"");
+    }
+    else {
+        /// Strings are cut at their terminator, and characters that aren't
+        /// safe in JSON are dropped.
+        rc += snprintf(&dst[rc], dstmax-rc, "%s\"", sep);
+        for (int i=0; (i<(field->type.bits/8)) && (src[i]!=0) && (rc<(int)dstmax-2); i++) {
+            if ((src[i] >= 0x20) && (src[i] != '"') && (src[i] != '\\') && (src[i] < 0x7F)) {
+                dst[rc++] = (char)src[i];
+            }
+        }
+        rc += snprintf(&dst[rc], dstmax-rc, "\"");
+    }
+    return rc;
+}
+
+
+static int sub_compile_fields(TALLOC_CTX* ctx, query_field_t* field, const tmpl_schema_t* schema, const char* list) {
+/// Resolves a comma separated list of field names.  Returns the number of
+/// fields, or negative on error.
+    char* names;
+    char* name;
+    char* tokctx;
+    int count = 0;
+
+    if (list == NULL) {
+        return 0;
+    }
+    names = talloc_strdup(ctx, list);
+    if (names == NULL) {
+        return -1;
+    }
+    for (name=strtok_r(names, ",", &tokctx); name!=NULL; name=strtok_r(NULL, ",", &tokctx)) {
+        if ((count >= QUERY_MAXFIELDS) || (query_resolve(&field[count], schema, name) != 0)) {
+            return -2;
+        }
+        count++;
+    }
+    return count;
+}
+
+
+
+
+int cmd_select(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDSET | ARGFIELD_QUERY,
+    };
+    void* args[] = {help_man, jsonout_opt, devidset_opt, project_opt, query_man, end_man};
+    tmpl_schema_t* schema = dth->ext->schema;
+    query_pred_t pred[16];
+    query_field_t field[QUERY_MAXFIELDS];
+    int preds;
+    int fields;
+    otfs_t* dev = NULL;
+    uint8_t* hit = NULL;
+    uint64_t* uid = NULL;
+    size_t count = 0;
+    int index = -1;
+    size_t devices;
+    size_t hits;
+    uint8_t* dstcurs;
+    size_t dstlimit;
+
+    if ((dth->ext->db == NULL) || (schema == NULL)) {
+        return cmd_jsonout_err((char*)dst, dstmax, false, -1, "select");
+    }
+
+    rc = cmd_extract_args(&arglist, args, "select", (const char*)src, inbytes);
+    if (rc != 0) {
+        goto cmd_select_END;
+    }
+
+    /// Predicates and projected fields are compiled once for all devices
+    preds = arglist.query_list_size;
+    for (int i=0; i<preds; i++) {
+        if (query_compile(dth->tctx, &pred[i], schema, arglist.query_list[i]) != 0) {
+            rc = -9;
+            goto cmd_select_END;
+        }
+    }
+    fields = sub_compile_fields(dth->tctx, field, schema, arglist.project);
+    if (fields < 0) {
+        rc = -10;
+        goto cmd_select_END;
+    }
+
+    /// Devices are the ones given in -I, or else the candidates of the most
+    /// selective predicate that has an index, or else all of them.
+    if (arglist.devid_set != NULL) {
+        uid     = iterator_parseset(dth->tctx, arglist.devid_set, &count);
+        dev     = (uid != NULL) ? sub_devices(dth, uid, count, &devices) : NULL;
+    }
+    else {
+        for (int i=0; i<preds; i++) {
+            uint64_t* cand = NULL;
+            int found = fidx_lookup(dth->ext->fidx, dth->tctx, &pred[i], &cand);
+            if ((found >= 0) && ((index < 0) || ((size_t)found < count))) {
+                talloc_free(uid);
+                uid     = cand;
+                count   = (size_t)found;
+                index   = i;
+            }
+            else {
+                talloc_free(cand);
+            }
+        }
+        if (index >= 0) {
+            dev = sub_devices(dth, uid, count, &devices);
+        }
+        else {
+            dev = query_alldevices(dth->tctx, dth->ext->db, &devices);
+        }
+    }
+    hit = talloc_zero_array(dth->tctx, uint8_t, devices + 1);
+    if ((dev == NULL) || (hit == NULL)) {
+        rc = -2;
+        goto cmd_select_END;
+    }
+    hits = query_scan(dev, devices, pred, preds, hit);
+
+    /// Matches are streamed, in DB order
+    dstcurs     = dst;
+    dstlimit    = dstmax - 1;
+    if (arglist.jsonout_flag) {
+        dstcurs += snprintf((char*)dstcurs, dstlimit, "{\"cmd\":\"select\", \"index\":\"%s\", \"devices\":%zu, \"count\":%zu, \"matches\":[",
+                            (index >= 0) ? pred[index].field.name : "", devices, hits);
+    }
+    for (size_t i=0, n=0, relook=0; i<devices; i++) {
+        char* cursor;
+
+        if (hit[i] == 0) {
+            continue;
+        }
+
+        /// After a drain, the images of the devices are looked up again, and
+        /// devices deleted meanwhile are skipped.  The compiled fields refer
+        /// to the schema, so a new one ends the command.
+        if (relook) {
+            if (dth->ext->schema != schema) {
+                rc = -11;
+                goto cmd_select_END;
+            }
+            uint64_t devid = dev[i].uid.u64;
+            if (devcache_setfs(dth->ext->devcache, dth->ext->db, &dev[i], (uint8_t*)&devid) != 0) {
+                continue;
+            }
+        }
+        dstcurs = dtwriter_advance(dth->out, dstcurs, &dstlimit, LINESIZE + (fields * 256));
+        if (dstcurs == NULL) {
+            rc = -4;
+            goto cmd_select_END;
+        }
+        cursor = (char*)dstcurs;
+        if (arglist.jsonout_flag) {
+            cursor += sprintf(cursor, "%s{\"devid\":\"%"PRIx64"\"", (n++ > 0) ? "," : "", dev[i].uid.u64);
+            if (fields > 0) {
+                cursor += sprintf(cursor, ", \"fields\":{");
+                for (int f=0; f<fields; f++) {
+                    cursor += (f > 0) ? sprintf(cursor, ", ") : 0;
+                    cursor += sub_putfield(cursor, 256, dev[i].base, &field[f], true);
+                }
+                cursor += sprintf(cursor, "}");
+            }
+            cursor += sprintf(cursor, "}");
+        }
+        else {
+            cursor += sprintf(cursor, "%"PRIx64, dev[i].uid.u64);
+            for (int f=0; f<fields; f++) {
+                cursor += sprintf(cursor, " ");
+                cursor += sub_putfield(cursor, 256, dev[i].base, &field[f], false);
+            }
+            cursor += sprintf(cursor, "\n");
+        }
+        dstcurs = (uint8_t*)cursor;
+
+        rc = dterm_drain(dth, &dstcurs, &dstlimit);
+        if (rc < 0) {
+            rc = -4;
+            goto cmd_select_END;
+        }
+        relook |= (size_t)rc;
+    }
+    if (arglist.jsonout_flag) {
+        dstcurs = dtwriter_advance(dth->out, dstcurs, &dstlimit, 3);
+        if (dstcurs == NULL) {
+            rc = -4;
+            goto cmd_select_END;
+        }
+        dstcurs += sprintf((char*)dstcurs, "]}");
+    }
+
+    /// Return the output still pending at the writer cursor
+    rc = (int)(dstcurs - dtwriter_cursor(dth->out, NULL));
+
+    cmd_select_END:
+    talloc_free(hit);
+    talloc_free(dev);
+    talloc_free(uid);
+    if (rc < 0) {
+        dst = dtwriter_cursor(dth->out, &dstmax);
+        rc  = cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "select");
+    }
+    return rc;
+}
+
+
+
+int cmd_agg(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDSET | ARGFIELD_BINS | ARGFIELD_FIELDNAME,
+    };
+    void* args[] = {help_man, jsonout_opt, devidset_opt, bins_opt, fieldname_man, end_man};
+    tmpl_schema_t* schema = dth->ext->schema;
+    query_field_t field;
+    agg_kernel_t kernel;
+    agg_result_t result;
+    otfs_t* dev = NULL;
+    uint64_t* uid = NULL;
+    double* column = NULL;
+    uint64_t* hist = NULL;
+    size_t devices;
+    size_t count;
+    uint8_t* dstcurs;
+    size_t dstlimit;
+    char* cursor;
+
+    if ((dth->ext->db == NULL) || (schema == NULL)) {
+        return cmd_jsonout_err((char*)dst, dstmax, false, -1, "agg");
+    }
+
+    rc = cmd_extract_args(&arglist, args, "agg", (const char*)src, inbytes);
+    if (rc != 0) {
+        goto cmd_agg_END;
+    }
+    if ((query_resolve(&field, schema, arglist.fieldname) != 0)
+    || (field.type.index == TYPE_string) || (field.type.index == TYPE_hex)) {
+        rc = -9;
+        goto cmd_agg_END;
+    }
+
+    if (arglist.devid_set != NULL) {
+        uid = iterator_parseset(dth->tctx, arglist.devid_set, &count);
+        dev = (uid != NULL) ? sub_devices(dth, uid, count, &devices) : NULL;
+    }
+    else {
+        dev = query_alldevices(dth->tctx, dth->ext->db, &devices);
+    }
+    column  = (dev != NULL) ? talloc_array(dth->tctx, double, devices + 1) : NULL;
+    hist    = talloc_array(dth->tctx, uint64_t, arglist.bins + 1);
+    if ((column == NULL) || (hist == NULL)) {
+        rc = -2;
+        goto cmd_agg_END;
+    }
+
+    /// The column is gathered once, then the histogram is taken over the
+    /// range found by the reduction.
+    kernel  = agg_kernel();
+    count   = agg_gather(column, dev, devices, &field);
+    agg_reduce(&result, column, count, kernel);
+    if (count == 0) {
+        arglist.bins = 0;
+    }
+    agg_histogram(hist, arglist.bins, result.min, result.max, column, count, kernel);
+
+    dstcurs     = dst;
+    dstlimit    = dstmax - 1;
+    dstcurs     = dtwriter_advance(dth->out, dstcurs, &dstlimit, LINESIZE + (arglist.bins * 24));
+    if (dstcurs == NULL) {
+        rc = -4;
+        goto cmd_agg_END;
+    }
+    cursor = (char*)dstcurs;
+    if (arglist.jsonout_flag) {
+        cursor += sprintf(cursor, "{\"cmd\":\"agg\", \"field\":\"%s\", \"kernel\":\"%s\", \"devices\":%zu, \"count\":%zu",
+                            arglist.fieldname, agg_kernelname(kernel), devices, result.count);
+        if (result.count > 0) {
+            cursor += sprintf(cursor, ", \"min\":%.15g, \"max\":%.15g, \"sum\":%.15g, \"mean\":%.15g",
+                                result.min, result.max, result.sum, result.sum / (double)result.count);
+        }
+        cursor += sprintf(cursor, ", \"hist\":[");
+        for (int i=0; i<arglist.bins; i++) {
+            cursor += sprintf(cursor, "%s%"PRIu64, (i > 0) ? "," : "", hist[i]);
+        }
+        cursor += sprintf(cursor, "]}");
+    }
+    else {
+        cursor += sprintf(cursor, "count=%zu", result.count);
+        if (result.count > 0) {
+            cursor += sprintf(cursor, " min=%.15g max=%.15g sum=%.15g mean=%.15g",
+                                result.min, result.max, result.sum, result.sum / (double)result.count);
+        }
+        for (int i=0; i<arglist.bins; i++) {
+            cursor += sprintf(cursor, "%s%"PRIu64, (i > 0) ? " " : "\nhist=", hist[i]);
+        }
+        cursor += sprintf(cursor, "\n");
+    }
+    dstcurs = (uint8_t*)cursor;
+    rc      = (int)(dstcurs - dtwriter_cursor(dth->out, NULL));
+
+    cmd_agg_END:
+    talloc_free(hist);
+    talloc_free(column);
+    talloc_free(dev);
+    talloc_free(uid);
+    if (rc < 0) {
+        dst = dtwriter_cursor(dth->out, &dstmax);
+        rc  = cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "agg");
+    }
+    return rc;
+}
+
+
+
+int cmd_idxnew(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_FIELDNAME,
+    };
+    void* args[] = {help_man, jsonout_opt, fieldname_man, end_man};
+    tmpl_schema_t* schema = dth->ext->schema;
+    otfs_t* dev = NULL;
+    size_t devices;
+
+    rc = cmd_extract_args(&arglist, args, "ix-new", (const char*)src, inbytes);
+    if (rc != 0) {
+        goto cmd_idxnew_END;
+    }
+
+    /// With a DB open, the field must be in its template.  Otherwise, the
+    /// index is only declared, and it is built when a DB is opened.
+    if (schema != NULL) {
+        query_field_t field;
+        if (query_resolve(&field, schema, arglist.fieldname) != 0) {
+            rc = -9;
+            goto cmd_idxnew_END;
+        }
+    }
+    rc = fidx_declare(dth->ext->fidx, arglist.fieldname);
+    if (rc != 0) {
+        rc = -1024 + rc;
+        goto cmd_idxnew_END;
+    }
+
+    if ((schema != NULL) && (dth->ext->db != NULL)) {
+        dev = query_alldevices(dth->tctx, dth->ext->db, &devices);
+        rc  = (dev != NULL) ? fidx_build(dth->ext->fidx, arglist.fieldname, schema, dev, devices) : -2;
+        talloc_free(dev);
+        if (rc < 0) {
+            fidx_drop(dth->ext->fidx, arglist.fieldname);
+            goto cmd_idxnew_END;
+        }
+    }
+
+    if (arglist.jsonout_flag) {
+        return snprintf((char*)dst, dstmax-1, "{\"cmd\":\"ix-new\", \"field\":\"%s\", \"entries\":%d}", arglist.fieldname, rc);
+    }
+    return snprintf((char*)dst, dstmax-1, "%d\n", rc);
+
+    cmd_idxnew_END:
+    return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "ix-new");
+}
+
+
+
+int cmd_idxdel(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_FIELDNAME,
+    };
+    void* args[] = {help_man, jsonout_opt, fieldname_man, end_man};
+
+    rc = cmd_extract_args(&arglist, args, "ix-del", (const char*)src, inbytes);
+    if (rc == 0) {
+        rc = fidx_drop(dth->ext->fidx, arglist.fieldname);
+        if (rc < 0) {
+            rc = -1024 + rc;
+        }
+    }
+
+    return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "ix-del");
+}
+
+
+
+int cmd_idxls(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT,
+    };
+    void* args[] = {help_man, jsonout_opt, end_man};
+    char* cursor = (char*)dst;
+    char* limit = (char*)dst + dstmax - 1;
+    char name[64];
+    size_t entries;
+    bool built;
+
+    rc = cmd_extract_args(&arglist, args, "ix-ls", (const char*)src, inbytes);
+    if (rc != 0) {
+        return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "ix-ls");
+    }
+
+    if (arglist.jsonout_flag) {
+        cursor += snprintf(cursor, limit-cursor, "{\"cmd\":\"ix-ls\", \"indexes\":[");
+    }
+    for (int i=0; (cursor < limit) && (fidx_info(dth->ext->fidx, i, name, sizeof(name), &entries, &built) == 0); i++) {
+        if (arglist.jsonout_flag) {
+            cursor += snprintf(cursor, limit-cursor, "%s{\"field\":\"%s\", \"built\":%s, \"entries\":%zu}",
+                                (i > 0) ? "," : "", name, built ? "true" : "false", entries);
+        }
+        else if (built) {
+            cursor += snprintf(cursor, limit-cursor, "%s %zu\n", name, entries);
+        }
+        else {
+            cursor += snprintf(cursor, limit-cursor, "%s unbuilt\n", name);
+        }
+    }
+    if ((arglist.jsonout_flag) && (cursor < limit)) {
+        cursor += snprintf(cursor, limit-cursor, "]}");
+    }
+    if (cursor > limit) {
+        cursor = limit;
+    }
+
+    return (int)(cursor - (char*)dst);
+}
@@ -19,7 +19,12 @@
 #include "dterm.h"
 #include "cliopt.h"
 #include "otdb_cfg.h"
+#include "dirty.h"
 #include "json_tools.h"
+#include "schema.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "workpool.h"
 
 // HB Headers/Libraries
 #include <bintex.h>
@@ -32,10 +37,13 @@
 #include <math.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 
@@ -43,6 +51,8 @@
 extern struct arg_str*  devid_man;
 extern struct arg_file* archive_man;
 extern struct arg_lit*  compress_opt;
+extern struct arg_lit*  snapshot_opt;
+extern struct arg_lit*  incremental_opt;
 extern struct arg_lit*  jsonout_opt;
 
 // used by file commands
@@ -77,23 +87,446 @@ extern struct arg_end*  end_man;
 #endif
 
 
-static int sub_nextdevice(void* handle, uint8_t* uid, int* devid_i, const char** strlist, size_t listsz) {
+static int sub_nextdevice(dterm_handle_t* dth, uint8_t* uid, int* devid_i, const char** strlist, size_t listsz) {
     int devtest = 1;
 
     for (; (devtest!=0) && (*devid_i<listsz); (*devid_i)++) {
         DEBUGPRINT("%s %d :: devid[%i] = %s\n", __FUNCTION__, __LINE__, *devid_i, strlist[*devid_i]);
         memset(uid, 0, 8);
         *((uint64_t*)uid) = strtoull(strlist[*devid_i], NULL, 16);
-        devtest = otfs_setfs(handle, NULL, uid);
+        devtest = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, uid);
     }
     
     return devtest;
 }
 
 
+static int sub_nextdirty(dterm_handle_t* dth, uint8_t* uid, int* dirty_i, const uint64_t* dirtylist, int dirtysz,
+                        const char** strlist, size_t listsz, char* pathbuf, char* rtpath) {
+/// Iterates over the devices changed since the last save, which are also in
+/// the device ID list if there is one.  Devices that no longer exist in the DB
+/// are removed from the archive here, so the iteration only returns devices
+/// that need files written.
+    int devtest = 1;
+    
+    for (; (devtest!=0) && (*dirty_i<dirtysz); (*dirty_i)++) {
+        uint64_t devid = dirtylist[*dirty_i];
+        
+        if (listsz > 0) {
+            size_t i;
+            for (i=0; (i<listsz) && (strtoull(strlist[i], NULL, 16) != devid); i++);
+            if (i == listsz) {
+                continue;
+            }
+        }
+        
+        memcpy(uid, &devid, 8);
+        devtest = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, uid);
+        if (devtest != 0) {
+            snprintf(rtpath, 17, "%"PRIx64, devid);
+            DEBUGPRINT("%s %d :: remove deleted device at %s\n", __FUNCTION__, __LINE__, pathbuf);
+            cmd_rmdir(pathbuf);
+            dirty_clear(dth->ext->dirty, devid);
+        }
+    }
+    
+    return devtest;
+}
+
+
+
+
+static int sub_checkpoint(dterm_handle_t* dth, const char* path, bool complete, bool incremental) {
+/// After a save of all devices, the archive matches the DB, so it gets a new
+/// write-ahead log.  A save of some devices over the logged archive replaces
+/// the devices that the log would be replayed onto, so the log is dropped.
+/// Only an incremental save keeps the rest of the archive as it was.  This is
+/// only done once the save is on disk.
+    if (complete) {
+        return wal_reset(dth->ext->wal, path);
+    }
+    if (!incremental && wal_isbase(dth->ext->wal, path)) {
+        return wal_reset(dth->ext->wal, NULL);
+    }
+    return 0;
+}
+
+
+static int sub_syncpath(const char* path) {
+/// fsync() works on directories too, which is how new entries get on disk.
+    int fd;
+    int rc;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+
+static int sub_syncparent(const char* path) {
+    char dirpath[256];
+    char* sep;
+    
+    snprintf(dirpath, sizeof(dirpath), "%s", path);
+    sep = strrchr(dirpath, '/');
+    if (sep == NULL) {
+        return sub_syncpath(".");
+    }
+    sep[(sep == dirpath)] = 0;
+    return sub_syncpath(dirpath);
+}
+
+
+static int sub_swapdir(const char* tmpdir, const char* dir) {
+/// Puts a complete directory in place of another one, which need not exist.
+/// A directory can't be renamed over one that has files, so the old one is
+/// moved aside first, and removed once the new one is in place.
+    char oldpath[272];
+    
+    snprintf(oldpath, sizeof(oldpath), "%s.old", dir);
+    cmd_rmdir(oldpath);
+    if ((rename(dir, oldpath) != 0) && (errno != ENOENT)) {
+        return -1;
+    }
+    if (rename(tmpdir, dir) != 0) {
+        rename(oldpath, dir);
+        return -1;
+    }
+    if (sub_syncparent(dir) != 0) {
+        return -1;
+    }
+    cmd_rmdir(oldpath);
+    return 0;
+}
+
+
+static int sub_writejson(cJSON* json, const char* path) {
+/// Same as jst_writeout(), except that the file is on disk when this returns
+/// 0.  It is written to a temporary file first, so a file of an archive is
+/// always either the old one or the new one.
+    char tmppath[272];
+    char* output;
+    FILE* fp;
+    int rc;
+    
+    output = cJSON_Print(json);
+    if (output == NULL) {
+        return -1;
+    }
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    fp = fopen(tmppath, "w");
+    if (fp == NULL) {
+        cJSON_free(output);
+        return -1;
+    }
+    rc  = (fputs(output, fp) < 0);
+    rc |= (fputs("\n", fp) < 0);
+    rc |= (fflush(fp) != 0);
+    rc |= (fsync(fileno(fp)) != 0);
+    rc |= (fclose(fp) != 0);
+    cJSON_free(output);
+    
+    if ((rc != 0) || (rename(tmppath, path) != 0)) {
+        unlink(tmppath);
+        return -1;
+    }
+    return 0;
+}
+
 
 
 
+/** Save Worker Pool
+  * -------------------------------------------------------------------------
+  * Veelite works on the active device only, so the command thread copies the
+  * files of each device out of the DB into a job.  The jobs are exported to
+  * JSON by a workpool of threads, which is where the time of a save goes.
+  * Each job is its own talloc context, so workers don't share any heap.  The
+  * command holds the DB lock until all jobs are done.
+  *
+  * Every file and directory is synced before the save returns, because the
+  * write-ahead log of the archive is reset after it.  A failed write fails
+  * the save, and the log is kept.
+  */
+
+typedef struct {
+    const tmpl_file_t* tfile;   // template file
+    uint8_t     file_id;
+    uint16_t    output_sz;      // bytes of file to export
+    uint32_t    modtime;
+    uint8_t*    fdat;           // NULL if the file doesn't exist on device
+} save_file_t;
+
+typedef struct {
+    uint64_t    uid;
+    bool        rewrite;        // remove device directory before writing
+    int         files;
+    save_file_t file[];
+} save_job_t;
+
+typedef struct {
+    dirty_t         dirty;
+    const tmpl_schema_t* schema;
+    bool            incremental;
+    char            root[256];  // archive path, with trailing '/'
+} save_ctx_t;
+
+
+
+static int sub_savefile(save_job_t* job, const tmpl_schema_t* schema, save_file_t* file, char* pathbuf, char* dev_rtpath, const char* hexuid) {
+/// Exports one file of a device to a JSON file in the device directory.
+    const tmpl_file_t* tfile = file->tfile;
+    cJSON*      cursor;
+    cJSON*      output  = NULL;
+    cJSON*      head    = NULL;
+    uint8_t*    fdat    = file->fdat;
+    uint16_t    output_sz = file->output_sz;
+    int         rc      = -1;
+    
+    /// Create JSON object top level depth, for output
+    head = cJSON_CreateObject();
+    if (head == NULL) {
+        return -1;
+    }
+    output = cJSON_AddObjectToObject(head, tfile->name);
+    if (output == NULL) {
+        goto sub_savefile_FREE;
+    }
+    
+    /// Add modtime to the metadata, and copy all metadata to output
+    {   cJSON *outmeta, *outtime, *outcontent, *outdevid;
+        outmeta     = cJSON_Duplicate(tfile->meta, true);
+        outdevid    = cJSON_CreateString(hexuid);
+        outtime     = cJSON_GetObjectItemCaseSensitive(outmeta, "modtime");
+        cJSON_SetIntValue(outtime, file->modtime);
+        cJSON_AddItemReferenceToObject(outmeta, "devid", outdevid);
+        cJSON_AddItemReferenceToObject(output, "_meta", outmeta);
+        outcontent  = cJSON_CreateObject();
+        cJSON_AddItemReferenceToObject(output, "_content", outcontent);
+    }
+
+    /// Add _content to output.  Content Data will get stored in here.
+    output = cJSON_GetObjectItemCaseSensitive(output, "_content");
+    if (output == NULL) {
+        goto sub_savefile_FREE;
+    }
+ 
+    /// Drill into contents -- three types
+    /// 1. Hex output option: just a hex string
+    /// 2. Array output option: integer for each byte
+    /// 3. Struct output option: structured data elements based on template
+    if (tfile->ctype == CONTENT_hex) {
+        char* hexstr;
+        
+        hexstr = talloc_size(job, (2*output_sz) + 1);
+        if (hexstr == NULL) {
+            goto sub_savefile_FREE;
+        }
+        cmd_hexwrite(hexstr, fdat, output_sz);
+        cursor = cJSON_AddStringToObject(output, tfile->name, hexstr);
+        talloc_free(hexstr);
+        if (cursor == NULL) {
+            goto sub_savefile_FREE;
+        }
+    }
+    
+    else if (tfile->ctype == CONTENT_array) {
+        int* intarray;
+        
+        intarray = talloc_size(job, sizeof(int)*output_sz);
+        if (intarray == NULL) {
+            goto sub_savefile_FREE;
+        }
+        for (int i=0; i<output_sz; i++) {
+            intarray[i] = fdat[i];
+        }
+        cursor = cJSON_CreateIntArray(intarray, output_sz);
+        talloc_free(intarray);
+        if (cursor == NULL) {
+            goto sub_savefile_FREE;
+        }
+        cJSON_AddItemReferenceToObject(output, tfile->name, cursor);
+    }
+    
+    else { 
+        const tmpl_field_t* field = &schema->field[tfile->field_first];
+        
+        // In struct type, the "_content" field must be an object.
+        // If content is empty, don't export this file
+        if ((tfile->has_content == false) || (tfile->field_count == 0)) {
+            rc = 0;
+            goto sub_savefile_FREE;
+        }
+     
+        // Loop through the template, export flat items, drill into
+        // nested items.
+        ///@todo make this recursive
+        for (int f=0; f<tfile->field_count; f++, field++) {
+            const tmpl_subfield_t* sub;
+            cJSON* nest_output;
+       
+            nest_output = jst_store_element(output, field->name, &fdat[field->pos], field->type.index, 0, field->type.bits);
+         
+            // This is a nested data type (namely, a bitmask)
+            // Could be recursive, currently hardcoded for bitmask
+            sub = &schema->sub[field->exp_first];
+            for (int k=0; k<field->exp_count; k++, sub++) {
+                jst_store_element(nest_output, sub->name, &fdat[field->pos], field->type.index, sub->bitpos, field->type.bits);
+            }
+        }
+    }
+    
+    /// Writeout JSON 
+    snprintf(dev_rtpath, 31, "/%u-%s.json", file->file_id, tfile->name);
+    DEBUGPRINT("%s %d :: new json file at %s\n", __FUNCTION__, __LINE__, &dev_rtpath[1]);
+    rc = (sub_writejson(head, pathbuf) == 0) ? 0 : -9;
+
+    sub_savefile_FREE:
+    cJSON_Delete(head);
+    return rc;
+}
+
+
+static int sub_savejob(save_ctx_t* save, save_job_t* job) {
+/// Writes the device directory of a job and all of its files.
+    char pathbuf[256];
+    char* rtpath;
+    char* dev_rtpath;
+    char hexuid[17];
+    
+    /// Create new directory for the device.
+    /// New directory does not use leading zeros, but for implantation into
+    /// files, it must have leading zeros.
+    rtpath      = stpcpy(pathbuf, save->root);
+    snprintf(hexuid, 17, "%"PRIx64, job->uid);
+    dev_rtpath  = stpcpy(rtpath, hexuid);
+    snprintf(hexuid, 17, "%016"PRIx64, job->uid);
+    
+    /// In incremental save, the device directory is rewritten only if the
+    /// whole device has changed.  Otherwise only its changed files are.  A
+    /// rewritten directory is written next to the old one, and swapped in.
+    if (job->rewrite) {
+        dev_rtpath = stpcpy(dev_rtpath, ".tmp");
+        cmd_rmdir(pathbuf);
+    }
+    DEBUGPRINT("%s %d :: new dir at %s\n", __FUNCTION__, __LINE__, rtpath);
+    if ((mkdir(pathbuf, 0700) != 0) && !(save->incremental && !job->rewrite && (errno == EEXIST))) {
+        return -8;
+    }
+    
+    /// Export each file in the job.  A changed file that no longer exists is
+    /// removed from the archive.
+    for (int i=0; i<job->files; i++) {
+        if (job->file[i].fdat != NULL) {
+            int rc = sub_savefile(job, save->schema, &job->file[i], pathbuf, dev_rtpath, hexuid);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        else if (save->incremental && !job->rewrite) {
+            snprintf(dev_rtpath, 31, "/%u-%s.json", job->file[i].file_id, job->file[i].tfile->name);
+            if ((unlink(pathbuf) != 0) && (errno != ENOENT)) {
+                return -9;
+            }
+        }
+    }
+    
+    /// Sync the directory, so the files in it are on disk with it
+    *dev_rtpath = 0;
+    if (sub_syncpath(pathbuf) != 0) {
+        return -10;
+    }
+    if (job->rewrite) {
+        char devpath[256];
+        
+        snprintf(devpath, sizeof(devpath), "%s%"PRIx64, save->root, job->uid);
+        if (sub_swapdir(pathbuf, devpath) != 0) {
+            return -10;
+        }
+    }
+    else if (save->incremental && (sub_syncparent(pathbuf) != 0)) {
+        return -10;
+    }
+    
+    if (save->incremental) {
+        dirty_clear(save->dirty, job->uid);
+    }
+    return 0;
+}
+
+
+static int sub_saveaction(void* arg, void* job) {
+    return sub_savejob(arg, job);
+}
+
+
+static void sub_savedone(void* arg, void* job, int rc) {
+    talloc_free(job);
+}
+
+
+static save_job_t* sub_newjob(dterm_handle_t* dth, uint64_t uid, bool incremental) {
+/// Copies the files of the active device, which are exported by the template,
+/// into a new job.
+    const tmpl_schema_t* schema = dth->ext->schema;
+    save_job_t* job;
+    
+    job = talloc_zero_size(NULL, sizeof(save_job_t) + (schema->files * sizeof(save_file_t)));
+    if (job == NULL) {
+        return NULL;
+    }
+    job->uid        = uid;
+    job->rewrite    = incremental && dirty_testdev(dth->ext->dirty, uid);
+    
+    /// Export each file in the Device FS to a JSON file in the dev root.
+    /// Only file elements from the tmpl get exported.  The schema only has
+    /// template files that contain metadata.
+    for (int i=0; i<schema->files; i++) {
+        const tmpl_file_t* tfile = &schema->file[i];
+        save_file_t* file = &job->file[job->files];
+        vlFILE* fp;
+        uint8_t* fdat;
+      
+        /// Grab Block & ID of the file about to be exported, and open it.
+        ///@todo implement way to use non-stock files
+        file->tfile     = tfile;
+        file->file_id   = tfile->id;
+        if (incremental && !dirty_test(dth->ext->dirty, uid, tfile->block, tfile->id)) {
+            continue;
+        }
+        fp = vl_open(tfile->block, tfile->id, VL_ACCESS_R, NULL);
+        if (fp == NULL) {
+            if (incremental) {
+                job->files++;
+            }
+            continue;
+        }
+        fdat = vl_memptr(fp);
+        if (fdat != NULL) {
+            /// The copy is the template size of the file, so struct elements
+            /// read the same bytes they would from the FS.
+            file->output_sz = (fp->length < tfile->size) ? fp->length : tfile->size;
+            file->modtime   = vl_getmodtime(fp);
+            file->fdat      = talloc_zero_size(job, tfile->size + 1);
+            if (file->fdat == NULL) {
+                vl_close(fp);
+                talloc_free(job);
+                return NULL;
+            }
+            memcpy(file->fdat, fdat, (fp->alloc < tfile->size) ? fp->alloc : tfile->size);
+            job->files++;
+        }
+        vl_close(fp);
+    }
+    
+    return job;
+}
+
+
 
 
 int cmd_save(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
@@ -104,21 +537,30 @@ int cmd_save(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     
     // POSIX Filesystem and JSON handles
     char pathbuf[256];
+    char archive[256];
     char* rtpath;
-    //char* output;
+    char* tmpdir    = NULL;
     DIR* dir        = NULL;
-    cJSON* tmpl     = NULL;
-    cJSON* obj      = NULL;
     
     // Device OTFS
     int devtest;
     int devid_i = 0;
+    int devices;
     otfs_id_union uid;
     
+    // Incremental save
+    bool incremental;
+    uint64_t* dirtylist = NULL;
+    int dirtysz = 0;
+    
+    // Workers
+    save_ctx_t save;
+    workpool_t pool;
+    
     cmd_arglist_t arglist = {
-        .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDLIST | ARGFIELD_COMPRESS | ARGFIELD_ARCHIVE,
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDLIST | ARGFIELD_COMPRESS | ARGFIELD_ARCHIVE | ARGFIELD_SNAPSHOT | ARGFIELD_INCREMENTAL,
     };
-    void* args[] = {help_man, jsonout_opt, compress_opt, archive_man, devidlist_opt, end_man};
+    void* args[] = {help_man, jsonout_opt, compress_opt, snapshot_opt, incremental_opt, archive_man, devidlist_opt, end_man};
     
     ///@todo do input checks!!!!!!
     
@@ -141,10 +583,67 @@ int cmd_save(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
     }
     DEBUGPRINT("cmd_open():\n  compress=%d\n  archive=%s\n", arglist.compress_flag, arglist.archive_path);
     
-    /// Make sure that archive path doesn't already exist
+    /// Binary snapshot is a single file, written in one pass.
+    if (arglist.snapshot_flag) {
+        uint64_t* uidlist = NULL;
+        
+        if (arglist.devid_strlist_size > 0) {
+            uidlist = talloc_array(cmd_save_heap, uint64_t, arglist.devid_strlist_size);
+            if (uidlist == NULL) {
+                rc = -1;
+                goto cmd_save_END;
+            }
+            for (int i=0; i<arglist.devid_strlist_size; i++) {
+                uidlist[i] = strtoull(arglist.devid_strlist[i], NULL, 16);
+            }
+        }
+        rc = snapshot_write(arglist.archive_path, dth->ext->tmpl, dth->ext->tmpl_fs, dth->ext->db,
+                            uidlist, (size_t)arglist.devid_strlist_size);
+        rc = (rc < 0) ? (-16 + rc) : 0;
+        if ((rc == 0) && (sub_syncparent(arglist.archive_path) != 0)) {
+            rc = -10;
+        }
+        if ((rc == 0) && (sub_checkpoint(dth, arglist.archive_path, (arglist.devid_strlist_size == 0), false) != 0)) {
+            rc = -11;
+        }
+        goto cmd_save_END;
+    }
+    
+    /// Incremental save only works onto the archive that the DB was last
+    /// opened from or saved to.  Otherwise, the save is complete.
+    /// Room is left for the device directory and file names, and for the
+    /// suffixes of temporary directories.
+    incremental = arglist.incremental_flag && dirty_isbase(dth->ext->dirty, arglist.archive_path);
+    rtpath = stpncpy(pathbuf, arglist.archive_path, sizeof(pathbuf)-(16+32+1+16));
+    *rtpath = 0;
+    if (incremental) {
+        dirtysz = dirty_list(dth->ext->dirty, cmd_save_heap, &dirtylist);
+        if (dirtysz < 0) {
+            rc = -1;
+            goto cmd_save_END;
+        }
+        if (rtpath[-1] != '/') {
+            rtpath = stpcpy(rtpath, "/");
+        }
+        devtest = sub_nextdirty(dth, &uid.u8[0], &devid_i, dirtylist, dirtysz,
+                            arglist.devid_strlist, arglist.devid_strlist_size, pathbuf, rtpath);
+        devices = dirtysz;
+        goto cmd_save_DEVICES;
+    }
+    
+    /// A complete save is written to a temporary directory next to the
+    /// archive, which replaces the archive once all of it is on disk.  Until
+    /// then, the archive and its log are as they were.
+    while ((rtpath > &pathbuf[1]) && (rtpath[-1] == '/')) {
+        *(--rtpath) = 0;
+    }
+    strcpy(archive, pathbuf);
+    rtpath = stpcpy(rtpath, ".tmp");
+    
+    /// Make sure that the temporary path doesn't already exist.  It can be
+    /// left over from a save that didn't finish.
     ///@todo error code & reporting for directory access errors (dir already
     /// exists, or any error that is not "dir doesn't exist")
-    rtpath = stpncpy(pathbuf, arglist.archive_path, sizeof(pathbuf)-(16+32+1));
     DEBUGPRINT("%s %d :: check dir at %s\n", __FUNCTION__, __LINE__, pathbuf);
     cmd_rmdir(pathbuf);
     dir = opendir(pathbuf);
@@ -163,6 +662,7 @@ int cmd_save(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
         rc = -5;
         goto cmd_save_END;
     }
+    tmpdir = talloc_strdup(cmd_save_heap, pathbuf);
     
     /// Add trailing path separator if not already present
     if (rtpath[-1] != '/') {
@@ -179,231 +679,84 @@ int cmd_save(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
 
     strcpy(rtpath, "_TMPL/tmpl.json");
     DEBUGPRINT("%s %d :: writing tmpl (%016llx) at %s\n", __FUNCTION__, __LINE__, dth->ext->tmpl, pathbuf);
-    if (jst_writeout(dth->ext->tmpl, pathbuf) != 0) {
+    if (sub_writejson(dth->ext->tmpl, pathbuf) != 0) {
         rc = -7;
         goto cmd_save_END;
     }
+    strcpy(rtpath, "_TMPL");
+    if (sub_syncpath(pathbuf) != 0) {
+        rc = -10;
+        goto cmd_save_END;
+    }
 
     /// If there is a list of Device IDs supplied in the command, we use these.
     /// Else, we dump all the devices present in the OTDB.
     DEBUGPRINT("%s %d\n", __FUNCTION__, __LINE__);
     if (arglist.devid_strlist_size > 0) {
-        devtest = sub_nextdevice(dth->ext->db, &uid.u8[0], &devid_i, arglist.devid_strlist, arglist.devid_strlist_size);
+        devtest = sub_nextdevice(dth, &uid.u8[0], &devid_i, arglist.devid_strlist, arglist.devid_strlist_size);
+        devices = arglist.devid_strlist_size;
     }
     else {
         devtest = otfs_iterator_start(dth->ext->db, /*&devfs*/ NULL, &uid.u8[0]);
+        devices = -1;
     }
 
+    /// Devices are fanned-out to the worker pool.  The DB is locked for the
+    /// whole command, so the device list and data are consistent.
+    cmd_save_DEVICES:
+    *rtpath = 0;
+    save.dirty          = dth->ext->dirty;
+    save.schema         = dth->ext->schema;
+    save.incremental    = incremental;
+    snprintf(save.root, sizeof(save.root)-(16+32+1), "%s", pathbuf);
+    if (workpool_start(&pool, OTDB_PARAM_SAVE_WORKERS, devices, 0, &sub_saveaction, &sub_savedone, &save) != 0) {
+        rc = -1;
+        goto cmd_save_END;
+    }
     DEBUGPRINT("%s %d\n", __FUNCTION__, __LINE__);
     while (devtest == 0) {
-        char* dev_rtpath;
-        char hexuid[17];
-        
-        /// Create new directory for the device.
-        /// New directory does not use leading zeros, but for implantation into
-        /// files, it must have leading zeros.
-        snprintf(hexuid, 17, "%"PRIx64, uid.u64);
-        dev_rtpath  = stpcpy(rtpath, hexuid);
-        snprintf(hexuid, 17, "%016"PRIx64, uid.u64);
+        save_job_t* job;
         
-        DEBUGPRINT("%s %d :: new dir at %s\n", __FUNCTION__, __LINE__, rtpath);
-        if (mkdir(pathbuf, 0700) != 0) {
-            rc = -8;
-            ///@todo close necessary memory
-            goto cmd_save_END;
+        job = sub_newjob(dth, uid.u64, incremental);
+        if (job == NULL) {
+            rc = -1;
+            break;
         }
-
-        /// Export each file in the Device FS to a JSON file in the dev root.
-        /// Only file elements from the tmpl get exported.
-        tmpl    = dth->ext->tmpl;
-        obj     = tmpl->child;
-        while (obj != NULL) {
-            cJSON*      meta;
-            cJSON*      content;
-            cJSON*      cursor;
-            cJSON*      output  = NULL;
-            cJSON*      head    = NULL;
-            vlFILE*     fp      = NULL;
-            uint8_t*    fdat;
-            uint8_t     file_id;
-            uint8_t     block_id;
-            uint16_t    output_sz;
-            content_type_enum c_type;
-
-            /// Template files must contain metadata to be considered
-            meta = cJSON_GetObjectItemCaseSensitive(obj, "_meta");
-            if (meta == NULL) {
-                // Skip files without meta objects
-                goto cmd_save_LOOPEND;
-            }
-          
-            /// Grab Block & ID of the file about to be exported, and open it.
-            ///@todo make this a function (used in multiple places)
-            ///@todo implement way to use non-stock files
-            file_id     = jst_extract_id(meta);
-            block_id    = jst_extract_blockid(meta);
-            fp          = vl_open(block_id, file_id, VL_ACCESS_R, NULL);
-            if (fp == NULL) {
-                goto cmd_save_LOOPEND;
-            }
-            fdat = vl_memptr(fp);
-            if (fdat == NULL) {
-                goto cmd_save_LOOPCLOSE;
-            }
-            output_sz = jst_extract_size(meta);
-            if (fp->length < output_sz) {
-                output_sz = fp->length;
-            }
-          
-            /// Create JSON object top level depth, for output
-            head = cJSON_CreateObject();
-            if (head == NULL) {
-                goto cmd_save_LOOPCLOSE;
-            }
-            output = cJSON_AddObjectToObject(head, obj->string);
-            if (output == NULL) {
-                goto cmd_save_LOOPFREE;
-            }
-            
-            /// Add modtime to the metadata, and copy all metadata to output
-            {   cJSON *outmeta, *outtime, *outcontent, *outdevid;
-                outmeta     = cJSON_Duplicate(meta, true);
-                outdevid    = cJSON_CreateString(hexuid);
-                outtime     = cJSON_GetObjectItemCaseSensitive(outmeta, "modtime");
-                cJSON_SetIntValue(outtime, vl_getmodtime(fp));
-                cJSON_AddItemReferenceToObject(outmeta, "devid", outdevid);
-                cJSON_AddItemReferenceToObject(output, "_meta", outmeta);
-                outcontent  = cJSON_CreateObject();
-                cJSON_AddItemReferenceToObject(output, "_content", outcontent);
-            }
-
-            /// Add _content to output.  Content Data will get stored in here.
-            output = cJSON_GetObjectItemCaseSensitive(output, "_content");
-            if (output == NULL) {
-                goto cmd_save_LOOPFREE;
-            }
-         
-            /// Drill into contents -- three types
-            /// 1. Hex output option: just a hex string
-            /// 2. Array output option: integer for each byte
-            /// 3. Struct output option: structured data elements based on template
-            c_type = jst_extract_type(meta);
-            
-            if (c_type == CONTENT_hex) {
-                char* hexstr;
-                
-                hexstr = talloc_size(cmd_save_heap, (2*output_sz) + 1);
-                if (hexstr == NULL) {
-                    goto cmd_save_LOOPFREE;
-                }
-                hexstr[fp->length] = 0;
-                
-                cmd_hexwrite(hexstr, fdat, output_sz);
-                cursor = cJSON_AddStringToObject(output, obj->string, hexstr);
-                if (cursor == NULL) {
-                    goto cmd_save_LOOPFREE;
-                }
-                
-                talloc_free(hexstr);
-            }
-            
-            else if (c_type == CONTENT_array) {
-                int* intarray;
-                
-                intarray = talloc_size(cmd_save_heap, sizeof(int)*output_sz);
-                if (intarray == NULL) {
-                    goto cmd_save_LOOPFREE;
-                }
-                
-                for (int i=0; i<output_sz; i++) {
-                    intarray[i] = fdat[i];
-                }
-                
-                cursor = cJSON_CreateIntArray(intarray, output_sz);
-                if (cursor == NULL) {
-                    goto cmd_save_LOOPFREE;
-                }
-                
-                talloc_free(intarray);
-                
-                cJSON_AddItemReferenceToObject(output, obj->string, cursor);
-            }
-            
-            else { 
-                // In struct type, the "_content" field must be an object.
-                content = cJSON_GetObjectItemCaseSensitive(obj, "_content");
-                if (cJSON_IsObject(content) == false) {
-                    goto cmd_save_LOOPFREE;
-                }
-             
-                // If content is empty, don't export this file
-                content = content->child;
-                if (content == NULL) {
-                    goto cmd_save_LOOPFREE;
-                }
-             
-                // Loop through the template, export flat items, drill into
-                // nested items.
-                ///@todo make this recursive
-                while (content != NULL) {
-                    cJSON* nest_tmpl;
-                    cJSON* nest_output;
-                    typeinfo_enum type;
-                    int pos, bits;
-                    unsigned long bitpos;
-               
-                    pos         = jst_extract_pos(content);
-                    bits        = jst_extract_typesize(&type, content);
-                    nest_output = jst_store_element(output, content->string, &fdat[pos], type, 0, bits);
-                    nest_tmpl   = cJSON_GetObjectItemCaseSensitive(content, "_meta");
-                 
-                    // This is a nested data type (namely, a bitmask)
-                    // Could be recursive, currently hardcoded for bitmask
-                    if (nest_tmpl != NULL) {
-                        nest_tmpl = cJSON_GetObjectItemCaseSensitive(nest_tmpl, "_content");
-                        if (nest_tmpl != NULL) {
-                            nest_tmpl = nest_tmpl->child;
-                            while (nest_tmpl != NULL) {
-                                bitpos = jst_extract_bitpos(nest_tmpl);
-                                jst_store_element(nest_output, nest_tmpl->string, &fdat[pos], type, bitpos, bits);                              
-                                nest_tmpl = nest_tmpl->next;
-                            }
-                        }
-                    }
-
-                    content = content->next;
-                }
-            }
-            
-            /// Writeout JSON 
-            snprintf(dev_rtpath, 31, "/%u-%s.json", file_id, obj->string);
-            DEBUGPRINT("%s %d :: new json file at %s\n", __FUNCTION__, __LINE__, &dev_rtpath[1]);
-            if (jst_writeout(head, pathbuf) != 0) {
-                goto cmd_save_LOOPCLOSE;
-            }
-
-            cmd_save_LOOPFREE:
-            cmd_save_LOOPCLOSE:
-            cmd_save_LOOPEND:
-            //cJSON_Delete(output);
-            cJSON_Delete(head);
-            
-            //cmd_save_LOOPCLOSE:
-            vl_close(fp);
-            
-            //cmd_save_LOOPEND:
-            obj = obj->next;
+        rc = workpool_put(pool, job);
+        if (rc != 0) {
+            break;
         }
 
         /// Fetch next device 
         DEBUGPRINT("%s %d :: fetch next device\n", __FUNCTION__, __LINE__);
-        if (arglist.devid_strlist_size > 0) {
-            devtest = sub_nextdevice(dth->ext->db, &uid.u8[0], &devid_i, arglist.devid_strlist, arglist.devid_strlist_size);
+        if (incremental) {
+            devtest = sub_nextdirty(dth, &uid.u8[0], &devid_i, dirtylist, dirtysz,
+                                arglist.devid_strlist, arglist.devid_strlist_size, pathbuf, rtpath);
+            *rtpath = 0;
+        }
+        else if (arglist.devid_strlist_size > 0) {
+            devtest = sub_nextdevice(dth, &uid.u8[0], &devid_i, arglist.devid_strlist, arglist.devid_strlist_size);
         }
         else {
             devtest = otfs_iterator_next(dth->ext->db, /*&devfs*/ NULL, &uid.u8[0]);
         }
- 
+    }
+    devtest = workpool_finish(pool, false);
+    if (rc == 0) {
+        rc = devtest;
+    }
+    if (rc != 0) {
+        goto cmd_save_END;
+    }
+
+    /// Put the new archive in place of the old one.
+    if (!incremental) {
+        *rtpath = 0;
+        if ((sub_syncpath(pathbuf) != 0) || (sub_swapdir(pathbuf, archive) != 0)) {
+            rc = -10;
+            goto cmd_save_END;
+        }
+        tmpdir = NULL;
     }
 
     /// Compress the directory structure and delete it.
@@ -411,14 +764,22 @@ int cmd_save(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
         ///@todo integrate 7z-lib
     }
     
+    /// A complete save of all devices is the new baseline for incremental
+    /// saves.  A save of some devices leaves no baseline.
+    if (!incremental) {
+        dirty_reset(dth->ext->dirty, (arglist.devid_strlist_size > 0) ? NULL : arglist.archive_path);
+    }
+    if (sub_checkpoint(dth, arglist.archive_path, (arglist.devid_strlist_size == 0), incremental) != 0) {
+        rc = -11;
+    }
+    
     cmd_save_END:
     if (dir != NULL)
         closedir(dir);
+    if (tmpdir != NULL)
+        cmd_rmdir(tmpdir);
     
     talloc_free(cmd_save_heap);
     
     return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "save");
 }
-
-
-
@@ -0,0 +1,379 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "cmds.h"
+#include "dm_printf.h"
+#include "dterm.h"
+#include "txn.h"
+#include "otdb_cfg.h"
+#include "debug.h"
+
+// HB Headers/Libraries
+#include <argtable3.h>
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdio.h>
+#include <string.h>
+
+
+// used by DB manipulation commands
+extern struct arg_lit*  jsonout_opt;
+
+// soft operation
+extern struct arg_lit*  soft_opt;
+
+// used by file commands
+extern struct arg_str*  devid_opt;
+extern struct arg_str*  fileblock_opt;
+extern struct arg_str*  filerange_opt;
+extern struct arg_int*  fileid_man;
+extern struct arg_str*  filedata_man;
+extern struct arg_int*  txid_man;
+
+// used by all commands
+extern struct arg_lit*  help_man;
+extern struct arg_end*  end_man;
+
+
+
+
+static void sub_closeall(vlFILE** fp, int count) {
+/// Writes to the same file share its vlFILE, which is closed once
+    for (int i=0; i<count; i++) {
+        bool shared = false;
+        for (int j=0; (j<i) && (shared==false); j++) {
+            shared = (fp[j] == fp[i]);
+        }
+        if ((fp[i] != NULL) && (shared == false)) {
+            vl_close(fp[i]);
+        }
+        fp[i] = NULL;
+    }
+}
+
+
+static const char* sub_blockname(uint8_t block_id) {
+    switch (block_id) {
+        case VL_GFB_BLOCKID: return "gfb";
+        case VL_ISS_BLOCKID: return "iss";
+        default:             return "isf";
+    }
+}
+
+
+
+int cmd_txbegin(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_DEVICEIDOPT,
+    };
+    void* args[] = {help_man, jsonout_opt, devid_opt, end_man};
+
+    rc = cmd_extract_args(&arglist, args, "tx-new", (const char*)src, inbytes);
+    if (rc != 0) {
+        goto cmd_txbegin_END;
+    }
+
+    /// The device must exist when the transaction is opened
+    if (arglist.devid != 0) {
+        rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+        if (rc != 0) {
+            rc = -256 + rc;
+            goto cmd_txbegin_END;
+        }
+    }
+    else if (otfs_activeuid(dth->ext->db, (uint8_t*)&arglist.devid) != 0) {
+        rc = -256;
+        goto cmd_txbegin_END;
+    }
+
+    rc = txn_begin(dth->ext->txn, arglist.devid);
+    if (rc < 0) {
+        rc = -1024 + rc;
+        goto cmd_txbegin_END;
+    }
+
+    if (arglist.jsonout_flag) {
+        return snprintf((char*)dst, dstmax-1, "{\"cmd\":\"tx-new\", \"devid\":\"%"PRIx64"\", \"txid\":%d}", arglist.devid, rc);
+    }
+    return snprintf((char*)dst, dstmax-1, "%d\n", rc);
+
+    cmd_txbegin_END:
+    return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "tx-new");
+}
+
+
+
+int cmd_txstage(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    txn_write_t write;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_BLOCKID | ARGFIELD_FILERANGE | ARGFIELD_TXID | ARGFIELD_FILEID | ARGFIELD_FILEDATA,
+    };
+    void* args[] = {help_man, jsonout_opt, fileblock_opt, filerange_opt, txid_man, fileid_man, filedata_man, end_man};
+    void* args_raw[] = {help_man, jsonout_opt, fileblock_opt, filerange_opt, txid_man, fileid_man, end_man};
+
+    /// Extract arguments into arglist struct.  File data from a binary frame
+    /// is used as-is, as in w.
+    if (dth->rawdata != NULL) {
+        arglist.fields         &= ~ARGFIELD_FILEDATA;
+        rc                      = cmd_extract_args(&arglist, args_raw, "tx-w", (const char*)src, inbytes);
+        arglist.filedata        = (uint8_t*)dth->rawdata;
+        arglist.filedata_size   = dth->rawdata_size;
+    }
+    else {
+        arglist.filedata        = dst;
+        arglist.filedata_size   = (int)dstmax;
+        rc                      = cmd_extract_args(&arglist, args, "tx-w", (const char*)src, inbytes);
+    }
+    if (rc != 0) {
+        goto cmd_txstage_END;
+    }
+
+    /// The write is only checked against the file when it is committed
+    write.block_id  = arglist.block_id;
+    write.file_id   = arglist.file_id;
+    write.range_lo  = arglist.range_lo;
+    write.range_hi  = arglist.range_hi;
+    write.size      = (arglist.filedata_size > 65535) ? 65535 : (uint16_t)arglist.filedata_size;
+    write.data      = arglist.filedata;
+
+    rc = txn_stage(dth->ext->txn, arglist.txid, &write);
+    if (rc < 0) {
+        rc = -1024 + rc;
+    }
+    else {
+        rc = 0;
+    }
+
+    cmd_txstage_END:
+    return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "tx-w");
+}
+
+
+
+int cmd_txabort(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_TXID,
+    };
+    void* args[] = {help_man, jsonout_opt, txid_man, end_man};
+
+    rc = cmd_extract_args(&arglist, args, "tx-del", (const char*)src, inbytes);
+    if (rc == 0) {
+        rc = txn_abort(dth->ext->txn, arglist.txid);
+        if (rc < 0) {
+            rc = -1024 + rc;
+        }
+    }
+
+    return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "tx-del");
+}
+
+
+
+int cmd_txcommit(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    int rc;
+    txn_batch_t* batch = NULL;
+    vaddr header[OTDB_PARAM_TXN_WRITES];
+    AUTH_level minauth[OTDB_PARAM_TXN_WRITES];
+    uint16_t span[OTDB_PARAM_TXN_WRITES];
+    vlFILE* fp[OTDB_PARAM_TXN_WRITES] = { NULL };
+    int acked = 0;
+    bool logged = true;
+    cmd_arglist_t arglist = {
+        .fields = ARGFIELD_JSONOUT | ARGFIELD_SOFTMODE | ARGFIELD_DEVICEIDOPT | ARGFIELD_TXID,
+    };
+    void* args[] = {help_man, jsonout_opt, soft_opt, devid_opt, txid_man, end_man};
+
+    rc = cmd_extract_args(&arglist, args, "tx-ok", (const char*)src, inbytes);
+    if (rc != 0) {
+        goto cmd_txcommit_END;
+    }
+
+    /// The command holds the exclusive lock of the device in -i, or of the
+    /// active device, so the transaction must be on that device.
+    if (arglist.devid != 0) {
+        rc = devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&arglist.devid);
+        if (rc != 0) {
+            rc = -256 + rc;
+            goto cmd_txcommit_END;
+        }
+    }
+    else {
+        otfs_activeuid(dth->ext->db, (uint8_t*)&arglist.devid);
+    }
+    batch = txn_take(dth->ext->txn, arglist.txid, arglist.devid);
+    if (batch == NULL) {
+        rc = -1024 - 1;
+        goto cmd_txcommit_END;
+    }
+
+    /// 1. Open and check the files of all the writes before applying any
+    ///    of them.  A transaction that fails the check is dropped with
+    ///    nothing applied.  The files stay open, so nothing can fail once
+    ///    the first write is applied.
+    for (int i=0; i<batch->count; i++) {
+        txn_write_t* write = &batch->write[i];
+
+        rc = vl_getheader_vaddr(&header[i], write->block_id, write->file_id, VL_ACCESS_W, NULL);
+        if (rc != 0) {
+            rc = -512 - rc;
+            goto cmd_txcommit_END;
+        }
+        for (int j=0; (j<i) && (fp[i]==NULL); j++) {
+            if (header[j] == header[i]) {
+                fp[i] = fp[j];
+            }
+        }
+        if (fp[i] == NULL) {
+            fp[i] = vl_open_file(header[i]);
+            if (fp[i] == NULL) {
+                rc = -512 - 255;
+                goto cmd_txcommit_END;
+            }
+        }
+        if ((write->range_lo >= fp[i]->alloc) || (vl_memptr(fp[i]) == NULL)) {
+            rc = -512 - 7;
+            goto cmd_txcommit_END;
+        }
+        if (write->range_hi > fp[i]->alloc) {
+            write->range_hi = fp[i]->alloc;
+        }
+        span[i] = write->size;
+        if (span[i] > (write->range_hi - write->range_lo)) {
+            span[i] = (write->range_hi - write->range_lo);
+        }
+        minauth[i] = cmd_minauth_get(fp[i], VL_ACCESS_W);
+    }
+
+    /// 2. Apply the writes.  The device lock is exclusive, so no reader sees
+    ///    the device between the first and the last of them.
+    for (int i=0; i<batch->count; i++) {
+        txn_write_t* write = &batch->write[i];
+        uint8_t* dptr = vl_memptr(fp[i]);
+
+        if (fp[i]->length < (span[i] + write->range_lo)) {
+            fp[i]->length = (span[i] + write->range_lo);
+        }
+        if (span[i] > 0) {
+            memcpy(&dptr[write->range_lo], write->data, span[i]);
+        }
+    }
+    sub_closeall(fp, batch->count);
+
+    /// 3. Log the writes as one record, so that replay applies all of them
+    ///    or, if the log is cut inside the record, none.
+    {   wal_rec_t rec = {
+            .op     = WAL_txn,
+            .uid    = batch->uid,
+        };
+        uint32_t size = 0;
+        uint8_t* jdata;
+
+        for (int i=0; i<batch->count; i++) {
+            size += sizeof(wal_txw_t) + span[i];
+        }
+        jdata = talloc_size(batch, size);
+        if (jdata == NULL) {
+            logged = false;
+        }
+        else {
+            uint8_t* cursor = jdata;
+            for (int i=0; i<batch->count; i++) {
+                wal_txw_t txw = {
+                    .offset = batch->write[i].range_lo,
+                    .size   = span[i],
+                    .block  = batch->write[i].block_id,
+                    .file   = batch->write[i].file_id,
+                };
+                memcpy(cursor, &txw, sizeof(wal_txw_t));
+                memcpy(cursor+sizeof(wal_txw_t), batch->write[i].data, span[i]);
+                cursor += sizeof(wal_txw_t) + span[i];
+            }
+            logged = (cmd_journal(dth, &rec, jdata, size) == 0);
+            talloc_free(jdata);
+        }
+    }
+    rc = 0;
+
+    /// 4. Send the writes to the device manager together.  They are all in
+    ///    flight at once, a window at a time.  The local commit is complete,
+    ///    so the DB locks are released while the device manager answers, as
+    ///    in w.  The batch is owned by this command, so nothing that it uses
+    ///    meanwhile refers to the DB.
+    if ((arglist.soft_flag == 0) && (dth->ext->devmgr != NULL)) {
+        bool suspended = (dblock_suspend(dth->dblock, &dth->lock) == 0);
+
+        for (int base=0; base<batch->count; base+=OTDB_PARAM_DEVMGR_WINDOW) {
+            dm_txn_t txn[OTDB_PARAM_DEVMGR_WINDOW];
+            uint8_t* txbuf[OTDB_PARAM_DEVMGR_WINDOW];
+            int window = batch->count - base;
+
+            if (window > OTDB_PARAM_DEVMGR_WINDOW) {
+                window = OTDB_PARAM_DEVMGR_WINDOW;
+            }
+            for (int k=0; k<window; k++) {
+                txn_write_t* write = &batch->write[base+k];
+                size_t txmax = (2*span[base+k]) + 256;
+                char* hexbuf;
+
+                txbuf[k]    = talloc_size(batch, txmax);
+                hexbuf      = talloc_size(batch, (2*span[base+k]) + 1);
+                if ((txbuf[k] == NULL) || (hexbuf == NULL)) {
+                    txbuf[k] = NULL;
+                    continue;
+                }
+                cmd_hexwrite(hexbuf, write->data, span[base+k]);
+                dm_xnsubmit(dth, &txn[k], txbuf[k], txmax, minauth[base+k], batch->uid,
+                            "file w -b %s %u -r %u:%u [%s]", sub_blockname(write->block_id),
+                            write->file_id, write->range_lo, write->range_hi, hexbuf);
+                talloc_free(hexbuf);
+            }
+            for (int k=0; k<window; k++) {
+                if (txbuf[k] != NULL) {
+                    acked += (dm_xnwait(dth, &txn[k]) > 0);
+                    talloc_free(txbuf[k]);
+                }
+            }
+        }
+
+        /// The locks are held again even if the device has been removed
+        /// meanwhile, which doesn't undo the commit.
+        if (suspended) {
+            dblock_reacquire(dth->dblock, &dth->lock, DBLOCK_devwrite, &dth->ext->db);
+        }
+    }
+    if (!logged) {
+        rc = CMD_ERR_JOURNAL;
+        goto cmd_txcommit_END;
+    }
+
+    if (arglist.jsonout_flag) {
+        rc = snprintf((char*)dst, dstmax-1, "{\"cmd\":\"tx-ok\", \"devid\":\"%"PRIx64"\", \"txid\":%d, \"writes\":%d, \"acked\":%d}",
+                        batch->uid, batch->id, batch->count, acked);
+    }
+    talloc_free(batch);
+    return rc;
+
+    cmd_txcommit_END:
+    sub_closeall(fp, OTDB_PARAM_TXN_WRITES);
+    talloc_free(batch);
+    return cmd_jsonout_err((char*)dst, dstmax, arglist.jsonout_flag, rc, "tx-ok");
+}
@@ -18,7 +18,10 @@
 #include "cmds.h"
 #include "dterm.h"
 #include "cliopt.h"
+#include "dirty.h"
+#include "fidx.h"
 #include "otdb_cfg.h"
+#include "wal.h"
 
 // HB Headers/Libraries
 #include <bintex.h>
@@ -39,6 +42,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -53,6 +57,8 @@ int home_path_len               = 2;
 struct arg_str*     devid_man;
 struct arg_file*    archive_man;
 struct arg_lit*     compress_opt;
+struct arg_lit*     snapshot_opt;
+struct arg_lit*     incremental_opt;
 struct arg_lit*     jsonout_opt;
 
 // Soft operation
@@ -61,6 +67,7 @@ struct arg_lit*     soft_opt;
 // used by file commands
 struct arg_str*     devid_opt;
 struct arg_str*     devidlist_opt;
+struct arg_str*     devidset_opt;
 struct arg_int*     fileage_opt;
 struct arg_str*     fileblock_opt;
 struct arg_str*     filerange_opt;
@@ -68,6 +75,12 @@ struct arg_int*     fileid_man;
 struct arg_str*     fileperms_man;
 struct arg_int*     filealloc_man;
 struct arg_str*     filedata_man;
+struct arg_str*     filelist_man;
+struct arg_int*     txid_man;
+struct arg_str*     query_man;
+struct arg_str*     project_opt;
+struct arg_str*     fieldname_man;
+struct arg_int*     bins_opt;
 
 // used by all commands
 struct arg_lit*     help_man;
@@ -104,7 +117,10 @@ void cmd_init_argtable(void) {
     jsonout_opt     = arg_lit0("j","json",              "Use JSON as output");
     soft_opt        = arg_lit0("s","soft",              "Use Soft mode (doesn't propagate to devices)");
     compress_opt    = arg_lit0("c","compress",          "Use compression on output (7z)");
+    snapshot_opt    = arg_lit0("S","snapshot",          "Use binary snapshot format for output");
+    incremental_opt = arg_lit0("I","incremental",       "Only save changes since the last save");
     devidlist_opt   = arg_strn(NULL,NULL,"DeviceID List", 0, 256, "Batch of up to 256 Device IDs");
+    devidset_opt    = arg_str0("I","ids","ID,ID,...|all", "Device IDs as HEX, comma separated, or all");
     devid_opt       = arg_str0("i","id","DeviceID",     "Device ID as HEX");
     fileage_opt     = arg_int0("a","age","ms",          "Maximum age of file, in ms. Default:0 (1 second max latency).");
     fileblock_opt   = arg_str0("b","block","isf|iss|gfb", "File Block to search in");
@@ -113,6 +129,12 @@ void cmd_init_argtable(void) {
     fileperms_man   = arg_str1(NULL,NULL,"Perms",       "Octal pair of User & Guest perms");
     filealloc_man   = arg_int1(NULL,NULL,"Alloc",       "Allocation bytes for file");
     filedata_man    = arg_str1(NULL,NULL,"Bintex",      "File data supplied as Bintex");
+    txid_man        = arg_int1(NULL,NULL,"TxID",        "Transaction ID, from tx-new");
+    query_man       = arg_strn(NULL,NULL,"file.field<op>value", 0, 16, "Up to 16 Predicates, which are ANDed");
+    project_opt     = arg_str0("p","project","file.field,...", "Fields to output for each match");
+    fieldname_man   = arg_str1(NULL,NULL,"file.field",  "Template field, or subfield as file.field.sub");
+    bins_opt        = arg_int0("n","bins","N",          "Histogram bins, 0-256.  Default: 10");
+    filelist_man    = arg_strn(NULL,NULL,"[block:]FileID[:X:Y]", 1, 64, "Batch of up to 64 Files, with optional range");
     help_man        = arg_lit0("h","help",              "Print this help and exit");
     end_man         = arg_end(20);
 }
@@ -367,12 +389,64 @@ int cmd_extract_args(cmd_arglist_t* data, void* args, const char* cmdname, const
     if (data->fields & ARGFIELD_COMPRESS) {
         data->compress_flag = (compress_opt->count > 0);
     }
+    
+    /// Snapshot Flag
+    if (data->fields & ARGFIELD_SNAPSHOT) {
+        data->snapshot_flag = (snapshot_opt->count > 0);
+    }
+    
+    /// Incremental Flag
+    if (data->fields & ARGFIELD_INCREMENTAL) {
+        data->incremental_flag = (incremental_opt->count > 0);
+    }
    
     /// List of Device IDs
     if (data->fields & ARGFIELD_DEVICEIDLIST) {
         data->devid_strlist_size    = devidlist_opt->count;
         data->devid_strlist         = devidlist_opt->sval;
     }
+    
+    /// Set of Device IDs, as a single comma separated string.  "all", or no
+    /// set, is every device in the DB.
+    if (data->fields & ARGFIELD_DEVICEIDSET) {
+        data->devid_set = NULL;
+        if ((devidset_opt->count > 0) && (strcmp(devidset_opt->sval[0], "all") != 0)) {
+            data->devid_set = devidset_opt->sval[0];
+        }
+    }
+
+    /// List of Files, which are parsed by the command
+    if (data->fields & ARGFIELD_FILELIST) {
+        data->filespec_list_size    = filelist_man->count;
+        data->filespec_list         = filelist_man->sval;
+    }
+
+    /// Query predicates and projection, which are compiled by the command
+    if (data->fields & ARGFIELD_QUERY) {
+        data->query_list_size   = query_man->count;
+        data->query_list        = query_man->sval;
+        data->project           = (project_opt->count > 0) ? project_opt->sval[0] : NULL;
+    }
+
+    /// Template field name, which is resolved by the command
+    if (data->fields & ARGFIELD_FIELDNAME) {
+        if (fieldname_man->count > 0) {
+            data->fieldname = fieldname_man->sval[0];
+        }
+        else {
+            out_val = -13;
+            goto sub_extract_args_END;
+        }
+    }
+
+    /// Histogram bins, 0 for no histogram
+    if (data->fields & ARGFIELD_BINS) {
+        data->bins = (bins_opt->count > 0) ? bins_opt->ival[0] : 10;
+        if ((data->bins < 0) || (data->bins > 256)) {
+            out_val = -14;
+            goto sub_extract_args_END;
+        }
+    }
 
     /// Check for Age flag (-a, --age), which specifies maximum file
     /// modification/access delta from present time.
@@ -424,6 +498,17 @@ int cmd_extract_args(cmd_arglist_t* data, void* args, const char* cmdname, const
         }
     }
    
+    /// Transaction ID precedes the File ID, when both are used
+    if (data->fields & ARGFIELD_TXID) {
+        if (txid_man->count > 0) {
+            data->txid = txid_man->ival[0];
+        }
+        else {
+            out_val = -9;
+            goto sub_extract_args_END;
+        }
+    }
+    
     /// File ID is simply copied from the args
     if (data->fields & ARGFIELD_FILEID) {
         if (fileid_man->count > 0) {
@@ -487,6 +572,86 @@ int cmd_extract_args(cmd_arglist_t* data, void* args, const char* cmdname, const
 
 
 
+static void sub_track(dterm_handle_t* dth, uint64_t uid, uint8_t op, uint8_t block, uint8_t file) {
+    if ((op == WAL_devimage) || (op == WAL_devdel)) {
+        dirty_markdev(dth->ext->dirty, uid);
+    }
+    else {
+        dirty_mark(dth->ext->dirty, uid, block, file);
+    }
+    
+    /// Indexes follow the change.  The device lock of the command is still
+    /// held, so the image is the one just changed.
+    if (op == WAL_devdel) {
+        fidx_updatedev(dth->ext->fidx, NULL, uid);
+    }
+    else if ((op == WAL_devimage) || fidx_covers(dth->ext->fidx, block, file)) {
+        otfs_t devfs;
+        if (devcache_setfs(dth->ext->devcache, dth->ext->db, &devfs, (uint8_t*)&uid) == 0) {
+            if (op == WAL_devimage) {
+                fidx_updatedev(dth->ext->fidx, devfs.base, uid);
+            }
+            else {
+                fidx_update(dth->ext->fidx, devfs.base, uid, block, file);
+            }
+        }
+    }
+}
+
+
+int cmd_journal(dterm_handle_t* dth, wal_rec_t* rec, const void* data, uint32_t size) {
+    if (rec->uid == 0) {
+        otfs_activeuid(dth->ext->db, (uint8_t*)&rec->uid);
+    }
+    if (rec->modtime == 0) {
+        rec->modtime = (uint32_t)time(NULL);
+    }
+    
+    /// A transaction is tracked as the writes that it holds
+    if (rec->op == WAL_txn) {
+        const uint8_t* cursor = data;
+        uint32_t left = size;
+        wal_txw_t txw;
+        
+        while (left >= sizeof(wal_txw_t)) {
+            memcpy(&txw, cursor, sizeof(wal_txw_t));
+            if (txw.size > (left - sizeof(wal_txw_t))) {
+                break;
+            }
+            sub_track(dth, rec->uid, WAL_write, txw.block, txw.file);
+            cursor += sizeof(wal_txw_t) + txw.size;
+            left   -= sizeof(wal_txw_t) + txw.size;
+        }
+    }
+    else {
+        sub_track(dth, rec->uid, rec->op, rec->block, rec->file);
+    }
+    
+    /// If the log fails, the change is in the DB but not in the log.  It is
+    /// saved by the next save, but it can be lost in a crash before that, so
+    /// the command reports it.
+    if (wal_append(dth->ext->wal, rec, data, size) != 0) {
+        return CMD_ERR_JOURNAL;
+    }
+    return 0;
+}
+
+
+int cmd_journaldev(dterm_handle_t* dth, uint64_t uid) {
+    wal_rec_t rec = {
+        .op     = WAL_devimage,
+        .uid    = uid,
+    };
+    otfs_t devfs;
+    
+    if (devcache_setfs(dth->ext->devcache, dth->ext->db, &devfs, (uint8_t*)&uid) == 0) {
+        return cmd_journal(dth, &rec, devfs.base, (uint32_t)devfs.alloc);
+    }
+    return 0;
+}
+
+
+
 int cmd_rmdir(const char *dir) {
     int ret = 0;
     FTS *ftsp = NULL;
@@ -19,6 +19,10 @@
 
 // Local Headers
 #include "dterm.h"
+#include "devcache.h"
+#include "txn.h"
+#include "schema.h"
+#include "wal.h"
 
 // HB libraries
 #include <otfs.h>
@@ -44,6 +48,14 @@
 #define ARGFIELD_FILEALLOC      (1<<11)
 #define ARGFIELD_FILERANGE      (1<<12)
 #define ARGFIELD_FILEDATA       (1<<13)
+#define ARGFIELD_SNAPSHOT       (1<<14)
+#define ARGFIELD_INCREMENTAL    (1<<15)
+#define ARGFIELD_DEVICEIDSET    (1<<16)
+#define ARGFIELD_FILELIST       (1<<17)
+#define ARGFIELD_TXID           (1<<18)
+#define ARGFIELD_QUERY          (1<<19)
+#define ARGFIELD_FIELDNAME      (1<<20)
+#define ARGFIELD_BINS           (1<<21)
 
 
 typedef enum {
@@ -60,9 +72,20 @@ typedef struct {
     uint64_t        devid;
     const char**    devid_strlist;
     int             devid_strlist_size;
+    const char*     devid_set;
+    const char**    filespec_list;
+    int             filespec_list_size;
+    int             txid;
+    const char**    query_list;
+    int             query_list_size;
+    const char*     project;
+    const char*     fieldname;
+    int             bins;
     int             age_ms;
     uint8_t         jsonout_flag;
     uint8_t         compress_flag;
+    uint8_t         snapshot_flag;
+    uint8_t         incremental_flag;
     uint8_t         soft_flag;
     uint8_t         block_id;
     uint8_t         file_id;
@@ -77,11 +100,14 @@ typedef struct {
     struct arg_str*     devid_man;
     struct arg_file*    archive_man;
     struct arg_lit*     compress_opt;
+    struct arg_lit*     snapshot_opt;
+    struct arg_lit*     incremental_opt;
     struct arg_lit*     jsonout_opt;
 
     // used by file commands
     struct arg_str*     devid_opt;
     struct arg_str*     devidlist_opt;
+    struct arg_str*     devidset_opt;
     struct arg_int*     fileage_opt;
     struct arg_str*     fileblock_opt;
     struct arg_str*     filerange_opt;
@@ -89,6 +115,12 @@ typedef struct {
     struct arg_str*     fileperms_man;
     struct arg_int*     filealloc_man;
     struct arg_str*     filedata_man;
+    struct arg_str*     filelist_man;
+    struct arg_int*     txid_man;
+    struct arg_str*     query_man;
+    struct arg_str*     project_opt;
+    struct arg_str*     fieldname_man;
+    struct arg_int*     bins_opt;
 
     // used by all commands
     struct arg_lit*     help_man;
@@ -128,6 +160,31 @@ int cmd_jsonout_data(char** dst, size_t* dstmax, bool jsonflag, int errcode, uin
 int cmd_rmdir(const char *dir);
 
 
+/// Error of a command whose change is in the DB, but not in the write-ahead
+/// log, so it is not safe from a crash until the next save.
+#define CMD_ERR_JOURNAL     (-4096)
+
+/** @brief Records a change to the DB, after it is made
+  * @param dth      (dterm_handle_t*) Controlling interface handle
+  * @param rec      (wal_rec_t*) Change.  uid 0 is the active device, and
+  *                 modtime 0 is now.
+  * @param data     (const void*) Data of the change
+  * @param size     (uint32_t) Bytes of data
+  * @retval         0, or CMD_ERR_JOURNAL if the change couldn't be logged
+  *
+  * The change is marked for incremental save (see dirty.h), applied to the
+  * field indexes (see fidx.h) and appended to the write-ahead log (see wal.h).
+  */
+int cmd_journal(dterm_handle_t* dth, wal_rec_t* rec, const void* data, uint32_t size);
+
+/** @brief Records a device that was created or replaced, as a full FS image
+  * @param dth      (dterm_handle_t*) Controlling interface handle
+  * @param uid      (uint64_t) Device ID.  It becomes the active device.
+  * @retval         0, or CMD_ERR_JOURNAL if the device couldn't be logged
+  */
+int cmd_journaldev(dterm_handle_t* dth, uint64_t uid);
+
+
 AUTH_level cmd_minauth_get(vlFILE* fp, uint8_t modreq);
 
 
@@ -235,7 +292,7 @@ int cmd_devset(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
   * @param dth          (dterm_handle_t*) dterm handle
   * @param dst          (uint8_t*) destination buffer -- used only as interim
   * @param dstmax       (size_t) maximum extent of destination buffer
-  * @param fstmpl       (cJSON*) FS template JSON object
+  * @param schema       (tmpl_schema_t*) FS template schema
   * @param devdir       (DIR*) directory object for device archive directory
   * @param path         (const char*) active path to device directory (or device)
   * @param uid          (uint64_t) 64 bit device id (Unique ID)
@@ -245,7 +302,7 @@ int cmd_devset(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
   * If sync_target == false, dst can be NULL and dstmax is ignored.
   */
 int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
-                        cJSON* fstmpl, DIR* devdir, const char* path, uint64_t uid,
+                        tmpl_schema_t* schema, DIR* devdir, const char* path, uint64_t uid,
                         bool export_tmp);
 
 
@@ -261,7 +318,8 @@ int cmdsub_datafile(dterm_handle_t* dth, uint8_t* dst, size_t dstmax,
   * open [-j] infile
   *
   * infile:     Input file.  This is either a directory or a compressed archive
-  *             depending on the way it is saved (-c option or not).
+  *             depending on the way it is saved (-c option or not), or a
+  *             binary snapshot file (-S option), which opens much faster.
   */
 int cmd_open(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
 
@@ -305,10 +363,18 @@ int cmd_load(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
   * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
   *
   * Protocol usage: text input
-  * save [-jc] outfile [IDlist]
+  * save [-jcSI] outfile [IDlist]
   *
   * -c:         Optional argument to compress output.  Compression is 7z type.
   *
+  * -I:         Optional argument to save incrementally.  If outfile is the
+  *             archive that the DB was last opened from or saved to, only the
+  *             devices and files changed since then are rewritten.  Otherwise
+  *             the save is complete.
+  *
+  * -S:         Optional argument to save a binary snapshot (see snapshot.h)
+  *             instead of the JSON archive.  The output is a single file.
+  *
   * outfile:    File name of the saved output.
   *             If compression is not used, the output will be a directory with
   *             this name, with an internal structure of subdirectories and 
@@ -320,6 +386,28 @@ int cmd_save(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size
 
 
 
+/** @brief Runs a microbenchmark of the DB engine
+  * @param dth      (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Only built when OTDB_FEATURE_BENCH is ENABLED, e.g. with
+  * make EXT_DEF=-DOTDB_FEATURE_BENCH=1
+  *
+  * Protocol usage: text input
+  * bench name [N ...]
+  *
+  * name:       setfs -- device switch latency through libotfs and through
+  *             the device cache, on a scratch DB of N devices sharing the
+  *             template image (default N = 1000, 100000, 1000000).  A DB must
+  *             be open, for its template.
+  */
+int cmd_bench(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
 ///@todo documentation for devls, push, pull
 int cmd_devls(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
 int cmd_push(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
@@ -383,11 +471,35 @@ int cmd_new(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_
   *
   * range:  A byte range such as 0:16 (first 16 bytes), :16 (first 16 bytes),
   *         8: (all bytes after 7th), etc.  Defaults to 0:
+  *
+  * A file older than -a is refreshed from the device first.  Reads of the
+  * same file that are stale at the same time share one refresh (see
+  * sflight.h), and get its result.
   */
 int cmd_read(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
 
 
 
+/** @brief Counters of file refreshes done by r
+  * @param dth       (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Protocol usage: text input
+  * rstat [-j]
+  *
+  * refreshes is the number of refreshes sent to the device manager,
+  * coalesced is the number of reads that waited on one of them instead, and
+  * inflight is the number of refreshes underway.
+  *
+  * JSON output: {"cmd":"rstat", "refreshes":N, "coalesced":M, "inflight":K}
+  */
+int cmd_readstats(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
 /** @brief Read a file and file headers from a device
   * @param dth       (dterm_handle_t*) Controlling interface handle
   * @param dst      (uint8_t*) Protocol output buffer
@@ -412,6 +524,180 @@ int cmd_readall(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, s
 
 
 
+/** @brief Read a file from many devices, or from all devices
+  * @param dth       (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Protocol usage: text input
+  * r+ [-j] [-I ID,ID,...|all] [-b block] [-r range] file_id
+  *
+  * if -I is missing, or is "all", every device in the DB is read
+  * if -b is missing, it defaults to isf0
+  *
+  * One record is streamed per device, in one pass over the DB.  The read is
+  * always soft: data is what the DB holds, and devices are not synchronized
+  * as by r.  Each record is limited to OTDB_PARAM_OUTBUF_CHUNK of output.
+  *
+  * JSON output: {"cmd":"r+", "block":B, "id":I, "records":[...]}, where each
+  * record is {"devid":"ID", "d_offset":..., "d_size":..., "d_hex":"..."}, or
+  * {"devid":"ID", "err":E} if the device doesn't have the file.
+  *
+  * Binary output: for each device, UID[8], status[1], length[2], data[length].
+  * UID and length are big endian.  Status is 0, or the Veelite error.
+  */
+int cmd_readmulti(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
+/** @brief Read a list of files from a device
+  * @param dth       (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Protocol usage: text input
+  * rl [-j] [-i ID] file [file ...]
+  *
+  * if -i is missing, it defaults to the active device
+  *
+  * file:   [block:]file_id[:X:Y], such as 12, isf:12, iss:3:0:16 or isf:5:8:
+  *         Block defaults to isf and the range X:Y to 0:, as in r
+  *
+  * Up to 64 files are read, in list order, from the DB copy of the device, as
+  * by r*.  The device is selected once and the headers of all the files are
+  * resolved before any is read.
+  *
+  * JSON output: {"cmd":"rl", "devid":"ID", "files":[...]}, where each file is
+  * {"block":B, "id":I, "d_offset":..., "d_size":..., "d_hex":"..."}, or
+  * {"block":B, "id":I, "err":E} if the device doesn't have the file.
+  *
+  * Binary output: for each file, block[1], id[1], status[1], length[2],
+  * data[length].  Length is big endian.  Status is 0, or the Veelite error.
+  */
+int cmd_readlist(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
+/** @brief Write transaction commands
+  * @param dth       (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Protocol usage: text input
+  * tx-new [-j] [-i ID]
+  * tx-w [-j] [-b block] [-r range] txid file_id bintex
+  * tx-ok [-j] [-s] [-i ID] txid
+  * tx-del [-j] txid
+  *
+  * tx-new opens a transaction on a device, and outputs its txid.  tx-w
+  * stages a write, with the arguments of w, up to OTDB_PARAM_TXN_WRITES of
+  * them.  Staged writes aren't visible until tx-ok applies them all to the
+  * device, under its exclusive lock.  If any write is invalid, none is
+  * applied.  tx-ok must name the device of the transaction in -i, unless it
+  * is the active device, because that is the device it locks.  tx-del drops
+  * a transaction.  Either way, the txid can't be used again.  The writes
+  * are logged as one WAL_txn record, so replay applies all or none of them.
+  *
+  * Unless -s is given, tx-ok then sends all the writes to the device manager
+  * at once, and waits for all of them with the DB locks released, as w does.
+  */
+int cmd_txbegin(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+int cmd_txstage(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+int cmd_txcommit(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+int cmd_txabort(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
+/** @brief Find devices by the values of template fields
+  * @param dth       (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Protocol usage: text input
+  * select [-j] [-I ID,ID,...|all] [-p file.field,...] predicate [predicate ...]
+  *
+  * if -I is missing, or is "all", every device in the DB is tested
+  *
+  * predicate:  file.field OP value, without spaces, such as
+  *             realtime_vars.battery<20.  OP is one of < <= > >= == !=.
+  *             Fields of string and hex type only take == and !=.
+  *
+  * Up to 16 predicates are given, and a device matches if all of them are
+  * true.  Fields are read from the DB images in place, using the offsets of
+  * the loaded template, and the devices are split among worker threads.
+  * Each match outputs the UID and the fields given in -p.
+  *
+  * Without -I, if any predicate other than != is on an indexed field (see
+  * ix-new), only the devices that the index lists for it are tested, using
+  * the index with the fewest.
+  *
+  * JSON output: {"cmd":"select", "index":"file.field", "devices":N,
+  * "count":M, "matches":[...]}, where each match is {"devid":"ID",
+  * "fields":{"file.field":value, ...}}.  devices is the number of devices
+  * tested, and index is empty if no index was used.
+  */
+int cmd_select(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
+/** @brief Aggregate a number field over devices
+  * @param dth       (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Protocol usage: text input
+  * agg [-j] [-I ID,ID,...|all] [-n bins] file.field
+  *
+  * if -I is missing, or is "all", every device in the DB is aggregated
+  * if -n is missing, the histogram has 10 bins.  -n 0 gives no histogram.
+  *
+  * The field is named as in select, and must be a number.  It is gathered
+  * from the DB images into a column, which is reduced by the vector kernels
+  * of the CPU (see agg.h).  Devices that don't have the field are left out
+  * of count.  The histogram has equal bins between min and max.
+  *
+  * JSON output: {"cmd":"agg", "field":"file.field", "kernel":"avx2",
+  * "devices":N, "count":C, "min":..., "max":..., "sum":..., "mean":...,
+  * "hist":[...]}.  min, max, sum and mean are left out if count is 0.
+  */
+int cmd_agg(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
+/** @brief Manage indexes on template fields
+  * @param dth       (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t*) Protocol output buffer
+  * @param inbytes  (int*) Protocol Input Bytes.  Also outputs adjusted input bytes.
+  * @param src      (uint8_t*) Protocol input buffer
+  * @param dstmax   (size_t) Maximum size of dst (Protocol output buffer)
+  *
+  * Protocol usage: text input
+  * ix-new [-j] file.field
+  * ix-del [-j] file.field
+  * ix-ls [-j]
+  *
+  * ix-new declares an index on a field, as named by select, and builds it
+  * from all the devices if a DB is open.  It outputs the number of devices
+  * in the index.  Indexes are kept up to date with every change to the DB,
+  * and they are rebuilt when a DB is opened.  Up to OTDB_PARAM_FIDX_MAX
+  * fields are indexed.  ix-del drops an index, and ix-ls lists them.
+  */
+int cmd_idxnew(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+int cmd_idxdel(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+int cmd_idxls(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+
+
 /** @brief Restore a file on a device to its defaults
   * @param dth       (dterm_handle_t*) Controlling interface handle
   * @param dst      (uint8_t*) Protocol output buffer
@@ -22,9 +22,12 @@
 #include "cmdsearch.h"
 
 #include <bintex.h>
+#include <hbutils.h>
+#include <argtable3.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 
 
@@ -38,38 +41,54 @@
 typedef struct {
     const char      name[8]; 
     cmdaction_t     action; 
+    dblock_class_t  lock;
+    bool            devmgr;     // may wait on the device manager
 } cmd_t;
 
 static const cmd_t otdb_commands[] = {
-    { "cmdls",      &cmd_cmdlist },
-    { "del",        &cmd_del },
-    { "dev-del",    &cmd_devdel },
-    { "dev-ls",     &cmd_devls },
-    { "dev-new",    &cmd_devnew },
-    { "dev-set",    &cmd_devset },
-    { "load",       &cmd_load },
-    { "open",       &cmd_open },
-    { "new",        &cmd_new },
-    { "pub",        &cmd_pub },
-    { "pull",       &cmd_pull },
-    { "push",       &cmd_push },
-    { "quit",       &cmd_quit },
-    { "r",          &cmd_read },
-    { "r*",         &cmd_readall },
-    { "restore",    &cmd_restore },
-    { "rh",         &cmd_readhdr },
-    { "rp",         &cmd_readperms },
-    { "w",          &cmd_write },
-    { "wp",         &cmd_writeperms },
-    { "save",       &cmd_save },
-    { "z",          &cmd_restore },
+    { "agg",        &cmd_agg,           DBLOCK_dbread },
+#if OTDB_FEATURE(BENCH)
+    { "bench",      &cmd_bench,         DBLOCK_dbwrite },
+#endif
+    { "cmdls",      &cmd_cmdlist,       DBLOCK_none },
+    { "del",        &cmd_del,           DBLOCK_devwrite },
+    { "dev-del",    &cmd_devdel,        DBLOCK_dbwrite },
+    { "dev-ls",     &cmd_devls,         DBLOCK_dbread },
+    { "dev-new",    &cmd_devnew,        DBLOCK_dbwrite },
+    { "dev-set",    &cmd_devset,        DBLOCK_dbread },
+    { "ix-del",     &cmd_idxdel,        DBLOCK_devread },
+    { "ix-ls",      &cmd_idxls,         DBLOCK_devread },
+    { "ix-new",     &cmd_idxnew,        DBLOCK_dbread },
+    { "load",       &cmd_load,          DBLOCK_dbwrite },
+    { "open",       &cmd_open,          DBLOCK_dbwrite },
+    { "new",        &cmd_new,           DBLOCK_devwrite },
+    { "pub",        &cmd_pub,           DBLOCK_devwrite },
+    { "pull",       &cmd_pull,          DBLOCK_dbread,      true },
+    { "push",       &cmd_push,          DBLOCK_dbread,      true },
+    { "quit",       &cmd_quit,          DBLOCK_none },
+    { "r",          &cmd_read,          DBLOCK_devread,     true },
+    { "r*",         &cmd_readall,       DBLOCK_devread },
+    { "r+",         &cmd_readmulti,     DBLOCK_dbread },
+    { "restore",    &cmd_restore,       DBLOCK_devwrite },
+    { "rh",         &cmd_readhdr,       DBLOCK_devread },
+    { "rl",         &cmd_readlist,      DBLOCK_devread },
+    { "rp",         &cmd_readperms,     DBLOCK_devread },
+    { "rstat",      &cmd_readstats,     DBLOCK_devread },
+    { "w",          &cmd_write,         DBLOCK_devwrite,    true },
+    { "wp",         &cmd_writeperms,    DBLOCK_devwrite },
+    { "save",       &cmd_save,          DBLOCK_dbwrite },
+    { "select",     &cmd_select,        DBLOCK_dbread },
+    { "tx-del",     &cmd_txabort,       DBLOCK_devread },
+    { "tx-new",     &cmd_txbegin,       DBLOCK_devread },
+    { "tx-ok",      &cmd_txcommit,      DBLOCK_devwrite,    true },
+    { "tx-w",       &cmd_txstage,       DBLOCK_devread },
+    { "z",          &cmd_restore,       DBLOCK_devwrite },
 };
 
 
 
-///@todo OTDB currently has a mutex to ensure that only one client is able to
-///      do a command at a time.  If that ever changes, the cmd search and
-///      command execution process needs a mutex instead.
+///@note The cmdtab is only modified during cmd_init(), before any client
+///      threads exist, so searching it concurrently is safe.
 static cmdtab_t cmdtab_default = {
     .cmd    = NULL,
     .size   = 0,
@@ -228,6 +247,85 @@ int cmd_getname(char* cmdname, const char* cmdline, size_t max_cmdname) {
 
 
 
+dblock_class_t cmd_lockclass(const cmdtab_item_t* cmd) {
+    if (cmd != NULL) {
+        if ((otdb_extcmd_t)cmd->extcmd == EXTCMD_null) {
+            for (int i=0; i<(sizeof(otdb_commands)/sizeof(cmd_t)); i++) {
+                if ((void*)otdb_commands[i].action == cmd->action) {
+                    return otdb_commands[i].lock;
+                }
+            }
+        }
+    }
+    
+    /// External commands and unknown commands don't touch the DB
+    return DBLOCK_none;
+}
+
+
+bool cmd_usesdevmgr(const cmdtab_item_t* cmd) {
+    if ((cmd != NULL) && ((otdb_extcmd_t)cmd->extcmd == EXTCMD_null)) {
+        for (int i=0; i<(sizeof(otdb_commands)/sizeof(cmd_t)); i++) {
+            if ((void*)otdb_commands[i].action == cmd->action) {
+                return otdb_commands[i].devmgr;
+            }
+        }
+    }
+    return false;
+}
+
+
+
+bool cmd_getdevid(uint64_t* devid, const char* args, size_t max_args) {
+/// The argtable globals belong to the command that holds the engine, and
+/// this runs before any lock is taken, so it parses with a private table.
+/// The table has every option that the commands take, so a flag that has a
+/// value never hides -i, and combined flags split as they do in the command.
+    struct arg_lit* lit_opt = arg_litn("jscShS", "json,soft,compress,snapshot,incremental,help", 0, 256, "");
+    struct arg_str* id_opt  = arg_str0("i", "id", "DeviceID", "");
+    struct arg_str* str_opt = arg_strn("Ibrp", "ids,block,range,project", "value", 0, 256, "");
+    struct arg_int* int_opt = arg_intn("an", "age,bins", "N", 0, 256, "");
+    struct arg_str* any_man = arg_strn(NULL, NULL, "arg", 0, 256, "");
+    struct arg_end* end     = arg_end(20);
+    void* argtable[]        = { lit_opt, id_opt, str_opt, int_opt, any_man, end };
+    char*   buffer  = NULL;
+    char**  argv;
+    int     argc;
+    bool    found   = false;
+    
+    if (arg_nullcheck(argtable) != 0) {
+        goto cmd_getdevid_END;
+    }
+    
+    /// hbutils_parseargv() tokenizes in place, and treats all bintex
+    /// containers as whitespace-safe, as it does in cmd_extract_args().
+    buffer = malloc(max_args + 1);
+    if (buffer == NULL) {
+        goto cmd_getdevid_END;
+    }
+    memcpy(buffer, args, max_args);
+    buffer[max_args] = 0;
+    
+    argc = hbutils_parseargv(&argv, "getdevid", buffer, buffer, max_args);
+    if (argc > 0) {
+        /// Errors belong to the command, which reports them when it runs
+        arg_parse(argc, argv, argtable);
+        if (id_opt->count > 0) {
+            *devid  = strtoull(id_opt->sval[0], NULL, 16);
+            found   = true;
+        }
+        hbutils_freeargv(argv);
+    }
+    
+    cmd_getdevid_END:
+    free(buffer);
+    arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+    return found;
+}
+
+
+
+
 const cmdtab_item_t* cmd_search(cmdtab_t* cmdtab, char *cmdname) {
     return cmdtab_search(cmdtab, cmdname);
 }
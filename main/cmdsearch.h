@@ -36,6 +36,29 @@ int cmd_run(const cmdtab_item_t* cmd, dterm_handle_t* dth, uint8_t* dst, int* in
 int cmd_getname(char* cmdname, const char* cmdline, size_t max_cmdname);
 
 
+/** @brief Returns the DB lock class a command must run under
+  */
+dblock_class_t cmd_lockclass(const cmdtab_item_t* cmd);
+
+
+/** @brief Tests if a command may send to the device manager and wait on it
+  */
+bool cmd_usesdevmgr(const cmdtab_item_t* cmd);
+
+
+/** @brief Finds the device ID option (-i, --id) in command arguments
+  * @param devid    (uint64_t*) Output device ID, written only when found
+  * @param args     (const char*) Command arguments, following command name
+  * @param max_args (size_t) Maximum length of args
+  * @retval         true if a device ID option is present
+  *
+  * This is a pre-parse, used to select device locks before the command
+  * itself runs.  It uses a private argtable with all the command options, so
+  * it is safe without locks and splits flags the way the command does.
+  */
+bool cmd_getdevid(uint64_t* devid, const char* args, size_t max_args);
+
+
 // searches for command by exact name
 // returns command index or -1 if command not found
 const cmdtab_item_t* cmd_search(cmdtab_t* cmdtab, char *name);
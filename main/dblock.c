@@ -0,0 +1,340 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "dblock.h"
+#include "debug.h"
+#include "hashmix.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct {
+    pthread_rwlock_t    db;
+    pthread_mutex_t     engine;
+    size_t              shards;
+    pthread_rwlock_t*   shard;
+} dblock_t;
+
+
+
+static int sub_shard(dblock_t* dbl, uint64_t uid) {
+/// Shard count is a power of two.  The UID is mixed first, because UIDs
+/// allocated in sequence would otherwise cluster in low bits.
+    return (int)(hashmix_u64(uid) & (dbl->shards - 1));
+}
+
+
+static uint64_t sub_activeuid(dblock_t* dbl, void* db) {
+    uint64_t uid = 0;
+
+    if (db != NULL) {
+        pthread_mutex_lock(&dbl->engine);
+        otfs_activeuid(db, (uint8_t*)&uid);
+        pthread_mutex_unlock(&dbl->engine);
+    }
+    return uid;
+}
+
+
+
+int dblock_init(dblock_handle_t* handle, size_t shards) {
+    dblock_t* dbl;
+    size_t i;
+    int rc;
+
+    if (handle == NULL) {
+        return -1;
+    }
+
+    if (shards == 0) {
+        shards = OTDB_PARAM_LOCKSHARDS;
+    }
+
+    // Round shards up to a power of two
+    for (i=1; i<shards; i<<=1);
+    shards = i;
+
+    dbl = calloc(1, sizeof(dblock_t));
+    if (dbl == NULL) {
+        return -2;
+    }
+    dbl->shard = calloc(shards, sizeof(pthread_rwlock_t));
+    if (dbl->shard == NULL) {
+        rc = -2;
+        goto dblock_init_FREE;
+    }
+
+    if (pthread_rwlock_init(&dbl->db, NULL) != 0) {
+        rc = -3;
+        goto dblock_init_FREE;
+    }
+    if (pthread_mutex_init(&dbl->engine, NULL) != 0) {
+        rc = -4;
+        goto dblock_init_DB;
+    }
+    for (dbl->shards=0; dbl->shards<shards; dbl->shards++) {
+        if (pthread_rwlock_init(&dbl->shard[dbl->shards], NULL) != 0) {
+            rc = -5;
+            goto dblock_init_SHARDS;
+        }
+    }
+
+    *handle = dbl;
+    return 0;
+
+    dblock_init_SHARDS:
+    while (dbl->shards-- > 0) {
+        pthread_rwlock_destroy(&dbl->shard[dbl->shards]);
+    }
+    pthread_mutex_destroy(&dbl->engine);
+
+    dblock_init_DB:
+    pthread_rwlock_destroy(&dbl->db);
+
+    dblock_init_FREE:
+    free(dbl->shard);
+    free(dbl);
+    return rc;
+}
+
+
+
+void dblock_deinit(dblock_handle_t handle) {
+    dblock_t* dbl = handle;
+
+    if (dbl != NULL) {
+        for (size_t i=0; i<dbl->shards; i++) {
+            pthread_rwlock_destroy(&dbl->shard[i]);
+        }
+        pthread_mutex_destroy(&dbl->engine);
+        pthread_rwlock_destroy(&dbl->db);
+        free(dbl->shard);
+        free(dbl);
+    }
+}
+
+
+
+int dblock_acquire(dblock_handle_t handle, dblock_ticket_t* ticket, dblock_class_t cls, uint64_t uid, void** db) {
+    dblock_t* dbl = handle;
+    bool pin_device = false;
+
+    if ((dbl == NULL) || (ticket == NULL)) {
+        return -1;
+    }
+
+    ticket->cls         = cls;
+    ticket->shard       = -1;
+    ticket->uid         = uid;
+    ticket->engine      = false;
+    ticket->yielded     = false;
+    ticket->suspended   = false;
+    ticket->resume_setfs= false;
+
+    switch (cls) {
+        case DBLOCK_none:
+            return 0;
+
+        case DBLOCK_dbwrite:
+            pthread_rwlock_wrlock(&dbl->db);
+            break;
+
+        case DBLOCK_devread:
+        case DBLOCK_devwrite:
+            pthread_rwlock_rdlock(&dbl->db);
+
+            /// The active device cannot be deleted while the DB lock is held,
+            /// but another command may select a different one before this
+            /// command gets the engine.  It gets pinned below.
+            if (uid == 0) {
+                ticket->uid = sub_activeuid(dbl, (db != NULL) ? *db : NULL);
+                pin_device  = (ticket->uid != 0);
+            }
+            ticket->shard = sub_shard(dbl, ticket->uid);
+            if (cls == DBLOCK_devwrite) {
+                pthread_rwlock_wrlock(&dbl->shard[ticket->shard]);
+            }
+            else {
+                pthread_rwlock_rdlock(&dbl->shard[ticket->shard]);
+            }
+            break;
+
+        case DBLOCK_dbread:
+            pthread_rwlock_rdlock(&dbl->db);
+            break;
+
+        default:
+            return -2;
+    }
+
+    pthread_mutex_lock(&dbl->engine);
+    ticket->engine = true;
+
+    if (pin_device && (*db != NULL)) {
+        otfs_setfs(*db, NULL, (uint8_t*)&ticket->uid);
+    }
+
+    return 0;
+}
+
+
+
+void dblock_release(dblock_handle_t handle, dblock_ticket_t* ticket) {
+    dblock_t* dbl = handle;
+
+    if ((dbl == NULL) || (ticket == NULL) || (ticket->cls == DBLOCK_none)) {
+        return;
+    }
+    if (ticket->suspended) {
+        ticket->suspended   = false;
+        ticket->cls         = DBLOCK_none;
+        return;
+    }
+
+    if (ticket->engine) {
+        ticket->engine = false;
+        pthread_mutex_unlock(&dbl->engine);
+    }
+    if (ticket->shard >= 0) {
+        pthread_rwlock_unlock(&dbl->shard[ticket->shard]);
+        ticket->shard = -1;
+    }
+    pthread_rwlock_unlock(&dbl->db);
+    ticket->cls = DBLOCK_none;
+}
+
+
+
+void dblock_yield(dblock_handle_t handle, dblock_ticket_t* ticket, void* db) {
+    dblock_t* dbl = handle;
+
+    if ((dbl == NULL) || (ticket == NULL) || (ticket->engine == false)) {
+        return;
+    }
+
+    ticket->resume_setfs = false;
+    if (db != NULL) {
+        ticket->resume_uid   = 0;
+        otfs_activeuid(db, (uint8_t*)&ticket->resume_uid);
+        ticket->resume_setfs = (ticket->resume_uid != 0);
+    }
+
+    ticket->engine  = false;
+    ticket->yielded = true;
+    pthread_mutex_unlock(&dbl->engine);
+}
+
+
+
+void dblock_resume(dblock_handle_t handle, dblock_ticket_t* ticket, void* db) {
+    dblock_t* dbl = handle;
+
+    if ((dbl == NULL) || (ticket == NULL) || (ticket->yielded == false)) {
+        return;
+    }
+
+    pthread_mutex_lock(&dbl->engine);
+    ticket->engine  = true;
+    ticket->yielded = false;
+
+    /// Other commands may have selected a different device in the meantime
+    if (ticket->resume_setfs && (db != NULL)) {
+        otfs_setfs(db, NULL, (uint8_t*)&ticket->resume_uid);
+    }
+}
+
+
+
+int dblock_lockdev(dblock_handle_t handle, dblock_ticket_t* ticket, uint64_t uid, void* db) {
+    dblock_t* dbl = handle;
+
+    if ((dbl == NULL) || (ticket == NULL) || (ticket->cls != DBLOCK_dbread) || (ticket->shard >= 0)) {
+        return -1;
+    }
+
+    dblock_yield(handle, ticket, db);
+    ticket->shard = sub_shard(dbl, uid);
+    pthread_rwlock_wrlock(&dbl->shard[ticket->shard]);
+    dblock_resume(handle, ticket, db);
+    return 0;
+}
+
+
+
+void dblock_unlockdev(dblock_handle_t handle, dblock_ticket_t* ticket) {
+    dblock_t* dbl = handle;
+
+    if ((dbl == NULL) || (ticket == NULL) || (ticket->cls != DBLOCK_dbread) || (ticket->shard < 0)) {
+        return;
+    }
+    pthread_rwlock_unlock(&dbl->shard[ticket->shard]);
+    ticket->shard = -1;
+}
+
+
+
+int dblock_suspend(dblock_handle_t handle, dblock_ticket_t* ticket) {
+    dblock_t* dbl = handle;
+    dblock_class_t cls;
+
+    if ((dbl == NULL) || (ticket == NULL) || ticket->suspended || ticket->yielded) {
+        return -1;
+    }
+    if ((ticket->cls != DBLOCK_devread) && (ticket->cls != DBLOCK_devwrite)
+    &&  ((ticket->cls != DBLOCK_dbread) || (ticket->shard >= 0))) {
+        return -2;
+    }
+
+    cls = ticket->cls;
+    dblock_release(handle, ticket);
+    ticket->cls         = cls;
+    ticket->suspended   = true;
+    return 0;
+}
+
+
+
+int dblock_reacquire(dblock_handle_t handle, dblock_ticket_t* ticket, dblock_class_t cls, void** db) {
+    int rc;
+
+    if ((ticket == NULL) || (ticket->suspended == false)) {
+        return -1;
+    }
+    if (ticket->cls == DBLOCK_dbread) {
+        return dblock_acquire(handle, ticket, DBLOCK_dbread, ticket->uid, db);
+    }
+    if ((cls != DBLOCK_devread) && (cls != DBLOCK_devwrite)) {
+        cls = ticket->cls;
+    }
+
+    /// uid in the ticket was resolved when it was first acquired, so it is
+    /// never 0 for an existing device.
+    rc = dblock_acquire(handle, ticket, cls, ticket->uid, db);
+    if ((rc == 0) && (db != NULL) && (*db != NULL)) {
+        if (otfs_setfs(*db, NULL, (uint8_t*)&ticket->uid) != 0) {
+            rc = -3;
+        }
+    }
+    return rc;
+}
+
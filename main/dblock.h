@@ -0,0 +1,166 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef dblock_h
+#define dblock_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** DB Lock Manager
+  * -------------------------------------------------------------------------
+  * Commands are isolated by a three-level lock hierarchy.  Locks are always
+  * taken in this order, and released in reverse:
+  *
+  * 1. DB lock (rwlock).  Taken exclusively by commands that restructure the
+  *    DB (open, save, load, dev-new, dev-del), and shared by all others.
+  * 2. Device lock (rwlock, sharded by UID).  Taken shared by device reads
+  *    and exclusively by device writes.
+  * 3. Engine mutex.  libotfs/veelite keep the active device as process
+  *    state, and the argtable objects are global, so the part of a command
+  *    that touches them is serialized.  The engine mutex may be yielded
+  *    while a command blocks on the device manager, which is what lets
+  *    commands on other devices proceed in the meantime.
+  *
+  * The image of a device doesn't move while its device lock is held, so a
+  * device read yields the engine once it has the pointers it needs from
+  * Veelite, and makes its output without it.  Reads of different devices
+  * only serialize on the Veelite calls.
+  *
+  * DB-level reads that store to devices (i.e. pull) take the device lock of
+  * each device they write with dblock_lockdev().
+  */
+
+typedef void* dblock_handle_t;
+
+typedef enum {
+    DBLOCK_none     = 0,    // No DB access (cmdls, quit, external commands)
+    DBLOCK_devread  = 1,    // DB shared, device shared
+    DBLOCK_devwrite = 2,    // DB shared, device exclusive
+    DBLOCK_dbread   = 3,    // DB shared, multi-device access via engine only
+    DBLOCK_dbwrite  = 4     // DB exclusive
+} dblock_class_t;
+
+typedef struct {
+    dblock_class_t  cls;
+    int             shard;          // -1 when no device lock is held
+    uint64_t        uid;            // Device the lock was taken for
+    bool            engine;         // true when the engine mutex is held
+    bool            yielded;        // true between yield and resume
+    bool            suspended;      // true between suspend and reacquire
+    bool            resume_setfs;
+    uint64_t        resume_uid;
+} dblock_ticket_t;
+
+
+
+/** @brief Creates a lock manager
+  * @param handle   (dblock_handle_t*) Output handle
+  * @param shards   (size_t) Number of device lock shards.  0 uses default.
+  * @retval         0 on success, negative on error
+  */
+int dblock_init(dblock_handle_t* handle, size_t shards);
+
+void dblock_deinit(dblock_handle_t handle);
+
+
+/** @brief Acquires the locks required by a command class
+  * @param handle   (dblock_handle_t) Lock manager handle
+  * @param ticket   (dblock_ticket_t*) Lock ticket, output
+  * @param cls      (dblock_class_t) Lock class of the command
+  * @param uid      (uint64_t) Device UID from command, or 0 for active device
+  * @param db       (void**) Pointer to DB handle.  Dereferenced under DB lock.
+  * @retval         0 on success, negative on error
+  *
+  * When uid is 0 for a device-level class, the active device is resolved
+  * under the DB lock and re-selected once the engine mutex is taken, so the
+  * command always operates on the device that it locked.
+  */
+int dblock_acquire(dblock_handle_t handle, dblock_ticket_t* ticket, dblock_class_t cls, uint64_t uid, void** db);
+
+void dblock_release(dblock_handle_t handle, dblock_ticket_t* ticket);
+
+
+/** @brief Temporarily releases the engine mutex, keeping DB and device locks
+  * @param handle   (dblock_handle_t) Lock manager handle
+  * @param ticket   (dblock_ticket_t*) Ticket of the running command
+  * @param db       (void*) DB handle
+  *
+  * The active device is saved, and it is restored by dblock_resume().  Use
+  * this around blocking waits that do not touch the DB.  Nothing referring
+  * to argtable storage may be used between yield and resume.  Calls are
+  * ignored when the ticket does not hold the engine.
+  */
+void dblock_yield(dblock_handle_t handle, dblock_ticket_t* ticket, void* db);
+
+void dblock_resume(dblock_handle_t handle, dblock_ticket_t* ticket, void* db);
+
+
+/** @brief Takes the device lock of one device, in a DB-level read
+  * @param handle   (dblock_handle_t) Lock manager handle
+  * @param ticket   (dblock_ticket_t*) Ticket of a DBLOCK_dbread command
+  * @param uid      (uint64_t) Device that the command is going to write
+  * @param db       (void*) DB handle
+  * @retval         0 on success, negative if the ticket isn't DBLOCK_dbread
+  *                 or already holds a device lock.
+  *
+  * The lock is exclusive.  The engine is yielded while the lock is taken,
+  * so the lock order holds, and the active device is kept.  Release the
+  * device lock with dblock_unlockdev() before taking another.
+  */
+int dblock_lockdev(dblock_handle_t handle, dblock_ticket_t* ticket, uint64_t uid, void* db);
+
+void dblock_unlockdev(dblock_handle_t handle, dblock_ticket_t* ticket);
+
+
+/** @brief Releases all locks of a command, keeping its ticket
+  * @param handle   (dblock_handle_t) Lock manager handle
+  * @param ticket   (dblock_ticket_t*) Ticket of the running command
+  * @retval         0 on success, negative if the ticket isn't device-level or
+  *                 a DB-level read without a device lock, or if the engine
+  *                 is yielded.
+  *
+  * Use this around long waits (i.e. the device manager or a slow client), so
+  * that not even DB-exclusive commands have to wait on them.  The command
+  * must not hold any vlFILE across the suspension, and it must look-up again
+  * anything it got from the DB, because the device may be changed or removed
+  * meanwhile.
+  */
+int dblock_suspend(dblock_handle_t handle, dblock_ticket_t* ticket);
+
+
+/** @brief Takes the locks of a suspended ticket again
+  * @param handle   (dblock_handle_t) Lock manager handle
+  * @param ticket   (dblock_ticket_t*) Suspended ticket
+  * @param cls      (dblock_class_t) Device-level class to take, which may
+  *                 differ from the class that was suspended.  A DB-level
+  *                 read always takes its own class again.
+  * @param db       (void**) Pointer to DB handle
+  * @retval         0 on success, negative if the device of the ticket no
+  *                 longer exists.  The locks are held in either case.
+  *
+  * The device of a device-level ticket is re-selected as the active device.
+  */
+int dblock_reacquire(dblock_handle_t handle, dblock_ticket_t* ticket, dblock_class_t cls, void** db);
+
+
+#endif
@@ -0,0 +1,192 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "devcache.h"
+#include "hashmix.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define DEVCACHE_MISSES     4096
+
+
+typedef struct {
+    bool        used;
+    int         rc;
+    uint64_t    uid;
+} devcache_miss_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    void*           db;
+
+    // Last device found, which answers lookups of the active device
+    bool            last_used;
+    otfs_t          last;
+
+    // Negative cache, direct-mapped
+    devcache_miss_t miss[DEVCACHE_MISSES];
+} devcache_item_t;
+
+
+
+
+static devcache_miss_t* sub_miss(devcache_item_t* dc, uint64_t uid) {
+    return &dc->miss[hashmix_u64(uid) & (DEVCACHE_MISSES-1)];
+}
+
+
+
+
+int devcache_init(devcache_t* handle) {
+    devcache_item_t* dc;
+
+    if (handle == NULL) {
+        return -1;
+    }
+    dc = calloc(1, sizeof(devcache_item_t));
+    if (dc == NULL) {
+        return -2;
+    }
+    if (pthread_mutex_init(&dc->mutex, NULL) != 0) {
+        free(dc);
+        return -3;
+    }
+    *handle = dc;
+    return 0;
+}
+
+
+void devcache_deinit(devcache_t handle) {
+    devcache_item_t* dc = handle;
+
+    if (dc != NULL) {
+        pthread_mutex_destroy(&dc->mutex);
+        free(dc);
+    }
+}
+
+
+void devcache_reset(devcache_t handle, void* db) {
+    devcache_item_t* dc = handle;
+
+    if (dc == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dc->mutex);
+    dc->last_used   = false;
+    memset(dc->miss, 0, sizeof(dc->miss));
+    dc->db          = db;
+    pthread_mutex_unlock(&dc->mutex);
+}
+
+
+int devcache_setfs(devcache_t handle, void* db, otfs_t* fs, const uint8_t* uid) {
+    devcache_item_t* dc = handle;
+    devcache_miss_t* miss;
+    otfs_t found;
+    uint64_t key;
+    uint64_t active;
+    int rc;
+
+    memcpy(&key, uid, 8);
+    if ((dc == NULL) || (db == NULL) || (db != dc->db) || (key == 0)) {
+        return otfs_setfs(db, fs, (uint8_t*)uid);
+    }
+
+    pthread_mutex_lock(&dc->mutex);
+
+    /// Fast path: the device is already active, and it is the last one found.
+    /// libotfs can only make a device active by looking it up, so other
+    /// devices always go through otfs_setfs().  A deleted device is never
+    /// returned, because devcache_del() forgets it.
+    active = 0;
+    otfs_activeuid(db, (uint8_t*)&active);
+    if ((active == key) && dc->last_used && (dc->last.uid.u64 == key)) {
+        found = dc->last;
+        goto devcache_setfs_HIT;
+    }
+
+    /// UIDs that were not found are not searched again, until they are added
+    miss = sub_miss(dc, key);
+    if (miss->used && (miss->uid == key)) {
+        rc = miss->rc;
+        pthread_mutex_unlock(&dc->mutex);
+        return rc;
+    }
+
+    rc = otfs_setfs(db, &found, (uint8_t*)uid);
+    if (rc != 0) {
+        miss->used  = true;
+        miss->uid   = key;
+        miss->rc    = rc;
+        pthread_mutex_unlock(&dc->mutex);
+        return rc;
+    }
+
+    devcache_setfs_HIT:
+    dc->last        = found;
+    dc->last_used   = true;
+    pthread_mutex_unlock(&dc->mutex);
+    if (fs != NULL) {
+        *fs = found;
+    }
+    return 0;
+}
+
+
+void devcache_add(devcache_t handle, void* db, const otfs_t* fs) {
+    devcache_item_t* dc = handle;
+    devcache_miss_t* miss;
+
+    if ((dc == NULL) || (fs == NULL)) {
+        return;
+    }
+    pthread_mutex_lock(&dc->mutex);
+    if (db == dc->db) {
+        miss = sub_miss(dc, fs->uid.u64);
+        if (miss->uid == fs->uid.u64) {
+            miss->used = false;
+        }
+        if (dc->last_used && (dc->last.uid.u64 == fs->uid.u64)) {
+            dc->last = *fs;
+        }
+    }
+    pthread_mutex_unlock(&dc->mutex);
+}
+
+
+void devcache_del(devcache_t handle, void* db, uint64_t uid) {
+    devcache_item_t* dc = handle;
+
+    if (dc == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dc->mutex);
+    if (db == dc->db) {
+        if (dc->last.uid.u64 == uid) {
+            dc->last_used = false;
+        }
+    }
+    pthread_mutex_unlock(&dc->mutex);
+}
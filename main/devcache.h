@@ -0,0 +1,79 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef devcache_h
+#define devcache_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Device Lookup Cache
+  * -------------------------------------------------------------------------
+  * Sits in front of otfs_setfs() for the open DB.  It keeps:
+  * - The last device found.  Lookups of the active device, which are most of
+  *   them, since the lock manager pins the device before the command selects
+  *   it, are answered from it without calling into libotfs.  Other devices
+  *   go through otfs_setfs(), which is the only way to make one active.
+  * - A negative cache of UIDs that were not found, so lists with unknown
+  *   UIDs don't search the DB every time.
+  *
+  * The cache must be told of every otfs_new() and otfs_del() on the DB it
+  * caches, and reset when the DB is replaced.  Calls for another DB handle
+  * go straight to libotfs.
+  */
+
+typedef void* devcache_t;
+
+
+int devcache_init(devcache_t* handle);
+void devcache_deinit(devcache_t handle);
+
+
+/** @brief Drops all entries and binds the cache to a DB
+  * @param handle   (devcache_t) Cache handle
+  * @param db       (void*) DB handle, or NULL when there is none
+  */
+void devcache_reset(devcache_t handle, void* db);
+
+
+/** @brief Selects a device, as otfs_setfs()
+  * @param handle   (devcache_t) Cache handle.  If NULL, otfs_setfs() is used.
+  * @param db       (void*) DB handle
+  * @param fs       (otfs_t*) Output otfs_t of the device, or NULL
+  * @param uid      (const uint8_t*) 8 byte UID
+  * @retval         0 on success, or the non-zero result of otfs_setfs()
+  */
+int devcache_setfs(devcache_t handle, void* db, otfs_t* fs, const uint8_t* uid);
+
+
+/** @brief Records a device after otfs_new()
+  */
+void devcache_add(devcache_t handle, void* db, const otfs_t* fs);
+
+/** @brief Forgets a device after otfs_del()
+  */
+void devcache_del(devcache_t handle, void* db, uint64_t uid);
+
+
+#endif
@@ -0,0 +1,297 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "devimage.h"
+#include "hashmix.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/// The shared copy of a template image is an unlinked file, which is private
+/// mapped by each device image.  It is a talloc child of the template FS base,
+/// so it goes away with the template.
+typedef struct {
+    const void* image;
+    size_t      alloc;
+    int         fd;
+} tmpl_item_t;
+
+/// Mapped images are kept in an open-addressed table, because munmap() needs
+/// the size and the free callback only gets the base.
+typedef struct {
+    uintptr_t   base;
+    size_t      size;
+} map_slot_t;
+
+static pthread_mutex_t  img_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static tmpl_item_t*     img_tmpl    = NULL;
+static map_slot_t*      img_slot    = NULL;
+static size_t           img_slots   = 0;
+static size_t           img_maps    = 0;
+static size_t           img_cap     = 0;
+static bool             img_capped  = false;
+
+
+
+
+static size_t sub_pagesize(void) {
+    static size_t pagesz = 0;
+    if (pagesz == 0) {
+        pagesz = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    return pagesz;
+}
+
+
+static size_t sub_mapcap(void) {
+/// Images may use the mappings allowed by vm.max_map_count, less the ones
+/// reserved for libraries, thread stacks, malloc and snapshots.
+    unsigned long maxmaps = 65530;
+    FILE* fp;
+
+    fp = fopen("/proc/sys/vm/max_map_count", "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%lu", &maxmaps) != 1) {
+            maxmaps = 65530;
+        }
+        fclose(fp);
+    }
+    return (maxmaps > OTDB_PARAM_COW_RESERVE) ? (size_t)(maxmaps - OTDB_PARAM_COW_RESERVE) : 0;
+}
+
+
+static size_t sub_hash(uintptr_t base) {
+    return (size_t)hashmix_u64((uint64_t)base);
+}
+
+
+static int sub_insert(void* base, size_t size) {
+    size_t i;
+
+    /// Table is kept at most half full
+    if (((img_maps + 1) * 2) > img_slots) {
+        size_t newslots = (img_slots == 0) ? 1024 : (img_slots * 2);
+        map_slot_t* newslot = calloc(newslots, sizeof(map_slot_t));
+        if (newslot == NULL) {
+            return -1;
+        }
+        for (size_t j=0; j<img_slots; j++) {
+            if (img_slot[j].base != 0) {
+                i = sub_hash(img_slot[j].base) & (newslots - 1);
+                while (newslot[i].base != 0) {
+                    i = (i + 1) & (newslots - 1);
+                }
+                newslot[i] = img_slot[j];
+            }
+        }
+        free(img_slot);
+        img_slot    = newslot;
+        img_slots   = newslots;
+    }
+
+    i = sub_hash((uintptr_t)base) & (img_slots - 1);
+    while (img_slot[i].base != 0) {
+        i = (i + 1) & (img_slots - 1);
+    }
+    img_slot[i].base = (uintptr_t)base;
+    img_slot[i].size = size;
+    img_maps++;
+    return 0;
+}
+
+
+static size_t sub_remove(void* base) {
+/// Returns the size of a mapped image, after removing it, or 0 if the base
+/// isn't a mapped image.
+    size_t i, j, size;
+
+    if (img_slots == 0) {
+        return 0;
+    }
+    i = sub_hash((uintptr_t)base) & (img_slots - 1);
+    while (img_slot[i].base != (uintptr_t)base) {
+        if (img_slot[i].base == 0) {
+            return 0;
+        }
+        i = (i + 1) & (img_slots - 1);
+    }
+    size = img_slot[i].size;
+    img_maps--;
+
+    /// Shift back the following entries of the probe sequence
+    for (j=(i+1)&(img_slots-1); img_slot[j].base!=0; j=(j+1)&(img_slots-1)) {
+        size_t home = sub_hash(img_slot[j].base) & (img_slots - 1);
+        if (hashmix_canshift(i, j, home)) {
+            img_slot[i] = img_slot[j];
+            i = j;
+        }
+    }
+    img_slot[i].base = 0;
+    img_slot[i].size = 0;
+    return size;
+}
+
+
+static int sub_tmplfree(tmpl_item_t* tmpl) {
+    pthread_mutex_lock(&img_mutex);
+    if (img_tmpl == tmpl) {
+        img_tmpl = NULL;
+    }
+    pthread_mutex_unlock(&img_mutex);
+
+    /// Images that still map the file keep it alive
+    if (tmpl->fd >= 0) {
+        close(tmpl->fd);
+    }
+    return 0;
+}
+
+
+static tmpl_item_t* sub_gettmpl(const otfs_t* tmpl_fs) {
+/// Returns the shared copy of the template image, making it if necessary.
+/// If it can't be made, its fd is negative, so it isn't tried again.
+    tmpl_item_t* tmpl;
+    char path[] = "/tmp/otdb-image-XXXXXX";
+    const uint8_t* cursor;
+    size_t left;
+
+    if ((img_tmpl != NULL) && (img_tmpl->image == tmpl_fs->base) && (img_tmpl->alloc == tmpl_fs->alloc)) {
+        return img_tmpl;
+    }
+    tmpl = talloc_zero(tmpl_fs->base, tmpl_item_t);
+    if (tmpl == NULL) {
+        return NULL;
+    }
+    tmpl->image = tmpl_fs->base;
+    tmpl->alloc = tmpl_fs->alloc;
+    tmpl->fd    = mkstemp(path);
+    if (tmpl->fd >= 0) {
+        unlink(path);
+        cursor  = tmpl_fs->base;
+        left    = tmpl->alloc;
+        while (left > 0) {
+            ssize_t wrote = write(tmpl->fd, cursor, left);
+            if (wrote <= 0) {
+                close(tmpl->fd);
+                tmpl->fd = -1;
+                break;
+            }
+            cursor += wrote;
+            left   -= (size_t)wrote;
+        }
+    }
+    talloc_set_destructor(tmpl, &sub_tmplfree);
+
+    img_tmpl    = tmpl;
+    img_cap     = sub_mapcap();
+    img_capped  = false;
+    return tmpl;
+}
+
+
+
+
+void* devimage_new(TALLOC_CTX* ctx, const otfs_t* tmpl_fs, const void* src, size_t alloc) {
+    tmpl_item_t* tmpl;
+    void* base = MAP_FAILED;
+
+    if (tmpl_fs == NULL) {
+        return NULL;
+    }
+
+    /// Map the shared template, if the image is the template size and is at
+    /// least a page.
+    pthread_mutex_lock(&img_mutex);
+    if ((tmpl_fs->alloc == alloc) && (alloc >= sub_pagesize())) {
+        tmpl = sub_gettmpl(tmpl_fs);
+        if ((tmpl != NULL) && (tmpl->fd >= 0) && (img_maps < img_cap)) {
+            base = mmap(NULL, alloc, PROT_READ|PROT_WRITE, MAP_PRIVATE, tmpl->fd, 0);
+            if ((base != MAP_FAILED) && (sub_insert(base, alloc) != 0)) {
+                munmap(base, alloc);
+                base = MAP_FAILED;
+            }
+        }
+        else if ((tmpl != NULL) && (tmpl->fd >= 0) && !img_capped) {
+            /// Past this point each new image costs its full size, which is
+            /// most of the fleet at large scale, so it is always reported.
+            img_capped = true;
+            fprintf(stderr, "devimage: %zu images are mapped, which is the limit from "
+                            "vm.max_map_count.  Further images are heap copies.\n", img_maps);
+        }
+    }
+    pthread_mutex_unlock(&img_mutex);
+
+    if (base != MAP_FAILED) {
+        if (src != NULL) {
+            devimage_copy(base, src, alloc);
+        }
+        return base;
+    }
+
+    /// Otherwise the image is a heap copy
+    base = talloc_size(ctx, alloc);
+    if (base != NULL) {
+        memcpy(base, (src != NULL) ? src : tmpl_fs->base, alloc);
+    }
+    return base;
+}
+
+
+void devimage_copy(void* base, const void* src, size_t alloc) {
+    size_t pagesz = sub_pagesize();
+    uint8_t* dst = base;
+    const uint8_t* cursor = src;
+
+    /// Reading a shared page doesn't copy it, so unchanged pages stay shared
+    for (size_t offset=0; offset<alloc; offset+=pagesz) {
+        size_t span = ((alloc - offset) < pagesz) ? (alloc - offset) : pagesz;
+        if (memcmp(&dst[offset], &cursor[offset], span) != 0) {
+            memcpy(&dst[offset], &cursor[offset], span);
+        }
+    }
+}
+
+
+void devimage_free(void* base) {
+    size_t size;
+
+    if (base == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&img_mutex);
+    size = sub_remove(base);
+    pthread_mutex_unlock(&img_mutex);
+
+    if (size != 0) {
+        munmap(base, size);
+    }
+    else {
+        talloc_free(base);
+    }
+}
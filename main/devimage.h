@@ -0,0 +1,82 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef devimage_h
+#define devimage_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/** Device FS Images
+  * -------------------------------------------------------------------------
+  * Device images are copies of the template FS image, which are changed by
+  * device data.  Instead of a heap copy, an image is a private mapping of a
+  * shared, read-only copy of the template image.  Pages of the image are
+  * shared with the template until they are written by Veelite, at which
+  * point the kernel copies that page for the device.  Stock files that are
+  * never written stay shared by the whole fleet.
+  *
+  * Each mapped image is a mapping of the process, and the kernel allows
+  * vm.max_map_count of those (65530 by default).  Images may use all of them
+  * but OTDB_PARAM_COW_RESERVE, which are left for the rest of OTDB.  The
+  * limit is read from /proc/sys/vm/max_map_count each time the template
+  * changes, so a DB opened after raising it maps more images.
+  *
+  * Images smaller than a page, or made once the limit is reached, are copied
+  * to the heap as before.  With the default limit that is about 57k mapped
+  * images, so in a DB of a million devices nearly all images are full heap
+  * copies, unless vm.max_map_count is raised.  The first image that is copied
+  * because of the limit is reported on stderr.  Either kind of image must be freed with
+  * devimage_free(), which is the free callback for otfs_del() and
+  * otfs_deinit().
+  */
+
+
+/** @brief Makes a new device image from the template FS
+  * @param ctx      (TALLOC_CTX*) Context of the image, if it is on the heap
+  * @param tmpl_fs  (const otfs_t*) Template FS
+  * @param src      (const void*) Image data, or NULL to copy the template
+  * @param alloc    (size_t) Bytes of image
+  * @retval         Base of the image, or NULL on error
+  *
+  * When src is given, only pages that differ from the template are copied.
+  */
+void* devimage_new(TALLOC_CTX* ctx, const otfs_t* tmpl_fs, const void* src, size_t alloc);
+
+
+/** @brief Overwrites a device image, copying only the pages that differ
+  * @param base     (void*) Base of the image
+  * @param src      (const void*) New image data
+  * @param alloc    (size_t) Bytes of image
+  */
+void devimage_copy(void* base, const void* src, size_t alloc);
+
+
+/** @brief Frees a device image made by devimage_new()
+  */
+void devimage_free(void* base);
+
+
+#endif
@@ -0,0 +1,267 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "dirty.h"
+#include "hashmix.h"
+
+// HB Headers/Libraries
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Blocks are GFB, ISS, ISF (1-3), and each has up to 256 files
+#define DIRTY_BLOCKS        3
+#define DIRTY_BUCKETS       1024
+
+
+typedef struct dirty_dev {
+    struct dirty_dev* next;
+    uint64_t    uid;
+    bool        whole;
+    uint32_t    bits[DIRTY_BLOCKS][256/32];
+} dirty_dev_t;
+
+
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t          devices;
+    dirty_dev_t*    bucket[DIRTY_BUCKETS];
+    char*           basepath;
+} dirty_item_t;
+
+
+
+
+static size_t sub_bucket(uint64_t uid) {
+    return (size_t)(hashmix_u64(uid) % DIRTY_BUCKETS);
+}
+
+
+static dirty_dev_t* sub_find(dirty_item_t* dt, uint64_t uid, bool create) {
+    dirty_dev_t** link = &dt->bucket[sub_bucket(uid)];
+    dirty_dev_t* dev;
+
+    for (dev=*link; dev!=NULL; dev=dev->next) {
+        if (dev->uid == uid) {
+            return dev;
+        }
+    }
+    if (create) {
+        dev = calloc(1, sizeof(dirty_dev_t));
+        if (dev != NULL) {
+            dev->uid    = uid;
+            dev->next   = *link;
+            *link       = dev;
+            dt->devices++;
+        }
+    }
+    return dev;
+}
+
+
+static void sub_clearall(dirty_item_t* dt) {
+    for (size_t i=0; i<DIRTY_BUCKETS; i++) {
+        while (dt->bucket[i] != NULL) {
+            dirty_dev_t* dev = dt->bucket[i];
+            dt->bucket[i] = dev->next;
+            free(dev);
+        }
+    }
+    dt->devices = 0;
+}
+
+
+
+
+int dirty_init(dirty_t* handle) {
+    dirty_item_t* dt;
+
+    if (handle == NULL) {
+        return -1;
+    }
+    dt = calloc(1, sizeof(dirty_item_t));
+    if (dt == NULL) {
+        return -2;
+    }
+    if (pthread_mutex_init(&dt->mutex, NULL) != 0) {
+        free(dt);
+        return -3;
+    }
+    *handle = dt;
+    return 0;
+}
+
+
+void dirty_deinit(dirty_t handle) {
+    dirty_item_t* dt = handle;
+
+    if (dt != NULL) {
+        sub_clearall(dt);
+        pthread_mutex_destroy(&dt->mutex);
+        free(dt->basepath);
+        free(dt);
+    }
+}
+
+
+void dirty_mark(dirty_t handle, uint64_t uid, uint8_t block, uint8_t file) {
+    dirty_item_t* dt = handle;
+    dirty_dev_t* dev;
+
+    if (dt == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    dev = sub_find(dt, uid, true);
+    if (dev != NULL) {
+        if ((block >= 1) && (block <= DIRTY_BLOCKS)) {
+            dev->bits[block-1][file/32] |= (uint32_t)1 << (file%32);
+        }
+        else {
+            dev->whole = true;
+        }
+    }
+    pthread_mutex_unlock(&dt->mutex);
+}
+
+
+void dirty_markdev(dirty_t handle, uint64_t uid) {
+    dirty_item_t* dt = handle;
+    dirty_dev_t* dev;
+
+    if (dt == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    dev = sub_find(dt, uid, true);
+    if (dev != NULL) {
+        dev->whole = true;
+    }
+    pthread_mutex_unlock(&dt->mutex);
+}
+
+
+bool dirty_test(dirty_t handle, uint64_t uid, uint8_t block, uint8_t file) {
+    dirty_item_t* dt = handle;
+    dirty_dev_t* dev;
+    bool test = false;
+
+    if (dt == NULL) {
+        return true;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    dev = sub_find(dt, uid, false);
+    if (dev != NULL) {
+        test = dev->whole;
+        if ((block >= 1) && (block <= DIRTY_BLOCKS)) {
+            test = test || (dev->bits[block-1][file/32] & ((uint32_t)1 << (file%32)));
+        }
+    }
+    pthread_mutex_unlock(&dt->mutex);
+    return test;
+}
+
+
+bool dirty_testdev(dirty_t handle, uint64_t uid) {
+    dirty_item_t* dt = handle;
+    dirty_dev_t* dev;
+    bool test;
+
+    if (dt == NULL) {
+        return true;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    dev     = sub_find(dt, uid, false);
+    test    = (dev != NULL) && dev->whole;
+    pthread_mutex_unlock(&dt->mutex);
+    return test;
+}
+
+
+int dirty_list(dirty_t handle, TALLOC_CTX* ctx, uint64_t** uids) {
+    dirty_item_t* dt = handle;
+    size_t count = 0;
+
+    if ((dt == NULL) || (uids == NULL)) {
+        return -1;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    *uids = talloc_array(ctx, uint64_t, dt->devices + 1);
+    if (*uids != NULL) {
+        for (size_t i=0; i<DIRTY_BUCKETS; i++) {
+            for (dirty_dev_t* dev=dt->bucket[i]; dev!=NULL; dev=dev->next) {
+                (*uids)[count++] = dev->uid;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dt->mutex);
+
+    return (*uids == NULL) ? -2 : (int)count;
+}
+
+
+void dirty_clear(dirty_t handle, uint64_t uid) {
+    dirty_item_t* dt = handle;
+    dirty_dev_t** link;
+
+    if (dt == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    for (link=&dt->bucket[sub_bucket(uid)]; *link!=NULL; link=&(*link)->next) {
+        if ((*link)->uid == uid) {
+            dirty_dev_t* dev = *link;
+            *link = dev->next;
+            free(dev);
+            dt->devices--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dt->mutex);
+}
+
+
+void dirty_reset(dirty_t handle, const char* basepath) {
+    dirty_item_t* dt = handle;
+
+    if (dt == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    sub_clearall(dt);
+    free(dt->basepath);
+    dt->basepath = (basepath != NULL) ? strdup(basepath) : NULL;
+    pthread_mutex_unlock(&dt->mutex);
+}
+
+
+bool dirty_isbase(dirty_t handle, const char* path) {
+    dirty_item_t* dt = handle;
+    bool test;
+
+    if ((dt == NULL) || (path == NULL)) {
+        return false;
+    }
+    pthread_mutex_lock(&dt->mutex);
+    test = (dt->basepath != NULL) && (strcmp(dt->basepath, path) == 0);
+    pthread_mutex_unlock(&dt->mutex);
+    return test;
+}
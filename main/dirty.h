@@ -0,0 +1,91 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef dirty_h
+#define dirty_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// HB Headers/Libraries
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** Dirty Tracking
+  * -------------------------------------------------------------------------
+  * Records which devices and files have changed since the DB was last saved
+  * to its baseline archive, so that an incremental save only rewrites those.
+  * A device is marked whole when it is created, deleted or loaded, and by
+  * file otherwise.  Marks are safe to make from any thread.
+  */
+
+typedef void* dirty_t;
+
+
+int dirty_init(dirty_t* handle);
+void dirty_deinit(dirty_t handle);
+
+
+/** @brief Marks a file of a device as changed
+  */
+void dirty_mark(dirty_t handle, uint64_t uid, uint8_t block, uint8_t file);
+
+/** @brief Marks a whole device as changed (new, deleted or reloaded)
+  */
+void dirty_markdev(dirty_t handle, uint64_t uid);
+
+
+/** @brief Tests if a file has changed, including by its device being marked whole
+  */
+bool dirty_test(dirty_t handle, uint64_t uid, uint8_t block, uint8_t file);
+
+/** @brief Tests if a whole device has changed
+  */
+bool dirty_testdev(dirty_t handle, uint64_t uid);
+
+
+/** @brief Lists the devices with changes
+  * @param handle   (dirty_t) Dirty tracking handle
+  * @param ctx      (TALLOC_CTX*) Context for the list
+  * @param uids     (uint64_t**) Output list
+  * @retval         Number of devices in the list, or negative on error
+  */
+int dirty_list(dirty_t handle, TALLOC_CTX* ctx, uint64_t** uids);
+
+
+/** @brief Clears the changes of a device, once it has been saved
+  */
+void dirty_clear(dirty_t handle, uint64_t uid);
+
+
+/** @brief Clears all changes and sets the baseline archive
+  * @param handle   (dirty_t) Dirty tracking handle
+  * @param basepath (const char*) Archive that now matches the DB, or NULL
+  *                 if there isn't one (i.e. after open).
+  */
+void dirty_reset(dirty_t handle, const char* basepath);
+
+/** @brief Tests if a path is the baseline archive
+  */
+bool dirty_isbase(dirty_t handle, const char* path);
+
+
+#endif
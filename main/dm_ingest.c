@@ -0,0 +1,433 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "cmds.h"
+#include "dblock.h"
+#include "dm_ingest.h"
+#include "debug.h"
+
+// HB Headers/Libraries
+#include <cJSON.h>
+#include <otfs.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+// ALP record header, and file data template that follows it
+#define INGEST_ALPHDR       4
+#define INGEST_FILEHDR      5
+
+
+typedef struct dm_report {
+    struct dm_report* next;
+    uint64_t    uid;
+    uint8_t     block;
+    uint8_t     file;
+    uint16_t    offset;
+    uint16_t    length;
+    uint8_t     data[];
+} dm_report_t;
+
+
+typedef struct {
+    dterm_handle_t* dth;
+    sp_subscr_t     sub;
+
+    // Pending reports, in arrival order
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    dm_report_t*    head;
+    dm_report_t**   tail;
+    size_t          pending;
+    bool            stop;
+
+    // Applier
+    pthread_t       thread;
+    size_t          stored;
+    size_t          rejected;
+    size_t          unlogged;   // stored, but not in the write-ahead log
+} dm_ingest_item_t;
+
+
+
+
+static bool sub_getuid(cJSON* data, uint64_t* uid) {
+    cJSON* obj = cJSON_GetObjectItemCaseSensitive(data, "uid");
+
+    if (cJSON_IsString(obj) && (obj->valuestring != NULL)) {
+        char* end;
+        *uid = strtoull(obj->valuestring, &end, 16);
+        return (end != obj->valuestring) && (*end == 0);
+    }
+    if (cJSON_IsNumber(obj)) {
+        *uid = (uint64_t)obj->valuedouble;
+        return true;
+    }
+    return false;
+}
+
+
+static int sub_decode(cJSON* data, dm_report_t** list) {
+/// Decodes the file data records of a report into a list of dm_report_t.
+/// Returns the number of records, or negative if the report is invalid.
+    cJSON* obj;
+    uint64_t uid;
+    uint8_t block = VL_ISF_BLOCKID;
+    uint8_t* frame;
+    int framelen;
+    int cursor;
+    int records = 0;
+
+    obj = cJSON_GetObjectItemCaseSensitive(data, "qual");
+    if (cJSON_IsNumber(obj) && (obj->valueint != 0)) {
+        return -1;
+    }
+    if (sub_getuid(data, &uid) == false) {
+        return -2;
+    }
+    obj = cJSON_GetObjectItemCaseSensitive(data, "block");
+    if (cJSON_IsNumber(obj)) {
+        block = (uint8_t)obj->valueint;
+    }
+    obj = cJSON_GetObjectItemCaseSensitive(data, "frame");
+    if (!cJSON_IsString(obj) || (obj->valuestring == NULL)) {
+        return -3;
+    }
+
+    frame = malloc((strlen(obj->valuestring) / 2) + 1);
+    if (frame == NULL) {
+        return -4;
+    }
+    framelen = cmd_hexread(frame, obj->valuestring);
+
+    /// Each ALP record carries one file data template.  Records that don't
+    /// fit the frame end the decoding.
+    for (cursor=0; (cursor+INGEST_ALPHDR+INGEST_FILEHDR) <= framelen; ) {
+        uint8_t* rec = &frame[cursor];
+        uint16_t length;
+        dm_report_t* rpt;
+
+        if ((INGEST_ALPHDR + rec[1]) > (framelen - cursor)) {
+            break;
+        }
+        length = ((uint16_t)rec[7] << 8) | rec[8];
+        if ((INGEST_FILEHDR + length) > rec[1]) {
+            break;
+        }
+
+        rpt = malloc(sizeof(dm_report_t) + length);
+        if (rpt == NULL) {
+            break;
+        }
+        rpt->next   = NULL;
+        rpt->uid    = uid;
+        rpt->block  = block;
+        rpt->file   = rec[4];
+        rpt->offset = ((uint16_t)rec[5] << 8) | rec[6];
+        rpt->length = length;
+        memcpy(rpt->data, &rec[INGEST_ALPHDR+INGEST_FILEHDR], length);
+
+        *list   = rpt;
+        list    = &rpt->next;
+        cursor += INGEST_ALPHDR + rec[1];
+        records++;
+    }
+
+    free(frame);
+    return records;
+}
+
+
+static void sub_report_action(void* arg, int dir, const uint8_t* line, size_t size) {
+/// Runs on the sockpush subscriber thread for each inbound line that didn't
+/// belong to a devmgr transaction.
+    dm_ingest_item_t* ing = arg;
+    dm_report_t* list = NULL;
+    dm_report_t* last;
+    cJSON* resp;
+    cJSON* type;
+    cJSON* data;
+    cJSON* sid;
+    int records;
+
+    resp = cJSON_Parse((const char*)line);
+    if (resp == NULL) {
+        return;
+    }
+
+    type = cJSON_GetObjectItemCaseSensitive(resp, "type");
+    data = cJSON_GetObjectItemCaseSensitive(resp, "data");
+    if (!cJSON_IsString(type) || (strcmp(type->valuestring, "rxstat") != 0) || !cJSON_IsObject(data)) {
+        goto sub_report_action_END;
+    }
+    sid = cJSON_GetObjectItemCaseSensitive(data, "sid");
+    if (cJSON_IsNumber(sid) && (sid->valueint != 0)) {
+        goto sub_report_action_END;
+    }
+
+    records = sub_decode(data, &list);
+    if (records <= 0) {
+        DEBUG_PRINTF("Device report not ingested (%i)\n", records);
+        goto sub_report_action_END;
+    }
+    for (last=list; last->next!=NULL; last=last->next);
+
+    pthread_mutex_lock(&ing->mutex);
+    *ing->tail      = list;
+    ing->tail       = &last->next;
+    ing->pending   += records;
+    if (ing->pending >= OTDB_PARAM_INGEST_BATCH) {
+        pthread_cond_signal(&ing->cond);
+    }
+    pthread_mutex_unlock(&ing->mutex);
+
+    sub_report_action_END:
+    cJSON_Delete(resp);
+}
+
+
+
+
+static int sub_store(dm_report_t* rpt, uint32_t modtime) {
+/// Stores a report into the active device.  The report is patched into the
+/// file in place, whatever its offset, so bytes outside of it are kept, and
+/// the file length only grows to the end of the report.  A gap between the
+/// old length and the report is zeroed.  This is what replay of a WAL_write
+/// record does, so reports are logged as WAL_write with the same modtime.
+    vlFILE* fp;
+    uint8_t* dptr;
+    uint16_t end;
+    int rc = 0;
+
+    fp = vl_open(rpt->block, rpt->file, VL_ACCESS_SU, NULL);
+    if (fp == NULL) {
+        return -1;
+    }
+
+    end = rpt->offset + rpt->length;
+    if ((rpt->offset + rpt->length) > fp->alloc) {
+        rc = -2;
+    }
+    else if ((dptr = vl_memptr(fp)) == NULL) {
+        rc = -3;
+    }
+    else {
+        if (rpt->offset > fp->length) {
+            memset(&dptr[fp->length], 0, rpt->offset - fp->length);
+        }
+        memcpy(&dptr[rpt->offset], rpt->data, rpt->length);
+        if (end > fp->length) {
+            fp->length = end;
+        }
+        vl_setmodtime(fp, (ot_u32)modtime);
+    }
+
+    vl_close(fp);
+    return rc;
+}
+
+
+static void sub_apply(dm_ingest_item_t* ing, dm_report_t* list) {
+/// Stores a batch, taking each device's write lock once for all of its
+/// reports.  Reports for a device are stored in arrival order.  Ingest runs
+/// in the background, so the active device is restored afterwards.
+    dterm_handle_t* dth = ing->dth;
+    dm_report_t* rpt;
+    dblock_ticket_t ticket;
+    uint64_t uid;
+    uint64_t active_uid;
+
+    while (list != NULL) {
+        uid = list->uid;
+        dblock_acquire(dth->dblock, &ticket, DBLOCK_devwrite, uid, &dth->ext->db);
+
+        active_uid = 0;
+        if (dth->ext->db != NULL) {
+            otfs_activeuid(dth->ext->db, (uint8_t*)&active_uid);
+        }
+        if ((dth->ext->db == NULL) || (devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&uid) != 0)) {
+            for (rpt=list; rpt!=NULL; rpt=rpt->next) {
+                ing->rejected += (rpt->uid == uid);
+            }
+        }
+        else {
+            for (rpt=list; rpt!=NULL; rpt=rpt->next) {
+                if (rpt->uid == uid) {
+                    uint32_t modtime = (uint32_t)time(NULL);
+                    if (sub_store(rpt, modtime) == 0) {
+                        wal_rec_t rec = {
+                            .op     = WAL_write,
+                            .uid    = uid,
+                            .modtime = modtime,
+                            .block  = rpt->block,
+                            .file   = rpt->file,
+                            .offset = rpt->offset,
+                        };
+                        ing->unlogged += (cmd_journal(dth, &rec, rpt->data, rpt->length) != 0);
+                        ing->stored++;
+                    }
+                    else {
+                        ing->rejected++;
+                    }
+                }
+            }
+            if ((active_uid != 0) && (active_uid != uid)) {
+                devcache_setfs(dth->ext->devcache, dth->ext->db, NULL, (uint8_t*)&active_uid);
+            }
+        }
+
+        dblock_release(dth->dblock, &ticket);
+
+        // Free the reports of this device
+        for (dm_report_t** link=&list; *link!=NULL; ) {
+            rpt = *link;
+            if (rpt->uid == uid) {
+                *link = rpt->next;
+                free(rpt);
+            }
+            else {
+                link = &rpt->next;
+            }
+        }
+    }
+}
+
+
+static void* sub_applier(void* args) {
+/// Flushes pending reports when a batch is full, or once they have been
+/// waiting OTDB_PARAM_INGEST_FLUSH ms.
+    dm_ingest_item_t* ing = args;
+    dm_report_t* list;
+    struct timespec ts;
+    bool stop;
+
+    while (1) {
+        pthread_mutex_lock(&ing->mutex);
+        while (!ing->stop && (ing->pending == 0)) {
+            pthread_cond_wait(&ing->cond, &ing->mutex);
+        }
+        if (!ing->stop && (ing->pending < OTDB_PARAM_INGEST_BATCH)) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += (OTDB_PARAM_INGEST_FLUSH % 1000) * 1000000;
+            ts.tv_sec  += (OTDB_PARAM_INGEST_FLUSH / 1000) + (ts.tv_nsec / 1000000000);
+            ts.tv_nsec %= 1000000000;
+            while (!ing->stop && (ing->pending < OTDB_PARAM_INGEST_BATCH)) {
+                if (pthread_cond_timedwait(&ing->cond, &ing->mutex, &ts) != 0) {
+                    break;
+                }
+            }
+        }
+        list            = ing->head;
+        ing->head       = NULL;
+        ing->tail       = &ing->head;
+        ing->pending    = 0;
+        stop            = ing->stop;
+        pthread_mutex_unlock(&ing->mutex);
+
+        sub_apply(ing, list);
+        DEBUG_PRINTF("Device reports: %zu stored, %zu rejected, %zu not logged\n", ing->stored, ing->rejected, ing->unlogged);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+
+int dm_ingest_open(dm_ingest_t* handle, dterm_handle_t* dth, sp_handle_t sp) {
+    dm_ingest_item_t* ing;
+    int rc;
+
+    if ((handle == NULL) || (dth == NULL) || (sp == NULL)) {
+        return -1;
+    }
+
+    ing = calloc(1, sizeof(dm_ingest_item_t));
+    if (ing == NULL) {
+        return -2;
+    }
+    ing->dth    = dth;
+    ing->tail   = &ing->head;
+
+    if (pthread_mutex_init(&ing->mutex, NULL) != 0) {
+        rc = -3;
+        goto dm_ingest_open_ERR;
+    }
+    if (pthread_cond_init(&ing->cond, NULL) != 0) {
+        rc = -4;
+        goto dm_ingest_open_ERR;
+    }
+    if (pthread_create(&ing->thread, NULL, &sub_applier, ing) != 0) {
+        rc = -5;
+        goto dm_ingest_open_ERR;
+    }
+    ing->sub = sp_subscribe(sp, &sub_report_action, ing, SP_SUB_INBOUND, 0);
+    if (ing->sub == NULL) {
+        rc = -6;
+        goto dm_ingest_open_ERR;
+    }
+
+    *handle = ing;
+    return 0;
+
+    dm_ingest_open_ERR:
+    switch (rc) {
+        case -6: pthread_mutex_lock(&ing->mutex);
+                 ing->stop = true;
+                 pthread_cond_signal(&ing->cond);
+                 pthread_mutex_unlock(&ing->mutex);
+                 pthread_join(ing->thread, NULL);
+        case -5: pthread_cond_destroy(&ing->cond);
+        case -4: pthread_mutex_destroy(&ing->mutex);
+        case -3: free(ing);
+        default: break;
+    }
+
+    return rc;
+}
+
+
+void dm_ingest_close(dm_ingest_t handle) {
+    dm_ingest_item_t* ing = handle;
+
+    if (ing == NULL) {
+        return;
+    }
+
+    // Queued lines are decoded before the subscriber stops, and the applier
+    // stores all pending reports before it stops.
+    sp_unsubscribe(ing->sub);
+
+    pthread_mutex_lock(&ing->mutex);
+    ing->stop = true;
+    pthread_cond_signal(&ing->cond);
+    pthread_mutex_unlock(&ing->mutex);
+    pthread_join(ing->thread, NULL);
+
+    pthread_cond_destroy(&ing->cond);
+    pthread_mutex_destroy(&ing->mutex);
+    free(ing);
+}
@@ -0,0 +1,68 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef dm_ingest_h
+#define dm_ingest_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Local Headers
+#include "dterm.h"
+#include "sockpush.h"
+
+// Standard C & POSIX Libraries
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** Device Report Ingest
+  * -------------------------------------------------------------------------
+  * Devices may send file data to devmgr without being asked (i.e. sensor and
+  * alarm reports).  devmgr forwards these as rxstat lines that don't belong
+  * to any transaction:
+  *
+  * {"type":"rxstat", "data":{"uid":"(HEX STRING)", "qual":0, "frame":"(HEX)"}}
+  *
+  * The frame contains ALP records with file data, the same as the response
+  * to a devmgr "file r" command: [flags][len][id][cmd] [file][offset][length]
+  * [data...], with big-endian 16 bit offset and length.  An optional "block"
+  * field gives the file block (default ISF).  Lines with a non-zero sid are
+  * late transaction responses, and they are ignored.
+  *
+  * Reports are decoded on a sockpush subscriber thread and stored into the
+  * DB in batches, by an applier thread that takes the write lock of each
+  * device once per batch.
+  */
+
+typedef void* dm_ingest_t;
+
+
+/** @brief Starts ingesting device reports from the devmgr socket
+  * @param handle   (dm_ingest_t*) Output handle
+  * @param dth      (dterm_handle_t*) DTerm handle, for the DB and its locks
+  * @param sp       (sp_handle_t) devmgr sockpush handle
+  * @retval         0 on success, negative on error
+  */
+int dm_ingest_open(dm_ingest_t* handle, dterm_handle_t* dth, sp_handle_t sp);
+
+
+/** @brief Stops ingest, after storing reports already received
+  */
+void dm_ingest_close(dm_ingest_t handle);
+
+
+#endif
@@ -0,0 +1,522 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+/// Responses from devmgr are JSON lines:
+///
+/// 1. ack: {"type":"ack", "data":{"cmd":"(STRING)", "err":0, "sid":(INT)}}
+///    - If err is non-zero, there was a problem with the command
+///    - If sid is zero, this command doesn't have a packet, and thus the
+///      transaction is complete.
+///
+/// 2. rxstat: {"type":"rxstat", "data":{"sid":(INT), "qual":(INT), "frame":(STRING)}}
+///    - If qual is non-zero, the frame is corrupted: retry.
+///    - If the frame is somehow invalid: retry.
+///    - If the frame is valid, the transaction is complete.
+
+// Local Headers
+#include "dm_mux.h"
+#include "debug.h"
+
+// HB Headers/Libraries
+#include <cJSON.h>
+
+// Standard C & POSIX Libraries
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define DM_MUX_SIDBUCKETS   64
+
+
+/// A send of a transaction.  A transaction that is retried before its ack has
+/// more than one send, and the ack of any of them is the ack of the
+/// transaction.  Sends outlive their transaction, so that a late ack is still
+/// matched to the send it answers, instead of to a newer transaction for the
+/// same command.
+typedef struct dm_send {
+    struct dm_send* next;
+    dm_txn_t*       txn;
+    struct timespec expire;
+    char            cmdname[16];
+} dm_send_t;
+
+typedef struct {
+    sp_handle_t     sp;
+    pthread_mutex_t mutex;
+
+    // Sends waiting for ack, in send order
+    dm_send_t*      ackq;
+
+    // Transactions waiting for rxstat, by sid
+    dm_txn_t*       sidtab[DM_MUX_SIDBUCKETS];
+} dm_mux_item_t;
+
+
+
+
+static cJSON* sub_json_gettype(cJSON* top, const char* typename) {
+    top = cJSON_GetObjectItemCaseSensitive(top, "type");
+    if (cJSON_IsString(top)) {
+        if (strcmp(top->valuestring, typename) == 0) {
+            return top;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int sub_json_getack(cJSON* top, uint32_t* sid, const char** cmdname) {
+    uint32_t sidval = 0;
+    int errval = -1;
+
+    cJSON* obj;
+
+    top = cJSON_GetObjectItemCaseSensitive(top, "data");
+    if (cJSON_IsObject(top)) {
+        obj = cJSON_GetObjectItemCaseSensitive(top, "err");
+        if (cJSON_IsNumber(obj)) {
+            errval = obj->valueint;
+
+            if (sid != NULL) {
+                obj = cJSON_GetObjectItemCaseSensitive(top, "sid");
+                if (cJSON_IsNumber(obj)) {
+                    sidval = obj->valueint;
+                }
+                *sid = sidval;
+            }
+        }
+        if (cmdname != NULL) {
+            obj = cJSON_GetObjectItemCaseSensitive(top, "cmd");
+            *cmdname = cJSON_IsString(obj) ? obj->valuestring : NULL;
+        }
+    }
+
+    return errval;
+}
+
+
+static int sub_json_getframe(cJSON* top, cJSON** frame, int* qualtest) {
+    int sid = -1;
+
+    cJSON* obj;
+
+    top = cJSON_GetObjectItemCaseSensitive(top, "data");
+    if (cJSON_IsObject(top)) {
+        obj = cJSON_GetObjectItemCaseSensitive(top, "sid");
+        if (cJSON_IsNumber(obj)) {
+            sid = obj->valueint;
+
+            if (qualtest != NULL) {
+                obj = cJSON_GetObjectItemCaseSensitive(top, "qual");
+                if (cJSON_IsNumber(obj)) {
+                    *qualtest = obj->valueint;
+                }
+            }
+            if (frame != NULL) {
+                *frame = cJSON_GetObjectItemCaseSensitive(top, "frame");
+            }
+        }
+    }
+
+    return sid;
+}
+
+
+
+
+static void sub_deadline(struct timespec* ts, int timeout_ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec  += timeout_ms / 1000;
+    ts->tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_nsec -= 1000000000;
+        ts->tv_sec  += 1;
+    }
+}
+
+
+static bool sub_isafter(const struct timespec* a, const struct timespec* b) {
+    return (a->tv_sec > b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec >= b->tv_nsec));
+}
+
+
+
+
+static void sub_unlink(dm_mux_item_t* mux, dm_txn_t* txn) {
+/// Removes txn from the sid table, if it is in it.
+    dm_txn_t** link;
+
+    if (txn->state == DM_TXN_rxstat) {
+        for (link=&mux->sidtab[txn->sid % DM_MUX_SIDBUCKETS]; *link!=NULL; link=&(*link)->next) {
+            if (*link == txn) {
+                *link = txn->next;
+                break;
+            }
+        }
+    }
+    txn->next = NULL;
+}
+
+
+static void sub_link(dm_mux_item_t* mux, dm_txn_t* txn, dm_txnstate_t state) {
+/// Puts txn into a new state, and into the sid table if it waits for rxstat.
+    dm_txn_t** link;
+
+    txn->state  = state;
+    txn->next   = NULL;
+    if (state == DM_TXN_rxstat) {
+        for (link=&mux->sidtab[txn->sid % DM_MUX_SIDBUCKETS]; *link!=NULL; link=&(*link)->next);
+        *link = txn;
+    }
+}
+
+
+static void sub_orphan(dm_mux_item_t* mux, dm_txn_t* txn) {
+/// Sends of txn that are still waiting for ack no longer have a transaction.
+/// Their acks are dropped when they arrive.
+    dm_send_t* send;
+
+    for (send=mux->ackq; send!=NULL; send=send->next) {
+        if (send->txn == txn) {
+            send->txn = NULL;
+        }
+    }
+}
+
+
+static void sub_complete(dm_mux_item_t* mux, dm_txn_t* txn, int rc) {
+    sub_orphan(mux, txn);
+    txn->state  = DM_TXN_done;
+    txn->rc     = rc;
+    pthread_cond_signal(&txn->cond);
+}
+
+
+static bool sub_take_ack(dm_mux_item_t* mux, const char* cmdname, dm_txn_t** txn) {
+/// Takes the oldest send of the command, or just the oldest one if the ack
+/// doesn't say which command it is for.  Sends without a transaction whose
+/// ack is overdue are presumed lost, and dropped, so they can't take the ack
+/// of a newer send.
+    dm_send_t** link;
+    dm_send_t*  send;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (link=&mux->ackq; (send=*link)!=NULL; ) {
+        if ((send->txn == NULL) && sub_isafter(&now, &send->expire)) {
+            *link = send->next;
+            free(send);
+            continue;
+        }
+        if ((cmdname == NULL) || (strncmp(send->cmdname, cmdname, sizeof(send->cmdname)-1) == 0)) {
+            *link   = send->next;
+            *txn    = send->txn;
+            free(send);
+            return true;
+        }
+        link = &send->next;
+    }
+
+    *txn = NULL;
+    return false;
+}
+
+
+static dm_txn_t* sub_take_sid(dm_mux_item_t* mux, uint32_t sid) {
+    dm_txn_t* txn;
+
+    for (txn=mux->sidtab[sid % DM_MUX_SIDBUCKETS]; txn!=NULL; txn=txn->next) {
+        if (txn->sid == sid) {
+            sub_unlink(mux, txn);
+            break;
+        }
+    }
+    return txn;
+}
+
+
+static bool sub_route(void* arg, const uint8_t* line, size_t size) {
+/// Runs on the sockpush I/O thread for each inbound line.  Returns true if
+/// the line belonged to a transaction.
+    dm_mux_item_t* mux = arg;
+    dm_txn_t* txn = NULL;
+    bool matched = false;
+    cJSON* resp;
+
+    resp = cJSON_Parse((const char*)line);
+    if (resp == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+
+    if (sub_json_gettype(resp, "ack") != NULL) {
+        const char* cmdname = NULL;
+        uint32_t sid = 0;
+        int cmd_err;
+
+        cmd_err = sub_json_getack(resp, &sid, &cmdname);
+        matched = sub_take_ack(mux, cmdname, &txn);
+
+        /// The first ack of a transaction binds it to the sid of the ack.
+        /// Acks of its other sends, or of a transaction that is over, are
+        /// dropped: their rxstats have no transaction, and go on to the
+        /// readers.
+        if ((txn != NULL) && ((txn->state == DM_TXN_ack) || (txn->state == DM_TXN_retry))) {
+            if (cmd_err != 0) {
+                ///@todo better error reporting
+                sub_complete(mux, txn, -256 - abs(cmd_err));
+            }
+            else if (sid == 0) {
+                sub_complete(mux, txn, 0);
+            }
+            else {
+                txn->sid = sid;
+                sub_link(mux, txn, DM_TXN_rxstat);
+            }
+        }
+    }
+    else if (sub_json_gettype(resp, "rxstat") != NULL) {
+        cJSON* frame = NULL;
+        int qualtest = 0;
+        int sid;
+
+        sid = sub_json_getframe(resp, &frame, &qualtest);
+        txn = (sid >= 0) ? sub_take_sid(mux, (uint32_t)sid) : NULL;
+        if (txn != NULL) {
+            matched = true;
+            if ((qualtest == 0) && cJSON_IsString(frame) && (frame->valuestring != NULL)) {
+                int rc = (int)strlen(frame->valuestring);
+                if (rc > (int)txn->dstmax - 1) {
+                    ///@todo dstmax too small, flag error
+                    rc = (int)txn->dstmax - 1;
+                }
+                memcpy(txn->dst, frame->valuestring, rc);
+                txn->dst[rc] = 0;
+                sub_complete(mux, txn, rc);
+            }
+            else {
+                txn->state = DM_TXN_retry;
+                pthread_cond_signal(&txn->cond);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&mux->mutex);
+    cJSON_Delete(resp);
+
+    return matched;
+}
+
+
+static int sub_send(dm_mux_item_t* mux, dm_txn_t* txn) {
+/// The send is queued before it is written, so a fast ack can't be missed.
+/// The mutex is released while writing to the socket.
+    dm_send_t** link;
+    dm_send_t*  send;
+
+    send = malloc(sizeof(dm_send_t));
+    if (send == NULL) {
+        sub_complete(mux, txn, -2);
+        return -2;
+    }
+    send->next  = NULL;
+    send->txn   = txn;
+    sub_deadline(&send->expire, OTDB_PARAM_DEVMGR_TIMEOUT);
+    memcpy(send->cmdname, txn->cmdname, sizeof(send->cmdname));
+
+    sub_link(mux, txn, DM_TXN_ack);
+    for (link=&mux->ackq; *link!=NULL; link=&(*link)->next);
+    *link = send;
+    pthread_mutex_unlock(&mux->mutex);
+
+    DEBUG_PRINTF("Sending %zu bytes to sp_sendcmd():\n%.*s\n", txn->cmdlen, (int)txn->cmdlen, txn->cmd);
+    if (sp_sendcmd(mux->sp, (uint8_t*)txn->cmd, txn->cmdlen) < 0) {
+        pthread_mutex_lock(&mux->mutex);
+        for (link=&mux->ackq; *link!=NULL; link=&(*link)->next) {
+            if (*link == send) {
+                *link = send->next;
+                free(send);
+                break;
+            }
+        }
+        if (txn->state != DM_TXN_done) {
+            sub_unlink(mux, txn);
+            sub_complete(mux, txn, -6);
+        }
+        return -6;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+    return 0;
+}
+
+
+
+
+int dm_mux_open(dm_mux_t* mux, sp_handle_t sp) {
+    dm_mux_item_t* new_mux;
+
+    if ((mux == NULL) || (sp == NULL)) {
+        return -1;
+    }
+
+    new_mux = calloc(1, sizeof(dm_mux_item_t));
+    if (new_mux == NULL) {
+        return -2;
+    }
+    new_mux->sp = sp;
+
+    if (pthread_mutex_init(&new_mux->mutex, NULL) != 0) {
+        free(new_mux);
+        return -3;
+    }
+    if (sp_route(sp, &sub_route, new_mux) != 0) {
+        pthread_mutex_destroy(&new_mux->mutex);
+        free(new_mux);
+        return -4;
+    }
+
+    *mux = new_mux;
+    return 0;
+}
+
+
+void dm_mux_close(dm_mux_t mux) {
+    dm_mux_item_t* dmx = mux;
+
+    if (dmx != NULL) {
+        sp_route(dmx->sp, NULL, NULL);
+        while (dmx->ackq != NULL) {
+            dm_send_t* next = dmx->ackq->next;
+            free(dmx->ackq);
+            dmx->ackq = next;
+        }
+        pthread_mutex_destroy(&dmx->mutex);
+        free(dmx);
+    }
+}
+
+
+int dm_mux_submit(dm_mux_t mux, dm_txn_t* txn, const uint8_t* cmd, size_t cmdlen, uint8_t* dst, size_t dstmax) {
+    dm_mux_item_t* dmx = mux;
+    size_t i;
+    int rc;
+
+    if (txn == NULL) {
+        return -1;
+    }
+
+    txn->next       = NULL;
+    txn->cmd        = cmd;
+    txn->cmdlen     = cmdlen;
+    txn->dst        = dst;
+    txn->dstmax     = dstmax;
+    txn->sid        = 0;
+    txn->rc         = -4;
+    txn->retries    = 0;
+    pthread_cond_init(&txn->cond, NULL);
+
+    // Acks are matched by the command name, which is the first word
+    for (i=0; (cmd!=NULL) && (i<cmdlen) && (i<sizeof(txn->cmdname)-1) && (cmd[i]>' '); i++) {
+        txn->cmdname[i] = (char)cmd[i];
+    }
+    txn->cmdname[i] = 0;
+
+    if ((dmx == NULL) || (cmd == NULL) || (dst == NULL) || (dstmax == 0)) {
+        txn->state  = DM_TXN_done;
+        txn->rc     = -1;
+        return -1;
+    }
+
+    pthread_mutex_lock(&dmx->mutex);
+    rc = sub_send(dmx, txn);
+    pthread_mutex_unlock(&dmx->mutex);
+    return rc;
+}
+
+
+int dm_mux_wait(dm_mux_t mux, dm_txn_t* txn) {
+/// A transaction that isn't acked within OTDB_PARAM_DEVMGR_RETRY ms is sent
+/// again, and so is one whose rxstat frame is bad, until
+/// OTDB_PARAM_DEVMGR_TIMEOUT ms have passed.  An acked transaction is not
+/// sent again on a timer: the device already has the command, and a resend
+/// would only race the rxstat of the first one.
+    dm_mux_item_t* dmx = mux;
+    struct timespec deadline;
+    int rc;
+
+    if (txn == NULL) {
+        return -1;
+    }
+    if (dmx == NULL) {
+        pthread_cond_destroy(&txn->cond);
+        return txn->rc;
+    }
+
+    sub_deadline(&deadline, OTDB_PARAM_DEVMGR_TIMEOUT);
+
+    pthread_mutex_lock(&dmx->mutex);
+    while (txn->state != DM_TXN_done) {
+        struct timespec slice = deadline;
+
+        if (txn->state == DM_TXN_retry) {
+            txn->retries++;
+            if (sub_send(dmx, txn) != 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (txn->state == DM_TXN_ack) {
+            sub_deadline(&slice, OTDB_PARAM_DEVMGR_RETRY);
+            if (sub_isafter(&slice, &deadline)) {
+                slice = deadline;
+            }
+        }
+        rc = pthread_cond_timedwait(&txn->cond, &dmx->mutex, &slice);
+
+        if ((rc == ETIMEDOUT) && (txn->state != DM_TXN_done)) {
+            if (sub_isafter(&slice, &deadline)) {
+                ERR_PRINTF("devmgr transaction timeout (%s, %i retries)\n", txn->cmdname, txn->retries);
+                sub_unlink(dmx, txn);
+                sub_complete(dmx, txn, -4);
+            }
+            else if (txn->state == DM_TXN_ack) {
+                /// The send stays queued, in case its ack is only late
+                txn->state = DM_TXN_retry;
+            }
+        }
+    }
+    rc = txn->rc;
+    pthread_mutex_unlock(&dmx->mutex);
+
+    pthread_cond_destroy(&txn->cond);
+    return rc;
+}
+
+
+int dm_mux_transact(dm_mux_t mux, const uint8_t* cmd, size_t cmdlen, uint8_t* dst, size_t dstmax) {
+    dm_txn_t txn;
+
+    dm_mux_submit(mux, &txn, cmd, cmdlen, dst, dstmax);
+    return dm_mux_wait(mux, &txn);
+}
+
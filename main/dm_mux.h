@@ -0,0 +1,118 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef dm_mux_h
+#define dm_mux_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Local Headers
+#include "sockpush.h"
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** Device Manager Multiplexer
+  * -------------------------------------------------------------------------
+  * Lets many devmgr transactions share the one devmgr socket.  A devmgr
+  * transaction is a command, an ack for the command, and (if the ack has a
+  * non-zero sid) an rxstat with the same sid, which carries the response
+  * from the device.
+  *
+  * Each send of a command waits for its ack in send order, and an ack is
+  * matched to the oldest send with the same command name.  A transaction is
+  * only sent again while it has no ack (or when its rxstat frame is bad).
+  * The first ack of a transaction binds it to the sid of the ack, and it
+  * then waits in a table keyed by sid, so rxstats may arrive in any order.
+  * Acks of its other sends are dropped.  All matching is done on the
+  * sockpush I/O thread, and lines that don't match any transaction go on to
+  * the sockpush readers.
+  */
+
+typedef void* dm_mux_t;
+
+typedef enum {
+    DM_TXN_ack      = 0,
+    DM_TXN_rxstat   = 1,
+    DM_TXN_retry    = 2,
+    DM_TXN_done     = 3
+} dm_txnstate_t;
+
+typedef struct dm_txn {
+    struct dm_txn*  next;
+    dm_txnstate_t   state;
+    const uint8_t*  cmd;
+    size_t          cmdlen;
+    char            cmdname[16];
+    uint8_t*        dst;
+    size_t          dstmax;
+    uint32_t        sid;
+    int             rc;
+    int             retries;
+    pthread_cond_t  cond;
+} dm_txn_t;
+
+
+
+/** @brief Creates a multiplexer on an open sockpush handle
+  * @param mux      (dm_mux_t*) Output handle
+  * @param sp       (sp_handle_t) devmgr sockpush handle
+  * @retval         0 on success, negative on error
+  */
+int dm_mux_open(dm_mux_t* mux, sp_handle_t sp);
+
+void dm_mux_close(dm_mux_t mux);
+
+
+/** @brief Sends a devmgr command as a new transaction
+  * @param mux      (dm_mux_t) Multiplexer handle
+  * @param txn      (dm_txn_t*) Transaction storage, owned by the caller
+  * @param cmd      (const uint8_t*) Command
+  * @param cmdlen   (size_t) Command length
+  * @param dst      (uint8_t*) Buffer for the rxstat frame (a string)
+  * @param dstmax   (size_t) Size of dst
+  * @retval         0 on success, negative on error.
+  *
+  * cmd must remain valid until dm_mux_wait() returns, because it is sent
+  * again if the transaction is retried.  It may share memory with dst: dst
+  * is only written when the transaction completes.
+  */
+int dm_mux_submit(dm_mux_t mux, dm_txn_t* txn, const uint8_t* cmd, size_t cmdlen, uint8_t* dst, size_t dstmax);
+
+
+/** @brief Waits for a submitted transaction to complete
+  * @param mux      (dm_mux_t) Multiplexer handle
+  * @param txn      (dm_txn_t*) Submitted transaction
+  * @retval         Length of the frame written to dst, 0 if the command had
+  *                 no response from the device, or negative on error:
+  *                 -2 out of memory, -4 timeout, -6 write error, -256-N
+  *                 devmgr error N.
+  *
+  * Every submitted transaction must be waited on, even after an error.
+  */
+int dm_mux_wait(dm_mux_t mux, dm_txn_t* txn);
+
+
+/** @brief dm_mux_submit() followed by dm_mux_wait()
+  */
+int dm_mux_transact(dm_mux_t mux, const uint8_t* cmd, size_t cmdlen, uint8_t* dst, size_t dstmax);
+
+
+#endif
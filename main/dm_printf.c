@@ -65,7 +65,9 @@ int dm_printf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, const char* rest
 
 
 
-int dm_xnprintf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, ...) {
+static int sub_vxnformat(uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, va_list vargs) {
+/// Formats an xnode command for the device manager into dst.  Returns the
+/// length of the command, or negative on error.
     static const char* auth_guest = "guest";
     static const char* auth_user = "user";
     static const char* auth_root = "root";
@@ -73,7 +75,6 @@ int dm_xnprintf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, AUTH_level aut
     char* pcurs;
     int psize;
     int plimit;
-    va_list vargs;
     
     switch (auth) {
         case AUTH_root: auth_str = auth_root;   break;
@@ -106,9 +107,7 @@ int dm_xnprintf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, AUTH_level aut
         return -4;      ///@todo codify an error for buffer overflow
     }
     
-    va_start(vargs, fmt);
     psize = vsnprintf(pcurs, plimit, fmt, vargs);
-    va_end(vargs);
     
     plimit -= psize;
     pcurs  += psize;
@@ -128,8 +127,99 @@ int dm_xnprintf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, AUTH_level aut
         return -4;      ///@todo codify an error for buffer overflow
     }
     
-    psize = (int)((uint8_t*)pcurs - dst);
+    return (int)((uint8_t*)pcurs - dst);
+}
+
+
+
+int dm_xnprintf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, ...) {
+    int psize;
+    va_list vargs;
     
+    va_start(vargs, fmt);
+    psize = sub_vxnformat(dst, dstmax, auth, uid, fmt, vargs);
+    va_end(vargs);
+    
+    if (psize < 0) {
+        return psize;
+    }
     return cmd_devmgr(dth, (uint8_t*)dst, &psize, (uint8_t*)dst, dstmax);
 }
 
+
+
+int dm_xnsubmit(dterm_handle_t* dth, dm_txn_t* txn, uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, ...) {
+    int psize;
+    va_list vargs;
+    
+    // A NULL cmd marks a transaction that is already complete
+    txn->cmd = NULL;
+    
+    va_start(vargs, fmt);
+    psize = sub_vxnformat(dst, dstmax, auth, uid, fmt, vargs);
+    va_end(vargs);
+    
+    if (psize < 0) {
+        txn->rc = psize;
+        return psize;
+    }
+    
+    /// The devmgr subprocess is strictly command-response, so it runs the
+    /// transaction right away.
+    if ((dth->ext->devmgr == NULL) || (dth->ext->use_socket == false)) {
+        txn->rc = cmd_devmgr(dth, dst, &psize, dst, dstmax);
+        return (txn->rc < 0) ? txn->rc : 0;
+    }
+    
+    return dm_mux_submit(dth->ext->devmux, txn, dst, (size_t)psize, dst, dstmax);
+}
+
+
+
+int dm_xnwait(dterm_handle_t* dth, dm_txn_t* txn) {
+    int rc;
+    
+    if (txn->cmd == NULL) {
+        return txn->rc;
+    }
+    
+    dblock_yield(dth->dblock, &dth->lock, dth->ext->db);
+    rc = dm_mux_wait(dth->ext->devmux, txn);
+    dblock_resume(dth->dblock, &dth->lock, dth->ext->db);
+    
+    return rc;
+}
+
+
+
+int dm_xnprintf_unlocked(dterm_handle_t* dth, dblock_class_t relock, uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, ...) {
+    bool suspended;
+    int psize;
+    int rc;
+    va_list vargs;
+    
+    /// The command is formatted while the locks are still held, because the
+    /// arguments may refer to DB data.
+    va_start(vargs, fmt);
+    psize = sub_vxnformat(dst, dstmax, auth, uid, fmt, vargs);
+    va_end(vargs);
+    
+    if (psize < 0) {
+        return psize;
+    }
+    
+    /// Commands that aren't device-level can't be suspended.  They keep their
+    /// locks, and cmd_devmgr() only yields the engine.
+    suspended = (dblock_suspend(dth->dblock, &dth->lock) == 0);
+    
+    rc = cmd_devmgr(dth, (uint8_t*)dst, &psize, (uint8_t*)dst, dstmax);
+    
+    if (suspended) {
+        if (dblock_reacquire(dth->dblock, &dth->lock, relock, &dth->ext->db) != 0) {
+            rc = -8;
+        }
+    }
+    
+    return rc;
+}
+
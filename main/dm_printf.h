@@ -16,6 +16,7 @@
 
 // Local Headers
 #include "cmds.h"
+#include "dm_mux.h"
 #include "dterm.h"
 
 // HB Headers/Libraries
@@ -33,3 +34,30 @@ int dm_printf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, const char* rest
 
 int dm_xnprintf(dterm_handle_t* dth, uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, ...);
 
+
+/** @brief Submits a dm_xnprintf() command without waiting for it
+  * @param txn      (dm_txn_t*) Transaction storage, for dm_xnwait()
+  * @retval         0 on success, negative on error
+  *
+  * dst holds the command until the response replaces it, so each pending
+  * transaction needs its own dst.  Every submitted transaction must be
+  * completed with dm_xnwait(), which yields the DB engine while waiting.
+  */
+int dm_xnsubmit(dterm_handle_t* dth, dm_txn_t* txn, uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, ...);
+
+int dm_xnwait(dterm_handle_t* dth, dm_txn_t* txn);
+
+
+/** @brief dm_xnprintf() that releases the DB locks while the device manager
+  *        is working
+  * @param relock   (dblock_class_t) Class of the locks taken again afterwards
+  * @retval         As dm_xnprintf().  -8 if the device was removed while the
+  *                 locks were released.
+  *
+  * The locks of a device-level command are released while it waits for the
+  * device manager, which can take seconds when a device is unreachable.  The
+  * locks are always held again when this returns.  The caller must close any
+  * vlFILE beforehand, and re-open it afterwards, because other commands may
+  * modify the DB in the meantime.
+  */
+int dm_xnprintf_unlocked(dterm_handle_t* dth, dblock_class_t relock, uint8_t* dst, size_t dstmax, AUTH_level auth, uint64_t uid, const char* restrict fmt, ...);
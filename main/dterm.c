@@ -21,6 +21,8 @@
 #include "cmdsearch.h"
 #include "dterm.h"
 #include "debug.h"
+#include "otdb_frame.h"
+#include "ringbuf.h"
 
 // Local Libraries/Headers
 #include <bintex.h>
@@ -49,6 +51,13 @@
 
 #include <ctype.h>
 
+#if defined(__linux__)
+#   include <sys/epoll.h>
+#   define DTERM_USE_EPOLL  1
+#else
+#   define DTERM_USE_EPOLL  0
+#endif
+
 
 #if 0 //OTDB_FEATURE_DEBUG
 #   define PRINTLINE()     fprintf(stderr, "%s %d\n", __FUNCTION__, __LINE__)
@@ -125,24 +134,39 @@ static size_t sub_str_mark(char* str, size_t max) {
 }
 
 
+/// The cJSON and argtable allocator hooks are process-wide, but commands on
+/// different client threads run concurrently.  So the hooks are installed
+/// once, and each thread routes them to its own isolation context.  When a
+/// thread has no isolation context, the standard allocators are used.
+static __thread TALLOC_CTX* iso_ctx = NULL;
+
 static void iso_free(void* ctx) {
-    talloc_free(ctx);
+    if (iso_ctx != NULL)    talloc_free(ctx);
+    else                    free(ctx);
 }
 
-static TALLOC_CTX* iso_ctx;
 static void* iso_malloc(size_t size) {
-    return talloc_size(iso_ctx, size);
+    if (iso_ctx != NULL)    return talloc_size(iso_ctx, size);
+    else                    return malloc(size);
 }
 
-static void cjson_iso_allocators(void) {
+static void iso_allocators_init(void) {
     cJSON_Hooks hooks;
     hooks.free_fn   = &iso_free;
     hooks.malloc_fn = &iso_malloc;
     cJSON_InitHooks(&hooks);
+    arg_set_allocators(&iso_malloc, &iso_free);
 }
 
-static void cjson_std_allocators(void) {
+static void iso_allocators_deinit(void) {
     cJSON_InitHooks(NULL);
+    arg_set_allocators(NULL, NULL);
+}
+
+TALLOC_CTX* dterm_isolate(TALLOC_CTX* ctx) {
+    TALLOC_CTX* prev = iso_ctx;
+    iso_ctx = ctx;
+    return prev;
 }
 
 
@@ -166,6 +190,12 @@ int dterm_init(dterm_handle_t* dth, dterm_ext_t* ext_data, INTF_Type intf) {
     
     dth->ext    = ext_data;
     dth->ch     = NULL;
+    dth->pctx_mutex = NULL;
+    dth->dblock = NULL;
+    dth->out    = NULL;
+    dth->outq   = NULL;
+    dth->rawdata = NULL;
+    dth->rawdata_size = 0;
     dth->intf   = malloc(sizeof(dterm_intf_t));
     if (dth->intf == NULL) {
         rc = -2;
@@ -194,17 +224,28 @@ int dterm_init(dterm_handle_t* dth, dterm_ext_t* ext_data, INTF_Type intf) {
         goto dterm_init_TERM;
     }
     
-    dth->iso_mutex = malloc(sizeof(pthread_mutex_t));
-    if (dth->iso_mutex == NULL) {
+    dth->pctx_mutex = malloc(sizeof(pthread_mutex_t));
+    if (dth->pctx_mutex == NULL) {
         rc = -6;
         goto dterm_init_TERM;
     }
     
-    if (pthread_mutex_init(dth->iso_mutex, NULL) != 0 ) {
+    if (pthread_mutex_init(dth->pctx_mutex, NULL) != 0 ) {
+        free(dth->pctx_mutex);
+        dth->pctx_mutex = NULL;
         rc = -7;
         goto dterm_init_TERM;
     }
     
+    if (dblock_init(&dth->dblock, 0) != 0) {
+        dth->dblock = NULL;
+        rc = -8;
+        goto dterm_init_TERM;
+    }
+    dth->lock.cls = DBLOCK_none;
+    
+    iso_allocators_init();
+    
     /// If sockets are being used, SIGPIPE can cause trouble that we don't
     /// want, and it is safe to ignore.
     if (dth->intf->type == INTF_socket) {
@@ -216,6 +257,11 @@ int dterm_init(dterm_handle_t* dth, dterm_ext_t* ext_data, INTF_Type intf) {
     dterm_init_TERM:
     clithread_deinit(dth->clithread);
     
+    if (dth->pctx_mutex != NULL) {
+        pthread_mutex_destroy(dth->pctx_mutex);
+        free(dth->pctx_mutex);
+    }
+    
     if (dth->intf != NULL) {
         free(dth->intf);
     }
@@ -249,15 +295,19 @@ void dterm_deinit(dterm_handle_t* dth) {
         // Cannot use cJSON_Delete() here because the tmpl is stored as a
         // contiguous block.
         talloc_free(dth->ext->tmpl);
+        talloc_free(dth->ext->schema);
     }
     // -----------------------------------------------------------------------
 
     clithread_deinit(dth->clithread);
     
-    if (dth->iso_mutex != NULL) {
-        pthread_mutex_unlock(dth->iso_mutex);
-        pthread_mutex_destroy(dth->iso_mutex);
-        free(dth->iso_mutex);
+    dblock_deinit(dth->dblock);
+    iso_allocators_deinit();
+    
+    if (dth->pctx_mutex != NULL) {
+        pthread_mutex_unlock(dth->pctx_mutex);
+        pthread_mutex_destroy(dth->pctx_mutex);
+        free(dth->pctx_mutex);
     }
 }
 
@@ -311,7 +361,6 @@ dterm_thread_t dterm_open(dterm_handle_t* dth, const char* path) {
     
     else if ((dth->intf->type == INTF_socket) && (path != NULL)) {
         /// Socket mode opens a listening socket
-        ///@todo have listening queue size be dynamic
         struct sockaddr_un addr;
         
         dth->fd.in = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -335,7 +384,7 @@ dterm_thread_t dterm_open(dterm_handle_t* dth, const char* path) {
         }
         VERBOSE_PRINTF("Binding Socket fd=%i to %s\n", dth->fd.in, path);
         
-        if (listen(dth->fd.in, 5) == -1) {
+        if (listen(dth->fd.in, cliopt_getbacklog()) == -1) {
             perror("Unable to enter listen on server socket");
             goto dterm_open_END;
         }
@@ -387,24 +436,172 @@ int dterm_close(dterm_handle_t* dth) {
   */
 
 
+static void sub_cmd_lock(dterm_handle_t* dth, dblock_class_t lockcls, uint64_t devid) {
+/// Takes the DB locks of a class.  Commands that need the whole DB may also
+/// allocate on the process context.
+    dblock_acquire(dth->dblock, &dth->lock, lockcls, devid, &dth->ext->db);
+    if (lockcls == DBLOCK_dbwrite) {
+        pthread_mutex_lock(dth->pctx_mutex);
+    }
+}
+
+
+static void sub_cmd_unlock(dterm_handle_t* dth) {
+    if (dth->lock.cls == DBLOCK_dbwrite) {
+        pthread_mutex_unlock(dth->pctx_mutex);
+    }
+    dblock_release(dth->dblock, &dth->lock);
+}
+
+
+static int sub_cmd_run(dterm_handle_t* dth, const cmdtab_item_t* cmdptr, uint8_t* dst, int* inbytes, char* args, size_t dstmax) {
+/// Runs a command within the DB locks required by its class.  If the handle
+/// already holds locks, the command is part of a batch that was locked as a
+/// whole (see sub_proc_socketinput()), and it runs within them.
+    uint64_t devid = 0;
+    bool own_lock;
+    int rc;
+    
+    own_lock = (dth->lock.cls == DBLOCK_none);
+    if (own_lock) {
+        cmd_getdevid(&devid, args, (size_t)*inbytes);
+        sub_cmd_lock(dth, cmd_lockclass(cmdptr), devid);
+    }
+    else {
+        /// A command earlier in the batch may have yielded the engine
+        dblock_resume(dth->dblock, &dth->lock, dth->ext->db);
+    }
+    
+    rc = cmd_run(cmdptr, dth, dst, inbytes, (uint8_t*)args, dstmax);
+    
+    if (own_lock) {
+        sub_cmd_unlock(dth);
+    }
+    
+    return rc;
+}
+
+
+struct dterm_outq {
+    TALLOC_CTX* ctx;
+    int         count;
+    dtwriter_t* out[OTDB_PARAM_BATCH_MAX];
+};
+
+
+static dtwriter_t* sub_response_new(dterm_handle_t* dth) {
+/// A response in a batch outlives its command, because it is flushed after
+/// the batch.
+    TALLOC_CTX* ctx = (dth->outq != NULL) ? dth->outq->ctx : dth->tctx;
+    return dtwriter_new(ctx, dth->fd.out, 0);
+}
+
+
+static int sub_response_send(dterm_handle_t* dth, dtwriter_t* out, bool* queued) {
+/// Flushes a response, or queues it if it is part of a batch.  A batch holds
+/// its locks until all of its commands have run, and a flush can block on
+/// the client.
+    int rc;
+    
+    *queued = false;
+    if (dth->outq != NULL) {
+        dth->outq->out[dth->outq->count++] = out;
+        *queued = true;
+        return (int)dtwriter_total(out);
+    }
+    rc = dtwriter_flush(out);
+    return (rc < 0) ? -1 : rc;
+}
+
+
+static int sub_drain(dterm_handle_t* dth) {
+/// Flushes the responses of a batch, and the response of the running command,
+/// once the connection buffers OTDB_PARAM_OUTQUEUE_MAX bytes of them.  The
+/// locks of the command are released while the client takes the output.  If
+/// they can't be, the output stays buffered.
+    bool suspended = false;
+    size_t held = 0;
+    int rc = 0;
+
+    if (dth->outq != NULL) {
+        for (int k=0; k<dth->outq->count; k++) {
+            held += dtwriter_held(dth->outq->out[k]);
+        }
+    }
+    if ((dth->out != NULL) && (dth->out->pinned == false)) {
+        held += dtwriter_held(dth->out);
+    }
+    if (held < OTDB_PARAM_OUTQUEUE_MAX) {
+        return 0;
+    }
+
+    if ((dth->dblock != NULL) && (dth->lock.cls != DBLOCK_none)) {
+        if (dblock_suspend(dth->dblock, &dth->lock) != 0) {
+            return 0;
+        }
+        suspended = true;
+    }
+
+    if (dth->outq != NULL) {
+        for (int k=0; (rc==0) && (k<dth->outq->count); k++) {
+            rc = (dtwriter_flush(dth->outq->out[k]) < 0) ? -1 : 0;
+        }
+    }
+    if ((rc == 0) && (dth->out != NULL) && (dth->out->pinned == false)) {
+        rc = (dtwriter_flush(dth->out) < 0) ? -1 : 0;
+    }
+
+    /// The device of a device-level command may be gone.  Its locks are held
+    /// again anyway, and the command finds that out when it looks it up.
+    if (suspended) {
+        dblock_reacquire(dth->dblock, &dth->lock, dth->lock.cls, &dth->ext->db);
+    }
+    return (rc < 0) ? rc : 1;
+}
+
+
+int dterm_drain(dterm_handle_t* dth, uint8_t** cursor, size_t* avail) {
+    int rc;
+
+    if (dth->out == NULL) {
+        return 0;
+    }
+    *cursor = dtwriter_advance(dth->out, *cursor, avail, 0);
+    if (*cursor == NULL) {
+        return -1;
+    }
+    rc      = sub_drain(dth);
+    *cursor = dtwriter_cursor(dth->out, avail);
+    return rc;
+}
+
+
 static int sub_proc_lineinput(dterm_handle_t* dth, int* cmdrc, char* loadbuf, int linelen, const char* termstring) {
-    uint8_t     protocol_buf[1024];
     char        cmdname[32];
     int         cmdlen;
     cJSON*      cmdobj;
-    uint8_t*    cursor  = protocol_buf;
-    int         bufmax  = sizeof(protocol_buf);
+    dtwriter_t* out;
+    uint8_t*    cursor;
+    size_t      bufmax;
+    size_t      hdrbytes = 0;
     int         bytesout = 0;
+    bool        queued = false;
     const cmdtab_item_t* cmdptr;
     
     DEBUG_PRINTF("raw input (%i bytes) %.*s\n", linelen, linelen, loadbuf);
 
-    // Isolation memory context
+    // Isolation memory context for cJSON, argtable
     iso_ctx = dth->tctx;
-
-    // Set allocators for cJSON, argtable
-    cjson_iso_allocators();
-    arg_set_allocators(&iso_malloc, &iso_free);
+    
+    // The response is formatted into a writer, which grows up to a limit and
+    // is queued beyond it.
+    out = sub_response_new(dth);
+    if (out == NULL) {
+        iso_ctx = NULL;
+        return -1;
+    }
+    dth->out    = out;
+    cursor      = dtwriter_cursor(out, &bufmax);
 
     ///@todo set context for other data systems
 
@@ -423,8 +620,12 @@ static int sub_proc_lineinput(dterm_handle_t* dth, int* cmdrc, char* loadbuf, in
             VCLIENT_PRINTF("JSON Request (%i bytes): %.*s\n", linelen, linelen, loadbuf);
             loadbuf = dataobj->valuestring;
             hdr_sz  = snprintf((char*)cursor, bufmax-1, "{\"type\":\"%s\", \"data\":", typeobj->valuestring);
-            cursor += hdr_sz;
-            bufmax -= hdr_sz;
+            if ((hdr_sz < 0) || (hdr_sz >= (int)bufmax-1)) {
+                goto sub_proc_lineinput_FREE;
+            }
+            cursor  += hdr_sz;
+            bufmax  -= hdr_sz;
+            hdrbytes = (size_t)hdr_sz;
         }
         else {
             goto sub_proc_lineinput_FREE;
@@ -438,71 +639,91 @@ static int sub_proc_lineinput(dterm_handle_t* dth, int* cmdrc, char* loadbuf, in
     if (cmdptr == NULL) {
         ///@todo build a nicer way to show where the error is,
         ///      possibly by using pi or ci (sign reversing)
+        cursor = dtwriter_cursor(out, &bufmax);
         if (linelen > 0) {
-            bytesout = snprintf((char*)protocol_buf, sizeof(protocol_buf)-1,
+            cursor += snprintf((char*)cursor, bufmax-1,
                         "{\"cmd\":\"%s\", \"err\":1, \"desc\":\"command not found\"}%s",
                         cmdname, termstring);
-            //dterm_puts(&dth->fd, (char*)protocol_buf);
         }
     }
     else {
         int bytesin = linelen - cmdlen;
+        
+        /// Commit the JSON header, so the command's output always starts at
+        /// the writer cursor, and give the command a reasonable start buffer.
+        cursor = dtwriter_advance(out, cursor, &bufmax, OTDB_PARAM_OUTBUF_CHUNK);
+        if (cursor == NULL) {
+            bytesout = -1;
+            goto sub_proc_lineinput_FREE;
+        }
 
         ///@todo segmentation fault within cmd_run() for command:
         /// open -j /opt/otdb/examples/csip
         /// Could this be due to permissions problem?
-        bytesout = cmd_run(cmdptr, dth, cursor, &bytesin, (uint8_t*)(loadbuf+cmdlen), bufmax);
+        /// The return value is the number of output bytes still pending at
+        /// the writer cursor.  Streaming commands commit the rest themselves.
+        bytesout = sub_cmd_run(dth, cmdptr, cursor, &bytesin, loadbuf+cmdlen, bufmax);
+        
         if (cmdrc != NULL) {
             *cmdrc = bytesout;
         }
 
         ///@todo spruce-up the command error reporting, maybe even with
         ///      a cursor showing where the first error was found.
+        /// If part of a streamed response is already out, the error object
+        /// follows it.
         if (bytesout < 0) {
-            bytesout = snprintf((char*)protocol_buf, sizeof(protocol_buf)-1, 
+            dtwriter_discard(out);
+            cursor  = dtwriter_cursor(out, &bufmax);
+            cursor += snprintf((char*)cursor, bufmax-1, 
                         "{\"cmd\":\"%s\", \"err\":%d, \"desc\":\"command execution error\"}%s",
                         cmdname, bytesout, termstring);
-            //dterm_puts(&dth->fd, (char*)protocol_buf);
         }
 
         // If there are bytes to send to interface, do that.
-        // If bytesout == 0, there is no error, but also nothing to send.
-        else if (bytesout > 0) {
-            cursor += bytesout;
-            bufmax -= bytesout;
+        // If the command output nothing, there is no error, but also nothing
+        // to send, not even the JSON header.
+        else if ((dtwriter_total(out) + bytesout) > hdrbytes) {
+            cursor  = dtwriter_cursor(out, NULL) + bytesout;
+            cursor  = dtwriter_advance(out, cursor, &bufmax, strlen(termstring)+2);
+            if (cursor == NULL) {
+                bytesout = -1;
+                goto sub_proc_lineinput_FREE;
+            }
             if (cJSON_IsObject(cmdobj)) {
-                VCLIENT_PRINTF("JSON Response (%i bytes): %.*s\n", bytesout, bytesout, (char*)cursor);
+                VCLIENT_PRINTF("JSON Response (%zu bytes)\n", dtwriter_total(out)-hdrbytes);
                 cursor += snprintf((char*)cursor, bufmax, "}%s", termstring);
             }
             else {
                 cursor += snprintf((char*)cursor, bufmax, "%s", termstring);
             }
-            bytesout = (int)(cursor - protocol_buf);
-            
-            DEBUG_PRINTF("raw output (%i bytes) %.*s\n", bytesout, bytesout, protocol_buf);
-        }
-    }
-    
-    /// If there are bytes to send back to the client, we can be extra safe
-    /// by checking that the fd is still available (that client didn't die)
-    /// If the file is down, we send an error to the caller so it can drop
-    /// the client.
-    if (bytesout > 0) {
-        if ((fcntl(dth->fd.out, F_GETFD) != -1) || (errno != EBADF)) {
-            write(dth->fd.out, (char*)protocol_buf, bytesout);
+            DEBUG_PRINTF("raw output (%zu bytes)\n", dtwriter_total(out) + (cursor - dtwriter_cursor(out, NULL)));
         }
         else {
-            perror("could not write back to client");
-            bytesout = -1;
+            dtwriter_discard(out);
+            cursor = dtwriter_cursor(out, NULL);
         }
     }
+    
+    /// Send the rest of the response to the client.  If the client died,
+    /// an error goes to the caller so it can drop the client.
+    if (dtwriter_advance(out, cursor, &bufmax, 0) == NULL) {
+        bytesout = -1;
+    }
+    else {
+        bytesout = sub_response_send(dth, out, &queued);
+    }
 
     sub_proc_lineinput_FREE:
     cJSON_Delete(cmdobj);
+    
+    dth->out = NULL;
+    if (!queued) {
+        dtwriter_free(out);
+    }
 
     // Return cJSON and argtable to generic context allocators
-    cjson_std_allocators();
-    arg_set_allocators(NULL, NULL);
+    iso_ctx = NULL;
 
     return bytesout;
 }
@@ -513,6 +734,564 @@ static int sub_proc_lineinput(dterm_handle_t* dth, int* cmdrc, char* loadbuf, in
 
 
 
+/** Binary Frame Input <BR>
+  * ========================================================================<BR>
+  * Socket clients may send binary frames (see otdb_frame.h) between text
+  * lines.  Frame commands are run like their text counterparts, without
+  * JSON output, and the raw command output becomes the response payload.
+  */
+
+static const char* const frame_cmdname[OTDB_FRAME_MAX] = {
+    NULL,       // OTDB_FRAME_hello is handled internally
+    "r",
+    "r*",
+    "rh",
+    "w",
+    "pub"
+};
+
+
+static int sub_proc_frame(dterm_handle_t* dth, const otdb_frame_t* req, uint8_t* payload) {
+    otdb_frame_t resp;
+    dtwriter_t* out;
+    uint8_t* cursor;
+    size_t bufmax;
+    bool queued = false;
+    int rc;
+    
+    // Isolation memory context for cJSON, argtable
+    iso_ctx = dth->tctx;
+    
+    out = sub_response_new(dth);
+    if (out == NULL) {
+        iso_ctx = NULL;
+        return -1;
+    }
+    dth->out = out;
+    
+    // Space for the response header is committed first, and it is filled-in
+    // when the payload length is known, so the response can't be drained.
+    out->pinned = true;
+    cursor  = dtwriter_cursor(out, &bufmax);
+    cursor  = dtwriter_advance(out, cursor+OTDB_FRAME_HDRSIZE, &bufmax, OTDB_PARAM_OUTBUF_CHUNK);
+    if (cursor == NULL) {
+        rc = -1;
+        goto sub_proc_frame_FREE;
+    }
+    
+    if (req->cmd == OTDB_FRAME_hello) {
+        cursor[0]   = OTDB_FRAME_VERSION;
+        rc          = 1;
+    }
+    else {
+        const cmdtab_item_t* cmdptr = NULL;
+        int argslen;
+        
+        if (req->cmd < OTDB_FRAME_MAX) {
+            cmdptr = cmd_search(dth->ext->cmdtab, (char*)frame_cmdname[req->cmd]);
+        }
+        if (cmdptr == NULL) {
+            rc = -1;
+            goto sub_proc_frame_RESPOND;
+        }
+        
+        /// Arguments are text, and w/pub may have raw data after them.
+        argslen = (int)strnlen((const char*)payload, req->length);
+        if (argslen < (int)req->length) {
+            dth->rawdata        = payload + argslen + 1;
+            dth->rawdata_size   = (int)req->length - (argslen + 1);
+        }
+        VCLIENT_PRINTF("Frame Request %u: cmd=%s, args=%.*s, data=%i bytes\n", 
+                        req->reqid, frame_cmdname[req->cmd], argslen, (char*)payload, dth->rawdata_size);
+        
+        rc = sub_cmd_run(dth, cmdptr, cursor, &argslen, (char*)payload, bufmax);
+        
+        dth->rawdata        = NULL;
+        dth->rawdata_size   = 0;
+    }
+    
+    /// Frame commands don't stream, so the whole response is still in the
+    /// writer and the header can be written in front of it.
+    sub_proc_frame_RESPOND:
+    resp.cmd    = req->cmd;
+    resp.reqid  = req->reqid;
+    if (rc < 0) {
+        resp.status = (int16_t)rc;
+        resp.length = 0;
+        dtwriter_discard(out);
+        cursor = dtwriter_cursor(out, NULL) + OTDB_FRAME_HDRSIZE;
+    }
+    else {
+        resp.status = 0;
+        resp.length = (uint32_t)(dtwriter_total(out) - OTDB_FRAME_HDRSIZE) + (uint32_t)rc;
+        cursor = dtwriter_cursor(out, NULL) + rc;
+    }
+    if ((dtwriter_advance(out, cursor, &bufmax, 0) == NULL) || (dtwriter_total(out) != (resp.length+OTDB_FRAME_HDRSIZE))) {
+        rc = -1;
+        goto sub_proc_frame_FREE;
+    }
+    otdb_frame_pack(dtwriter_head(out), &resp);
+    
+    rc = sub_response_send(dth, out, &queued);
+    
+    sub_proc_frame_FREE:
+    dth->out = NULL;
+    if (!queued) {
+        dtwriter_free(out);
+    }
+    iso_ctx = NULL;
+    return rc;
+}
+
+
+/** Socket Input <BR>
+  * ========================================================================<BR>
+  * Socket input is reassembled in a per-client ring buffer, so commands may
+  * be split across reads and may be longer than LINESIZE.  Each time data
+  * arrives, all the complete commands in the ring are collected as a batch,
+  * and a partial command stays in the ring until the rest of it arrives.
+  *
+  * Consecutive commands of a batch that need the same locks (e.g. a stream
+  * of r/w on one device) are run within a single lock acquisition.  JSON
+  * lines aren't parsed until they run, so they take their own locks.
+  */
+
+typedef struct {
+    bool            frame;
+    bool            solo;       // takes its own locks
+    otdb_frame_t    req;        // frame header, if frame
+    char*           data;       // text line or frame payload, 0-terminated
+    int             datalen;
+    dblock_class_t  cls;
+    uint64_t        uid;
+} dterm_job_t;
+
+
+static void sub_job_plan(dterm_handle_t* dth, dterm_job_t* job) {
+/// Determines the locks a job needs, the same way sub_cmd_run() does.
+    const cmdtab_item_t* cmdptr = NULL;
+    const char* args = job->data;
+    size_t argslen = (size_t)job->datalen;
+
+    job->solo   = false;
+    job->cls    = DBLOCK_none;
+    job->uid    = 0;
+
+    if (job->frame) {
+        if ((job->req.cmd != OTDB_FRAME_hello) && (job->req.cmd < OTDB_FRAME_MAX)) {
+            cmdptr  = cmd_search(dth->ext->cmdtab, (char*)frame_cmdname[job->req.cmd]);
+            argslen = strnlen(args, argslen);
+        }
+    }
+    else if (job->data[0] == '{') {
+        job->solo = true;
+        return;
+    }
+    else {
+        char cmdname[32];
+        int cmdlen;
+        cmdlen  = cmd_getname(cmdname, args, sizeof(cmdname));
+        cmdptr  = cmd_search(dth->ext->cmdtab, cmdname);
+        args   += cmdlen;
+        argslen-= (size_t)cmdlen;
+    }
+
+    if (cmdptr != NULL) {
+        job->cls = cmd_lockclass(cmdptr);
+        cmd_getdevid(&job->uid, args, argslen);
+        
+        /// A command that waits on the device manager suspends the locks of
+        /// its ticket, which would be the locks of the whole batch.
+        job->solo = cmd_usesdevmgr(cmdptr) && (dth->ext->devmgr != NULL);
+    }
+}
+
+
+static bool sub_job_joins(const dterm_job_t* batch, const dterm_job_t* job) {
+/// A job can join a batch if the batch locks cover it.  Device commands on
+/// the same device can share a device lock, which is taken exclusive if
+/// any of them needs it.  Other commands share locks of the same class.
+    bool batch_dev, job_dev;
+
+    if (batch->solo || job->solo) {
+        return false;
+    }
+    batch_dev   = ((batch->cls == DBLOCK_devread) || (batch->cls == DBLOCK_devwrite));
+    job_dev     = ((job->cls == DBLOCK_devread) || (job->cls == DBLOCK_devwrite));
+    if (batch_dev && job_dev) {
+        return (batch->uid == job->uid);
+    }
+    return (batch->cls == job->cls);
+}
+
+
+static int sub_batch_collect(dterm_handle_t* dth, TALLOC_CTX* ctx, ringbuf_t* rx, dterm_job_t* job, int max) {
+/// Moves complete commands from the ring into job[], up to max of them.
+/// Returns the number of jobs, or negative if the client should be dropped.
+    int jobs = 0;
+
+    while (jobs < max) {
+        dterm_job_t* jp = &job[jobs];
+        size_t len, used;
+        uint8_t c;
+
+        // Burn whitespace and terminators ahead of command.
+        while ((rx->used > 0) && (((c = ringbuf_at(rx, 0)) == 0) || isspace(c))) {
+            ringbuf_drop(rx, 1);
+        }
+        if (rx->used == 0) {
+            break;
+        }
+
+        if (ringbuf_at(rx, 0) == OTDB_FRAME_MAGIC) {
+            uint8_t hdr[OTDB_FRAME_HDRSIZE];
+
+            if (rx->used < OTDB_FRAME_HDRSIZE) {
+                break;
+            }
+            ringbuf_peek(rx, hdr, OTDB_FRAME_HDRSIZE);
+            otdb_frame_unpack(&jp->req, hdr);
+            if (jp->req.length > OTDB_PARAM_FRAME_MAX) {
+                ERR_PRINTF("Frame from socket:fd=%i is too large (%u bytes)\n", dth->fd.out, jp->req.length);
+                return -1;
+            }
+            if (rx->used < (OTDB_FRAME_HDRSIZE + jp->req.length)) {
+                break;
+            }
+            ringbuf_drop(rx, OTDB_FRAME_HDRSIZE);
+            len         = jp->req.length;
+            used        = len;
+            jp->frame   = true;
+        }
+        else {
+            // Text lines may be terminated by \n, \r or 0.
+            ssize_t end = ringbuf_findline(rx);
+            if (end < 0) {
+                break;
+            }
+            len         = (size_t)end;
+            used        = len + 1;
+            jp->frame   = false;
+        }
+
+        // The command is copied out of the ring, so it is contiguous and
+        // 0-terminated for the arguments parser.
+        jp->data = talloc_size(ctx, len+1);
+        if (jp->data == NULL) {
+            return -1;
+        }
+        ringbuf_peek(rx, jp->data, len);
+        ringbuf_drop(rx, used);
+        jp->data[len]   = 0;
+        jp->datalen     = (int)len;
+
+        sub_job_plan(dth, jp);
+        jobs++;
+    }
+
+    return jobs;
+}
+
+
+static int sub_proc_socketinput(dterm_handle_t* dth, TALLOC_CTX* ctx, ringbuf_t* rx) {
+/// Processes all complete commands (text lines and binary frames) in the
+/// client's ring.  Each command gets its own temporary context under ctx.
+/// Returns negative if the client should be dropped.
+    dterm_job_t job[OTDB_PARAM_BATCH_MAX];
+    struct dterm_outq outq;
+    TALLOC_CTX* bctx;
+    int jobs;
+    int rc = 0;
+
+    do {
+        bctx = talloc_new(ctx);
+        jobs = sub_batch_collect(dth, bctx, rx, job, OTDB_PARAM_BATCH_MAX);
+        if (jobs < 0) {
+            rc = -1;
+        }
+
+        for (int i=0, j; (i<jobs) && (rc>=0); i=j) {
+            dterm_job_t batch = job[i];
+
+            for (j=i+1; (j<jobs) && sub_job_joins(&batch, &job[j]); j++) {
+                if (job[j].cls == DBLOCK_devwrite) {
+                    batch.cls = DBLOCK_devwrite;
+                }
+            }
+            if ((j-i) > 1) {
+                VCLIENT_PRINTF("Batch of %i commands on socket:fd=%i\n", j-i, dth->fd.out);
+                outq.ctx    = bctx;
+                outq.count  = 0;
+                dth->outq   = &outq;
+                sub_cmd_lock(dth, batch.cls, batch.uid);
+            }
+
+            for (int k=i; (k<j) && (rc>=0); k++) {
+                dth->tctx = talloc_new(bctx);
+                if (job[k].frame) {
+                    rc = sub_proc_frame(dth, &job[k].req, (uint8_t*)job[k].data);
+                }
+                else {
+                    rc = sub_proc_lineinput(dth, NULL, job[k].data, job[k].datalen, "\n");
+                }
+                talloc_free(dth->tctx);
+                dth->tctx = NULL;
+                
+                /// Responses of a long batch go out with its locks released,
+                /// between its commands.
+                if ((rc >= 0) && (dth->outq != NULL)) {
+                    dblock_resume(dth->dblock, &dth->lock, dth->ext->db);
+                    rc = (sub_drain(dth) < 0) ? -1 : rc;
+                }
+            }
+
+            if ((j-i) > 1) {
+                sub_cmd_unlock(dth);
+                dth->outq = NULL;
+                
+                /// The responses go out in order, after the locks are released
+                for (int k=0; k<outq.count; k++) {
+                    if ((rc >= 0) && (dtwriter_flush(outq.out[k]) < 0)) {
+                        rc = -1;
+                    }
+                    dtwriter_free(outq.out[k]);
+                }
+            }
+        }
+
+        talloc_free(bctx);
+    } while ((rc >= 0) && (jobs == OTDB_PARAM_BATCH_MAX));
+
+    return rc;
+}
+
+
+
+
+#if DTERM_USE_EPOLL
+
+/** Socket Reactor <BR>
+  * ========================================================================<BR>
+  * dterm_socketer() multiplexes the listening socket and all client sockets
+  * with epoll.  Client sockets are registered as one-shot: when a client has
+  * input, its connection is dispatched to a fixed pool of workers, and the
+  * worker re-arms the fd after processing it.  So a client is only ever
+  * serviced by one worker at a time, and its responses stay in order.
+  *
+  * Each connection has a ring buffer that holds partial input between
+  * dispatches, so it lives as long as the client is connected.
+  */
+
+typedef struct {
+    int             fd;
+    ringbuf_t       rx;
+} dterm_conn_t;
+
+typedef struct {
+    dterm_handle_t* dth;
+    int             epfd;
+    int             jobpipe[2];
+    int             workers;
+    pthread_t*      worker;
+} dterm_reactor_t;
+
+
+static int sub_reactor_arm(dterm_reactor_t* reactor, dterm_conn_t* conn, int op) {
+    struct epoll_event ev;
+    
+    ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    return epoll_ctl(reactor->epfd, op, conn->fd, &ev);
+}
+
+
+static dterm_conn_t* sub_reactor_add(dterm_reactor_t* reactor, int fd) {
+    dterm_conn_t* conn;
+    
+    conn = malloc(sizeof(dterm_conn_t));
+    if (conn != NULL) {
+        conn->fd = fd;
+        if (ringbuf_init(&conn->rx, 0, 0) != 0) {
+            free(conn);
+            conn = NULL;
+        }
+        else if (sub_reactor_arm(reactor, conn, EPOLL_CTL_ADD) != 0) {
+            ringbuf_free(&conn->rx);
+            free(conn);
+            conn = NULL;
+        }
+    }
+    return conn;
+}
+
+
+static void sub_reactor_drop(dterm_reactor_t* reactor, dterm_conn_t* conn) {
+    VERBOSE_PRINTF("Client on socket:fd=%i has disconnected\n", conn->fd);
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    ringbuf_free(&conn->rx);
+    free(conn);
+}
+
+
+static void* dterm_socket_worker(void* args) {
+/// Worker Thread that:
+/// <LI> Waits for a client connection to be dispatched by the reactor </LI>
+/// <LI> Processes each LINE and takes action accordingly. </LI>
+/// <LI> Re-arms or closes the client fd </LI>
+    dterm_reactor_t* reactor = args;
+    dterm_handle_t dts;
+    TALLOC_CTX* pool;
+    dterm_conn_t* conn;
+    
+    talloc_disable_null_tracking();
+    
+    // Thread-local memory elements.  The pool is reused by every command
+    // this worker runs, so there is no per-client pool setup.
+    memcpy(&dts, reactor->dth, sizeof(dterm_handle_t));
+    pool = talloc_pooled_object(NULL, void*, 4, cliopt_getpoolsize());
+    if (pool == NULL) {
+        ERR_PRINTF("dterm_socket_worker() could not allocate memory pool\n");
+        return NULL;
+    }
+    
+    // Cancellation is only allowed while waiting for a job, never while a
+    // command is holding DB locks.
+    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+    
+    while (read(reactor->jobpipe[0], &conn, sizeof(dterm_conn_t*)) == sizeof(dterm_conn_t*)) {
+        bool hangup;
+        
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        
+        // The read appends to whatever partial input the client has left in
+        // its ring.  A full ring means the command is larger than the limit.
+        dts.fd.out  = conn->fd;
+        hangup      = (ringbuf_readfd(&conn->rx, conn->fd) <= 0);
+        
+        // Process the complete commands (text lines or binary frames) in the
+        // ring.  If there's a fatal error in the processing, we drop the
+        // client.
+        if (hangup == false) {
+            hangup = (sub_proc_socketinput(&dts, pool, &conn->rx) < 0);
+        }
+        
+        // After servicing the client socket, it is important to close it.
+        if (hangup || (sub_reactor_arm(reactor, conn, EPOLL_CTL_MOD) != 0)) {
+            sub_reactor_drop(reactor, conn);
+        }
+        
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        pthread_testcancel();
+    }
+    
+    talloc_free(pool);
+    return NULL;
+}
+
+
+static void sub_reactor_cleanup(void* args) {
+    dterm_reactor_t* reactor = args;
+    
+    for (int i=0; i<reactor->workers; i++) {
+        pthread_cancel(reactor->worker[i]);
+    }
+    for (int i=0; i<reactor->workers; i++) {
+        pthread_join(reactor->worker[i], NULL);
+    }
+    
+    free(reactor->worker);
+    close(reactor->jobpipe[0]);
+    close(reactor->jobpipe[1]);
+    close(reactor->epfd);
+}
+
+
+void* dterm_socketer(void* args) {
+/// Thread that:
+/// <LI> Accepts clients on the listening socket </LI>
+/// <LI> Dispatches clients with pending input to the worker pool </LI>
+    dterm_handle_t* dth = (dterm_handle_t*)args;
+    dterm_reactor_t reactor;
+    struct epoll_event events[64];
+    struct epoll_event ev;
+    
+    // Socket operation has no interface prompt
+    dth->intf->state    = prompt_off;
+    reactor.dth         = dth;
+    reactor.workers     = 0;
+    reactor.worker      = calloc(cliopt_getworkers(), sizeof(pthread_t));
+    reactor.epfd        = epoll_create1(EPOLL_CLOEXEC);
+    
+    if ((reactor.worker == NULL) || (reactor.epfd < 0)) {
+        perror("Unable to create socket reactor");
+        goto dterm_socketer_EXIT;
+    }
+    if (pipe(reactor.jobpipe) != 0) {
+        perror("Unable to create socket reactor job pipe");
+        close(reactor.epfd);
+        goto dterm_socketer_EXIT;
+    }
+    
+    // Listening socket is non-blocking, so all pending connections can be
+    // accepted on a single event.
+    fcntl(dth->fd.in, F_SETFL, fcntl(dth->fd.in, F_GETFL) | O_NONBLOCK);
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, dth->fd.in, &ev);
+    
+    pthread_cleanup_push(&sub_reactor_cleanup, &reactor);
+    
+    for (; reactor.workers<cliopt_getworkers(); reactor.workers++) {
+        if (pthread_create(&reactor.worker[reactor.workers], NULL, &dterm_socket_worker, &reactor) != 0) {
+            break;
+        }
+    }
+    VERBOSE_PRINTF("Socket reactor started with %i workers\n", reactor.workers);
+    
+    while (reactor.workers > 0) {
+        int nfds;
+        
+        nfds = epoll_wait(reactor.epfd, events, sizeof(events)/sizeof(struct epoll_event), -1);
+        if (nfds < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Server Socket epoll_wait() failed");
+            break;
+        }
+        
+        for (int i=0; i<nfds; i++) {
+            if (events[i].data.ptr == NULL) {
+                int fd_client;
+                while ((fd_client = accept(dth->fd.in, NULL, NULL)) >= 0) {
+                    if (sub_reactor_add(&reactor, fd_client) == NULL) {
+                        close(fd_client);
+                        continue;
+                    }
+                    VERBOSE_PRINTF("Client on socket:fd=%i has connected\n", fd_client);
+                }
+                if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                    perror("Server Socket accept() failed");
+                }
+            }
+            else {
+                write(reactor.jobpipe[1], &events[i].data.ptr, sizeof(dterm_conn_t*));
+            }
+        }
+    }
+    
+    pthread_cleanup_pop(1);
+    
+    dterm_socketer_EXIT:
+    ERR_PRINTF("dterm_socketer() closing due to failure of socket reactor\n");
+    raise(SIGTERM);
+    return NULL;
+}
+
+
+#else
+
 void* dterm_socket_clithread(void* args) {
 /// Thread that:
 /// <LI> Listens to stdin via read() pipe </LI>
@@ -521,7 +1300,7 @@ void* dterm_socket_clithread(void* args) {
     dterm_handle_t* dth;
     dterm_handle_t dts;
     clithread_args_t* ct_args;
-    char databuf[1024];
+    ringbuf_t rx;
 
     ct_args = (clithread_args_t*)args;
     if (args == NULL)
@@ -536,7 +1315,13 @@ void* dterm_socket_clithread(void* args) {
     memcpy(&dts, dth, sizeof(dterm_handle_t));
     dts.fd.in   = ((clithread_args_t*)args)->fd_in;
     dts.fd.out  = ((clithread_args_t*)args)->fd_out;
-    dts.tctx    = ct_args->tctx;
+    
+    // Partial input is held in the ring between reads
+    if (ringbuf_init(&rx, 0, 0) != 0) {
+        close(dts.fd.out);
+        clithread_sigup(ct_args->clithread_self);
+        goto dterm_socket_clithread_EXIT;
+    }
     
     // Thread instantiation done: unblock the clithread creator
     clithread_sigup(ct_args->clithread_self);
@@ -547,47 +1332,22 @@ void* dterm_socket_clithread(void* args) {
     VERBOSE_PRINTF("Client Thread on socket:fd=%i has started\n", dts.fd.out);
     
     /// Get a packet from the Socket
-    while (1) {
-        int linelen;
-        int loadlen;
-        char* loadbuf = databuf;
-        
-        bzero(databuf, sizeof(databuf));
+    /// A failed read includes a command that overfills the ring.
+    VERBOSE_PRINTF("Waiting for read on socket:fd=%i\n", dts.fd.out);
+    while (ringbuf_readfd(&rx, dts.fd.out) > 0) {
+        dts.intf->state = prompt_off;
         
-        VERBOSE_PRINTF("Waiting for read on socket:fd=%i\n", dts.fd.out);
-        loadlen = (int)read(dts.fd.out, loadbuf, LINESIZE);
-        if (loadlen > 0) {
-            sub_str_sanitize(loadbuf, (size_t)loadlen);
-            pthread_mutex_lock(dts.iso_mutex);
-            dts.intf->state = prompt_off;
-            
-            do {
-                // Burn whitespace ahead of command.
-                while (isspace(*loadbuf)) { loadbuf++; loadlen--; }
-                linelen = (int)sub_str_mark(loadbuf, (size_t)loadlen);
-
-                // Process the line-input command
-                // If there's a fatal error in the processing, we kill this thread
-                if (sub_proc_lineinput(&dts, NULL, loadbuf, linelen, "\n") < 0) {
-                    pthread_mutex_unlock(dts.iso_mutex);
-                    goto dterm_socket_clithread_EXIT;
-                }
-
-                // +1 eats the terminator
-                loadlen -= (linelen + 1);
-                loadbuf += (linelen + 1);
-
-            } while (loadlen > 0);
-
-            pthread_mutex_unlock(dts.iso_mutex);
-
-        }
-        else {
-            // After servicing the client socket, it is important to close it.
-            close(dts.fd.out);
+        // Process the complete commands (text lines or binary frames).
+        // If there's a fatal error in the processing, we kill this thread
+        if (sub_proc_socketinput(&dts, ct_args->tctx, &rx) < 0) {
             break;
         }
+        VERBOSE_PRINTF("Waiting for read on socket:fd=%i\n", dts.fd.out);
     }
+    
+    // After servicing the client socket, it is important to close it.
+    close(dts.fd.out);
+    ringbuf_free(&rx);
 
     dterm_socket_clithread_EXIT:
 
@@ -631,7 +1391,7 @@ void* dterm_socketer(void* args) {
             ///@todo there are some problems with clithread that appear to be
             /// related to talloc's lack of support for concurrency.  For the
             /// time being, we're adding a guard.
-            clithread.guard = dth->iso_mutex;
+            clithread.guard = dth->pctx_mutex;
             
             clithread_add(dth->clithread, NULL, est_obj, poolsize, &dterm_socket_clithread, (void*)&clithread);
         }
@@ -640,6 +1400,8 @@ void* dterm_socketer(void* args) {
     return NULL;
 }
 
+#endif
+
 
 
 
@@ -741,7 +1503,6 @@ int dterm_cmdfile(dterm_handle_t* dth, const char* filename) {
     // Reset the terminal to default state
     dterm_reset(dth->intf);
     
-    pthread_mutex_lock(dth->iso_mutex);
     local.in    = STDIN_FILENO;
     local.out   = STDOUT_FILENO;
     saved       = dth->fd;
@@ -788,7 +1549,6 @@ int dterm_cmdfile(dterm_handle_t* dth, const char* filename) {
     }
     
     dth->fd = saved;
-    pthread_mutex_unlock(dth->iso_mutex);
 
     dterm_cmdfile_END:
     if (fp != NULL) fclose(fp);
@@ -917,12 +1677,6 @@ void* dterm_prompter(void* args) {
             continue;
         }
         
-        // This mutex protects the terminal output from being written-to by
-        // this thread and mpipe_parser() at the same time.
-        if (dth->intf->state == prompt_off) {
-            pthread_mutex_lock(dth->iso_mutex);
-        }
-        
         // These are error conditions
         if ((int)cmd < 0) {
             int sigcode;
@@ -957,9 +1711,6 @@ void* dterm_prompter(void* args) {
         }
         
         // These are commands that cause input into the prompt.
-        // Note that the mutex is only released after ENTER is used, which has
-        // the effect of blocking printout of received messages while the 
-        // prompt is up
         else {
             int cmdlen;
             char* cmdstr;
@@ -993,7 +1744,7 @@ void* dterm_prompter(void* args) {
                 // 1. Echo Newline (NOTE: not sure why 2 chars here)
                 // 2. Add line-entry into the  history
                 // 3. Search and try to execute cmd
-                // 4. Reset prompt, change to OFF State, unlock mutex on dterm
+                // 4. Reset prompt, change to OFF State
                 case ct_enter: {
                     int bytesout;
                     size_t est_objs;
@@ -1087,10 +1838,9 @@ void* dterm_prompter(void* args) {
             }
         }
         
-        // Unlock Mutex
+        // Close the prompt
         if (dth->intf->state != prompt_on) {
             dth->intf->state = prompt_off;
-            pthread_mutex_unlock(dth->iso_mutex);
         }
         
     }
@@ -21,6 +21,8 @@
 #include "otdb_cfg.h"
 #include "cliopt.h"
 #include "cmdhistory.h"
+#include "dblock.h"
+#include "dtwriter.h"
 #include "popen2.h"
 
 // HB Libraries
@@ -107,10 +109,18 @@ typedef struct {
 typedef struct {
     bool        use_socket;
     void*       devmgr;
+    void*       devmux;         // dm_mux_t, when use_socket
+    void*       dirty;          // dirty_t, changes since last save
+    void*       wal;            // wal_t, log of changes since last save
+    void*       devcache;       // devcache_t, UID lookups in db
+    void*       txn;            // txn_t, open write transactions
+    void*       fidx;           // fidx_t, indexes on template fields
+    void*       sflight;        // sflight_t, device refreshes in flight
     cmdtab_t*   cmdtab;
     void*       db;
     void*       tmpl_fs;
     cJSON*      tmpl;
+    void*       schema;         // tmpl_schema_t, compiled from tmpl
 } dterm_ext_t;
 
 
@@ -126,19 +136,43 @@ typedef struct {
     // Should be altered per client thread in cloned dterm_handle_t
     dterm_fd_t          fd;
     
+    // Response writer of the command running on this handle.  Commands that
+    // stream output use it through dtwriter_advance().  Set by DTerm.
+    dtwriter_t*         out;
+    
+    // Responses of a batch of commands, which are flushed only once the
+    // batch has released its locks.  NULL outside of a batch.  Set by DTerm.
+    struct dterm_outq*  outq;
+    
+    // Raw file data from a binary frame request, which commands that take
+    // file data (w, pub) use in place of the Bintex argument.  NULL unless
+    // a binary frame is being processed.
+    const uint8_t*      rawdata;
+    int                 rawdata_size;
+    
     // Process Context:
     // Thread Context: may be null if not using talloc
     TALLOC_CTX*         pctx;
     TALLOC_CTX*         tctx;
     
-    // Isolation Mutex
-    // * Used by client threads to prevent more than one command from running in
-    //   OTDB engine at any given time.
+    // Process Context Mutex
+    // * talloc is not thread-safe on a shared parent, so creation and removal
+    //   of client contexts on pctx is guarded by this mutex, as are commands
+    //   that allocate on pctx.
     // * Initialized by DTerm
-    pthread_mutex_t*    iso_mutex;
+    pthread_mutex_t*    pctx_mutex;
+    
+    // DB Lock Manager
+    // * Commands take the locks of their class (see dblock.h) so that commands
+    //   on different devices don't have to wait on each other.
+    // * lock is the ticket of the command running on this handle.  It should
+    //   be altered per client thread in cloned dterm_handle_t.
+    // * Initialized by DTerm
+    dblock_handle_t     dblock;
+    dblock_ticket_t     lock;
     
     // Externally Initialized data elements
-    // These should only be used within lock provided by isolation mutex
+    // These should only be used within locks provided by dblock
     dterm_ext_t*        ext;
     
 } dterm_handle_t;
@@ -182,6 +216,33 @@ int dterm_close(dterm_handle_t* dth);
 int dterm_cmdfile(dterm_handle_t* dth, const char* filename);
 
 
+/** @brief Routes the cJSON and argtable allocators of the calling thread
+  * @param ctx      (TALLOC_CTX*) Context to allocate from, or NULL for malloc
+  * @retval         Context that was routed to before
+  *
+  * Worker threads of a command use this so that the cJSON trees they make
+  * come from talloc, as they do on the command thread that later frees them.
+  */
+TALLOC_CTX* dterm_isolate(TALLOC_CTX* ctx);
+
+
+/** @brief Flushes the output of a connection once it holds too much of it
+  * @param dth      (dterm_handle_t*) Controlling interface handle
+  * @param cursor   (uint8_t**) Writer cursor, committed and then adjusted
+  * @param avail    (size_t*) Space available at cursor, adjusted on return
+  * @retval         1 if output was flushed, with the DB locks of the command
+  *                 released meanwhile.  0 if the output stays buffered.
+  *                 Negative if the client can't take the output.
+  *
+  * Streaming commands call this between devices, at points where they hold
+  * no vlFILE and nothing that they got from the DB.  When it returns 1,
+  * anything got from the DB before must be looked-up again.  Output is only
+  * flushed once the connection buffers OTDB_PARAM_OUTQUEUE_MAX bytes, and
+  * only if the locks of the command can be released (see dblock_suspend()).
+  */
+int dterm_drain(dterm_handle_t* dth, uint8_t** cursor, size_t* avail);
+
+
 ///@todo refactor these read/write functions
 
 
@@ -0,0 +1,250 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "dtwriter.h"
+#include "debug.h"
+
+// HB Headers/Libraries
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+
+/// Output committed before the buffer was full, waiting for dtwriter_flush()
+typedef struct dtwriter_chunk {
+    struct dtwriter_chunk* next;
+    uint8_t*    buf;
+    size_t      fill;
+} dtwriter_chunk_t;
+
+
+
+
+static int sub_grow(dtwriter_t* w, size_t required) {
+    size_t newsize;
+    uint8_t* newbuf;
+
+    if (required > w->limit) {
+        return -1;
+    }
+    for (newsize=w->size; newsize<required; newsize<<=1);
+    if (newsize > w->limit) {
+        newsize = w->limit;
+    }
+
+    newbuf = talloc_realloc(w->ctx, w->buf, uint8_t, newsize);
+    if (newbuf == NULL) {
+        return -2;
+    }
+    w->buf  = newbuf;
+    w->size = newsize;
+    return 0;
+}
+
+
+static int sub_queue(dtwriter_t* w, size_t need) {
+/// Moves the committed output into the queue, with its buffer, and starts a
+/// new buffer with room for need.
+    dtwriter_chunk_t* chunk;
+    uint8_t* newbuf;
+    size_t newsize;
+
+    newsize = (OTDB_PARAM_OUTBUF_INIT < need) ? need : OTDB_PARAM_OUTBUF_INIT;
+    newbuf  = talloc_array(w->ctx, uint8_t, newsize);
+    chunk   = talloc(w->ctx, dtwriter_chunk_t);
+    if ((newbuf == NULL) || (chunk == NULL)) {
+        talloc_free(newbuf);
+        talloc_free(chunk);
+        return -2;
+    }
+    chunk->next = NULL;
+    chunk->buf  = talloc_steal(chunk, w->buf);
+    chunk->fill = w->fill;
+    *w->qtail   = chunk;
+    w->qtail    = &chunk->next;
+    w->queued  += w->fill;
+
+    w->buf      = newbuf;
+    w->size     = newsize;
+    w->fill     = 0;
+    return 0;
+}
+
+
+static int sub_writeall(int fd, const uint8_t* data, size_t remain) {
+    while (remain > 0) {
+        ssize_t wbytes = write(fd, data, remain);
+        if (wbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("could not write back to client");
+            return -1;
+        }
+        data   += wbytes;
+        remain -= (size_t)wbytes;
+    }
+    return 0;
+}
+
+
+static void sub_dropqueue(dtwriter_t* w) {
+    while (w->queue != NULL) {
+        dtwriter_chunk_t* next = w->queue->next;
+        talloc_free(w->queue);
+        w->queue = next;
+    }
+    w->qtail    = &w->queue;
+    w->queued   = 0;
+}
+
+
+static int sub_write(dtwriter_t* w) {
+/// Writes the queue and then the buffer
+    while (w->queue != NULL) {
+        dtwriter_chunk_t* chunk = w->queue;
+        if (sub_writeall(w->fd, chunk->buf, chunk->fill) != 0) {
+            return -1;
+        }
+        w->flushed += chunk->fill;
+        w->queued  -= chunk->fill;
+        w->queue    = chunk->next;
+        talloc_free(chunk);
+    }
+    w->qtail = &w->queue;
+
+    if (sub_writeall(w->fd, w->buf, w->fill) != 0) {
+        return -1;
+    }
+    w->flushed += w->fill;
+    w->fill     = 0;
+    return 0;
+}
+
+
+
+
+dtwriter_t* dtwriter_new(TALLOC_CTX* ctx, int fd, size_t limit) {
+    dtwriter_t* w;
+
+    w = talloc_zero(ctx, dtwriter_t);
+    if (w != NULL) {
+        w->fd       = fd;
+        w->ctx      = w;
+        w->qtail    = &w->queue;
+        w->limit    = (limit == 0) ? OTDB_PARAM_OUTBUF_MAX : limit;
+        w->size     = (OTDB_PARAM_OUTBUF_INIT < w->limit) ? OTDB_PARAM_OUTBUF_INIT : w->limit;
+        w->buf      = talloc_array(w, uint8_t, w->size);
+        if (w->buf == NULL) {
+            talloc_free(w);
+            w = NULL;
+        }
+    }
+    return w;
+}
+
+
+void dtwriter_free(dtwriter_t* w) {
+    talloc_free(w);
+}
+
+
+uint8_t* dtwriter_cursor(dtwriter_t* w, size_t* avail) {
+    if (avail != NULL) {
+        *avail = w->size - w->fill;
+    }
+    return &w->buf[w->fill];
+}
+
+
+uint8_t* dtwriter_advance(dtwriter_t* w, uint8_t* dst, size_t* avail, size_t need) {
+    size_t commit;
+
+    /// A need that can never be met is refused without breaking the writer
+    if ((w == NULL) || (w->err != 0) || (need > w->limit)) {
+        return NULL;
+    }
+
+    /// dst must be inside the free part of the buffer
+    if ((dst < &w->buf[w->fill]) || (dst > &w->buf[w->size])) {
+        w->err = -1;
+        return NULL;
+    }
+    commit      = (size_t)(dst - &w->buf[w->fill]);
+    w->fill    += commit;
+
+    /// Grow first, so that responses within the limit are one buffer.  When
+    /// the limit is reached, queue the buffer.  The queue is only emptied by
+    /// a flush, which the command must not do with its locks held, so a
+    /// response that isn't drained is refused past its bound.
+    if ((w->queued + w->fill + need) > (2 * OTDB_PARAM_OUTQUEUE_MAX)) {
+        return NULL;
+    }
+    if ((w->size - w->fill) < need) {
+        if ((w->fill + need) <= w->limit) {
+            w->err = sub_grow(w, w->fill + need);
+        }
+        else {
+            w->err = sub_queue(w, need);
+        }
+    }
+    if (w->err != 0) {
+        return NULL;
+    }
+
+    return dtwriter_cursor(w, avail);
+}
+
+
+uint8_t* dtwriter_head(dtwriter_t* w) {
+    return (w->queue != NULL) ? w->queue->buf : w->buf;
+}
+
+
+size_t dtwriter_total(dtwriter_t* w) {
+    return w->flushed + w->queued + w->fill;
+}
+
+
+size_t dtwriter_held(dtwriter_t* w) {
+    return w->queued + w->fill;
+}
+
+
+bool dtwriter_discard(dtwriter_t* w) {
+    sub_dropqueue(w);
+    w->fill = 0;
+    return (w->flushed == 0);
+}
+
+
+int dtwriter_flush(dtwriter_t* w) {
+    if (w->err == 0) {
+        w->err = sub_write(w);
+    }
+    if (w->err != 0) {
+        return w->err;
+    }
+    return (int)w->flushed;
+}
+
@@ -0,0 +1,140 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef dtwriter_h
+#define dtwriter_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// HB Headers/Libraries
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** DTerm Response Writer
+  * -------------------------------------------------------------------------
+  * Commands format their output at the writer cursor (the dst argument of a
+  * command), exactly as they would into a flat buffer.  A command that
+  * produces more output than it can know in advance calls dtwriter_advance()
+  * to commit what it has written so far and obtain more space.
+  *
+  * The buffer grows until it reaches its limit.  After that, the committed
+  * output is queued and a new buffer is started.  Commands run with DB locks
+  * held, so nothing is written to the client fd until dtwriter_flush(), which
+  * is called once the locks are released.  A slow client then can't stall
+  * other commands.
+  *
+  * A connection buffers about OTDB_PARAM_OUTQUEUE_MAX bytes of output.  Past
+  * that, streaming commands flush it with their locks released, through
+  * dterm_drain().  A response that isn't drained is refused once it holds
+  * twice as much, so the memory of a connection stays bounded either way.
+  */
+
+struct dtwriter_chunk;
+
+typedef struct {
+    int         fd;
+    TALLOC_CTX* ctx;
+    uint8_t*    buf;
+    size_t      size;       // current allocation of buf
+    size_t      limit;      // maximum allocation of buf
+    size_t      fill;       // committed bytes in buf
+    size_t      queued;     // committed bytes in the queue, ahead of buf
+    size_t      flushed;    // bytes already written to fd
+    struct dtwriter_chunk*  queue;
+    struct dtwriter_chunk** qtail;
+    int         err;
+    bool        pinned;     // head is filled-in last: no flush until the end
+} dtwriter_t;
+
+
+
+/** @brief Creates a writer for one response
+  * @param ctx      (TALLOC_CTX*) Context to allocate the writer and its buffer
+  * @param fd       (int) Output fd, where the response is flushed
+  * @param limit    (size_t) Maximum buffer size.  0 uses default.
+  * @retval         (dtwriter_t*) New writer, or NULL on allocation error
+  */
+dtwriter_t* dtwriter_new(TALLOC_CTX* ctx, int fd, size_t limit);
+
+void dtwriter_free(dtwriter_t* w);
+
+
+/** @brief Returns the writer cursor and the space available at it
+  * @param w        (dtwriter_t*) Writer
+  * @param avail    (size_t*) Output space available at cursor.  May be NULL.
+  * @retval         (uint8_t*) Cursor
+  */
+uint8_t* dtwriter_cursor(dtwriter_t* w, size_t* avail);
+
+
+/** @brief Commits output written at the cursor, and makes space for more
+  * @param w        (dtwriter_t*) Writer
+  * @param dst      (uint8_t*) End of the output written at the cursor
+  * @param avail    (size_t*) Output space available at the new cursor
+  * @param need     (size_t) Minimum space required at the new cursor
+  * @retval         (uint8_t*) New cursor, or NULL on error
+  *
+  * A need larger than the buffer limit is refused, and nothing is committed,
+  * as is a need that would take the response past twice
+  * OTDB_PARAM_OUTQUEUE_MAX.  The other error is a failed allocation.  After
+  * it, the writer refuses all further output and the response should be
+  * abandoned.  Output is never written to the fd here.
+  */
+uint8_t* dtwriter_advance(dtwriter_t* w, uint8_t* dst, size_t* avail, size_t need);
+
+
+/** @brief Returns the start of the unflushed part of the response
+  *
+  * This is the start of the response as long as nothing has been flushed,
+  * which lets a fixed-size header be filled-in after the output is known.
+  * The pointer is invalidated by dtwriter_advance().
+  */
+uint8_t* dtwriter_head(dtwriter_t* w);
+
+
+/** @brief Total bytes committed to the response, including flushed bytes
+  */
+size_t dtwriter_total(dtwriter_t* w);
+
+
+/** @brief Bytes committed to the response that haven't been flushed
+  */
+size_t dtwriter_held(dtwriter_t* w);
+
+
+/** @brief Drops the buffered (unflushed) part of the response
+  * @retval         true if the whole response was dropped, false if part of
+  *                 it was already flushed to the fd.
+  */
+bool dtwriter_discard(dtwriter_t* w);
+
+
+/** @brief Flushes all committed output to the fd
+  * @retval         Total bytes written for this response, or negative on error
+  *
+  * This blocks until the client takes the output, so the caller must not
+  * hold DB locks.
+  */
+int dtwriter_flush(dtwriter_t* w);
+
+
+#endif
@@ -0,0 +1,891 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "fidx.h"
+#include "json_tools.h"
+
+// HB Headers/Libraries
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/// Pairs per B+tree node, and the most levels a tree can have.  Nodes other
+/// than the root have at least half of FIDX_ORDER pairs, so 16 levels is far
+/// more than any number of devices needs.
+#define FIDX_ORDER      64
+#define FIDX_LEVELS     16
+#define FIDX_MIN        (FIDX_ORDER/2)
+#define FIDX_FILL       ((FIDX_ORDER*3)/4)
+
+
+/// A pair is (key, uid) in the tree sorted by key, and (uid, key) in the tree
+/// sorted by UID, so both are sorted by (a, b).
+typedef struct {
+    uint64_t        a;
+    uint64_t        b;
+} fidx_pair_t;
+
+/// In a leaf, pair holds the entries.  In an inner node, pair[i] is a lower
+/// bound of the pairs under child[i], and it is above all the pairs under
+/// child[i-1].
+typedef struct fidx_node {
+    size_t          count;
+    bool            leaf;
+    struct fidx_node* next;
+    fidx_pair_t     pair[FIDX_ORDER];
+    struct fidx_node* child[FIDX_ORDER];
+} fidx_node_t;
+
+typedef struct {
+    TALLOC_CTX*     ctx;
+    fidx_node_t*    root;
+} fidx_tree_t;
+
+typedef struct {
+    char            name[64];
+    bool            built;
+    query_field_t   field;
+    size_t          count;
+    fidx_tree_t     bykey;
+    fidx_tree_t     byuid;
+} fidx_index_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    TALLOC_CTX*     ctx;
+    int             count;
+    fidx_index_t    index[OTDB_PARAM_FIDX_MAX];
+} fidx_item_t;
+
+typedef struct {
+    const query_field_t* field;
+    uint64_t*       key;
+    uint8_t*        valid;
+} fidx_build_t;
+
+
+
+
+static uint64_t sub_hash(const uint8_t* src, size_t size) {
+/// FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i=0; i<size; i++) {
+        hash ^= src[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static bool sub_numkey(uint64_t* key, double number) {
+/// Maps a number to a key of the same order: negative numbers have their bits
+/// flipped, positive numbers get the sign bit set.
+    uint64_t bits;
+
+    if (number != number) {
+        return false;
+    }
+    if (number == 0) {
+        number = 0;
+    }
+    memcpy(&bits, &number, sizeof(bits));
+    *key = (bits & (1ULL << 63)) ? ~bits : (bits | (1ULL << 63));
+    return true;
+}
+
+
+static bool sub_key(uint64_t* key, const void* image, const query_field_t* field) {
+    const uint8_t* src;
+    double number;
+
+    src = query_locate(image, field);
+    if (src == NULL) {
+        return false;
+    }
+    if (field->type.index == TYPE_string) {
+        *key = sub_hash(src, strnlen((const char*)src, field->type.bits/8));
+        return true;
+    }
+    if (field->type.index == TYPE_hex) {
+        *key = sub_hash(src, field->type.bits/8);
+        return true;
+    }
+    if (jst_read_number(&number, src, field->type.index, field->bitpos, field->type.bits) == false) {
+        return false;
+    }
+    return sub_numkey(key, number);
+}
+
+
+static size_t sub_lower(const fidx_pair_t* pair, size_t count, uint64_t a, uint64_t b) {
+    size_t lo = 0;
+    size_t hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) / 2);
+        if ((pair[mid].a < a) || ((pair[mid].a == a) && (pair[mid].b < b))) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+static size_t sub_child(const fidx_node_t* node, uint64_t a, uint64_t b) {
+/// The child of an inner node that (a, b) belongs under: the last one whose
+/// lower bound is not above it, or the first one.
+    size_t lo = 1;
+    size_t hi = node->count;
+
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) / 2);
+        if ((node->pair[mid].a < a) || ((node->pair[mid].a == a) && (node->pair[mid].b <= b))) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+
+static int sub_paircmp(const void* a, const void* b) {
+    const fidx_pair_t* pa = a;
+    const fidx_pair_t* pb = b;
+
+    if (pa->a != pb->a) {
+        return (pa->a < pb->a) ? -1 : 1;
+    }
+    if (pa->b != pb->b) {
+        return (pa->b < pb->b) ? -1 : 1;
+    }
+    return 0;
+}
+
+
+static int sub_uidcmp(const void* a, const void* b) {
+    uint64_t ua = *(const uint64_t*)a;
+    uint64_t ub = *(const uint64_t*)b;
+    return (ua < ub) ? -1 : (ua > ub);
+}
+
+
+
+
+static fidx_node_t* sub_node_new(fidx_tree_t* tree, bool leaf) {
+    fidx_node_t* node = talloc(tree->ctx, fidx_node_t);
+
+    if (node != NULL) {
+        node->count = 0;
+        node->leaf  = leaf;
+        node->next  = NULL;
+    }
+    return node;
+}
+
+
+static void sub_node_put(fidx_node_t* node, size_t i, fidx_pair_t pair, fidx_node_t* child) {
+/// Opens slot i of a node that isn't full, and puts a pair (and child) in it
+    memmove(&node->pair[i+1], &node->pair[i], (node->count-i) * sizeof(fidx_pair_t));
+    node->pair[i] = pair;
+    if (node->leaf == false) {
+        memmove(&node->child[i+1], &node->child[i], (node->count-i) * sizeof(fidx_node_t*));
+        node->child[i] = child;
+    }
+    node->count++;
+}
+
+
+static void sub_node_cut(fidx_node_t* node, size_t i) {
+/// Closes slot i of a node
+    memmove(&node->pair[i], &node->pair[i+1], (node->count-i-1) * sizeof(fidx_pair_t));
+    if (node->leaf == false) {
+        memmove(&node->child[i], &node->child[i+1], (node->count-i-1) * sizeof(fidx_node_t*));
+    }
+    node->count--;
+}
+
+
+static int sub_split(fidx_tree_t* tree, fidx_node_t* parent, size_t i) {
+/// Splits the full child i of a parent that isn't full
+    fidx_node_t* left = parent->child[i];
+    fidx_node_t* right;
+
+    right = sub_node_new(tree, left->leaf);
+    if (right == NULL) {
+        return -1;
+    }
+    right->count = FIDX_ORDER - FIDX_MIN;
+    memcpy(right->pair, &left->pair[FIDX_MIN], right->count * sizeof(fidx_pair_t));
+    if (left->leaf) {
+        right->next = left->next;
+        left->next  = right;
+    }
+    else {
+        memcpy(right->child, &left->child[FIDX_MIN], right->count * sizeof(fidx_node_t*));
+    }
+    left->count = FIDX_MIN;
+
+    memmove(&parent->pair[i+2], &parent->pair[i+1], (parent->count-i-1) * sizeof(fidx_pair_t));
+    memmove(&parent->child[i+2], &parent->child[i+1], (parent->count-i-1) * sizeof(fidx_node_t*));
+    parent->pair[i+1]   = right->pair[0];
+    parent->child[i+1]  = right;
+    parent->count++;
+    return 0;
+}
+
+
+static int sub_insert(fidx_tree_t* tree, uint64_t a, uint64_t b) {
+/// Full nodes are split on the way down, so there is always room for a split
+/// below.  On a failed allocation the tree is still valid, but without the
+/// pair.
+    fidx_pair_t pair = { .a = a, .b = b };
+    fidx_node_t* node;
+    size_t i;
+
+    if (tree->root == NULL) {
+        tree->root = sub_node_new(tree, true);
+        if (tree->root == NULL) {
+            return -1;
+        }
+    }
+    if (tree->root->count == FIDX_ORDER) {
+        node = sub_node_new(tree, false);
+        if (node == NULL) {
+            return -1;
+        }
+        node->count     = 1;
+        node->pair[0]   = tree->root->pair[0];
+        node->child[0]  = tree->root;
+        if (sub_split(tree, node, 0) != 0) {
+            talloc_free(node);
+            return -1;
+        }
+        tree->root = node;
+    }
+
+    node = tree->root;
+    while (node->leaf == false) {
+        i = sub_child(node, a, b);
+        if (sub_paircmp(&pair, &node->pair[i]) < 0) {
+            node->pair[i] = pair;
+        }
+        if (node->child[i]->count == FIDX_ORDER) {
+            if (sub_split(tree, node, i) != 0) {
+                return -1;
+            }
+            if (sub_paircmp(&pair, &node->pair[i+1]) >= 0) {
+                i++;
+            }
+        }
+        node = node->child[i];
+    }
+
+    i = sub_lower(node->pair, node->count, a, b);
+    if ((i == node->count) || (sub_paircmp(&pair, &node->pair[i]) != 0)) {
+        sub_node_put(node, i, pair, NULL);
+    }
+    return 0;
+}
+
+
+static void sub_rebalance(fidx_tree_t* tree, fidx_node_t* parent, size_t i) {
+/// Child i of parent has too few pairs.  It takes one from a sibling that can
+/// spare one, or else it is merged with the sibling, which takes a pair from
+/// the parent.
+    fidx_node_t* left;
+    fidx_node_t* right;
+
+    if (i > 0) {
+        left    = parent->child[i-1];
+        right   = parent->child[i];
+        if (left->count > FIDX_MIN) {
+            sub_node_put(right, 0, left->pair[left->count-1], left->leaf ? NULL : left->child[left->count-1]);
+            left->count--;
+            parent->pair[i] = right->pair[0];
+            return;
+        }
+        i--;
+    }
+    else {
+        left    = parent->child[0];
+        right   = parent->child[1];
+        if (right->count > FIDX_MIN) {
+            sub_node_put(left, left->count, right->pair[0], right->leaf ? NULL : right->child[0]);
+            sub_node_cut(right, 0);
+            parent->pair[1] = right->pair[0];
+            return;
+        }
+    }
+
+    /// Merge right into left: both have at most FIDX_MIN pairs
+    memcpy(&left->pair[left->count], right->pair, right->count * sizeof(fidx_pair_t));
+    if (left->leaf) {
+        left->next = right->next;
+    }
+    else {
+        memcpy(&left->child[left->count], right->child, right->count * sizeof(fidx_node_t*));
+    }
+    left->count += right->count;
+    sub_node_cut(parent, i+1);
+    talloc_free(right);
+}
+
+
+static void sub_remove(fidx_tree_t* tree, uint64_t a, uint64_t b) {
+/// Removing never allocates, so it can't fail
+    fidx_pair_t pair = { .a = a, .b = b };
+    fidx_node_t* path[FIDX_LEVELS];
+    size_t slot[FIDX_LEVELS];
+    fidx_node_t* node;
+    int depth = 0;
+    size_t i;
+
+    node = tree->root;
+    if (node == NULL) {
+        return;
+    }
+    while (node->leaf == false) {
+        path[depth] = node;
+        slot[depth] = sub_child(node, a, b);
+        node        = node->child[slot[depth++]];
+    }
+
+    i = sub_lower(node->pair, node->count, a, b);
+    if ((i == node->count) || (sub_paircmp(&pair, &node->pair[i]) != 0)) {
+        return;
+    }
+    sub_node_cut(node, i);
+
+    while ((depth > 0) && (node->count < FIDX_MIN)) {
+        depth--;
+        sub_rebalance(tree, path[depth], slot[depth]);
+        node = path[depth];
+    }
+
+    node = tree->root;
+    if ((node->leaf == false) && (node->count == 1)) {
+        tree->root = node->child[0];
+        talloc_free(node);
+    }
+    else if (node->leaf && (node->count == 0)) {
+        tree->root = NULL;
+        talloc_free(node);
+    }
+}
+
+
+static const fidx_node_t* sub_seek(const fidx_tree_t* tree, uint64_t a, uint64_t b, size_t* i) {
+/// Finds the first pair that is not below (a, b).  Returns the leaf that has
+/// it, or NULL if there is no such pair.
+    const fidx_node_t* node = tree->root;
+
+    if (node == NULL) {
+        return NULL;
+    }
+    while (node->leaf == false) {
+        node = node->child[sub_child(node, a, b)];
+    }
+    *i = sub_lower(node->pair, node->count, a, b);
+    while ((node != NULL) && (*i >= node->count)) {
+        node    = node->next;
+        *i      = 0;
+    }
+    return node;
+}
+
+
+static int sub_load(fidx_tree_t* tree, const fidx_pair_t* pair, size_t count) {
+/// Builds a tree from sorted pairs, a level at a time.  Nodes are filled to
+/// FIDX_FILL, so that updates don't split them right away.
+    fidx_node_t** level;
+    size_t nodes;
+
+    nodes = (count + FIDX_FILL - 1) / FIDX_FILL;
+    if (nodes == 0) {
+        return 0;
+    }
+    level = talloc_array(tree->ctx, fidx_node_t*, nodes);
+    if (level == NULL) {
+        return -1;
+    }
+
+    for (size_t n=0, i=0; n<nodes; n++) {
+        fidx_node_t* leaf = sub_node_new(tree, true);
+        if (leaf == NULL) {
+            talloc_free(level);
+            return -1;
+        }
+        leaf->count = (count / nodes) + (n < (count % nodes));
+        memcpy(leaf->pair, &pair[i], leaf->count * sizeof(fidx_pair_t));
+        i += leaf->count;
+        if (n > 0) {
+            level[n-1]->next = leaf;
+        }
+        level[n] = leaf;
+    }
+
+    while (nodes > 1) {
+        size_t parents = (nodes + FIDX_FILL - 1) / FIDX_FILL;
+
+        for (size_t n=0, i=0; n<parents; n++) {
+            fidx_node_t* inner = sub_node_new(tree, false);
+            if (inner == NULL) {
+                talloc_free(level);
+                return -1;
+            }
+            inner->count = (nodes / parents) + (n < (nodes % parents));
+            for (size_t k=0; k<inner->count; k++, i++) {
+                inner->pair[k]  = level[i]->pair[0];
+                inner->child[k] = level[i];
+            }
+            level[n] = inner;
+        }
+        nodes = parents;
+    }
+
+    tree->root = level[0];
+    talloc_free(level);
+    return 0;
+}
+
+
+
+
+static fidx_index_t* sub_find(fidx_item_t* fi, const char* name) {
+    for (int i=0; i<fi->count; i++) {
+        if (strcmp(fi->index[i].name, name) == 0) {
+            return &fi->index[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void sub_clear(fidx_index_t* ix) {
+    talloc_free(ix->bykey.ctx);
+    talloc_free(ix->byuid.ctx);
+    ix->bykey   = (fidx_tree_t){ .ctx = NULL, .root = NULL };
+    ix->byuid   = (fidx_tree_t){ .ctx = NULL, .root = NULL };
+    ix->count   = 0;
+    ix->built   = false;
+}
+
+
+static void sub_set(fidx_item_t* fi, fidx_index_t* ix, const void* image, uint64_t uid) {
+/// Moves a device to the key of its current value, in O(log n).  If a node
+/// can't be allocated, the index is cleared: an index without the device
+/// would hide it from select, while an unbuilt index is only slower.
+    const fidx_node_t* node;
+    uint64_t key;
+    bool valid;
+    size_t u;
+
+    valid   = (image != NULL) && sub_key(&key, image, &ix->field);
+    node    = sub_seek(&ix->byuid, uid, 0, &u);
+
+    if ((node != NULL) && (node->pair[u].a == uid)) {
+        uint64_t oldkey = node->pair[u].b;
+        if (valid && (oldkey == key)) {
+            return;
+        }
+        sub_remove(&ix->bykey, oldkey, uid);
+        sub_remove(&ix->byuid, uid, oldkey);
+        ix->count--;
+    }
+    if (valid == false) {
+        return;
+    }
+
+    if ((sub_insert(&ix->bykey, key, uid) != 0) || (sub_insert(&ix->byuid, uid, key) != 0)) {
+        sub_clear(ix);
+        return;
+    }
+    ix->count++;
+}
+
+
+static void sub_buildaction(const otfs_t* dev, size_t i, void* arg) {
+    fidx_build_t* build = arg;
+    build->valid[i] = sub_key(&build->key[i], dev->base, build->field);
+}
+
+
+static int sub_build(fidx_item_t* fi, fidx_index_t* ix, const tmpl_schema_t* schema, const otfs_t* dev, size_t devices) {
+    fidx_build_t build;
+    fidx_pair_t* bykey;
+    fidx_pair_t* byuid;
+    size_t count = 0;
+    int rc = 0;
+
+    sub_clear(ix);
+    if (query_resolve(&ix->field, schema, ix->name) != 0) {
+        return -1;
+    }
+
+    /// Keys are read from all the devices in parallel, then sorted and
+    /// loaded into the trees
+    build.field     = &ix->field;
+    build.key       = talloc_array(fi->ctx, uint64_t, devices + 1);
+    build.valid     = talloc_array(fi->ctx, uint8_t, devices + 1);
+    bykey           = talloc_array(fi->ctx, fidx_pair_t, devices + 1);
+    byuid           = talloc_array(fi->ctx, fidx_pair_t, devices + 1);
+    ix->bykey.ctx   = talloc_new(fi->ctx);
+    ix->byuid.ctx   = talloc_new(fi->ctx);
+    if ((build.key == NULL) || (build.valid == NULL) || (bykey == NULL) || (byuid == NULL)
+    || (ix->bykey.ctx == NULL) || (ix->byuid.ctx == NULL)) {
+        rc = -2;
+        goto sub_build_END;
+    }
+    query_parallel(dev, devices, &sub_buildaction, &build);
+
+    for (size_t i=0; i<devices; i++) {
+        if (build.valid[i]) {
+            bykey[count] = (fidx_pair_t){ .a = build.key[i], .b = dev[i].uid.u64 };
+            byuid[count] = (fidx_pair_t){ .a = dev[i].uid.u64, .b = build.key[i] };
+            count++;
+        }
+    }
+    qsort(bykey, count, sizeof(fidx_pair_t), &sub_paircmp);
+    qsort(byuid, count, sizeof(fidx_pair_t), &sub_paircmp);
+    if ((sub_load(&ix->bykey, bykey, count) != 0) || (sub_load(&ix->byuid, byuid, count) != 0)) {
+        rc = -2;
+        goto sub_build_END;
+    }
+    ix->count   = count;
+    ix->built   = true;
+    rc          = (int)count;
+
+    sub_build_END:
+    if (rc < 0) {
+        sub_clear(ix);
+    }
+    talloc_free(build.key);
+    talloc_free(build.valid);
+    talloc_free(bykey);
+    talloc_free(byuid);
+    return rc;
+}
+
+
+
+
+int fidx_init(fidx_t* handle) {
+    fidx_item_t* fi;
+
+    if (handle == NULL) {
+        return -1;
+    }
+    fi = calloc(1, sizeof(fidx_item_t));
+    if (fi == NULL) {
+        return -2;
+    }
+    fi->ctx = talloc_new(NULL);
+    if (fi->ctx == NULL) {
+        free(fi);
+        return -2;
+    }
+    if (pthread_mutex_init(&fi->mutex, NULL) != 0) {
+        talloc_free(fi->ctx);
+        free(fi);
+        return -3;
+    }
+    *handle = fi;
+    return 0;
+}
+
+
+void fidx_deinit(fidx_t handle) {
+    fidx_item_t* fi = handle;
+
+    if (fi != NULL) {
+        pthread_mutex_destroy(&fi->mutex);
+        talloc_free(fi->ctx);
+        free(fi);
+    }
+}
+
+
+int fidx_declare(fidx_t handle, const char* name) {
+    fidx_item_t* fi = handle;
+    fidx_index_t* ix;
+    int rc = 0;
+
+    if ((fi == NULL) || (name == NULL) || (strchr(name, '.') == NULL) || (strlen(name) >= sizeof(ix->name))) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    if (sub_find(fi, name) != NULL) {
+        rc = -2;
+    }
+    else if (fi->count >= OTDB_PARAM_FIDX_MAX) {
+        rc = -3;
+    }
+    else {
+        ix = &fi->index[fi->count++];
+        memset(ix, 0, sizeof(fidx_index_t));
+        snprintf(ix->name, sizeof(ix->name), "%s", name);
+    }
+    pthread_mutex_unlock(&fi->mutex);
+
+    return rc;
+}
+
+
+int fidx_drop(fidx_t handle, const char* name) {
+    fidx_item_t* fi = handle;
+    fidx_index_t* ix;
+    int rc = -1;
+
+    if ((fi == NULL) || (name == NULL)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    ix = sub_find(fi, name);
+    if (ix != NULL) {
+        sub_clear(ix);
+        fi->count--;
+        *ix = fi->index[fi->count];
+        ix->field.name = ix->name;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&fi->mutex);
+
+    return rc;
+}
+
+
+int fidx_build(fidx_t handle, const char* name, const tmpl_schema_t* schema, const otfs_t* dev, size_t devices) {
+    fidx_item_t* fi = handle;
+    fidx_index_t* ix;
+    int rc = -1;
+
+    if ((fi == NULL) || (name == NULL) || (schema == NULL)) {
+        return -1;
+    }
+
+    /// Updates wait for the build, so a change made while it reads a device
+    /// is applied to the built index.
+    pthread_mutex_lock(&fi->mutex);
+    ix = sub_find(fi, name);
+    if (ix != NULL) {
+        rc = sub_build(fi, ix, schema, dev, devices);
+    }
+    pthread_mutex_unlock(&fi->mutex);
+
+    return rc;
+}
+
+
+void fidx_rebuild(fidx_t handle, const tmpl_schema_t* schema, const otfs_t* dev, size_t devices) {
+    fidx_item_t* fi = handle;
+
+    if (fi == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    for (int i=0; i<fi->count; i++) {
+        if (schema != NULL) {
+            sub_build(fi, &fi->index[i], schema, dev, devices);
+        }
+        else {
+            sub_clear(&fi->index[i]);
+        }
+    }
+    pthread_mutex_unlock(&fi->mutex);
+}
+
+
+bool fidx_covers(fidx_t handle, uint8_t block_id, uint8_t file_id) {
+    fidx_item_t* fi = handle;
+    bool covers = false;
+
+    if (fi == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    for (int i=0; (i<fi->count) && (covers==false); i++) {
+        covers = fi->index[i].built
+              && (fi->index[i].field.block_id == block_id)
+              && (fi->index[i].field.file_id == file_id);
+    }
+    pthread_mutex_unlock(&fi->mutex);
+
+    return covers;
+}
+
+
+void fidx_update(fidx_t handle, const void* image, uint64_t uid, uint8_t block_id, uint8_t file_id) {
+    fidx_item_t* fi = handle;
+
+    if (fi == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    for (int i=0; i<fi->count; i++) {
+        fidx_index_t* ix = &fi->index[i];
+        if (ix->built && (ix->field.block_id == block_id) && (ix->field.file_id == file_id)) {
+            sub_set(fi, ix, image, uid);
+        }
+    }
+    pthread_mutex_unlock(&fi->mutex);
+}
+
+
+void fidx_updatedev(fidx_t handle, const void* image, uint64_t uid) {
+    fidx_item_t* fi = handle;
+
+    if (fi == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    for (int i=0; i<fi->count; i++) {
+        if (fi->index[i].built) {
+            sub_set(fi, &fi->index[i], image, uid);
+        }
+    }
+    pthread_mutex_unlock(&fi->mutex);
+}
+
+
+int fidx_lookup(fidx_t handle, TALLOC_CTX* ctx, const query_pred_t* pred, uint64_t** uids) {
+    fidx_item_t* fi = handle;
+    fidx_index_t* ix = NULL;
+    const fidx_node_t* node;
+    uint64_t lo = 0;
+    uint64_t hi = UINT64_MAX;
+    uint64_t key;
+    size_t first;
+    size_t i;
+    int rc;
+
+    if ((fi == NULL) || (pred == NULL) || (uids == NULL) || (pred->op == QOP_ne)) {
+        return -1;
+    }
+    *uids = NULL;
+
+    /// The key range of the predicate
+    if (pred->string != NULL) {
+        key = sub_hash((const uint8_t*)pred->string, pred->strsize);
+    }
+    else if (sub_numkey(&key, pred->number) == false) {
+        return 0;
+    }
+    switch (pred->op) {
+        case QOP_lt:    if (key == 0) return 0;
+                        hi = key - 1;
+                        break;
+        case QOP_le:    hi = key;
+                        break;
+        case QOP_gt:    if (key == UINT64_MAX) return 0;
+                        lo = key + 1;
+                        break;
+        case QOP_ge:    lo = key;
+                        break;
+        default:        lo = key;
+                        hi = key;
+                        break;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    for (int i=0; i<fi->count; i++) {
+        const query_field_t* field = &fi->index[i].field;
+        if (fi->index[i].built
+        && (field->block_id == pred->field.block_id) && (field->file_id == pred->field.file_id)
+        && (field->pos == pred->field.pos) && (field->bitpos == pred->field.bitpos)
+        && (field->type.index == pred->field.type.index) && (field->type.bits == pred->field.type.bits)) {
+            ix = &fi->index[i];
+            break;
+        }
+    }
+    if (ix == NULL) {
+        rc = -1;
+        goto fidx_lookup_END;
+    }
+
+    /// Candidates are counted, then copied, from the leaves in key order
+    rc = 0;
+    for (node=sub_seek(&ix->bykey, lo, 0, &first); node!=NULL; node=node->next, first=0) {
+        for (i=first; (i<node->count) && (node->pair[i].a <= hi); i++) {
+            rc++;
+        }
+        if (i < node->count) {
+            break;
+        }
+    }
+    if (rc > 0) {
+        *uids = talloc_array(ctx, uint64_t, rc);
+        if (*uids == NULL) {
+            rc = -1;
+            goto fidx_lookup_END;
+        }
+        rc = 0;
+        for (node=sub_seek(&ix->bykey, lo, 0, &first); node!=NULL; node=node->next, first=0) {
+            for (i=first; (i<node->count) && (node->pair[i].a <= hi); i++) {
+                (*uids)[rc++] = node->pair[i].b;
+            }
+            if (i < node->count) {
+                break;
+            }
+        }
+    }
+
+    fidx_lookup_END:
+    pthread_mutex_unlock(&fi->mutex);
+
+    if (rc > 1) {
+        qsort(*uids, rc, sizeof(uint64_t), &sub_uidcmp);
+    }
+    return rc;
+}
+
+
+int fidx_info(fidx_t handle, int i, char* name, size_t namemax, size_t* entries, bool* built) {
+    fidx_item_t* fi = handle;
+    int rc = -1;
+
+    if (fi == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fi->mutex);
+    if ((i >= 0) && (i < fi->count)) {
+        snprintf(name, namemax, "%s", fi->index[i].name);
+        *entries    = fi->index[i].count;
+        *built      = fi->index[i].built;
+        rc          = 0;
+    }
+    pthread_mutex_unlock(&fi->mutex);
+
+    return rc;
+}
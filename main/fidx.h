@@ -0,0 +1,143 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef fidx_h
+#define fidx_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Local Headers
+#include "query.h"
+#include "schema.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/** Field Indexes
+  * -------------------------------------------------------------------------
+  * Secondary indexes from the value of a template field to the UIDs of the
+  * devices that have that value.  An index is declared by field name, as
+  * used by select, and built against the schema of the open DB.  Declared
+  * indexes outlive the DB: they are rebuilt, in parallel, each time a DB is
+  * opened, and an index whose field isn't in the template stays declared
+  * but unbuilt.
+  *
+  * Values are kept as 64 bit keys in a B+tree, next to a B+tree by UID that
+  * finds the current key of a device, so an update is O(log n).  Keys of
+  * number fields keep the order of the numbers, so an index serves range
+  * lookups.  Keys of string and hex fields are hashes, which only serve
+  * equality lookups.
+  * Either way, a lookup returns candidates that the caller must still test.
+  *
+  * Indexes are updated whenever a change to a device is journaled, so they
+  * follow w, pub, pull, ingest and the others.  The indexes have their own
+  * mutex, so updates may come from any device lock.  An index that runs out
+  * of memory on an update becomes unbuilt, rather than lose the device, and
+  * select scans instead until the next open rebuilds it.
+  */
+
+typedef void* fidx_t;
+
+
+int fidx_init(fidx_t* handle);
+void fidx_deinit(fidx_t handle);
+
+
+/** @brief Declares an index on a field
+  * @param handle   (fidx_t) Index handle
+  * @param name     (const char*) file.field or file.field.subfield
+  * @retval         0 on success, -1 if the name is invalid, -2 if it is
+  *                 already indexed, -3 if there are OTDB_PARAM_FIDX_MAX
+  *                 indexes already.
+  *
+  * The index is empty until it is built by fidx_build() or fidx_rebuild().
+  */
+int fidx_declare(fidx_t handle, const char* name);
+
+/** @brief Drops an index
+  * @retval         0 on success, negative if there is no such index
+  */
+int fidx_drop(fidx_t handle, const char* name);
+
+
+/** @brief Builds one index from all the devices of the DB
+  * @param handle   (fidx_t) Index handle
+  * @param name     (const char*) Name of a declared index
+  * @param schema   (const tmpl_schema_t*) Schema of the DB
+  * @param dev      (const otfs_t*) All the devices of the DB
+  * @param devices  (size_t) Number of devices
+  * @retval         Number of devices in the index, or negative on error
+  */
+int fidx_build(fidx_t handle, const char* name, const tmpl_schema_t* schema, const otfs_t* dev, size_t devices);
+
+/** @brief Builds all the declared indexes, as by fidx_build()
+  */
+void fidx_rebuild(fidx_t handle, const tmpl_schema_t* schema, const otfs_t* dev, size_t devices);
+
+
+/** @brief Tests if any index has a field in a file
+  */
+bool fidx_covers(fidx_t handle, uint8_t block_id, uint8_t file_id);
+
+/** @brief Updates the indexes on a file of a device
+  * @param handle   (fidx_t) Index handle
+  * @param image    (const void*) Device FS image, or NULL if the device has
+  *                 been deleted
+  * @param uid      (uint64_t) Device UID
+  * @param block_id (uint8_t) Block of the changed file
+  * @param file_id  (uint8_t) ID of the changed file
+  */
+void fidx_update(fidx_t handle, const void* image, uint64_t uid, uint8_t block_id, uint8_t file_id);
+
+/** @brief Updates all the indexes of a device, as by fidx_update()
+  */
+void fidx_updatedev(fidx_t handle, const void* image, uint64_t uid);
+
+
+/** @brief Looks up the candidates of a predicate
+  * @param handle   (fidx_t) Index handle
+  * @param ctx      (TALLOC_CTX*) Context for the UID list
+  * @param pred     (const query_pred_t*) Predicate
+  * @param uids     (uint64_t**) Output UID list, in UID order
+  * @retval         Number of UIDs, or -1 if no index serves the predicate
+  *
+  * Candidates that don't match the predicate may be listed, because of
+  * hash collisions, so the caller must still test them.
+  */
+int fidx_lookup(fidx_t handle, TALLOC_CTX* ctx, const query_pred_t* pred, uint64_t** uids);
+
+
+/** @brief Gets the state of the i'th index, for listing
+  * @param handle   (fidx_t) Index handle
+  * @param i        (int) Index number, from 0
+  * @param name     (char*) Output name
+  * @param namemax  (size_t) Size of name
+  * @param entries  (size_t*) Output number of devices in the index
+  * @param built    (bool*) Output, true if the index is built
+  * @retval         0 on success, negative when there are no more indexes
+  */
+int fidx_info(fidx_t handle, int i, char* name, size_t namemax, size_t* entries, bool* built);
+
+
+#endif
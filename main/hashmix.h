@@ -0,0 +1,64 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef hashmix_h
+#define hashmix_h
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Hash Helpers
+  * -------------------------------------------------------------------------
+  * Helpers shared by the hash tables, shards and buckets keyed by UID or by
+  * address.  Such keys are often allocated in sequence, or aligned, so they
+  * are mixed before their low bits are used as an index.
+  */
+
+/** @brief Mixes a 64 bit key, with the first half of the murmur3 finalizer
+  * @param key      (uint64_t) Key, such as a UID or an address
+  * @retval         Mixed key, which has the entropy of the key in its low bits
+  */
+static inline uint64_t hashmix_u64(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+
+/** @brief Tells if an entry of an open-addressed table may shift back
+  * @param hole     (size_t) Slot that was emptied by a delete
+  * @param slot     (size_t) Slot of an entry after the hole, in its probe run
+  * @param home     (size_t) Slot that the key of the entry hashes to
+  * @retval         true if the entry moves into the hole, which keeps it
+  *                 reachable from its home once the hole is filled
+  *
+  * This is the test of deletion by backward shift with linear probing.  The
+  * caller walks the slots after the hole until an empty one, moving each
+  * entry that may shift into the hole, which is then at its old slot.
+  */
+static inline bool hashmix_canshift(size_t hole, size_t slot, size_t home) {
+    if (slot > hole) {
+        return (home <= hole) || (home > slot);
+    }
+    return (home <= hole) && (home > slot);
+}
+
+
+#endif
@@ -25,6 +25,7 @@
 
 // Standard C & POSIX Libraries
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #if 0 //OTDB_FEATURE_DEBUG
@@ -37,14 +38,12 @@
 
 
 
-static int sub_nextdevice(void* handle, otfs_t* outfs, int* devid_i, const char** strlist, size_t listsz) {
+static int sub_nextdevice(dterm_handle_t* dth, otfs_t* outfs, size_t* devid_i, const uint64_t* uidlist, size_t listsz) {
     int devtest = 1;
-    uint64_t uid;
 
     for (; (devtest!=0) && (*devid_i<listsz); (*devid_i)++) {
-        DEBUGPRINT("%s %d :: devid[%i] = %s\n", __FUNCTION__, __LINE__, *devid_i, strlist[*devid_i]);
-        uid = strtoull(strlist[*devid_i], NULL, 16);
-        devtest = otfs_setfs(handle, outfs, (uint8_t*)&uid);
+        DEBUGPRINT("%s %d :: devid[%zu] = %016"PRIx64"\n", __FUNCTION__, __LINE__, *devid_i, uidlist[*devid_i]);
+        devtest = devcache_setfs(dth->ext->devcache, dth->ext->db, outfs, (uint8_t*)&uidlist[*devid_i]);
     }
     
     return devtest;
@@ -52,53 +51,135 @@ static int sub_nextdevice(void* handle, otfs_t* outfs, int* devid_i, const char*
 
 
 
-int iterator_uids(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t** src, size_t dstmax,
-                cmd_arglist_t* arglist, iteraction_t action) {
-    int devtest;
-    int devid_i = 0;
-    int count;
-    int outbytes = 0;
-    otfs_t devfs;
-    int dstlimit;
+uint64_t* iterator_parseset(TALLOC_CTX* ctx, const char* devid_set, size_t* count) {
+/// Parses a comma separated list of HEX UIDs, as given to -I
+    const char* cursor = devid_set;
+    uint64_t* uid;
+    size_t alloc = 1;
+    size_t i = 0;
+    char* end;
+
+    for (size_t j=0; cursor[j]!=0; j++) {
+        alloc += (cursor[j] == ',');
+    }
+    uid = talloc_array(ctx, uint64_t, alloc);
+    while ((uid != NULL) && (i < alloc) && (*cursor != 0)) {
+        uid[i]  = strtoull(cursor, &end, 16);
+        i      += (end != cursor);
+        if ((*end != ',') && (*end != 0)) {
+            break;
+        }
+        cursor = (*end == ',') ? end+1 : end;
+    }
+
+    *count = i;
+    return uid;
+}
+
+
 
-    if (arglist->devid_strlist_size > 0) {
-        devtest = sub_nextdevice(dth->ext->db, &devfs, &devid_i, arglist->devid_strlist, arglist->devid_strlist_size);
+static uint64_t* sub_snapshot_uids(dterm_handle_t* dth, cmd_arglist_t* arglist, size_t* listsz) {
+/// The UID list is resolved before iterating, so actions may yield the DB
+/// engine (e.g. to wait on devmgr) without the argtable strings or the otfs
+/// iterator changing underneath.
+    uint64_t* uidlist;
+    size_t alloc;
+    size_t i;
+    
+    if (arglist->devid_set != NULL) {
+        uidlist = iterator_parseset(dth->tctx, arglist->devid_set, &alloc);
+    }
+    else if (arglist->devid_strlist_size > 0) {
+        alloc   = (size_t)arglist->devid_strlist_size;
+        uidlist = talloc_array(dth->tctx, uint64_t, alloc);
+        if (uidlist != NULL) {
+            for (i=0; i<alloc; i++) {
+                uidlist[i] = strtoull(arglist->devid_strlist[i], NULL, 16);
+            }
+        }
     }
     else {
+        otfs_t devfs;
         uint64_t uid = 0;
+        int devtest;
+        
+        alloc   = 64;
+        i       = 0;
+        uidlist = talloc_array(dth->tctx, uint64_t, alloc);
         devtest = otfs_iterator_start(dth->ext->db, &devfs, (uint8_t*)&uid);
+        while ((uidlist != NULL) && (devtest == 0)) {
+            if (i >= alloc) {
+                alloc  *= 2;
+                uidlist = talloc_realloc(dth->tctx, uidlist, uint64_t, alloc);
+                if (uidlist == NULL) {
+                    break;
+                }
+            }
+            uidlist[i++] = devfs.uid.u64;
+            uid     = 0;
+            devtest = otfs_iterator_next(dth->ext->db, &devfs, (uint8_t*)&uid);
+        }
+        alloc = i;
     }
     
-    dstlimit = (int)dstmax;
+    *listsz = alloc;
+    return uidlist;
+}
+
+
+
+int iterator_uids(dterm_handle_t* dth, uint8_t** dst, int* inbytes, uint8_t** src, size_t* dstmax,
+                cmd_arglist_t* arglist, iteraction_t action) {
+    int devtest;
+    size_t devid_i = 0;
+    int count;
+    otfs_t devfs;
+    uint64_t* uidlist;
+    size_t listsz;
+
+    uidlist = sub_snapshot_uids(dth, arglist, &listsz);
+    if (uidlist == NULL) {
+        return -1;
+    }
+    devtest = sub_nextdevice(dth, &devfs, &devid_i, uidlist, listsz);
+    
     count = 0;
     while (devtest == 0) {
         int newbytes;
         count++;
         
-        newbytes = action(dth, dst, inbytes, src, (size_t)dstlimit, count, arglist, &devfs);
+        /// Commit the output so far, and get a fresh chunk for the action
+        *dst = dtwriter_advance(dth->out, *dst, dstmax, OTDB_PARAM_OUTBUF_CHUNK);
+        if (*dst == NULL) {
+            count = -4;
+            goto iterator_EXIT;
+        }
+        
+        newbytes = action(dth, *dst, inbytes, src, *dstmax, count, arglist, &devfs);
         
         if (newbytes < 0) {
-            outbytes = -3;
+            count = -3;
             goto iterator_EXIT;
         }
-        if (dstlimit < 0 ) {
-            outbytes = -4;
+        if (newbytes >= (int)*dstmax) {
+            count = -4;
             goto iterator_EXIT;
         }
         
-        dstlimit   -= newbytes;
-        dst        += newbytes;
-        outbytes   += newbytes;
+        *dstmax    -= newbytes;
+        *dst       += newbytes;
         
-        if (arglist->devid_strlist_size > 0) {
-            devtest = sub_nextdevice(dth->ext->db, &devfs, &devid_i, arglist->devid_strlist, arglist->devid_strlist_size);
-        }
-        else {
-            uint64_t uid = 0;
-            devtest = otfs_iterator_next(dth->ext->db, &devfs, (uint8_t*)&uid);
+        /// Output past the bound of the connection goes out now, with the
+        /// locks released.  The next device is looked up afterwards.
+        if (dterm_drain(dth, dst, dstmax) < 0) {
+            count = -4;
+            goto iterator_EXIT;
         }
+        
+        devtest = sub_nextdevice(dth, &devfs, &devid_i, uidlist, listsz);
     }
 
     iterator_EXIT:
-    return outbytes;
+    talloc_free(uidlist);
+    return count;
 }
@@ -32,5 +32,32 @@ typedef int (*iteraction_t)(dterm_handle_t*, uint8_t*, int*, uint8_t**, size_t,
 
 
 
-int iterator_uids(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t** src, size_t dstmax,
+/** @brief Parses a comma separated list of HEX UIDs, as given to -I
+  * @param ctx      (TALLOC_CTX*) Context of the output array
+  * @param devid_set (const char*) List of UIDs
+  * @param count    (size_t*) Output, number of UIDs parsed
+  * @retval         Array of UIDs, or NULL on OOM.  Parsing stops at the first
+  *                 character that isn't part of a UID or a comma.
+  */
+uint64_t* iterator_parseset(TALLOC_CTX* ctx, const char* devid_set, size_t* count);
+
+
+/** @brief Runs an action on each device in the arglist, or on all devices
+  * @param dth      (dterm_handle_t*) Controlling interface handle
+  * @param dst      (uint8_t**) Output cursor, adjusted on return
+  * @param inbytes  (int*) Passed-through to action
+  * @param src      (uint8_t**) Passed-through to action
+  * @param dstmax   (size_t*) Space available at output cursor, adjusted on return
+  * @param arglist  (cmd_arglist_t*) Command arguments
+  * @param action   (iteraction_t) Action called for each device
+  * @retval         Number of devices iterated, or negative on error
+  *
+  * Output written by the caller at *dst before calling, and each action's
+  * output, is committed to the response writer (dth->out) as the iteration
+  * proceeds.  Output of a long iteration is therefore streamed to the client
+  * instead of being truncated.  Actions are given at least
+  * OTDB_PARAM_OUTBUF_CHUNK bytes, which they may also use as scratch space.
+  * Output of the last action is left uncommitted at *dst.
+  */
+int iterator_uids(dterm_handle_t* dth, uint8_t** dst, int* inbytes, uint8_t** src, size_t* dstmax,
                 cmd_arglist_t* arglist, iteraction_t action);
@@ -338,9 +338,8 @@ int jst_extract_typesize(typeinfo_enum* type, cJSON* meta) {
 
 int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* type, cJSON* value) {
     typeinfo_t typeinfo;
-    int bytesout;
     DEBUGPRINT("%s %d :: dst=%016"PRIx64", limit=%i, bitpos=%u, type=%s, value=%016"PRIx64"\n", __FUNCTION__, __LINE__, (uint64_t)dst, limit, bitpos, type, (uint64_t)value);
-    if ((dst==NULL) || (limit<=0) || (type==NULL) || (value==NULL)) {
+    if (type == NULL) {
         return 0;
     }
 
@@ -348,14 +347,28 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
     if (jst_typesize(&typeinfo, type) != 0) {
         return 0;
     }
+    
+    return jst_load_typed(dst, limit, bitpos, &typeinfo, value);
+}
+
+
+
+int jst_load_typed(uint8_t* dst, int limit, unsigned int bitpos, const typeinfo_t* typeinfo, cJSON* value) {
+    int bytesout;
+    if ((dst==NULL) || (limit<=0) || (typeinfo==NULL) || (value==NULL)) {
+        return 0;
+    }
+    if (typeinfo->index >= TYPE_MAX) {
+        return 0;
+    }
 
     bytesout = 0;
-    switch (typeinfo.index) {
+    switch (typeinfo->index) {
         // Bitmask type is a container that holds non-byte contents
         // It returns a negative number of its size in bytes
         case TYPE_bitmask: {
             DEBUGPRINT("%s %d :: Loading bitmask type (container only)\n", __FUNCTION__, __LINE__);
-            return -(typeinfo.bits/8);
+            return -(typeinfo->bits/8);
         }
         
         // Bit types require a mask and set operation
@@ -370,8 +383,8 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
         case TYPE_bit8: {
             ot_uni32 scr;
             unsigned long dat       = 0;
-            unsigned long maskbits  = typeinfo.bits;
-            DEBUGPRINT("%s %d :: Loading bit%d_t type\n", __FUNCTION__, __LINE__, typeinfo.bits);
+            unsigned long maskbits  = typeinfo->bits;
+            DEBUGPRINT("%s %d :: Loading bit%d_t type\n", __FUNCTION__, __LINE__, typeinfo->bits);
             
             if (cJSON_IsNumber(value)) {
                 dat = value->valueint;
@@ -380,7 +393,7 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
                 cmd_hexnread((uint8_t*)&dat, value->valuestring, sizeof(unsigned long));
             }
             if ((1+((bitpos+maskbits)/8)) > limit) {
-                goto jst_load_element_END;
+                goto jst_load_typed_END;
             }
             
             ///@todo this may be endian dependent
@@ -397,7 +410,7 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
         // String and hex types have length determined by value test
         case TYPE_string: {
             if (cJSON_IsString(value)) {
-                bytesout = typeinfo.bits/8;
+                bytesout = typeinfo->bits/8;
                 if (bytesout <= limit) {
                     DEBUGPRINT("%s %d :: Loading string type (bytesout=%d)\n", __FUNCTION__, __LINE__, bytesout);
                     memcpy(dst, (char*)(value->valuestring), bytesout);
@@ -407,7 +420,7 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
         
         case TYPE_hex: {
             if (cJSON_IsString(value)) {
-                bytesout = typeinfo.bits/8;
+                bytesout = typeinfo->bits/8;
                 if (bytesout <= limit) {
                     DEBUGPRINT("%s %d :: Loading hex type (bytesout=%d)\n", __FUNCTION__, __LINE__, bytesout);
                     cmd_hexnread(dst, (char*)(value->valuestring), bytesout);
@@ -426,8 +439,8 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
         case TYPE_uint64: 
         case TYPE_float:
         case TYPE_double: {
-            bytesout = typeinfo.bits/8;
-            DEBUGPRINT("%s %d :: type %d (%d bits), limit=%i\n", __FUNCTION__, __LINE__, typeinfo.index, typeinfo.bits, limit);
+            bytesout = typeinfo->bits/8;
+            DEBUGPRINT("%s %d :: type %d (%d bits), limit=%i\n", __FUNCTION__, __LINE__, typeinfo->index, typeinfo->bits, limit);
             if (bytesout <= limit) {
                 if (cJSON_IsString(value)) {
                     memset(dst, 0, bytesout);
@@ -435,12 +448,12 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
                     DEBUGPRINT("%s %d :: Loading arithmetic type as hex type (%d bytes)\n", __FUNCTION__, __LINE__, bytesout);
                 }
                 else if (cJSON_IsNumber(value)) {
-                    if (typeinfo.index == TYPE_float) {
+                    if (typeinfo->index == TYPE_float) {
                         float tmp = (float)value->valuedouble;
                         memcpy(dst, &tmp, bytesout);
                         DEBUGPRINT("%s %d :: Loading float type (data=%f)\n", __FUNCTION__, __LINE__, tmp);
                     }
-                    else if (typeinfo.index == TYPE_double) {
+                    else if (typeinfo->index == TYPE_double) {
                         memcpy(dst, &value->valuedouble, bytesout);
                         DEBUGPRINT("%s %d :: Loading double type (data=%lf)\n", __FUNCTION__, __LINE__, value->valuedouble);
                     }
@@ -455,30 +468,15 @@ int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* t
         default: break;
     }
     
-    jst_load_element_END:
+    jst_load_typed_END:
     return bytesout;
 }
 
 
 
-cJSON* jst_store_element(cJSON* parent, char* name, void* src, typeinfo_enum type, unsigned long bitpos, int bits) {
-    cJSON* newitem;
-    double number;
-    char hexbuf[512];
-    
-    if ((parent==NULL) || (bits<=0) || (src==NULL)) {
-        return 0;
-    }
-    
+bool jst_read_number(double* number, const void* src, typeinfo_enum type, unsigned long bitpos, int bits) {
     switch (type) {
-        // Bitmask type is a container that holds non-byte contents
-        // It returns a negative number of its size in bytes
-        case TYPE_bitmask: {
-            newitem = cJSON_AddObjectToObject(parent, name);
-        } break;
-        
-        // Bit types require a mask and set operation
-        // They return 0
+        // Bit types require a mask and shift operation
         case TYPE_bit1: 
         case TYPE_bit2:
         case TYPE_bit3:
@@ -496,89 +494,109 @@ cJSON* jst_store_element(cJSON* parent, char* name, void* src, typeinfo_enum typ
             maskbits    = ((1<<maskbits) - 1) << bitpos;
             scr.ulong  &= maskbits;
             scr.ulong >>= bitpos;
-            number      = (double)scr.ulong;
-        } goto jst_store_element_STOREDOUBLE;
-    
-        // String and hex types have length determined by value test
-        case TYPE_string: {
-            int end             = bits/8;
-            char saved_char     = ((char*)src)[end];
-            ((char*)src)[end]   = 0;
-            newitem             = cJSON_AddStringToObject(parent, name, src);
-            ((char*)src)[end]   = saved_char;
-        } break;
-        
-        case TYPE_hex: {
-            int bytes   = bits/8;
-            int end     = bits/4;
-            if (end > (sizeof(hexbuf)-1)) {
-                end = sizeof(hexbuf)-1;
-            }
-            hexbuf[end] = 0;
-            cmd_hexwrite(hexbuf, src, bytes);
-            newitem     = cJSON_AddStringToObject(parent, name, hexbuf);
+            *number     = (double)scr.ulong;
         } break;
     
         // Fixed length data types
         case TYPE_int8: {
-            number  = (double)*(int8_t*)src;    
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)*(int8_t*)src;    
+        } break;
         case TYPE_uint8: {
-            number  = (double)*(uint8_t*)src;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)*(uint8_t*)src;
+        } break;
         case TYPE_int16: {
             int16_t store;
             memcpy(&store, src, sizeof(int16_t));
-            number  = (double)store;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)store;
+        } break;
         case TYPE_uint16: {
             uint16_t store;
             memcpy(&store, src, sizeof(uint16_t));
-            number  = (double)store;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)store;
+        } break;
         case TYPE_int32: {
             int32_t store;
             memcpy(&store, src, sizeof(uint32_t));
-            number  = (double)store;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)store;
+        } break;
         case TYPE_uint32: {
             uint32_t store;
             memcpy(&store, src, sizeof(uint32_t));
-            number  = (double)store;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)store;
+        } break;
         case TYPE_int64: {
             int64_t store;
             memcpy(&store, src, sizeof(int64_t));
-            number  = (double)store;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)store;
+        } break;
         case TYPE_uint64: {
             uint64_t store;
             memcpy(&store, src, sizeof(uint64_t));
-            number  = (double)store;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)store;
+        } break;
         case TYPE_float: {
             float store;
             memcpy(&store, src, sizeof(float));
-            number  = (double)store;
-            goto jst_store_element_STOREDOUBLE;
-        }
+            *number = (double)store;
+        } break;
         case TYPE_double: {
-            memcpy(&number, src, sizeof(double));
-            
-            jst_store_element_STOREDOUBLE:
-            newitem = cJSON_AddNumberToObject(parent, name, number);
+            memcpy(number, src, sizeof(double));
         } break;
     
+        // Bitmask, string and hex types are not numbers
         default: 
-            newitem = NULL;
+            return false;
+    }
+    
+    return true;
+}
+
+
+
+cJSON* jst_store_element(cJSON* parent, char* name, void* src, typeinfo_enum type, unsigned long bitpos, int bits) {
+    cJSON* newitem;
+    double number;
+    char hexbuf[512];
+    
+    if ((parent==NULL) || (bits<=0) || (src==NULL)) {
+        return 0;
+    }
+    
+    switch (type) {
+        // Bitmask type is a container that holds non-byte contents
+        // It returns a negative number of its size in bytes
+        case TYPE_bitmask: {
+            newitem = cJSON_AddObjectToObject(parent, name);
+        } break;
+    
+        // String and hex types have length determined by value test
+        case TYPE_string: {
+            int end             = bits/8;
+            char saved_char     = ((char*)src)[end];
+            ((char*)src)[end]   = 0;
+            newitem             = cJSON_AddStringToObject(parent, name, src);
+            ((char*)src)[end]   = saved_char;
+        } break;
+        
+        case TYPE_hex: {
+            int bytes   = bits/8;
+            int end     = bits/4;
+            if (end > (sizeof(hexbuf)-1)) {
+                end = sizeof(hexbuf)-1;
+            }
+            hexbuf[end] = 0;
+            cmd_hexwrite(hexbuf, src, bytes);
+            newitem     = cJSON_AddStringToObject(parent, name, hexbuf);
+        } break;
+    
+        // Bit types and fixed length data types are numbers
+        default: 
+            if (jst_read_number(&number, src, type, bitpos, bits)) {
+                newitem = cJSON_AddNumberToObject(parent, name, number);
+            }
+            else {
+                newitem = NULL;
+            }
             break;
     }
     
@@ -99,6 +99,13 @@ int jst_extract_typesize(typeinfo_enum* type, cJSON* meta);
 
 int jst_load_element(uint8_t* dst, int limit, unsigned int bitpos, const char* type, cJSON* value);
 
+/// Same as jst_load_element(), with the type already parsed by jst_typesize()
+int jst_load_typed(uint8_t* dst, int limit, unsigned int bitpos, const typeinfo_t* typeinfo, cJSON* value);
+
+/// Reads a bit type or fixed length type as a number.  Returns false for
+/// other types.
+bool jst_read_number(double* number, const void* src, typeinfo_enum type, unsigned long bitpos, int bits);
+
 cJSON* jst_store_element(cJSON* parent, char* name, void* src, typeinfo_enum type, unsigned long bitpos, int bits);
 
 int jst_aggregate_json(void* memctx, cJSON** aggregate, const char* path, const char* fname);
@@ -41,8 +41,17 @@
 #include "cmdhistory.h"
 #include "cliopt.h"
 #include "debug.h"
+#include "devcache.h"
+#include "txn.h"
+#include "fidx.h"
+#include "sflight.h"
+#include "devimage.h"
+#include "dirty.h"
+#include "dm_ingest.h"
+#include "dm_mux.h"
 #include "popen2.h"
 #include "sockpush.h"
+#include "wal.h"
 
 // Local Package Libraries
 #include <argtable3.h>
@@ -99,13 +108,15 @@ cli_struct cli;
   */
 
 static void sub_tfree(void* ctx) {
-    talloc_free(ctx);
+    devimage_free(ctx);
 }
 
 static void sub_json_loadargs(  cJSON* json, 
                                 int* verbose_val,
                                 int* debug_val,
                                 int* intf_val, 
+                                int* backlog_val,
+                                int* workers_val,
                                 char** socket, 
                                 char** initfile,
                                 char** devmgr,
@@ -218,6 +229,8 @@ int main(int argc, char* argv[]) {
     struct arg_lit  *debug   = arg_lit0("d","debug",                    "Set debug mode on: requires compiling for debug");
     struct arg_str  *intf    = arg_str0("i","intf", "interactive|pipe|socket", "Interface select.  Default: interactive");
     struct arg_file *socket  = arg_file0("S","socket","path/addr",      "Socket path/address to use for otdb daemon");
+    struct arg_int  *backlog = arg_int0(NULL,"backlog","N",             "Socket listen backlog.  Default: 128");
+    struct arg_int  *workers = arg_int0(NULL,"workers","N",             "Socket worker threads.  Default: number of CPUs");
     struct arg_file *initfile= arg_file0("I","init","path",             "Path to initialization routine to run at startup");
     struct arg_str  *devmgr  = arg_str0("D", "devmgr", "cmd string",    "Command string to invoke device manager app");
     struct arg_file *xpath   = arg_file0("x", "xpath", "<filepath>",    "Path to directory of external data processor programs");
@@ -225,7 +238,7 @@ int main(int argc, char* argv[]) {
     struct arg_lit  *version = arg_lit0(NULL,"version",                 "print version information and exit");
     struct arg_end  *end     = arg_end(10);
     
-    void* argtable[] = { config, verbose, debug, intf, socket, initfile, devmgr, xpath, help, version, end };
+    void* argtable[] = { config, verbose, debug, intf, socket, backlog, workers, initfile, devmgr, xpath, help, version, end };
     const char* progname = OTDB_PARAM(NAME);
     int nerrors;
     bool bailout        = true;
@@ -240,6 +253,8 @@ int main(int argc, char* argv[]) {
     char* buffer        = NULL;
     
     INTF_Type intf_val  = INTF_interactive;
+    int backlog_val     = 0;
+    int workers_val     = 0;
     bool verbose_val    = false;
     bool debug_val      = false;
     
@@ -334,7 +349,7 @@ int main(int argc, char* argv[]) {
             goto main_FINISH;
         }
         {   int tmp_intf, tmp_verbose, tmp_debug;
-            sub_json_loadargs(json, &tmp_debug, &tmp_verbose, &tmp_intf, &socket_val, &initfile_val, &devmgr_val, &xpath_val);
+            sub_json_loadargs(json, &tmp_debug, &tmp_verbose, &tmp_intf, &backlog_val, &workers_val, &socket_val, &initfile_val, &devmgr_val, &xpath_val);
             intf_val    = tmp_intf;
             verbose_val = (bool)tmp_verbose;
             debug_val   = (bool)tmp_debug;
@@ -361,6 +376,16 @@ int main(int argc, char* argv[]) {
     test = sub_copy_stringarg(&xpath_val, xpath->count, xpath->filename[0]);
     if (test < 0)       goto main_FINISH;
 
+    if (backlog->count != 0) {
+        backlog_val = backlog->ival[0];
+    }
+    cliopts.backlog = backlog_val;
+    
+    if (workers->count != 0) {
+        workers_val = workers->ival[0];
+    }
+    cliopts.workers = workers_val;
+
     if (verbose->count != 0) {
         verbose_val = true;
     }
@@ -418,15 +443,24 @@ int otdb_main(  INTF_Type intf_val,
     // Devmgr process
     childproc_t devmgr_proc;
     sp_handle_t sockpush_handle;
+    dm_ingest_t ingest_handle = NULL;
     cmdtab_t main_cmdtab;
     
     // Application data hooked into dterm
     dterm_ext_t appdata = {
         .cmdtab = NULL,
         .devmgr = NULL,
+        .devmux = NULL,
+        .dirty = NULL,
+        .wal = NULL,
+        .devcache = NULL,
+        .txn = NULL,
+        .fidx = NULL,
+        .sflight = NULL,
         .db = NULL,
         .tmpl_fs = NULL,
-        .tmpl = NULL
+        .tmpl = NULL,
+        .schema = NULL
     };
     
     // DTerm Datastructs
@@ -464,6 +498,11 @@ int otdb_main(  INTF_Type intf_val,
         if (sp_open(&sockpush_handle, devmgr, 0) == 0) {
             appdata.use_socket  = true;
             appdata.devmgr      = sockpush_handle;
+            if (dm_mux_open(&appdata.devmux, sockpush_handle) != 0) {
+                fprintf(stderr, "Err: \"%s\" multiplexer could not be started.\n", devmgr);
+                cli.exitcode = -2;
+                goto otdb_main_TERM2;
+            }
         }
         else if (popen2(&devmgr_proc, devmgr, POPEN2_PERSISTENT) == 0) {
             appdata.use_socket  = false;
@@ -491,6 +530,38 @@ int otdb_main(  INTF_Type intf_val,
     cmd_init(&main_cmdtab, xpath);
     DEBUG_PRINTF("--> done\n");
    
+    /// Initialize tracking of changes for incremental saves
+    if (dirty_init(&appdata.dirty) != 0) {
+        fprintf(stderr, "Err: change tracking cannot be initialized.\n");
+        cli.exitcode = -2;
+        goto otdb_main_TERM2;
+    }
+    if (wal_init(&appdata.wal) != 0) {
+        fprintf(stderr, "Err: write-ahead log cannot be initialized.\n");
+        cli.exitcode = -2;
+        goto otdb_main_TERM2;
+    }
+    if (devcache_init(&appdata.devcache) != 0) {
+        fprintf(stderr, "Err: device cache cannot be initialized.\n");
+        cli.exitcode = -2;
+        goto otdb_main_TERM2;
+    }
+    if (txn_init(&appdata.txn) != 0) {
+        fprintf(stderr, "Err: transactions cannot be initialized.\n");
+        cli.exitcode = -2;
+        goto otdb_main_TERM2;
+    }
+    if (fidx_init(&appdata.fidx) != 0) {
+        fprintf(stderr, "Err: field indexes cannot be initialized.\n");
+        cli.exitcode = -2;
+        goto otdb_main_TERM2;
+    }
+    if (sflight_init(&appdata.sflight) != 0) {
+        fprintf(stderr, "Err: refresh coalescing cannot be initialized.\n");
+        cli.exitcode = -2;
+        goto otdb_main_TERM2;
+    }
+   
     /// Initialize DTerm data objects
     /// Non intrinsic dterm elements (cmdtab, devmgr, ext, tmpl) get attached
     /// following initialization
@@ -500,6 +571,18 @@ int otdb_main(  INTF_Type intf_val,
         goto otdb_main_TERM2;
     }
     DEBUG_PRINTF("--> done\n");
+    
+    /// Reports that devices send unsolicited through devmgr are stored into
+    /// the DB as they arrive.  This needs the DTerm locks.
+    if ((appdata.devmgr != NULL) && appdata.use_socket) {
+        DEBUG_PRINTF("Starting device report ingest ...\n");
+        if (dm_ingest_open(&ingest_handle, &dterm_handle, appdata.devmgr) != 0) {
+            fprintf(stderr, "Err: device report ingest could not be started.\n");
+            cli.exitcode = -2;
+            goto otdb_main_TERM1;
+        }
+        DEBUG_PRINTF("--> done\n");
+    }
 
     /// Open DTerm interface & Setup DTerm threads
     /// If sockets are not used, by design socket_path will be NULL.
@@ -571,6 +654,9 @@ int otdb_main(  INTF_Type intf_val,
     pthread_cancel(thr_dterm);
    
     otdb_main_TERM1:
+    DEBUG_PRINTF("Stopping device report ingest\n");
+    dm_ingest_close(ingest_handle);
+    
     ///@todo OTFS freeing procedure might be best to do internally... hard to say
     DEBUG_PRINTF("Freeing OTFS\n");
     if (dterm_handle.ext->db != NULL) {
@@ -584,6 +670,7 @@ int otdb_main(  INTF_Type intf_val,
     if (appdata.devmgr != NULL) {
         if (appdata.use_socket) {
             DEBUG_PRINTF("Closing Device Manager socket\n");
+            dm_mux_close(appdata.devmux);
             sp_close(appdata.devmgr);
         }
         else {
@@ -594,6 +681,12 @@ int otdb_main(  INTF_Type intf_val,
     
     DEBUG_PRINTF("Freeing cmdtab\n");
     cmdtab_free(&main_cmdtab);
+    sflight_deinit(appdata.sflight);
+    fidx_deinit(appdata.fidx);
+    txn_deinit(appdata.txn);
+    devcache_deinit(appdata.devcache);
+    wal_deinit(appdata.wal);
+    dirty_deinit(appdata.dirty);
     
     otdb_main_TERM3:
     DEBUG_PRINTF("Destroying threading objects\n");
@@ -612,7 +705,7 @@ int otdb_main(  INTF_Type intf_val,
 
 
 
-void sub_json_loadargs(cJSON* json, int* debug_val, int* verbose_val, int* intf_val, char** socket, char** initfile, char** devmgr, char** xpath) {
+void sub_json_loadargs(cJSON* json, int* debug_val, int* verbose_val, int* intf_val, int* backlog_val, int* workers_val, char** socket, char** initfile, char** devmgr, char** xpath) {
 
 #   define GET_STRINGENUM_ARG(DST, FUNC, NAME) do { \
         arg = cJSON_GetObjectItem(json, NAME);  \
@@ -678,6 +771,8 @@ void sub_json_loadargs(cJSON* json, int* debug_val, int* verbose_val, int* intf_
     /// 2. Systematically get all of the individual arguments
     GET_BOOL_ARG(debug_val, "debug");
     GET_BOOL_ARG(verbose_val, "verbose");
+    GET_INT_ARG(backlog_val, "backlog");
+    GET_INT_ARG(workers_val, "workers");
 }
 
 
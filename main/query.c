@@ -0,0 +1,409 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "query.h"
+#include "cmds.h"
+#include "workpool.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/// Scans of fewer devices than this per worker aren't worth a thread
+#define QUERY_MINSLICE      1024
+
+
+typedef struct {
+    const otfs_t*       dev;
+    size_t              first;
+    size_t              count;
+    query_action_t      action;
+    void*               arg;
+} query_slice_t;
+
+typedef struct {
+    const query_pred_t* pred;
+    int                 preds;
+    uint8_t*            hit;
+} query_scan_t;
+
+
+
+
+static int sub_fieldbytes(const typeinfo_t* type) {
+    if ((type->index >= TYPE_bit1) && (type->index <= TYPE_bit8)) {
+        return 1 + (type->bits / 8);
+    }
+    return type->bits / 8;
+}
+
+
+static const vl_header_t* sub_findheader(const void* image, uint8_t block_id, uint8_t file_id) {
+/// Same layout as used by push: the header tables of GFB, ISS and ISF follow
+/// the FS header, in that order.
+    const vlFSHEADER* fshdr = image;
+    const vl_header_t* fhdr;
+    int tab_offset;
+    int files;
+
+    switch (block_id) {
+        case VL_GFB_BLOCKID:
+            tab_offset  = 0;
+            files       = fshdr->gfb.used;
+            break;
+        case VL_ISS_BLOCKID:
+            tab_offset  = fshdr->gfb.files;
+            files       = fshdr->iss.used;
+            break;
+        case VL_ISF_BLOCKID:
+            tab_offset  = fshdr->gfb.files + fshdr->iss.files;
+            files       = fshdr->isf.used;
+            break;
+        default:
+            return NULL;
+    }
+
+    fhdr = (const vl_header_t*)((const uint8_t*)image + sizeof(vlFSHEADER)) + tab_offset;
+    for (int i=0; i<files; i++) {
+        ot_uni16 idmod;
+        idmod.ushort = fhdr[i].idmod;
+        if (idmod.ubyte[0] == file_id) {
+            return &fhdr[i];
+        }
+    }
+    return NULL;
+}
+
+
+
+
+int query_resolve(query_field_t* field, const tmpl_schema_t* schema, const char* name) {
+    char buf[128];
+    char* fieldname;
+    char* subname;
+    const tmpl_file_t* file;
+    const tmpl_field_t* tfield;
+    int i;
+
+    if ((field == NULL) || (schema == NULL) || (name == NULL)) {
+        return -1;
+    }
+    snprintf(buf, sizeof(buf), "%s", name);
+    fieldname = strchr(buf, '.');
+    if (fieldname == NULL) {
+        return -2;
+    }
+    *fieldname++ = 0;
+    subname = strchr(fieldname, '.');
+    if (subname != NULL) {
+        *subname++ = 0;
+    }
+
+    file = schema_findfile(schema, buf);
+    if ((file == NULL) || (file->ctype != CONTENT_struct)) {
+        return -3;
+    }
+    tfield = &schema->field[file->field_first];
+    for (i=0; i<file->field_count; i++, tfield++) {
+        if (strcmp(tfield->name, fieldname) == 0) {
+            break;
+        }
+    }
+    if (i >= file->field_count) {
+        return -4;
+    }
+
+    field->name     = name;
+    field->block_id = file->block;
+    field->file_id  = file->id;
+    field->pos      = tfield->pos;
+    field->bitpos   = tfield->bitpos;
+    field->type     = tfield->type;
+
+    /// Subfields are read as imported when the element has typed subfields,
+    /// otherwise as exported, with the type of the element.
+    if (subname != NULL) {
+        const tmpl_subfield_t* sub;
+
+        if (tfield->nested) {
+            sub = &schema->sub[tfield->imp_first];
+            for (i=0; (i<tfield->imp_count) && (strcmp(sub->name, subname)!=0); i++, sub++);
+            if (i >= tfield->imp_count) {
+                return -5;
+            }
+            field->pos      = tfield->nest_pos;
+            field->type     = sub->type;
+        }
+        else {
+            sub = &schema->sub[tfield->exp_first];
+            for (i=0; (i<tfield->exp_count) && (strcmp(sub->name, subname)!=0); i++, sub++);
+            if (i >= tfield->exp_count) {
+                return -5;
+            }
+        }
+        field->bitpos = sub->bitpos;
+    }
+
+    if ((field->type.index >= TYPE_MAX) || (sub_fieldbytes(&field->type) <= 0)) {
+        return -6;
+    }
+    return 0;
+}
+
+
+int query_compile(TALLOC_CTX* ctx, query_pred_t* pred, const tmpl_schema_t* schema, const char* expr) {
+    static const char* opstr[QOP_MAX] = { "<", "<=", ">", ">=", "==", "!=" };
+    const char* cursor;
+    const char* value;
+    char* name;
+    int op;
+    int rc;
+
+    /// The operator is the first run of operator characters
+    cursor = strpbrk(expr, "<>=!");
+    if ((cursor == NULL) || (cursor == expr)) {
+        return -1;
+    }
+    value = cursor + strspn(cursor, "<>=!");
+    for (op=0; op<QOP_MAX; op++) {
+        if ((strlen(opstr[op]) == (size_t)(value-cursor)) && (strncmp(cursor, opstr[op], value-cursor) == 0)) {
+            break;
+        }
+    }
+    if ((op >= QOP_MAX) || (*value == 0)) {
+        return -1;
+    }
+
+    name = talloc_strndup(ctx, expr, cursor-expr);
+    if (name == NULL) {
+        return -2;
+    }
+    rc = query_resolve(&pred->field, schema, name);
+    if (rc != 0) {
+        return -3;
+    }
+    pred->op        = (query_op_t)op;
+    pred->string    = NULL;
+    pred->strsize   = 0;
+    pred->number    = 0;
+
+    /// Numbers take any operator, strings and hex only equality
+    if (pred->field.type.index == TYPE_string) {
+        pred->string    = talloc_strdup(ctx, value);
+        pred->strsize   = (int)strlen(value);
+    }
+    else if (pred->field.type.index == TYPE_hex) {
+        uint8_t* raw = talloc_size(ctx, (strlen(value)/2) + 1);
+        if (raw != NULL) {
+            pred->strsize   = cmd_hexnread(raw, value, (strlen(value)/2) + 1);
+            pred->string    = (const char*)raw;
+        }
+    }
+    else {
+        char* end;
+        pred->number = strtod(value, &end);
+        return (*end == 0) ? 0 : -4;
+    }
+
+    if (pred->string == NULL) {
+        return -2;
+    }
+    if ((pred->op != QOP_eq) && (pred->op != QOP_ne)) {
+        return -4;
+    }
+    return 0;
+}
+
+
+const uint8_t* query_locate(const void* image, const query_field_t* field) {
+    const vl_header_t* fhdr;
+
+    if (image == NULL) {
+        return NULL;
+    }
+    fhdr = sub_findheader(image, field->block_id, field->file_id);
+    if (fhdr == NULL) {
+        return NULL;
+    }
+    if ((field->pos + sub_fieldbytes(&field->type)) > fhdr->length) {
+        return NULL;
+    }
+    return (const uint8_t*)image + fhdr->base + field->pos;
+}
+
+
+bool query_number(double* number, const void* image, const query_field_t* field) {
+    const uint8_t* src = query_locate(image, field);
+
+    if (src == NULL) {
+        return false;
+    }
+    return jst_read_number(number, src, field->type.index, field->bitpos, field->type.bits);
+}
+
+
+bool query_match(const void* image, const query_pred_t* pred, int preds) {
+    for (int i=0; i<preds; i++, pred++) {
+        if (pred->string != NULL) {
+            const uint8_t* src = query_locate(image, &pred->field);
+            int size = sub_fieldbytes(&pred->field.type);
+            bool equal;
+
+            if (src == NULL) {
+                return false;
+            }
+            /// Strings are compared up to their terminator, hex in full
+            if (pred->field.type.index == TYPE_string) {
+                equal = (pred->strsize <= size) && (strncmp((const char*)src, pred->string, size) == 0);
+            }
+            else {
+                equal = (pred->strsize == size) && (memcmp(src, pred->string, size) == 0);
+            }
+            if (equal != (pred->op == QOP_eq)) {
+                return false;
+            }
+        }
+        else {
+            double number;
+            bool pass;
+
+            if (query_number(&number, image, &pred->field) == false) {
+                return false;
+            }
+            switch (pred->op) {
+                case QOP_lt:    pass = (number <  pred->number);  break;
+                case QOP_le:    pass = (number <= pred->number);  break;
+                case QOP_gt:    pass = (number >  pred->number);  break;
+                case QOP_ge:    pass = (number >= pred->number);  break;
+                case QOP_eq:    pass = (number == pred->number);  break;
+                default:        pass = (number != pred->number);  break;
+            }
+            if (pass == false) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+static int sub_slice(void* arg, void* job) {
+    query_slice_t* slice = job;
+
+    for (size_t i=slice->first; i<(slice->first+slice->count); i++) {
+        slice->action(&slice->dev[i], i, slice->arg);
+    }
+    return 0;
+}
+
+
+void query_parallel(const otfs_t* dev, size_t devices, query_action_t action, void* arg) {
+    query_slice_t slice[OTDB_PARAM_QUERY_WORKERS];
+    workpool_t pool = NULL;
+    long workers;
+
+    /// There is a slice for each CPU, up to the configured maximum, and such
+    /// that each slice has a useful number of devices.  The command thread
+    /// takes the first slice itself, and the workpool takes the others.
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > OTDB_PARAM_QUERY_WORKERS) {
+        workers = OTDB_PARAM_QUERY_WORKERS;
+    }
+    if (workers > (long)(devices / QUERY_MINSLICE)) {
+        workers = (long)(devices / QUERY_MINSLICE);
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    for (long w=0; w<workers; w++) {
+        slice[w].dev    = dev;
+        slice[w].first  = (devices * w) / workers;
+        slice[w].count  = ((devices * (w+1)) / workers) - slice[w].first;
+        slice[w].action = action;
+        slice[w].arg    = arg;
+    }
+
+    /// If the workpool can't be started, all the slices are done here
+    if ((workers > 1) && (workpool_start(&pool, (int)workers-1, workers-1, (int)workers-1, &sub_slice, NULL, NULL) == 0)) {
+        for (long w=1; w<workers; w++) {
+            workpool_put(pool, &slice[w]);
+        }
+        sub_slice(NULL, &slice[0]);
+        workpool_finish(pool, false);
+    }
+    else {
+        for (long w=0; w<workers; w++) {
+            sub_slice(NULL, &slice[w]);
+        }
+    }
+}
+
+
+static void sub_scanaction(const otfs_t* dev, size_t i, void* arg) {
+    query_scan_t* scan = arg;
+    scan->hit[i] = query_match(dev->base, scan->pred, scan->preds);
+}
+
+
+size_t query_scan(const otfs_t* dev, size_t devices, const query_pred_t* pred, int preds, uint8_t* hit) {
+    query_scan_t scan = {
+        .pred   = pred,
+        .preds  = preds,
+        .hit    = hit,
+    };
+    size_t hits = 0;
+
+    query_parallel(dev, devices, &sub_scanaction, &scan);
+    for (size_t i=0; i<devices; i++) {
+        hits += hit[i];
+    }
+    return hits;
+}
+
+
+otfs_t* query_alldevices(TALLOC_CTX* ctx, void* db, size_t* devices) {
+    otfs_t* dev;
+    size_t alloc = 1024;
+    size_t i = 0;
+    uint64_t uid = 0;
+    int devtest;
+
+    dev     = talloc_array(ctx, otfs_t, alloc);
+    devtest = otfs_iterator_start(db, (dev != NULL) ? &dev[0] : NULL, (uint8_t*)&uid);
+    while ((dev != NULL) && (devtest == 0)) {
+        if (++i >= alloc) {
+            alloc  *= 2;
+            dev     = talloc_realloc(ctx, dev, otfs_t, alloc);
+            if (dev == NULL) {
+                break;
+            }
+        }
+        uid     = 0;
+        devtest = otfs_iterator_next(db, &dev[i], (uint8_t*)&uid);
+    }
+
+    *devices = (dev != NULL) ? i : 0;
+    return dev;
+}
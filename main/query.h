@@ -0,0 +1,158 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef query_h
+#define query_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Local Headers
+#include "json_tools.h"
+#include "schema.h"
+
+// HB Headers/Libraries
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/** Field Queries
+  * -------------------------------------------------------------------------
+  * Fields of template struct files are named as file.field, or as
+  * file.field.subfield for the subfields of a bitmask.  A name is resolved
+  * against the compiled schema, once, to the block, file ID, position and
+  * type of the field.  Fields are then read straight from device images,
+  * through the file header table of the image, without Veelite.  So many
+  * images can be read at once, by any number of threads, as long as the DB
+  * isn't changed meanwhile.
+  */
+
+typedef struct {
+    const char*     name;
+    uint8_t         block_id;
+    uint8_t         file_id;
+    int             pos;
+    uint8_t         bitpos;
+    typeinfo_t      type;
+} query_field_t;
+
+typedef enum {
+    QOP_lt = 0,
+    QOP_le,
+    QOP_gt,
+    QOP_ge,
+    QOP_eq,
+    QOP_ne,
+    QOP_MAX
+} query_op_t;
+
+typedef struct {
+    query_field_t   field;
+    query_op_t      op;
+    double          number;
+    const char*     string;     // value of string and hex fields, else NULL
+    int             strsize;
+} query_pred_t;
+
+
+/** @brief Resolves a field name against the schema
+  * @param field    (query_field_t*) Output field
+  * @param schema   (const tmpl_schema_t*) Compiled template
+  * @param name     (const char*) file.field or file.field.subfield
+  * @retval         0 on success, negative if there is no such field
+  */
+int query_resolve(query_field_t* field, const tmpl_schema_t* schema, const char* name);
+
+
+/** @brief Compiles a predicate, such as realtime_vars.battery<20
+  * @param ctx      (TALLOC_CTX*) Context for strings of the predicate
+  * @param pred     (query_pred_t*) Output predicate
+  * @param schema   (const tmpl_schema_t*) Compiled template
+  * @param expr     (const char*) file.field OP value, where OP is one of
+  *                 < <= > >= == !=.  String and hex fields only take == and
+  *                 !=, and hex values are written in hex.
+  * @retval         0 on success, negative on error
+  */
+int query_compile(TALLOC_CTX* ctx, query_pred_t* pred, const tmpl_schema_t* schema, const char* expr);
+
+
+/** @brief Locates a field in a device image
+  * @param image    (const void*) Device FS image
+  * @param field    (const query_field_t*) Field
+  * @retval         Pointer to the field, or NULL if the device doesn't have
+  *                 all of it
+  */
+const uint8_t* query_locate(const void* image, const query_field_t* field);
+
+
+/** @brief Reads a number field from a device image
+  * @retval         true if the field exists and is a number
+  */
+bool query_number(double* number, const void* image, const query_field_t* field);
+
+
+/** @brief Tests all the predicates, which are ANDed, on a device image
+  */
+bool query_match(const void* image, const query_pred_t* pred, int preds);
+
+
+/** @brief Action of query_parallel() on one device
+  * @param dev      (const otfs_t*) Device
+  * @param i        (size_t) Index of the device in the list
+  * @param arg      (void*) Argument of query_parallel()
+  */
+typedef void (*query_action_t)(const otfs_t* dev, size_t i, void* arg);
+
+
+/** @brief Runs an action on many devices, in parallel
+  * @param dev      (const otfs_t*) Devices
+  * @param devices  (size_t) Number of devices
+  * @param action   (query_action_t) Action, called once for each device
+  * @param arg      (void*) Argument of the action
+  *
+  * The devices are split among up to OTDB_PARAM_QUERY_WORKERS threads, so
+  * the action may only write to its own device index of any shared output.
+  * The caller must hold the DB so that the images aren't changed or freed.
+  */
+void query_parallel(const otfs_t* dev, size_t devices, query_action_t action, void* arg);
+
+
+/** @brief Tests predicates on many device images, in parallel
+  * @param dev      (const otfs_t*) Devices
+  * @param devices  (size_t) Number of devices
+  * @param pred     (const query_pred_t*) Predicates, which are ANDed
+  * @param preds    (int) Number of predicates
+  * @param hit      (uint8_t*) Output, set to 1 or 0 for each device
+  * @retval         Number of matching devices
+  */
+size_t query_scan(const otfs_t* dev, size_t devices, const query_pred_t* pred, int preds, uint8_t* hit);
+
+
+/** @brief Lists all the devices of the DB, in DB order
+  * @param ctx      (TALLOC_CTX*) Context for the list
+  * @param db       (void*) DB
+  * @param devices  (size_t*) Output number of devices
+  * @retval         List of devices, or NULL on error
+  */
+otfs_t* query_alldevices(TALLOC_CTX* ctx, void* db, size_t* devices);
+
+
+#endif
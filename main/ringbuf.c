@@ -0,0 +1,165 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "ringbuf.h"
+
+// Standard C & POSIX Libraries
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+
+static int sub_grow(ringbuf_t* rb) {
+/// The contents are unwrapped to the start of the new buffer
+    size_t newsize;
+    uint8_t* newbuf;
+
+    if (rb->size >= rb->limit) {
+        return -1;
+    }
+    newsize = rb->size * 2;
+    if (newsize > rb->limit) {
+        newsize = rb->limit;
+    }
+
+    newbuf = malloc(newsize);
+    if (newbuf == NULL) {
+        return -2;
+    }
+    ringbuf_peek(rb, newbuf, rb->used);
+    free(rb->buf);
+
+    rb->buf     = newbuf;
+    rb->size    = newsize;
+    rb->head    = 0;
+    return 0;
+}
+
+
+
+int ringbuf_init(ringbuf_t* rb, size_t size, size_t limit) {
+    rb->limit   = (limit == 0) ? OTDB_PARAM_CONN_BUFMAX : limit;
+    rb->size    = (size == 0) ? OTDB_PARAM_CONN_BUFINIT : size;
+    if (rb->size > rb->limit) {
+        rb->size = rb->limit;
+    }
+    rb->head    = 0;
+    rb->used    = 0;
+    rb->scanned = 0;
+    rb->buf     = malloc(rb->size);
+
+    return (rb->buf == NULL) ? -1 : 0;
+}
+
+
+void ringbuf_free(ringbuf_t* rb) {
+    free(rb->buf);
+    rb->buf     = NULL;
+    rb->size    = 0;
+    rb->used    = 0;
+    rb->scanned = 0;
+}
+
+
+ssize_t ringbuf_readfd(ringbuf_t* rb, int fd) {
+    struct iovec iov[2];
+    size_t tail;
+    ssize_t rbytes;
+    int iovcnt;
+
+    if ((rb->used == rb->size) && (sub_grow(rb) != 0)) {
+        return -1;
+    }
+
+    /// Free space may wrap around the end of the buffer
+    tail = (rb->head + rb->used) % rb->size;
+    if (tail >= rb->head) {
+        iov[0].iov_base = &rb->buf[tail];
+        iov[0].iov_len  = rb->size - tail;
+        iov[1].iov_base = rb->buf;
+        iov[1].iov_len  = rb->head;
+        iovcnt          = (rb->head > 0) ? 2 : 1;
+    }
+    else {
+        iov[0].iov_base = &rb->buf[tail];
+        iov[0].iov_len  = rb->head - tail;
+        iovcnt          = 1;
+    }
+
+    do {
+        rbytes = readv(fd, iov, iovcnt);
+    } while ((rbytes < 0) && (errno == EINTR));
+
+    if (rbytes > 0) {
+        rb->used += (size_t)rbytes;
+    }
+    return rbytes;
+}
+
+
+uint8_t ringbuf_at(ringbuf_t* rb, size_t offset) {
+    return rb->buf[(rb->head + offset) % rb->size];
+}
+
+
+ssize_t ringbuf_findline(ringbuf_t* rb) {
+    size_t i;
+
+    for (i=rb->scanned; i<rb->used; i++) {
+        uint8_t c = ringbuf_at(rb, i);
+        if ((c == '\n') || (c == '\r') || (c == 0)) {
+            rb->scanned = i;
+            return (ssize_t)i;
+        }
+    }
+    rb->scanned = rb->used;
+    return -1;
+}
+
+
+size_t ringbuf_peek(ringbuf_t* rb, void* dst, size_t bytes) {
+    size_t span;
+
+    if (bytes > rb->used) {
+        bytes = rb->used;
+    }
+    span = rb->size - rb->head;
+    if (span > bytes) {
+        span = bytes;
+    }
+    memcpy(dst, &rb->buf[rb->head], span);
+    memcpy((uint8_t*)dst + span, rb->buf, bytes - span);
+
+    return bytes;
+}
+
+
+void ringbuf_drop(ringbuf_t* rb, size_t bytes) {
+    if (bytes > rb->used) {
+        bytes = rb->used;
+    }
+    rb->head = (rb->head + bytes) % rb->size;
+    rb->used-= bytes;
+    rb->scanned = (rb->scanned > bytes) ? (rb->scanned - bytes) : 0;
+    if (rb->used == 0) {
+        rb->head = 0;
+    }
+}
+
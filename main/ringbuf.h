@@ -0,0 +1,95 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef ringbuf_h
+#define ringbuf_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Standard C & POSIX Libraries
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+
+/** Byte Ring Buffer
+  * -------------------------------------------------------------------------
+  * Used to reassemble socket input across reads.  Data is read from the fd
+  * straight into the free part of the ring, and consumed from the front
+  * once a complete line or frame is available.  The ring grows (doubling)
+  * when it is full, up to a limit.
+  */
+
+typedef struct {
+    uint8_t*    buf;
+    size_t      size;
+    size_t      limit;
+    size_t      head;       // offset of first byte
+    size_t      used;       // bytes in ring
+    size_t      scanned;    // bytes from the front known to have no line end
+} ringbuf_t;
+
+
+/** @brief Initializes a ring buffer
+  * @param rb       (ringbuf_t*) Ring buffer
+  * @param size     (size_t) Initial size.  0 uses default.
+  * @param limit    (size_t) Maximum size.  0 uses default.
+  * @retval         0 on success, negative on allocation error
+  */
+int ringbuf_init(ringbuf_t* rb, size_t size, size_t limit);
+
+void ringbuf_free(ringbuf_t* rb);
+
+
+/** @brief Reads available data from an fd into the ring
+  * @param rb       (ringbuf_t*) Ring buffer
+  * @param fd       (int) fd to read, with data available
+  * @retval         Bytes read.  0 on EOF, negative on error or when the ring
+  *                 is full at its limit.
+  *
+  * A single read is performed, so this won't block on a readable fd.
+  */
+ssize_t ringbuf_readfd(ringbuf_t* rb, int fd);
+
+
+/** @brief Returns the byte at an offset from the front of the ring
+  */
+uint8_t ringbuf_at(ringbuf_t* rb, size_t offset);
+
+
+/** @brief Finds the first line terminator (\n, \r or 0)
+  * @retval         Offset of terminator from front, or negative if there
+  *                 is no complete line in the ring.
+  *
+  * The search continues where the last one ended, so a long line that
+  * arrives in many reads is only scanned once.
+  */
+ssize_t ringbuf_findline(ringbuf_t* rb);
+
+
+/** @brief Copies bytes from the front of the ring, without consuming them
+  * @retval         Bytes copied
+  */
+size_t ringbuf_peek(ringbuf_t* rb, void* dst, size_t bytes);
+
+
+/** @brief Consumes bytes from the front of the ring
+  */
+void ringbuf_drop(ringbuf_t* rb, size_t bytes);
+
+
+#endif
@@ -0,0 +1,194 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "schema.h"
+
+// Standard C & POSIX Libraries
+#include <stdlib.h>
+#include <string.h>
+
+
+
+
+static int sub_cmpname(const void* a, const void* b) {
+    return strcmp((*(tmpl_file_t* const*)a)->name, (*(tmpl_file_t* const*)b)->name);
+}
+
+
+static void sub_typeof(typeinfo_t* spec, cJSON* elem) {
+    spec->bits  = jst_extract_typesize(&spec->index, elem);
+}
+
+
+static void sub_count(cJSON* tmpl, int* files, int* fields, int* subfields) {
+    cJSON* obj;
+    cJSON* content;
+    cJSON* nest;
+
+    *files      = 0;
+    *fields     = 0;
+    *subfields  = 0;
+    for (obj=tmpl->child; obj!=NULL; obj=obj->next) {
+        if (cJSON_IsObject(cJSON_GetObjectItemCaseSensitive(obj, "_meta")) == false) {
+            continue;
+        }
+        (*files)++;
+        content = cJSON_GetObjectItemCaseSensitive(obj, "_content");
+        if (cJSON_IsObject(content) == false) {
+            continue;
+        }
+        for (content=content->child; content!=NULL; content=content->next) {
+            (*fields)++;
+            nest = cJSON_GetObjectItemCaseSensitive(content, "_content");
+            if (cJSON_IsObject(nest)) {
+                *subfields += cJSON_GetArraySize(nest);
+            }
+            nest = cJSON_GetObjectItemCaseSensitive(content, "_meta");
+            nest = (nest != NULL) ? cJSON_GetObjectItemCaseSensitive(nest, "_content") : NULL;
+            if (nest != NULL) {
+                *subfields += cJSON_GetArraySize(nest);
+            }
+        }
+    }
+}
+
+
+static int sub_addsubs(tmpl_schema_t* schema, TALLOC_CTX* ctx, cJSON* nest, bool typed, int* count) {
+/// Adds the children of nest as subfields, and returns the first index
+    int first = schema->subfields;
+
+    *count = 0;
+    for (nest=nest->child; nest!=NULL; nest=nest->next) {
+        tmpl_subfield_t* sub = &schema->sub[schema->subfields++];
+        sub->name   = talloc_strdup(ctx, nest->string);
+        sub->bitpos = (uint8_t)jst_extract_bitpos(nest);
+        if (typed) {
+            sub_typeof(&sub->type, nest);
+        }
+        else {
+            sub->type.index = TYPE_MAX;
+            sub->type.bits  = 0;
+        }
+        (*count)++;
+    }
+    return first;
+}
+
+
+
+
+tmpl_schema_t* schema_compile(TALLOC_CTX* ctx, cJSON* tmpl) {
+    tmpl_schema_t* schema;
+    cJSON* obj;
+    int files, fields, subfields;
+
+    if (tmpl == NULL) {
+        return NULL;
+    }
+    schema = talloc_zero(ctx, tmpl_schema_t);
+    if (schema == NULL) {
+        return NULL;
+    }
+
+    /// Sizes of the tables are counted first, so they are allocated once
+    sub_count(tmpl, &files, &fields, &subfields);
+    schema->file    = talloc_zero_array(schema, tmpl_file_t, files + 1);
+    schema->byname  = talloc_zero_array(schema, tmpl_file_t*, files + 1);
+    schema->field   = talloc_zero_array(schema, tmpl_field_t, fields + 1);
+    schema->sub     = talloc_zero_array(schema, tmpl_subfield_t, subfields + 1);
+    if ((schema->file == NULL) || (schema->byname == NULL) || (schema->field == NULL) || (schema->sub == NULL)) {
+        talloc_free(schema);
+        return NULL;
+    }
+
+    for (obj=tmpl->child; obj!=NULL; obj=obj->next) {
+        tmpl_file_t* file;
+        cJSON* meta;
+        cJSON* content;
+
+        meta = cJSON_GetObjectItemCaseSensitive(obj, "_meta");
+        if (cJSON_IsObject(meta) == false) {
+            continue;
+        }
+        file                = &schema->file[schema->files];
+        schema->byname[schema->files++] = file;
+        file->name          = talloc_strdup(schema, obj->string);
+        file->meta          = meta;
+        file->block         = jst_extract_blockid(meta);
+        file->id            = jst_extract_id(meta);
+        file->size          = jst_extract_size(meta);
+        file->ctype         = jst_extract_type(meta);
+        file->stock         = jst_extract_stock(meta);
+        file->field_first   = schema->fields;
+
+        content = cJSON_GetObjectItemCaseSensitive(obj, "_content");
+        file->has_content = cJSON_IsObject(content);
+        if (file->has_content == false) {
+            continue;
+        }
+
+        for (content=content->child; content!=NULL; content=content->next) {
+            tmpl_field_t* field = &schema->field[schema->fields++];
+            cJSON* t_meta;
+            cJSON* t_content;
+
+            field->name     = talloc_strdup(schema, content->string);
+            field->pos      = jst_extract_pos(content);
+            field->bitpos   = (uint8_t)jst_extract_bitpos(content);
+            sub_typeof(&field->type, content);
+
+            t_meta          = cJSON_GetObjectItemCaseSensitive(content, "_meta");
+            t_content       = cJSON_GetObjectItemCaseSensitive(content, "_content");
+            field->nested   = cJSON_IsObject(t_meta) && cJSON_IsObject(t_content);
+            if (field->nested) {
+                field->nest_pos     = jst_extract_pos(t_meta);
+                field->nest_size    = jst_extract_size(t_meta);
+                field->imp_first    = sub_addsubs(schema, schema, t_content, true, &field->imp_count);
+            }
+
+            t_content = (t_meta != NULL) ? cJSON_GetObjectItemCaseSensitive(t_meta, "_content") : NULL;
+            if (t_content != NULL) {
+                field->exp_first    = sub_addsubs(schema, schema, t_content, false, &field->exp_count);
+            }
+            file->field_count++;
+        }
+    }
+
+    qsort(schema->byname, schema->files, sizeof(tmpl_file_t*), &sub_cmpname);
+    return schema;
+}
+
+
+const tmpl_file_t* schema_findfile(const tmpl_schema_t* schema, const char* name) {
+    int lo = 0;
+    int hi;
+
+    if ((schema == NULL) || (name == NULL)) {
+        return NULL;
+    }
+    hi = schema->files - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(name, schema->byname[mid]->name);
+        if (cmp == 0) {
+            return schema->byname[mid];
+        }
+        if (cmp < 0)    hi = mid - 1;
+        else            lo = mid + 1;
+    }
+    return NULL;
+}
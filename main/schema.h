@@ -0,0 +1,111 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef schema_h
+#define schema_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Local Headers
+#include "json_tools.h"
+
+// HB Headers/Libraries
+#include <cJSON.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Compiled Template Schema
+  * -------------------------------------------------------------------------
+  * The template is compiled once, when the DB is opened, into flat tables of
+  * the files and of the struct elements in each file.  Import and export of
+  * device data use these tables, so they don't look up template metadata or
+  * parse type names per device.
+  *
+  * Struct elements that are bitmasks hold subfields.  Export takes these
+  * from "_meta"."_content" of the element, with the type of the element.
+  * Import takes them from "_content" of the element, each with its own type,
+  * at the position and size given by "_meta" of the element.
+  */
+
+typedef struct {
+    char*           name;
+    uint8_t         bitpos;
+    typeinfo_t      type;
+} tmpl_subfield_t;
+
+typedef struct {
+    char*           name;
+    int             pos;
+    uint8_t         bitpos;
+    typeinfo_t      type;
+
+    // Import of nested element (has _meta and _content objects)
+    bool            nested;
+    int             nest_pos;
+    int             nest_size;
+    int             imp_first;
+    int             imp_count;
+
+    // Export of nested element (_meta._content)
+    int             exp_first;
+    int             exp_count;
+} tmpl_field_t;
+
+typedef struct {
+    char*               name;
+    cJSON*              meta;           // _meta object in the template
+    uint8_t             block;
+    uint8_t             id;
+    uint16_t            size;
+    content_type_enum   ctype;
+    bool                stock;
+    bool                has_content;    // template has a _content object
+    int                 field_first;
+    int                 field_count;
+} tmpl_file_t;
+
+typedef struct {
+    int                 files;
+    tmpl_file_t*        file;           // in template order
+    tmpl_file_t**       byname;         // sorted by name
+    int                 fields;
+    tmpl_field_t*       field;
+    int                 subfields;
+    tmpl_subfield_t*    sub;
+} tmpl_schema_t;
+
+
+
+/** @brief Compiles a template
+  * @param ctx      (TALLOC_CTX*) Context for the schema
+  * @param tmpl     (cJSON*) Template.  File "meta" references it, so it must
+  *                 outlive the schema.
+  * @retval         Schema, or NULL on error.  Free with talloc_free().
+  */
+tmpl_schema_t* schema_compile(TALLOC_CTX* ctx, cJSON* tmpl);
+
+
+/** @brief Finds a file of the schema by name
+  */
+const tmpl_file_t* schema_findfile(const tmpl_schema_t* schema, const char* name);
+
+
+#endif
@@ -0,0 +1,203 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "sflight.h"
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdlib.h>
+
+
+/// A flight is freed when it has landed and all its waiters have its result.
+/// It is only in the list of flights until it lands.
+typedef struct sflight_flight {
+    struct sflight_flight* next;
+    uint64_t        uid;
+    uint8_t         block_id;
+    uint8_t         file_id;
+    bool            landed;
+    int             refs;
+    int             result;
+} sflight_flight_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  landed;
+    sflight_flight_t* head;
+    int             inflight;
+    uint64_t        flights;
+    uint64_t        joined;
+} sflight_item_t;
+
+
+
+
+static void sub_unlink(sflight_item_t* sf, sflight_flight_t* flight) {
+    sflight_flight_t** link;
+
+    for (link=&sf->head; *link!=NULL; link=&(*link)->next) {
+        if (*link == flight) {
+            *link = flight->next;
+            sf->inflight--;
+            break;
+        }
+    }
+}
+
+
+
+
+int sflight_init(sflight_t* handle) {
+    sflight_item_t* sf;
+
+    if (handle == NULL) {
+        return -1;
+    }
+    sf = calloc(1, sizeof(sflight_item_t));
+    if (sf == NULL) {
+        return -2;
+    }
+    if (pthread_mutex_init(&sf->mutex, NULL) != 0) {
+        free(sf);
+        return -3;
+    }
+    if (pthread_cond_init(&sf->landed, NULL) != 0) {
+        pthread_mutex_destroy(&sf->mutex);
+        free(sf);
+        return -3;
+    }
+    *handle = sf;
+    return 0;
+}
+
+
+void sflight_deinit(sflight_t handle) {
+    sflight_item_t* sf = handle;
+
+    if (sf != NULL) {
+        while (sf->head != NULL) {
+            sflight_flight_t* next = sf->head->next;
+            free(sf->head);
+            sf->head = next;
+        }
+        pthread_cond_destroy(&sf->landed);
+        pthread_mutex_destroy(&sf->mutex);
+        free(sf);
+    }
+}
+
+
+void* sflight_join(sflight_t handle, uint64_t uid, uint8_t block_id, uint8_t file_id, bool* leader) {
+    sflight_item_t* sf = handle;
+    sflight_flight_t* flight;
+
+    *leader = true;
+    if (sf == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sf->mutex);
+    for (flight=sf->head; flight!=NULL; flight=flight->next) {
+        if ((flight->uid == uid) && (flight->block_id == block_id) && (flight->file_id == file_id)) {
+            break;
+        }
+    }
+    if (flight != NULL) {
+        flight->refs++;
+        sf->joined++;
+        *leader = false;
+    }
+    else {
+        flight = calloc(1, sizeof(sflight_flight_t));
+        if (flight != NULL) {
+            flight->uid         = uid;
+            flight->block_id    = block_id;
+            flight->file_id     = file_id;
+            flight->refs        = 1;
+            flight->next        = sf->head;
+            sf->head            = flight;
+            sf->inflight++;
+        }
+        sf->flights++;
+    }
+    pthread_mutex_unlock(&sf->mutex);
+
+    return flight;
+}
+
+
+void sflight_land(sflight_t handle, void* flight, int result) {
+    sflight_item_t* sf = handle;
+    sflight_flight_t* fl = flight;
+
+    if ((sf == NULL) || (fl == NULL)) {
+        return;
+    }
+
+    pthread_mutex_lock(&sf->mutex);
+    sub_unlink(sf, fl);
+    fl->landed  = true;
+    fl->result  = result;
+    if (--fl->refs == 0) {
+        free(fl);
+    }
+    else {
+        pthread_cond_broadcast(&sf->landed);
+    }
+    pthread_mutex_unlock(&sf->mutex);
+}
+
+
+int sflight_wait(sflight_t handle, void* flight) {
+    sflight_item_t* sf = handle;
+    sflight_flight_t* fl = flight;
+    int result;
+
+    if ((sf == NULL) || (fl == NULL)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&sf->mutex);
+    while (fl->landed == false) {
+        pthread_cond_wait(&sf->landed, &sf->mutex);
+    }
+    result = fl->result;
+    if (--fl->refs == 0) {
+        free(fl);
+    }
+    pthread_mutex_unlock(&sf->mutex);
+
+    return result;
+}
+
+
+void sflight_stats(sflight_t handle, uint64_t* flights, uint64_t* joined, int* inflight) {
+    sflight_item_t* sf = handle;
+
+    if (sf == NULL) {
+        *flights    = 0;
+        *joined     = 0;
+        *inflight   = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&sf->mutex);
+    *flights    = sf->flights;
+    *joined     = sf->joined;
+    *inflight   = sf->inflight;
+    pthread_mutex_unlock(&sf->mutex);
+}
@@ -0,0 +1,81 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef sflight_h
+#define sflight_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Single-Flight Refreshes
+  * -------------------------------------------------------------------------
+  * A refresh of a file from its device, by the device manager, is a flight
+  * keyed by (UID, block, file).  The first command to join a flight is its
+  * leader, and it does the refresh.  Commands that join while the flight is
+  * up wait for it to land, and get the result of the leader instead of
+  * doing their own refresh.  A flight is over once it lands, so a command
+  * that comes later starts a new one.
+  *
+  * Waiters must not hold DB locks, because the leader needs the device lock
+  * to store the file that it fetched.
+  */
+
+typedef void* sflight_t;
+
+
+int sflight_init(sflight_t* handle);
+void sflight_deinit(sflight_t handle);
+
+
+/** @brief Joins the flight of a file, or starts it
+  * @param handle   (sflight_t) Single-flight handle
+  * @param uid      (uint64_t) Device UID
+  * @param block_id (uint8_t) Block of the file
+  * @param file_id  (uint8_t) ID of the file
+  * @param leader   (bool*) Output, true if the caller leads the flight
+  * @retval         Flight, for sflight_land() by the leader or for
+  *                 sflight_wait() by the others.  NULL if a flight can't be
+  *                 started, in which case the caller is the leader of a
+  *                 flight that isn't shared.
+  */
+void* sflight_join(sflight_t handle, uint64_t uid, uint8_t block_id, uint8_t file_id, bool* leader);
+
+/** @brief Lands a flight with the result of its leader, and wakes its waiters
+  */
+void sflight_land(sflight_t handle, void* flight, int result);
+
+/** @brief Waits for a flight to land
+  * @retval         Result given by the leader to sflight_land()
+  */
+int sflight_wait(sflight_t handle, void* flight);
+
+
+/** @brief Gets the counters of flights
+  * @param handle   (sflight_t) Single-flight handle
+  * @param flights  (uint64_t*) Output, number of flights (refreshes done)
+  * @param joined   (uint64_t*) Output, number of refreshes that were
+  *                 coalesced into a flight
+  * @param inflight (int*) Output, number of flights up now
+  */
+void sflight_stats(sflight_t handle, uint64_t* flights, uint64_t* joined, int* inflight);
+
+
+#endif
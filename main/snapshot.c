@@ -0,0 +1,351 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "snapshot.h"
+#include "devimage.h"
+#include "debug.h"
+
+// HB Headers/Libraries
+#include <cJSON.h>
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+
+
+static uint64_t sub_align(uint64_t offset, uint64_t align) {
+    return (offset + align - 1) & ~(align - 1);
+}
+
+
+static int sub_pad(FILE* fp, uint64_t* offset, uint64_t align) {
+    uint64_t target = sub_align(*offset, align);
+
+    for (; *offset<target; (*offset)++) {
+        if (fputc(0, fp) == EOF) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int sub_put(FILE* fp, uint64_t* offset, const void* data, size_t size) {
+    if (fwrite(data, 1, size, fp) != size) {
+        return -1;
+    }
+    *offset += size;
+    return 0;
+}
+
+
+static int sub_cmpentry(const void* a, const void* b) {
+    uint64_t uid_a = ((const snapshot_entry_t*)a)->uid;
+    uint64_t uid_b = ((const snapshot_entry_t*)b)->uid;
+    return (uid_a > uid_b) - (uid_a < uid_b);
+}
+
+
+static snapshot_entry_t* sub_collect(void* db, const uint64_t* uidlist, size_t listsz, size_t* devices) {
+/// Builds the index, without offsets, from the uidlist or from all devices.
+/// Devices in the uidlist that don't exist, or that are listed again, are
+/// skipped.
+    snapshot_entry_t* index;
+    otfs_t devfs;
+    uint64_t uid;
+    size_t alloc;
+    size_t i = 0;
+    int devtest;
+
+    alloc = (uidlist != NULL) ? listsz : 64;
+    index = malloc((alloc+1) * sizeof(snapshot_entry_t));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    if (uidlist != NULL) {
+        for (size_t j=0; j<listsz; j++) {
+            uid = uidlist[j];
+            if (otfs_setfs(db, &devfs, (uint8_t*)&uid) == 0) {
+                index[i].uid    = devfs.uid.u64;
+                index[i].alloc  = devfs.alloc;
+                i++;
+            }
+        }
+    }
+    else {
+        uid     = 0;
+        devtest = otfs_iterator_start(db, &devfs, (uint8_t*)&uid);
+        while (devtest == 0) {
+            if (i >= alloc) {
+                snapshot_entry_t* grown;
+                alloc  *= 2;
+                grown   = realloc(index, (alloc+1) * sizeof(snapshot_entry_t));
+                if (grown == NULL) {
+                    free(index);
+                    return NULL;
+                }
+                index = grown;
+            }
+            index[i].uid    = devfs.uid.u64;
+            index[i].alloc  = devfs.alloc;
+            i++;
+            uid     = 0;
+            devtest = otfs_iterator_next(db, &devfs, (uint8_t*)&uid);
+        }
+    }
+
+    qsort(index, i, sizeof(snapshot_entry_t), &sub_cmpentry);
+    if (i > 1) {
+        size_t j = 1;
+        for (size_t k=1; k<i; k++) {
+            if (index[k].uid != index[j-1].uid) {
+                index[j++] = index[k];
+            }
+        }
+        i = j;
+    }
+    *devices = i;
+    return index;
+}
+
+
+
+
+int snapshot_write(const char* path, cJSON* tmpl, otfs_t* tmpl_fs, void* db,
+                    const uint64_t* uidlist, size_t listsz) {
+    snapshot_hdr_t hdr;
+    snapshot_entry_t* index = NULL;
+    char* tmpl_text = NULL;
+    char* tmppath = NULL;
+    FILE* fp = NULL;
+    uint64_t offset;
+    uint64_t active_uid = 0;
+    size_t devices = 0;
+    otfs_t devfs;
+    int rc;
+
+    if ((path == NULL) || (tmpl == NULL) || (tmpl_fs == NULL) || (db == NULL)) {
+        return -1;
+    }
+    otfs_activeuid(db, (uint8_t*)&active_uid);
+
+    /// 1. Lay-out the file: all offsets are known before writing.
+    tmpl_text = cJSON_PrintUnformatted(tmpl);
+    index     = sub_collect(db, uidlist, listsz, &devices);
+    if ((tmpl_text == NULL) || (index == NULL)) {
+        rc = -2;
+        goto snapshot_write_END;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version         = SNAPSHOT_VERSION;
+    hdr.align           = (uint32_t)sysconf(_SC_PAGESIZE);
+    hdr.tmpl_offset     = sizeof(snapshot_hdr_t);
+    hdr.tmpl_size       = strlen(tmpl_text) + 1;
+    hdr.fs_offset       = sub_align(hdr.tmpl_offset + hdr.tmpl_size, 8);
+    hdr.fs_size         = tmpl_fs->alloc;
+    hdr.index_offset    = sub_align(hdr.fs_offset + hdr.fs_size, 8);
+    hdr.devices         = devices;
+
+    offset = hdr.index_offset + (devices * sizeof(snapshot_entry_t));
+    for (size_t i=0; i<devices; i++) {
+        index[i].offset = sub_align(offset, hdr.align);
+        offset          = index[i].offset + index[i].alloc;
+    }
+
+    /// 2. Write to a temporary file, which replaces the output only once it
+    ///    is complete.
+    tmppath = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmppath == NULL) {
+        rc = -2;
+        goto snapshot_write_END;
+    }
+    strcpy(stpcpy(tmppath, path), ".tmp");
+    fp = fopen(tmppath, "wb");
+    if (fp == NULL) {
+        rc = -3;
+        goto snapshot_write_END;
+    }
+
+    offset  = 0;
+    rc      = sub_put(fp, &offset, &hdr, sizeof(hdr));
+    rc     |= sub_put(fp, &offset, tmpl_text, hdr.tmpl_size);
+    rc     |= sub_pad(fp, &offset, 8);
+    rc     |= sub_put(fp, &offset, tmpl_fs->base, hdr.fs_size);
+    rc     |= sub_pad(fp, &offset, 8);
+    rc     |= sub_put(fp, &offset, index, devices * sizeof(snapshot_entry_t));
+    for (size_t i=0; (rc==0) && (i<devices); i++) {
+        rc = sub_pad(fp, &offset, hdr.align);
+        if ((rc == 0) && (otfs_setfs(db, &devfs, (uint8_t*)&index[i].uid) != 0)) {
+            rc = -1;
+        }
+        if (rc == 0) {
+            rc = sub_put(fp, &offset, devfs.base, index[i].alloc);
+        }
+    }
+    if ((rc != 0) || (fflush(fp) != 0) || (fsync(fileno(fp)) != 0)) {
+        rc = -4;
+        goto snapshot_write_END;
+    }
+    fclose(fp);
+    fp = NULL;
+
+    if (rename(tmppath, path) != 0) {
+        unlink(tmppath);
+        rc = -5;
+        goto snapshot_write_END;
+    }
+    rc = (int)devices;
+
+    snapshot_write_END:
+    if (fp != NULL) {
+        fclose(fp);
+        unlink(tmppath);
+    }
+    if (active_uid != 0) {
+        otfs_setfs(db, NULL, (uint8_t*)&active_uid);
+    }
+    free(tmppath);
+    free(index);
+    cJSON_free(tmpl_text);
+    return rc;
+}
+
+
+
+
+int snapshot_read(TALLOC_CTX* pctx, const char* path, cJSON** tmpl, otfs_t* tmpl_fs, void** db) {
+    const snapshot_hdr_t* hdr;
+    const snapshot_entry_t* index;
+    const uint8_t* map = MAP_FAILED;
+    struct stat st;
+    uint64_t fsize;
+    otfs_t data_fs;
+    int fd;
+    int rc;
+
+    *tmpl   = NULL;
+    *db     = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(snapshot_hdr_t))) {
+        rc = -2;
+        goto snapshot_read_END;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        rc = -3;
+        goto snapshot_read_END;
+    }
+
+    /// 1. Validate header and the extents of all sections, before using any.
+    ///    Extents are tested as size > filesize - offset, after the offset,
+    ///    so that a corrupt offset or size can't wrap the sum around.
+    hdr     = (const snapshot_hdr_t*)map;
+    fsize   = (uint64_t)st.st_size;
+    if ((memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0)
+    ||  (hdr->version != SNAPSHOT_VERSION)
+    ||  (hdr->tmpl_size == 0)
+    ||  (hdr->tmpl_offset > fsize)
+    ||  (hdr->tmpl_size > (fsize - hdr->tmpl_offset))
+    ||  (hdr->fs_offset > fsize)
+    ||  (hdr->fs_size > (fsize - hdr->fs_offset))
+    ||  ((hdr->index_offset % 8) != 0)
+    ||  (hdr->index_offset > fsize)
+    ||  (hdr->devices > ((fsize - hdr->index_offset) / sizeof(snapshot_entry_t)))
+    ||  (map[hdr->tmpl_offset + hdr->tmpl_size - 1] != 0)) {
+        rc = -4;
+        goto snapshot_read_END;
+    }
+    index = (const snapshot_entry_t*)&map[hdr->index_offset];
+    for (uint64_t i=0; i<hdr->devices; i++) {
+        if ((index[i].alloc == 0)
+        ||  (index[i].offset > fsize)
+        ||  (index[i].alloc > (fsize - index[i].offset))) {
+            rc = -4;
+            goto snapshot_read_END;
+        }
+    }
+    madvise((void*)map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    /// 2. Template and template FS
+    *tmpl = cJSON_Parse((const char*)&map[hdr->tmpl_offset]);
+    if (*tmpl == NULL) {
+        rc = -5;
+        goto snapshot_read_END;
+    }
+    tmpl_fs->uid.u64    = 0;
+    tmpl_fs->alloc      = hdr->fs_size;
+    tmpl_fs->base       = talloc_size(tmpl_fs, hdr->fs_size);
+    if (tmpl_fs->base == NULL) {
+        rc = -6;
+        goto snapshot_read_END;
+    }
+    memcpy(tmpl_fs->base, &map[hdr->fs_offset], hdr->fs_size);
+
+    /// 3. Device images are copied into new device FSes.  Pages that match
+    ///    the template stay shared with it.
+    rc = otfs_init(db);
+    if (rc != 0) {
+        rc = ERRCODE(otfs, otfs_init, rc);
+        goto snapshot_read_END;
+    }
+    for (uint64_t i=0; i<hdr->devices; i++) {
+        data_fs.uid.u64 = index[i].uid;
+        data_fs.alloc   = index[i].alloc;
+        data_fs.base    = devimage_new(pctx, tmpl_fs, &map[index[i].offset], index[i].alloc);
+        if (data_fs.base == NULL) {
+            rc = -7;
+            goto snapshot_read_END;
+        }
+        rc = otfs_new(*db, &data_fs);
+        if (rc != 0) {
+            devimage_free(data_fs.base);
+            rc = ERRCODE(otfs, otfs_new, rc);
+            goto snapshot_read_END;
+        }
+    }
+    rc = (int)hdr->devices;
+
+    snapshot_read_END:
+    if (map != MAP_FAILED) {
+        munmap((void*)map, (size_t)st.st_size);
+    }
+    close(fd);
+    return rc;
+}
+
+
+bool snapshot_test(const char* path) {
+    struct stat st;
+    return (path != NULL) && (stat(path, &st) == 0) && S_ISREG(st.st_mode);
+}
@@ -0,0 +1,110 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef snapshot_h
+#define snapshot_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// HB Headers/Libraries
+#include <cJSON.h>
+#include <otfs.h>
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** Binary DB Snapshot
+  * -------------------------------------------------------------------------
+  * A snapshot is a single file holding a whole DB, which can be opened
+  * without parsing any device data.  It is laid-out as:
+  *
+  * 1. Header (snapshot_hdr_t)
+  * 2. Template, as unformatted JSON text (0-terminated)
+  * 3. Template FS image (the compiled template: FS table and default data)
+  * 4. UID index (snapshot_entry_t array, sorted by UID)
+  * 5. Device FS images (otfs_t base, alloc bytes), page-aligned
+  *
+  * Integers are stored in host byte order, so a snapshot is only portable
+  * between hosts of the same endianness.  The JSON archive directory remains
+  * the portable, human-readable format.
+  */
+
+#define SNAPSHOT_MAGIC      "OTDBSNAP"
+#define SNAPSHOT_VERSION    1
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    align;
+    uint64_t    tmpl_offset;
+    uint64_t    tmpl_size;
+    uint64_t    fs_offset;
+    uint64_t    fs_size;
+    uint64_t    index_offset;
+    uint64_t    devices;
+} snapshot_hdr_t;
+
+typedef struct {
+    uint64_t    uid;
+    uint64_t    offset;
+    uint64_t    alloc;
+} snapshot_entry_t;
+
+
+
+/** @brief Writes a snapshot of the DB
+  * @param path     (const char*) Output file.  It is replaced atomically.
+  * @param tmpl     (cJSON*) DB template
+  * @param tmpl_fs  (otfs_t*) Compiled template FS
+  * @param db       (void*) DB handle
+  * @param uidlist  (const uint64_t*) Devices to save, or NULL for all
+  * @param listsz   (size_t) Number of UIDs in uidlist
+  * @retval         Number of devices saved, or negative on error
+  *
+  * Devices are selected with otfs_setfs(), so this must be called under the
+  * DB engine.  The active device is restored afterwards.
+  */
+int snapshot_write(const char* path, cJSON* tmpl, otfs_t* tmpl_fs, void* db,
+                    const uint64_t* uidlist, size_t listsz);
+
+
+/** @brief Reads a snapshot into a new DB
+  * @param pctx     (TALLOC_CTX*) Context for the device FS images
+  * @param path     (const char*) Snapshot file
+  * @param tmpl     (cJSON**) Output template, allocated by cJSON
+  * @param tmpl_fs  (otfs_t*) Output template FS.  base is allocated on it.
+  * @param db       (void**) Output DB handle, created by otfs_init()
+  * @retval         Number of devices loaded, or negative on error
+  *
+  * The file is mapped into memory, and each device image is copied from the
+  * mapping into its own allocation and registered with otfs_new().  On
+  * error, outputs that were created are still returned, for the caller to
+  * free as it would after a failed JSON import.
+  */
+int snapshot_read(TALLOC_CTX* pctx, const char* path, cJSON** tmpl, otfs_t* tmpl_fs, void** db);
+
+
+/** @brief Checks if a path is a snapshot file (vs. an archive directory)
+  */
+bool snapshot_test(const char* path);
+
+
+#endif
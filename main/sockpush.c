@@ -44,7 +44,15 @@
 
 
 #define SP_MAX_READERS      1
-#define SP_MAX_SUBSCRIBERS  1
+#define SP_MAX_SUBSCRIBERS  4
+
+// Default subscriber queue depth (lines), used when sp_subscribe() gets 0
+#define SP_SUBQ_DEPTH       256
+
+// Inbound line buffer: starts at SP_RXBUF_INIT and doubles as needed to fit
+// a line, up to SP_RXBUF_MAX.  Longer lines are discarded.
+#define SP_RXBUF_INIT       4096
+#define SP_RXBUF_MAX        (256*1024)
 
 
 // Internal data types.  May change at any time.
@@ -56,12 +64,36 @@ typedef struct {
 } sprdr_t;
 
 
+// Subscriber queue: bounded, lock-free, multi-producer/single-consumer.
+// Each cell has a sequence number that tells producers and the consumer
+// whose turn it is (D. Vyukov's bounded queue).
+typedef struct {
+    size_t          seq;
+    int             dir;
+    uint8_t*        data;
+    size_t          size;
+} spcell_t;
+
+
 typedef struct {
     int             flags;
     void*           parent;
     sp_action_t     action;
-    uint8_t*        buf;
-    size_t          max;
+    void*           arg;
+    
+    // Queue
+    spcell_t*       cell;
+    size_t          mask;
+    size_t          enq;
+    size_t          deq;
+    size_t          drops;
+    
+    // Delivery thread, which sleeps on cond only when the queue is empty
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    int             sleeping;
+    bool            stop;
 } spsubscr_t;
 
 
@@ -73,10 +105,18 @@ typedef struct {
     int             fd_sock;
     
     // Data counter for bytes loaded from socket
+    // read_buf references the current line within rx_buf
     uint8_t*        read_buf;
     size_t          read_size;
     unsigned int    read_id;
     
+    // Inbound stream buffer.  Bytes [rx_head, rx_used) are not yet framed.
+    uint8_t*        rx_buf;
+    size_t          rx_size;
+    size_t          rx_head;
+    size_t          rx_used;
+    bool            rx_discard;
+    
     ///@todo id_mutex deprecated
     //pthread_mutex_t id_mutex;
     
@@ -107,6 +147,10 @@ typedef struct {
     size_t      max_subs;
     spsubscr_t* sub[SP_MAX_SUBSCRIBERS];
     
+    // Router: consumes lines that belong to devmgr transactions
+    sp_router_t router;
+    void*       router_arg;
+    
 } sp_item_t;
 
 
@@ -169,16 +213,117 @@ static void* sp_iothread(void*);
 
 
 
-static void sub_sendtosub(spsubscr_t* sub, uint8_t* data, size_t datasize) {
-    datasize = (datasize > sub->max) ? sub->max : datasize;
+static bool sub_subq_put(spsubscr_t* sub, int dir, uint8_t* data, size_t size) {
+    spcell_t* cell;
+    size_t pos;
+    intptr_t dif;
     
-    if (sub->buf != NULL) {
-        memcpy(sub->buf, data, datasize);
-        data = sub->buf;
+    pos = __atomic_load_n(&sub->enq, __ATOMIC_RELAXED);
+    while (1) {
+        cell    = &sub->cell[pos & sub->mask];
+        dif     = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&sub->enq, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&sub->enq, __ATOMIC_RELAXED);
+        }
     }
-    if (sub->action != NULL) {
-        sub->action(sub->parent, data, datasize);
+    
+    cell->dir   = dir;
+    cell->data  = data;
+    cell->size  = size;
+    __atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+static bool sub_subq_get(spsubscr_t* sub, spcell_t* out) {
+    spcell_t* cell;
+    size_t pos = sub->deq;
+    
+    cell = &sub->cell[pos & sub->mask];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != (pos+1)) {
+        return false;
     }
+    *out        = *cell;
+    sub->deq    = pos + 1;
+    __atomic_store_n(&cell->seq, pos + sub->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+static void sub_sendtosub(spsubscr_t* sub, int dir, const uint8_t* data, size_t datasize) {
+/// Queues a copy of the data for the subscriber.  The data is dropped if the
+/// subscriber's queue is full, because the socket can't wait on subscribers.
+    uint8_t* copy;
+    
+    if ((sub->flags & dir) == 0) {
+        return;
+    }
+    copy = malloc(datasize);
+    if (copy == NULL) {
+        __atomic_add_fetch(&sub->drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(copy, data, datasize);
+    
+    if (sub_subq_put(sub, dir, copy, datasize) == false) {
+        __atomic_add_fetch(&sub->drops, 1, __ATOMIC_RELAXED);
+        free(copy);
+        return;
+    }
+    
+    // The sleeping flag and the queue are checked in opposite order by the
+    // delivery thread, so a wakeup can't be missed.
+    if (__atomic_load_n(&sub->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&sub->mutex);
+        pthread_cond_signal(&sub->cond);
+        pthread_mutex_unlock(&sub->mutex);
+    }
+}
+
+
+static void* sub_subthread(void* args) {
+    spsubscr_t* sub = args;
+    spcell_t msg;
+    
+    while (1) {
+        if (sub_subq_get(sub, &msg)) {
+            sub->action(sub->arg, msg.dir, msg.data, msg.size);
+            free(msg.data);
+            continue;
+        }
+        
+        // Queue is empty.  Queued lines are always delivered before stopping.
+        pthread_mutex_lock(&sub->mutex);
+        __atomic_store_n(&sub->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (!sub->stop && (__atomic_load_n(&sub->cell[sub->deq & sub->mask].seq, __ATOMIC_SEQ_CST) != (sub->deq+1))) {
+            pthread_cond_wait(&sub->cond, &sub->mutex);
+        }
+        __atomic_store_n(&sub->sleeping, 0, __ATOMIC_SEQ_CST);
+        if (sub->stop && (__atomic_load_n(&sub->cell[sub->deq & sub->mask].seq, __ATOMIC_SEQ_CST) != (sub->deq+1))) {
+            pthread_mutex_unlock(&sub->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&sub->mutex);
+    }
+    
+    return NULL;
+}
+
+
+static void sub_substop(spsubscr_t* sub) {
+    pthread_mutex_lock(&sub->mutex);
+    sub->stop = true;
+    pthread_cond_signal(&sub->cond);
+    pthread_mutex_unlock(&sub->mutex);
+    pthread_join(sub->thread, NULL);
 }
 
 
@@ -310,10 +455,15 @@ int sp_close(sp_handle_t handle) {
     //pthread_mutex_unlock(&sp->id_mutex);
     //pthread_mutex_destroy(&sp->id_mutex);
     
+    /// Subscribers are removed under user_mutex, so they go before it does
     pthread_mutex_unlock(&sp->user_mutex);
+    while (sp->subs > 0) {
+        sp_unsubscribe(sp->sub[0]);
+    }
     pthread_mutex_destroy(&sp->user_mutex);
-
+    
     close(sp->fd_sock);
+    free(sp->rx_buf);
     free(sp);
     
     return 0;
@@ -388,6 +538,9 @@ void sp_reader_purge(sp_reader_t reader) {
 static int sub_loadread(sprdr_t* rdr, sp_item_t* sp, uint8_t* readbuf, size_t readmax) {
     rdr->last_read = sp->read_id;
 
+    if (sp->read_buf == NULL) {
+        return 0;
+    }
     if (readmax > sp->read_size) {
         readmax = sp->read_size;
     }
@@ -500,13 +653,8 @@ static int sub_write(sp_handle_t handle, uint8_t* writebuf, size_t writesize, bo
     }
     
     /// Dispatch to subscriber(s)
-    if (sp->subs > 0) {
-        for (int i=0; i<sp->subs; i++) {
-            ///@todo Change Array to linked list
-            if (sp->sub[i]->flags & SP_SUB_OUTBOUND) {
-                sub_sendtosub(sp->sub[i], writebuf, rc);
-            }
-        }
+    for (int i=0; i<sp->subs; i++) {
+        sub_sendtosub(sp->sub[i], SP_SUB_OUTBOUND, writebuf, writesize);
     }
     
     sub_write_END:
@@ -538,27 +686,222 @@ int sp_sendcmd(sp_handle_t handle, uint8_t* writebuf, size_t writesize) {
 
 
 
-///@todo Not yet implemented
-//-----------------------------------------------------------------------------
-int sp_subscribe(sp_handle_t handle, sp_action_t action, int flags, uint8_t* buf, size_t max) {
-    return -1;
+int sp_route(sp_handle_t handle, sp_router_t router, void* arg) {
+    sp_item_t* sp = handle;
+    
+    if (sp == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&sp->user_mutex);
+    sp->router      = router;
+    sp->router_arg  = arg;
+    pthread_mutex_unlock(&sp->user_mutex);
+    return 0;
 }
 
-//int sp_dispatch(sp_handle_t handle, sp_status_t action, uint8_t* writebuf, size_t writesize) {
-//    return -1;
-//}
-//-----------------------------------------------------------------------------
 
 
+sp_subscr_t sp_subscribe(sp_handle_t handle, sp_action_t action, void* arg, int flags, size_t depth) {
+    sp_item_t* sp = handle;
+    spsubscr_t* sub;
+    size_t size;
+    
+    if ((sp == NULL) || (action == NULL)) {
+        return NULL;
+    }
+    flags &= (SP_SUB_INBOUND | SP_SUB_OUTBOUND);
+    if (flags == 0) {
+        return NULL;
+    }
+    
+    // Queue size is a power of 2, for masking
+    if (depth == 0) {
+        depth = SP_SUBQ_DEPTH;
+    }
+    for (size=2; size<depth; size<<=1);
+    
+    sub = calloc(1, sizeof(spsubscr_t));
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->cell = malloc(size * sizeof(spcell_t));
+    if (sub->cell == NULL) {
+        goto sp_subscribe_ERR1;
+    }
+    for (size_t i=0; i<size; i++) {
+        sub->cell[i].seq = i;
+    }
+    sub->mask   = size - 1;
+    sub->flags  = flags;
+    sub->parent = sp;
+    sub->action = action;
+    sub->arg    = arg;
+    
+    if (pthread_mutex_init(&sub->mutex, NULL) != 0) {
+        goto sp_subscribe_ERR2;
+    }
+    if (pthread_cond_init(&sub->cond, NULL) != 0) {
+        goto sp_subscribe_ERR3;
+    }
+    if (pthread_create(&sub->thread, NULL, &sub_subthread, sub) != 0) {
+        goto sp_subscribe_ERR4;
+    }
+    
+    pthread_mutex_lock(&sp->user_mutex);
+    if (sp->subs < sp->max_subs) {
+        ///@todo Change Array to linked list
+        sp->sub[sp->subs++] = sub;
+        pthread_mutex_unlock(&sp->user_mutex);
+        return sub;
+    }
+    pthread_mutex_unlock(&sp->user_mutex);
+    
+    // Too many subscribers
+    sub_substop(sub);
+    
+    sp_subscribe_ERR4:
+    pthread_cond_destroy(&sub->cond);
+    sp_subscribe_ERR3:
+    pthread_mutex_destroy(&sub->mutex);
+    sp_subscribe_ERR2:
+    free(sub->cell);
+    sp_subscribe_ERR1:
+    free(sub);
+    return NULL;
+}
+
+
+void sp_unsubscribe(sp_subscr_t subscr) {
+    spsubscr_t* sub = subscr;
+    sp_item_t* sp;
+    
+    if (sub == NULL) {
+        return;
+    }
+    
+    // Once removed from the handle, no more lines are queued
+    sp = sub->parent;
+    pthread_mutex_lock(&sp->user_mutex);
+    for (int i=0; i<sp->subs; i++) {
+        if (sp->sub[i] == sub) {
+            sp->subs--;
+            sp->sub[i] = sp->sub[sp->subs];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sp->user_mutex);
+    
+    sub_substop(sub);
+    
+    pthread_cond_destroy(&sub->cond);
+    pthread_mutex_destroy(&sub->mutex);
+    free(sub->cell);
+    free(sub);
+}
+
+
+size_t sp_subscr_drops(sp_subscr_t subscr) {
+    spsubscr_t* sub = subscr;
+    return (sub == NULL) ? 0 : __atomic_load_n(&sub->drops, __ATOMIC_RELAXED);
+}
+
+
+
+static int sub_rxfill(sp_item_t* sp) {
+/// Reads a block from the socket into the stream buffer, after the bytes
+/// that aren't framed yet.  Returns bytes read, or 0 on disconnect/error.
+    ssize_t rbytes;
+
+    // Framed lines are no longer needed once a new block is read.  Move any
+    // partial line to the front, or grow the buffer if the partial line
+    // fills it.  read_buf is a reference into rx_buf, so it is invalidated.
+    if ((sp->rx_head > 0) || (sp->rx_used == sp->rx_size)) {
+        pthread_mutex_lock(&sp->user_mutex);
+        sp->read_buf    = NULL;
+        sp->read_size   = 0;
+        pthread_mutex_unlock(&sp->user_mutex);
+        
+        if (sp->rx_head > 0) {
+            sp->rx_used -= sp->rx_head;
+            memmove(sp->rx_buf, &sp->rx_buf[sp->rx_head], sp->rx_used);
+            sp->rx_head = 0;
+        }
+        else if (sp->rx_size < SP_RXBUF_MAX) {
+            uint8_t* newbuf;
+            size_t newsize = sp->rx_size * 2;
+            if (newsize > SP_RXBUF_MAX) {
+                newsize = SP_RXBUF_MAX;
+            }
+            newbuf = realloc(sp->rx_buf, newsize);
+            if (newbuf == NULL) {
+                return 0;
+            }
+            sp->rx_buf  = newbuf;
+            sp->rx_size = newsize;
+        }
+        else {
+            // Line is too long for the buffer: drop it through the next
+            // terminator.
+            sp->rx_discard  = true;
+            sp->rx_used     = 0;
+        }
+    }
+
+    do {
+        rbytes = read(sp->fd_sock, &sp->rx_buf[sp->rx_used], sp->rx_size - sp->rx_used);
+    } while ((rbytes < 0) && (errno == EINTR));
+
+    if (rbytes <= 0) {
+        return 0;
+    }
+    sp->rx_used += (size_t)rbytes;
+    return (int)rbytes;
+}
+
+
+static uint8_t* sub_rxline(sp_item_t* sp, size_t* linesize, size_t* scan) {
+/// Frames the next line in the stream buffer, which is terminated in place.
+/// Lines end with \n or 0.  *scan is the offset already searched for a
+/// terminator, so bytes aren't searched twice.  Returns NULL if there isn't
+/// a complete line, else the line, with *linesize including the terminator.
+    uint8_t* line;
+    uint8_t* term;
+
+    while (1) {
+        line = &sp->rx_buf[sp->rx_head];
+        term = NULL;
+        for (; *scan < sp->rx_used; (*scan)++) {
+            if ((sp->rx_buf[*scan] == '\n') || (sp->rx_buf[*scan] == 0)) {
+                term = &sp->rx_buf[*scan];
+                break;
+            }
+        }
+        if (term == NULL) {
+            return NULL;
+        }
+        
+        *term       = 0;
+        *scan      += 1;
+        sp->rx_head = *scan;
+        
+        if (sp->rx_discard) {
+            sp->rx_discard = false;
+            continue;
+        }
+        *linesize = (size_t)(term - line) + 1;
+        return line;
+    }
+}
+
 
 void* sp_iothread(void* args) {
     sp_item_t* sp = args;
     
-    uint8_t linebuf[1024];
-    uint8_t readbuf[1024];
-    char* cursor;
-    char* end;
-    int waiting_readers;
+    uint8_t* line;
+    size_t linesize;
+    size_t scan;
+    sp_router_t router;
+    void* router_arg;
     int backoff = 1;
     int max_backoff = 60;
     
@@ -568,10 +911,17 @@ void* sp_iothread(void* args) {
     
     // Setup reference variables needed by sp_read()
     sp->readline_inactive   = true;
-    sp->read_buf            = linebuf;
+    sp->read_buf            = NULL;
     sp->read_size           = 0;
     sp->read_id             = 1;
     
+    // The stream buffer is freed in sp_close()
+    sp->rx_size = SP_RXBUF_INIT;
+    sp->rx_buf  = malloc(sp->rx_size);
+    if (sp->rx_buf == NULL) {
+        return NULL;
+    }
+    
     while (1) {
         /// Connect to the socket
         if (connect(sp->fd_sock, (struct sockaddr *)&sp->addr, sizeof(struct sockaddr_un)) < 0) {
@@ -582,53 +932,46 @@ void* sp_iothread(void* args) {
             continue;
         }
         
-        backoff = 1;
+        backoff         = 1;
+        sp->rx_head     = 0;
+        sp->rx_used     = 0;
+        sp->rx_discard  = false;
+        scan            = 0;
         
         while (1) {
             // ----------------------------------------------------------------
-            /// Double-Buffer stream
-            /// Solves for problem of reading two lines at the same time.
-            cursor = (char*)readbuf;
-            end    = (char*)readbuf + sizeof(readbuf);
-            while(1) {
-                if (read(sp->fd_sock, cursor, 1) < 1) {
+            /// Block-read framer
+            /// Each read() may carry several lines, which are framed in place
+            /// and dispatched by reference, in order.
+            line = sub_rxline(sp, &linesize, &scan);
+            if (line == NULL) {
+                if (sub_rxfill(sp) <= 0) {
                     goto sp_iothread_RECONNECT;
                 }
-                if ((*cursor == '\n') || (*cursor == 0)) {
-                    *cursor++ = 0;
-                    break;
-                }
-                if (++cursor >= end) {
-                    cursor = (char*)readbuf;
-                }
+                scan = sp->rx_head;
+                continue;
             }
             // ----------------------------------------------------------------
-//{
-//struct timespec cur;
-//clock_gettime(CLOCK_REALTIME, &cur);
-//fprintf(stderr, _E_MAG "sp_iothread() [%zu.%zu] readline (%zu bytes)\n%s\n" _E_NRM, cur.tv_sec, cur.tv_nsec, (cursor - (char*)readbuf), readbuf);
-//}
+            
+            // The router runs without user_mutex, because it may wake threads
+            // that are about to write to the socket.
+            pthread_mutex_lock(&sp->user_mutex);
+            router      = sp->router;
+            router_arg  = sp->router_arg;
+            pthread_mutex_unlock(&sp->user_mutex);
+            if ((router != NULL) && router(router_arg, line, linesize)) {
+                continue;
+            }
+            
             pthread_mutex_lock(&sp->user_mutex);
             sp->read_id++;
-            sp->read_size = (cursor - (char*)readbuf);
-            memcpy(sp->read_buf, readbuf, sp->read_size);
+            sp->read_buf    = line;
+            sp->read_size   = linesize;
 
-//{
-//struct timespec cur;
-//clock_gettime(CLOCK_REALTIME, &cur);
-//fprintf(stderr, _E_MAG "sp_iothread() [%zu.%zu] post user_mutex lock\n" _E_NRM, cur.tv_sec, cur.tv_nsec);
-//}
-
-            // publish it to subscribers, which are callbacks that need
-            // to deal with data replication themselves.
-            // lock the data mutex to prevent new subscribers getting added
-            if (sp->subs > 0) {
-                for (int i=0; i<sp->subs; i++) {
-                    ///@todo Change Array to linked list
-                    if (sp->sub[i]->flags & SP_SUB_INBOUND) {
-                        sub_sendtosub(sp->sub[i], sp->read_buf, sp->read_size);
-                    }
-                }
+            // publish it to subscribers, which get their own copies on
+            // their own queues.  user_mutex only protects the sub array.
+            for (int i=0; i<sp->subs; i++) {
+                sub_sendtosub(sp->sub[i], SP_SUB_INBOUND, sp->read_buf, sp->read_size);
             }
 
             ///@todo there seems to be a problem where a line gets read multiple times via sp_read()
@@ -649,18 +992,6 @@ void* sp_iothread(void* args) {
                     }
                     pthread_mutex_unlock(&sp->readdone_mutex);
                 }
-                
-                
-                
-                
-
-//                while (waiting_readers > 0) {
-//fprintf(stderr, "loop lock for waiting_readers\n");
-//                    pthread_mutex_lock(&sp->id_mutex);
-//                    waiting_readers = (int)sp->waiting_readers;
-//                    pthread_mutex_unlock(&sp->id_mutex);
-//fprintf(stderr, "waiting_readers = %i\n", waiting_readers);
-//                }
             }
             
             pthread_mutex_unlock(&sp->user_mutex);
@@ -17,6 +17,7 @@
 #ifndef sockpush_h
 #define sockpush_h
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 
@@ -30,8 +31,16 @@
 // ---------------------------------------------------------------------------
 typedef void* sp_handle_t;
 typedef void* sp_reader_t;
+typedef void* sp_subscr_t;
 
-typedef int (*sp_action_t)(sp_handle_t, const uint8_t*, size_t);
+/// A subscriber action gets its arg, the direction (SP_SUB_INBOUND or
+/// SP_SUB_OUTBOUND), and a line.  It runs on the subscriber's own thread,
+/// and the line is only valid during the call.
+typedef void (*sp_action_t)(void*, int, const uint8_t*, size_t);
+
+/// A router sees each inbound line before readers and subscribers do, and it
+/// returns true if it consumed the line.  It runs on the sockpush I/O thread.
+typedef bool (*sp_router_t)(void*, const uint8_t*, size_t);
 
 
 
@@ -60,7 +69,35 @@ int sp_sendcmd(sp_handle_t handle, uint8_t* writebuf, size_t writesize);
 int sp_write(sp_handle_t handle, uint8_t* writebuf, size_t writesize);
 
 
-int sp_subscribe(sp_handle_t handle, sp_action_t action, int flags, uint8_t* readbuf, size_t readmax);
+/** @brief Adds an asynchronous subscriber to the socket traffic
+  * @param handle   (sp_handle_t) sockpush handle
+  * @param action   (sp_action_t) Called for each line
+  * @param arg      (void*) First argument to action
+  * @param flags    (int) SP_SUB_INBOUND and/or SP_SUB_OUTBOUND
+  * @param depth    (size_t) Queue depth in lines.  0 uses default.
+  * @retval         Subscriber handle, or NULL on error
+  *
+  * Lines are copied onto the subscriber's lock-free queue by the thread that
+  * reads or writes the socket, and delivered in order by the subscriber's
+  * own thread.  Lines are dropped if the queue is full (see
+  * sp_subscr_drops()).  Inbound lines consumed by the router aren't
+  * delivered to subscribers.
+  */
+sp_subscr_t sp_subscribe(sp_handle_t handle, sp_action_t action, void* arg, int flags, size_t depth);
+
+/** @brief Removes a subscriber, after delivering the lines it has queued
+  * @note Must not be called from the subscriber's action
+  */
+void sp_unsubscribe(sp_subscr_t subscr);
+
+/** @brief Returns the number of lines dropped for a subscriber
+  */
+size_t sp_subscr_drops(sp_subscr_t subscr);
+
+
+/** @brief Sets the router for inbound lines.  NULL router removes it.
+  */
+int sp_route(sp_handle_t handle, sp_router_t router, void* arg);
 
 
 //int sp_dispatch(sp_handle_t handle, sp_status_t action, uint8_t* writebuf, size_t writesize);
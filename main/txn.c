@@ -0,0 +1,228 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "txn.h"
+
+// HB Headers/Libraries
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/// A transaction expires when it hasn't been used for the timeout, so one
+/// that is still being staged by a slow client is kept.
+typedef struct {
+    txn_batch_t*    batch;
+    time_t          used;
+} txn_slot_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    TALLOC_CTX*     ctx;
+    int             next_id;
+    txn_slot_t      slot[OTDB_PARAM_TXN_MAX];
+} txn_item_t;
+
+
+
+
+static txn_slot_t* sub_find(txn_item_t* tx, int id) {
+    if (id <= 0) {
+        return NULL;
+    }
+    for (int i=0; i<OTDB_PARAM_TXN_MAX; i++) {
+        if ((tx->slot[i].batch != NULL) && (tx->slot[i].batch->id == id)) {
+            return &tx->slot[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void sub_expire(txn_item_t* tx, time_t now) {
+    for (int i=0; i<OTDB_PARAM_TXN_MAX; i++) {
+        if ((tx->slot[i].batch != NULL) && ((now - tx->slot[i].used) > OTDB_PARAM_TXN_TIMEOUT)) {
+            talloc_free(tx->slot[i].batch);
+            tx->slot[i].batch = NULL;
+        }
+    }
+}
+
+
+
+
+int txn_init(txn_t* handle) {
+    txn_item_t* tx;
+
+    if (handle == NULL) {
+        return -1;
+    }
+    tx = calloc(1, sizeof(txn_item_t));
+    if (tx == NULL) {
+        return -2;
+    }
+    tx->ctx = talloc_new(NULL);
+    if (tx->ctx == NULL) {
+        free(tx);
+        return -2;
+    }
+    if (pthread_mutex_init(&tx->mutex, NULL) != 0) {
+        talloc_free(tx->ctx);
+        free(tx);
+        return -3;
+    }
+    tx->next_id = 1;
+    *handle     = tx;
+    return 0;
+}
+
+
+void txn_deinit(txn_t handle) {
+    txn_item_t* tx = handle;
+
+    if (tx != NULL) {
+        pthread_mutex_destroy(&tx->mutex);
+        talloc_free(tx->ctx);
+        free(tx);
+    }
+}
+
+
+int txn_begin(txn_t handle, uint64_t uid) {
+    txn_item_t* tx = handle;
+    txn_batch_t* batch;
+    time_t now;
+    int rc = -2;
+
+    if (tx == NULL) {
+        return -1;
+    }
+    now = time(NULL);
+
+    pthread_mutex_lock(&tx->mutex);
+    sub_expire(tx, now);
+    for (int i=0; i<OTDB_PARAM_TXN_MAX; i++) {
+        if (tx->slot[i].batch == NULL) {
+            batch = talloc_zero(tx->ctx, txn_batch_t);
+            if (batch == NULL) {
+                rc = -3;
+                break;
+            }
+            batch->id   = tx->next_id;
+            batch->uid  = uid;
+            tx->slot[i].batch   = batch;
+            tx->slot[i].used    = now;
+            tx->next_id = (tx->next_id == INT32_MAX) ? 1 : (tx->next_id + 1);
+            rc = batch->id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tx->mutex);
+
+    return rc;
+}
+
+
+int txn_stage(txn_t handle, int id, const txn_write_t* write) {
+    txn_item_t* tx = handle;
+    txn_slot_t* slot;
+    txn_write_t* staged;
+    time_t now;
+    int rc;
+
+    if ((tx == NULL) || (write == NULL)) {
+        return -1;
+    }
+    now = time(NULL);
+
+    pthread_mutex_lock(&tx->mutex);
+    sub_expire(tx, now);
+    slot = sub_find(tx, id);
+    if (slot == NULL) {
+        rc = -1;
+    }
+    else if (slot->batch->count >= OTDB_PARAM_TXN_WRITES) {
+        rc = -2;
+    }
+    else {
+        staged  = &slot->batch->write[slot->batch->count];
+        *staged = *write;
+        staged->data = NULL;
+        if (write->size > 0) {
+            staged->data = talloc_memdup(slot->batch, write->data, write->size);
+        }
+        if ((write->size > 0) && (staged->data == NULL)) {
+            rc = -3;
+        }
+        else {
+            rc = ++slot->batch->count;
+            slot->used = now;
+        }
+    }
+    pthread_mutex_unlock(&tx->mutex);
+
+    return rc;
+}
+
+
+txn_batch_t* txn_take(txn_t handle, int id, uint64_t uid) {
+    txn_item_t* tx = handle;
+    txn_slot_t* slot;
+    txn_batch_t* batch = NULL;
+
+    if (tx == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tx->mutex);
+    sub_expire(tx, time(NULL));
+    slot = sub_find(tx, id);
+    if ((slot != NULL) && (slot->batch->uid == uid)) {
+        /// The batch is detached, so the caller frees it without the mutex
+        batch       = talloc_steal(NULL, slot->batch);
+        slot->batch = NULL;
+    }
+    pthread_mutex_unlock(&tx->mutex);
+
+    return batch;
+}
+
+
+int txn_abort(txn_t handle, int id) {
+    txn_item_t* tx = handle;
+    txn_slot_t* slot;
+    int rc = -1;
+
+    if (tx == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&tx->mutex);
+    slot = sub_find(tx, id);
+    if (slot != NULL) {
+        talloc_free(slot->batch);
+        slot->batch = NULL;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&tx->mutex);
+
+    return rc;
+}
@@ -0,0 +1,98 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef txn_h
+#define txn_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// HB Headers/Libraries
+#include <talloc.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Write Transactions
+  * -------------------------------------------------------------------------
+  * A transaction is a set of file writes to one device, which are staged by
+  * separate commands and applied together by a commit.  Staged writes don't
+  * touch the DB, so the registry only has its own mutex.  Transactions are
+  * known by ID rather than by client, because a client connection may be
+  * serviced by any worker.  Transactions that go OTDB_PARAM_TXN_TIMEOUT
+  * seconds without a staged write are dropped.
+  */
+
+typedef void* txn_t;
+
+typedef struct {
+    uint8_t     block_id;
+    uint8_t     file_id;
+    uint16_t    range_lo;
+    uint16_t    range_hi;
+    uint16_t    size;
+    uint8_t*    data;
+} txn_write_t;
+
+typedef struct {
+    int         id;
+    uint64_t    uid;
+    int         count;
+    txn_write_t write[OTDB_PARAM_TXN_WRITES];
+} txn_batch_t;
+
+
+int txn_init(txn_t* handle);
+void txn_deinit(txn_t handle);
+
+
+/** @brief Opens a transaction on a device
+  * @param handle   (txn_t) Transaction registry
+  * @param uid      (uint64_t) Device of the transaction
+  * @retval         Transaction ID, which is positive, or negative on error
+  */
+int txn_begin(txn_t handle, uint64_t uid);
+
+
+/** @brief Stages a write in a transaction
+  * @param handle   (txn_t) Transaction registry
+  * @param id       (int) Transaction ID
+  * @param write    (const txn_write_t*) Write.  Its data is copied.
+  * @retval         Number of writes staged, or negative on error: -1 if
+  *                 there is no such transaction, -2 if it is full.
+  */
+int txn_stage(txn_t handle, int id, const txn_write_t* write);
+
+
+/** @brief Removes a transaction from the registry, to commit it
+  * @param handle   (txn_t) Transaction registry
+  * @param id       (int) Transaction ID
+  * @param uid      (uint64_t) Device of the transaction
+  * @retval         The transaction, which the caller frees with talloc_free(),
+  *                 or NULL if there is no such transaction on the device.
+  */
+txn_batch_t* txn_take(txn_t handle, int id, uint64_t uid);
+
+
+/** @brief Drops a transaction without applying it
+  * @retval         0 on success, -1 if there is no such transaction
+  */
+int txn_abort(txn_t handle, int id);
+
+
+#endif
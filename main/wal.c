@@ -0,0 +1,522 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "wal.h"
+#include "debug.h"
+
+// Standard C & POSIX Libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+// Largest record data accepted by replay: bigger sizes mean corruption
+#define WAL_DATA_MAX        (16*1024*1024)
+
+
+typedef struct {
+    uint8_t*    data;
+    size_t      used;
+    size_t      alloc;
+} walbuf_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond_flush;
+    pthread_cond_t  cond_synced;
+    pthread_t       thread;
+    bool            stop;
+    bool            force;
+
+    int             fd;
+    char*           basepath;
+    int             error;
+    off_t           end;        // end of the last record written in full
+
+    // Records are appended to "fill" while the flusher writes "drain"
+    walbuf_t        fill;
+    walbuf_t        drain;
+    uint64_t        lsn_appended;
+    uint64_t        lsn_synced;
+} wal_item_t;
+
+
+static uint32_t crc_table[256];
+
+
+
+
+static void sub_crcinit(void) {
+    for (uint32_t i=0; i<256; i++) {
+        uint32_t c = i;
+        for (int k=0; k<8; k++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc_table[i] = c;
+    }
+}
+
+
+static uint32_t sub_crc(uint32_t crc, const uint8_t* data, size_t size) {
+    crc = ~crc;
+    while (size-- != 0) {
+        crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+static uint32_t sub_reccrc(const wal_rec_t* rec, const uint8_t* data) {
+    uint32_t crc;
+    crc = sub_crc(0, (const uint8_t*)rec + sizeof(rec->crc), sizeof(wal_rec_t) - sizeof(rec->crc));
+    return sub_crc(crc, data, rec->size);
+}
+
+
+static char* sub_walpath(const char* basepath) {
+    char* path = malloc(strlen(basepath) + sizeof(".wal"));
+    if (path != NULL) {
+        strcpy(stpcpy(path, basepath), ".wal");
+    }
+    return path;
+}
+
+
+static int sub_writefull(int fd, const uint8_t* data, size_t size) {
+    while (size != 0) {
+        ssize_t bytes = write(fd, data, size);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += bytes;
+        size -= (size_t)bytes;
+    }
+    return 0;
+}
+
+
+static int sub_readfull(int fd, uint8_t* data, size_t size) {
+/// Returns 0 when all bytes are read, 1 on a short read (end of log)
+    while (size != 0) {
+        ssize_t bytes = read(fd, data, size);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytes == 0) {
+            return 1;
+        }
+        data += bytes;
+        size -= (size_t)bytes;
+    }
+    return 0;
+}
+
+
+
+
+static void* sub_flusher(void* args) {
+/// Writes the fill buffer out every OTDB_PARAM_WAL_FLUSH ms, or when an
+/// append or wal_sync() is waiting on it.  Appends that arrive during a write
+/// and fsync go into the next one, which is the group commit.
+///
+/// A failed write is cut off the log, so the log ends with a whole record
+/// and replays up to it.  Nothing more is written after a failure, because
+/// records after the missing ones would replay onto the wrong data.
+    wal_item_t* wal = args;
+    struct timespec wake;
+    walbuf_t swap;
+    uint64_t target;
+    bool sync;
+    off_t end;
+    int fd;
+    int rc;
+
+    pthread_mutex_lock(&wal->mutex);
+    while (1) {
+        if (!wal->stop && !wal->force) {
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_nsec   += (long)OTDB_PARAM_WAL_FLUSH * 1000000L;
+            wake.tv_sec    += wake.tv_nsec / 1000000000L;
+            wake.tv_nsec   %= 1000000000L;
+            pthread_cond_timedwait(&wal->cond_flush, &wal->mutex, &wake);
+        }
+
+        if ((wal->fill.used != 0) && (wal->error != 0)) {
+            wal->fill.used  = 0;
+            wal->force      = false;
+            wal->lsn_synced = wal->lsn_appended;
+            pthread_cond_broadcast(&wal->cond_synced);
+        }
+        else if ((wal->fill.used != 0) && (wal->fd >= 0)) {
+            swap        = wal->drain;
+            wal->drain  = wal->fill;
+            wal->fill   = swap;
+            wal->fill.used = 0;
+            target      = wal->lsn_appended;
+            sync        = wal->force || (OTDB_PARAM_WAL_SYNC != WAL_SYNC_none);
+            fd          = wal->fd;
+            end         = wal->end;
+            wal->force  = false;
+            pthread_mutex_unlock(&wal->mutex);
+
+            rc = sub_writefull(fd, wal->drain.data, wal->drain.used);
+            if ((rc == 0) && sync) {
+                rc = fdatasync(fd);
+            }
+            if (rc != 0) {
+                rc = (errno != 0) ? -errno : -1;
+                if ((ftruncate(fd, end) == 0) && (lseek(fd, end, SEEK_SET) == end)) {
+                    fdatasync(fd);
+                }
+            }
+
+            pthread_mutex_lock(&wal->mutex);
+            if (rc != 0) {
+                wal->error  = rc;
+            }
+            else {
+                wal->end   += (off_t)wal->drain.used;
+            }
+            wal->drain.used = 0;
+            wal->lsn_synced = target;
+            pthread_cond_broadcast(&wal->cond_synced);
+        }
+        else if (wal->force) {
+            if (wal->fd >= 0) {
+                fdatasync(wal->fd);
+            }
+            wal->force      = false;
+            wal->lsn_synced = wal->lsn_appended;
+            pthread_cond_broadcast(&wal->cond_synced);
+        }
+        else if (wal->stop) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wal->mutex);
+
+    return NULL;
+}
+
+
+static void sub_detach(wal_item_t* wal) {
+/// Flushes the attached log and closes it
+    wal_sync(wal);
+
+    pthread_mutex_lock(&wal->mutex);
+    if (wal->fd >= 0) {
+        close(wal->fd);
+        wal->fd = -1;
+    }
+    free(wal->basepath);
+    wal->basepath   = NULL;
+    wal->error      = 0;
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+
+
+
+int wal_init(wal_t* handle) {
+    wal_item_t* wal;
+
+    if (handle == NULL) {
+        return -1;
+    }
+    wal = calloc(1, sizeof(wal_item_t));
+    if (wal == NULL) {
+        return -2;
+    }
+    sub_crcinit();
+    wal->fd = -1;
+
+    if (pthread_mutex_init(&wal->mutex, NULL) != 0) {
+        free(wal);
+        return -3;
+    }
+    pthread_cond_init(&wal->cond_flush, NULL);
+    pthread_cond_init(&wal->cond_synced, NULL);
+    if (pthread_create(&wal->thread, NULL, &sub_flusher, wal) != 0) {
+        pthread_cond_destroy(&wal->cond_synced);
+        pthread_cond_destroy(&wal->cond_flush);
+        pthread_mutex_destroy(&wal->mutex);
+        free(wal);
+        return -4;
+    }
+
+    *handle = wal;
+    return 0;
+}
+
+
+void wal_deinit(wal_t handle) {
+    wal_item_t* wal = handle;
+
+    if (wal != NULL) {
+        sub_detach(wal);
+
+        pthread_mutex_lock(&wal->mutex);
+        wal->stop = true;
+        pthread_cond_signal(&wal->cond_flush);
+        pthread_mutex_unlock(&wal->mutex);
+        pthread_join(wal->thread, NULL);
+
+        pthread_cond_destroy(&wal->cond_synced);
+        pthread_cond_destroy(&wal->cond_flush);
+        pthread_mutex_destroy(&wal->mutex);
+        free(wal->fill.data);
+        free(wal->drain.data);
+        free(wal);
+    }
+}
+
+
+int wal_attach(wal_t handle, const char* basepath, wal_apply_t apply, void* arg) {
+    wal_item_t* wal = handle;
+    char* path;
+    char magic[8];
+    uint8_t* data = NULL;
+    off_t valid;
+    int records = 0;
+    int fd;
+    int rc;
+
+    if ((wal == NULL) || (basepath == NULL)) {
+        return -1;
+    }
+    sub_detach(wal);
+
+    path = sub_walpath(basepath);
+    if (path == NULL) {
+        return -2;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    free(path);
+    if (fd < 0) {
+        return -3;
+    }
+
+    /// A new log gets the magic number.  An existing one is replayed.
+    rc = sub_readfull(fd, (uint8_t*)magic, sizeof(magic));
+    if (rc == 1) {
+        if ((ftruncate(fd, 0) != 0) || (lseek(fd, 0, SEEK_SET) != 0)
+        ||  (sub_writefull(fd, (const uint8_t*)WAL_MAGIC, sizeof(magic)) != 0)) {
+            close(fd);
+            return -4;
+        }
+        valid = sizeof(magic);
+    }
+    else if ((rc != 0) || (memcmp(magic, WAL_MAGIC, sizeof(magic)) != 0)) {
+        close(fd);
+        return -5;
+    }
+    else {
+        valid = sizeof(magic);
+        while (1) {
+            wal_rec_t rec;
+            uint8_t* grown;
+
+            if (sub_readfull(fd, (uint8_t*)&rec, sizeof(rec)) != 0) {
+                break;
+            }
+            if (rec.size > WAL_DATA_MAX) {
+                break;
+            }
+            grown = realloc(data, rec.size + 1);
+            if (grown == NULL) {
+                break;
+            }
+            data = grown;
+            if (sub_readfull(fd, data, rec.size) != 0) {
+                break;
+            }
+            if (sub_reccrc(&rec, data) != rec.crc) {
+                DEBUG_PRINTF("WAL record %d is corrupt, replay ends\n", records);
+                break;
+            }
+            if (apply != NULL) {
+                apply(arg, &rec, data);
+            }
+            valid += sizeof(rec) + rec.size;
+            records++;
+        }
+        free(data);
+
+        /// Appends follow the last valid record
+        if ((ftruncate(fd, valid) != 0) || (lseek(fd, valid, SEEK_SET) != valid)) {
+            close(fd);
+            return -4;
+        }
+    }
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->fd         = fd;
+    wal->end        = valid;
+    wal->basepath   = strdup(basepath);
+    pthread_mutex_unlock(&wal->mutex);
+
+    return records;
+}
+
+
+int wal_reset(wal_t handle, const char* basepath) {
+    wal_item_t* wal = handle;
+    char* path;
+    int fd;
+
+    if (wal == NULL) {
+        return -1;
+    }
+    sub_detach(wal);
+    if (basepath == NULL) {
+        return 0;
+    }
+
+    path = sub_walpath(basepath);
+    if (path == NULL) {
+        return -2;
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    free(path);
+    if (fd < 0) {
+        return -3;
+    }
+    if ((sub_writefull(fd, (const uint8_t*)WAL_MAGIC, 8) != 0) || (fdatasync(fd) != 0)) {
+        close(fd);
+        return -4;
+    }
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->fd         = fd;
+    wal->end        = 8;
+    wal->basepath   = strdup(basepath);
+    pthread_mutex_unlock(&wal->mutex);
+
+    return 0;
+}
+
+
+bool wal_isbase(wal_t handle, const char* path) {
+    wal_item_t* wal = handle;
+    bool test;
+
+    if ((wal == NULL) || (path == NULL)) {
+        return false;
+    }
+    pthread_mutex_lock(&wal->mutex);
+    test = (wal->basepath != NULL) && (strcmp(wal->basepath, path) == 0);
+    pthread_mutex_unlock(&wal->mutex);
+    return test;
+}
+
+
+int wal_append(wal_t handle, wal_rec_t* rec, const void* data, uint32_t size) {
+    wal_item_t* wal = handle;
+    size_t need;
+    uint64_t lsn;
+    int rc = 0;
+
+    if ((wal == NULL) || (rec == NULL)) {
+        return 0;
+    }
+
+    rec->size   = size;
+    rec->rfu    = 0;
+    rec->crc    = sub_reccrc(rec, data);
+    need        = sizeof(wal_rec_t) + size;
+
+    pthread_mutex_lock(&wal->mutex);
+    if (wal->fd < 0) {
+        goto wal_append_END;
+    }
+    if (wal->error != 0) {
+        rc = wal->error;
+        goto wal_append_END;
+    }
+
+    /// If the buffer is full, wait for the flusher to take it
+    while ((wal->fill.used != 0) && ((wal->fill.used + need) > OTDB_PARAM_WAL_BUFMAX)) {
+        wal->force = true;
+        pthread_cond_signal(&wal->cond_flush);
+        pthread_cond_wait(&wal->cond_synced, &wal->mutex);
+    }
+    if ((wal->fill.used + need) > wal->fill.alloc) {
+        size_t alloc = (wal->fill.alloc != 0) ? wal->fill.alloc : 4096;
+        uint8_t* grown;
+        while (alloc < (wal->fill.used + need)) {
+            alloc *= 2;
+        }
+        grown = realloc(wal->fill.data, alloc);
+        if (grown == NULL) {
+            rc = -2;
+            goto wal_append_END;
+        }
+        wal->fill.data  = grown;
+        wal->fill.alloc = alloc;
+    }
+    memcpy(&wal->fill.data[wal->fill.used], rec, sizeof(wal_rec_t));
+    memcpy(&wal->fill.data[wal->fill.used + sizeof(wal_rec_t)], data, size);
+    wal->fill.used     += need;
+    wal->lsn_appended  += need;
+    lsn                 = wal->lsn_appended;
+
+    /// In commit mode, return only once the record is on disk.  The flusher
+    /// is forced, so it doesn't wait out its period first.
+    if (OTDB_PARAM_WAL_SYNC == WAL_SYNC_commit) {
+        wal->force = true;
+        pthread_cond_signal(&wal->cond_flush);
+        while ((wal->lsn_synced < lsn) && (wal->fd >= 0)) {
+            pthread_cond_wait(&wal->cond_synced, &wal->mutex);
+        }
+    }
+    rc = wal->error;
+
+    wal_append_END:
+    pthread_mutex_unlock(&wal->mutex);
+    return rc;
+}
+
+
+int wal_sync(wal_t handle) {
+    wal_item_t* wal = handle;
+    uint64_t lsn;
+    int rc;
+
+    if (wal == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&wal->mutex);
+    if (wal->fd >= 0) {
+        lsn         = wal->lsn_appended;
+        wal->force  = true;
+        pthread_cond_signal(&wal->cond_flush);
+        while (wal->lsn_synced < lsn) {
+            pthread_cond_wait(&wal->cond_synced, &wal->mutex);
+        }
+    }
+    rc = wal->error;
+    pthread_mutex_unlock(&wal->mutex);
+    return rc;
+}
@@ -0,0 +1,149 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef wal_h
+#define wal_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** Write-Ahead Log
+  * -------------------------------------------------------------------------
+  * The WAL records every change to the DB since it was last opened from, or
+  * completely saved to, its baseline archive.  The log of archive "path" is
+  * the file "path.wal".  Opening the archive replays its log, so the DB comes
+  * back to its last state after a crash.  A complete save starts a new log.
+  *
+  * Appends go to a memory buffer, which a flusher thread writes out.  The
+  * fsync policy is OTDB_PARAM_WAL_SYNC:
+  * - WAL_SYNC_none:     Written every OTDB_PARAM_WAL_FLUSH ms, never synced.
+  * - WAL_SYNC_periodic: Written and synced every OTDB_PARAM_WAL_FLUSH ms.
+  * - WAL_SYNC_commit:   wal_append() returns after its record is synced.
+  *                      Concurrent appends share one fsync (group commit).
+  *
+  * Each record is a wal_rec_t followed by "size" bytes of data, and it has a
+  * CRC, so a torn record at the end of the log is detected and dropped.
+  * Integers are stored in host byte order.
+  *
+  * If a write to the log fails, the log is cut back to its last whole record
+  * and nothing more is appended to it.  The changes after that are only in
+  * the DB, so appends return the error until a save resets the log.
+  */
+
+#define WAL_MAGIC           "OTDBWAL1"
+
+typedef enum {
+    WAL_SYNC_none       = 0,
+    WAL_SYNC_periodic   = 1,
+    WAL_SYNC_commit     = 2
+} WAL_sync;
+
+typedef enum {
+    WAL_write       = 1,    // data written to file at offset
+    WAL_store       = 2,    // file content replaced by data
+    WAL_chmod       = 3,    // file permissions changed to perms
+    WAL_new         = 4,    // file created with perms and alloc
+    WAL_del         = 5,    // file deleted
+    WAL_devimage    = 6,    // device created or replaced by FS image in data
+    WAL_devdel      = 7,    // device deleted
+    WAL_txn         = 8     // writes of a transaction, as wal_txw_t in data
+} WAL_op;
+
+typedef struct {
+    uint32_t    crc;        // CRC32 of the record after this field, and data
+    uint32_t    size;       // bytes of data following the record
+    uint64_t    uid;
+    uint32_t    modtime;
+    uint16_t    offset;
+    uint16_t    alloc;
+    uint8_t     op;
+    uint8_t     block;
+    uint8_t     file;
+    uint8_t     perms;
+    uint32_t    rfu;
+} wal_rec_t;
+
+/// A WAL_txn record holds all the writes of a transaction, each one a
+/// wal_txw_t followed by "size" bytes of data.  The record is replayed whole
+/// or, if it is torn, not at all, so a transaction is never half replayed.
+typedef struct {
+    uint16_t    offset;
+    uint16_t    size;
+    uint8_t     block;
+    uint8_t     file;
+    uint16_t    rfu;
+} wal_txw_t;
+
+typedef void* wal_t;
+
+/// Replays one record into the DB.  Errors are ignored by the replay.
+typedef int (*wal_apply_t)(void* arg, const wal_rec_t* rec, const uint8_t* data);
+
+
+int wal_init(wal_t* handle);
+void wal_deinit(wal_t handle);
+
+
+/** @brief Replays the log of an archive, then continues appending to it
+  * @param handle   (wal_t) WAL handle
+  * @param basepath (const char*) Archive that has just been opened
+  * @param apply    (wal_apply_t) Applies a record to the DB
+  * @param arg      (void*) Argument for apply
+  * @retval         Number of records replayed, or negative on error
+  *
+  * A torn or corrupt record ends the replay, and the log is cut before it.
+  */
+int wal_attach(wal_t handle, const char* basepath, wal_apply_t apply, void* arg);
+
+
+/** @brief Starts a new, empty log for an archive, after it is saved
+  * @param handle   (wal_t) WAL handle
+  * @param basepath (const char*) Archive that now matches the DB, or NULL to
+  *                 stop logging.
+  * @retval         0 on success, negative on error
+  */
+int wal_reset(wal_t handle, const char* basepath);
+
+
+/** @brief Tests if a path is the baseline archive of the log
+  */
+bool wal_isbase(wal_t handle, const char* path);
+
+
+/** @brief Appends a record to the log
+  * @param handle   (wal_t) WAL handle.  If NULL, or if no log is attached,
+  *                 nothing is done.
+  * @param rec      (wal_rec_t*) Record.  crc and size are set here.
+  * @param data     (const void*) Data of the record
+  * @param size     (uint32_t) Bytes of data
+  * @retval         0 on success, negative on error.  Once the log has an
+  *                 error, the record is not appended.
+  */
+int wal_append(wal_t handle, wal_rec_t* rec, const void* data, uint32_t size);
+
+
+/** @brief Writes and syncs all records appended so far
+  */
+int wal_sync(wal_t handle);
+
+
+#endif
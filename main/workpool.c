@@ -0,0 +1,239 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "workpool.h"
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+/// The queue is a ring of depth jobs
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond_job;
+    pthread_cond_t  cond_space;
+    pthread_cond_t  cond_done;
+    void**          ring;
+    int             depth;
+    int             head;
+    int             queued;
+    bool            stop;
+    int             rc;
+
+    workpool_action_t action;
+    workpool_done_t done;
+    void*           arg;
+
+    int             threads;
+    pthread_t*      thread;
+} workpool_item_t;
+
+
+
+
+static void sub_done(workpool_item_t* pool, void* job, int rc) {
+/// Called with the mutex held
+    if ((rc != 0) && (pool->rc == 0)) {
+        pool->rc = rc;
+    }
+    if (pool->done != NULL) {
+        pool->done(pool->arg, job, rc);
+    }
+    pthread_cond_broadcast(&pool->cond_done);
+}
+
+
+static void* sub_worker(void* args) {
+    workpool_item_t* pool = args;
+    void* job;
+    int rc;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while ((pool->queued == 0) && !pool->stop) {
+            pthread_cond_wait(&pool->cond_job, &pool->mutex);
+        }
+        if (pool->queued == 0) {
+            break;
+        }
+        job         = pool->ring[pool->head];
+        pool->head  = (pool->head + 1) % pool->depth;
+        pool->queued--;
+        pthread_cond_signal(&pool->cond_space);
+
+        /// Jobs put before an error are still run, so that each one is done
+        /// the same way whether or not another one failed.
+        pthread_mutex_unlock(&pool->mutex);
+        rc = pool->action(pool->arg, job);
+        pthread_mutex_lock(&pool->mutex);
+        sub_done(pool, job, rc);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+
+
+
+int workpool_start(workpool_t* handle, int workers, long jobs, int depth,
+                   workpool_action_t action, workpool_done_t done, void* arg) {
+    workpool_item_t* pool;
+    long cpus;
+
+    if ((handle == NULL) || (action == NULL)) {
+        return -1;
+    }
+
+    /// Worker count is the number of CPUs, up to the given maximum, and no
+    /// more than there are jobs.
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((cpus > 0) && (workers > cpus)) {
+        workers = (int)cpus;
+    }
+    if ((jobs >= 0) && (workers > jobs)) {
+        workers = (int)jobs;
+    }
+    if (workers < 0) {
+        workers = 0;
+    }
+    if (depth <= 0) {
+        depth = (workers > 0) ? (2 * workers) : 1;
+    }
+
+    pool = calloc(1, sizeof(workpool_item_t));
+    if (pool == NULL) {
+        return -2;
+    }
+    pool->ring      = calloc(depth, sizeof(void*));
+    pool->thread    = calloc((workers > 0) ? workers : 1, sizeof(pthread_t));
+    if ((pool->ring == NULL) || (pool->thread == NULL)) {
+        free(pool->ring);
+        free(pool->thread);
+        free(pool);
+        return -2;
+    }
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool->ring);
+        free(pool->thread);
+        free(pool);
+        return -3;
+    }
+    pthread_cond_init(&pool->cond_job, NULL);
+    pthread_cond_init(&pool->cond_space, NULL);
+    pthread_cond_init(&pool->cond_done, NULL);
+    pool->depth     = depth;
+    pool->action    = action;
+    pool->done      = done;
+    pool->arg       = arg;
+
+    for (; pool->threads<workers; pool->threads++) {
+        if (pthread_create(&pool->thread[pool->threads], NULL, &sub_worker, pool) != 0) {
+            break;
+        }
+    }
+
+    *handle = pool;
+    return 0;
+}
+
+
+int workpool_put(workpool_t handle, void* job) {
+    workpool_item_t* pool = handle;
+    int rc;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if ((pool->threads == 0) && (pool->rc == 0)) {
+        pthread_mutex_unlock(&pool->mutex);
+        rc = pool->action(pool->arg, job);
+        pthread_mutex_lock(&pool->mutex);
+        sub_done(pool, job, rc);
+    }
+    else {
+        while ((pool->queued >= pool->depth) && (pool->rc == 0)) {
+            pthread_cond_wait(&pool->cond_space, &pool->mutex);
+        }
+        if (pool->rc == 0) {
+            pool->ring[(pool->head + pool->queued) % pool->depth] = job;
+            pool->queued++;
+            pthread_cond_signal(&pool->cond_job);
+        }
+        else {
+            sub_done(pool, job, pool->rc);
+        }
+    }
+    rc = pool->rc;
+
+    pthread_mutex_unlock(&pool->mutex);
+    return rc;
+}
+
+
+void workpool_wait(workpool_t handle, const bool* flag) {
+    workpool_item_t* pool = handle;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (*flag == false) {
+        pthread_cond_wait(&pool->cond_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+int workpool_finish(workpool_t handle, bool cancel) {
+    workpool_item_t* pool = handle;
+    int rc;
+
+    if (pool == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (cancel) {
+        /// Cancelled jobs are done with the error of the pool, or -1, which
+        /// doesn't become the error of the pool.
+        while (pool->queued > 0) {
+            void* job   = pool->ring[pool->head];
+            pool->head  = (pool->head + 1) % pool->depth;
+            pool->queued--;
+            if (pool->done != NULL) {
+                pool->done(pool->arg, job, (pool->rc != 0) ? pool->rc : -1);
+            }
+        }
+        pthread_cond_broadcast(&pool->cond_done);
+    }
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond_job);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i=0; i<pool->threads; i++) {
+        pthread_join(pool->thread[i], NULL);
+    }
+    rc = pool->rc;
+
+    pthread_cond_destroy(&pool->cond_done);
+    pthread_cond_destroy(&pool->cond_space);
+    pthread_cond_destroy(&pool->cond_job);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->ring);
+    free(pool->thread);
+    free(pool);
+    return rc;
+}
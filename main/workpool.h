@@ -0,0 +1,98 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef workpool_h
+#define workpool_h
+
+// Configuration Header
+#include "otdb_cfg.h"
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Worker Pools
+  * -------------------------------------------------------------------------
+  * A pool of threads that runs an action on jobs, which are put by one
+  * producer thread.  Jobs wait in a queue of bounded depth, so a producer
+  * that makes jobs faster than they are done is held back, which bounds the
+  * memory of jobs that are made but not done.  The pool is used by save,
+  * load and the parallel scans of the query module.
+  *
+  * Each job that is put is given to the done callback exactly once, under
+  * the mutex of the pool, with the result of the action.  Jobs that are not
+  * run, because the pool has failed or is cancelled, are given to it with
+  * the error instead.  The done callback may set a flag of the job that the
+  * producer then waits for with workpool_wait().
+  *
+  * If no worker can be started, jobs are run by workpool_put() itself.
+  */
+
+typedef void* workpool_t;
+
+/** @brief Action on a job, run by a worker
+  * @retval         0 on success.  The first non-zero result is the error of
+  *                 the pool, and jobs put after it aren't run.
+  */
+typedef int (*workpool_action_t)(void* arg, void* job);
+
+/** @brief Done callback of a job, run with the pool mutex held
+  */
+typedef void (*workpool_done_t)(void* arg, void* job, int rc);
+
+
+/** @brief Starts a pool
+  * @param handle   (workpool_t*) Output handle
+  * @param workers  (int) Most workers, which is further limited by the
+  *                 number of CPUs
+  * @param jobs     (long) Number of jobs, if it is known, or negative.  No
+  *                 more workers are started than there are jobs.
+  * @param depth    (int) Most jobs that wait in the queue, or 0 for twice
+  *                 the number of workers
+  * @param action   (workpool_action_t) Action on each job
+  * @param done     (workpool_done_t) Done callback of each job, or NULL
+  * @param arg      (void*) Argument of the action and the done callback
+  * @retval         0 on success, negative on error
+  */
+int workpool_start(workpool_t* handle, int workers, long jobs, int depth,
+                   workpool_action_t action, workpool_done_t done, void* arg);
+
+
+/** @brief Puts a job into the pool, waiting for space in the queue
+  * @param handle   (workpool_t) Pool handle
+  * @param job      (void*) Job
+  * @retval         Error of the pool so far, which is 0 if there is none
+  */
+int workpool_put(workpool_t handle, void* job);
+
+
+/** @brief Waits for a flag that the done callback of a job sets
+  * @param handle   (workpool_t) Pool handle
+  * @param flag     (const bool*) Flag, which is read with the pool mutex
+  */
+void workpool_wait(workpool_t handle, const bool* flag);
+
+
+/** @brief Waits for the jobs in the queue to be done, and stops the pool
+  * @param handle   (workpool_t) Pool handle
+  * @param cancel   (bool) If true, jobs that haven't started aren't run
+  * @retval         Error of the pool, which is 0 if there is none
+  */
+int workpool_finish(workpool_t handle, bool cancel);
+
+
+#endif
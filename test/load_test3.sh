@@ -0,0 +1,27 @@
+#!/bin/sh
+# Saves the DB as a binary snapshot (save -S) and opens it again, in a loop.
+# A file read before the save must read the same after the open.
+
+DEV=${DEV:-0100}
+
+otdb() {
+  echo "$@" | socat - UNIX-CONNECT:../otdb.sock
+}
+
+otdb open -j examples/classic
+
+while true; do
+  before=$(otdb r -i $DEV 0)
+  out=$(otdb save -j -S testsnap)
+  case "$out" in *'"err":-'*) echo "save -S failed: $out"; exit 1;; esac
+  out=$(otdb open -j testsnap)
+  case "$out" in *'"err":-'*) echo "open of snapshot failed: $out"; exit 1;; esac
+  after=$(otdb r -i $DEV 0)
+  if [ "$before" != "$after" ]; then
+    echo "snapshot round trip changed file 0 of $DEV"
+    echo "before: $before"
+    echo "after:  $after"
+    exit 1
+  fi
+  sleep 1;
+done
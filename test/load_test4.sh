@@ -0,0 +1,35 @@
+#!/bin/sh
+# Cuts the write-ahead log in the middle of its last record, and checks that
+# open replays the log up to the last complete record.
+
+DEV=${DEV:-0100}
+
+otdb() {
+  echo "$@" | socat - UNIX-CONNECT:../otdb.sock
+}
+
+otdb open -j examples/classic
+otdb save -j testwal
+
+otdb w -i $DEV 0 [11111111]
+first=$(otdb r -i $DEV 0)
+otdb w -i $DEV 0 [22222222]
+second=$(otdb r -i $DEV 0)
+
+# Let the flusher write out the log, then cut 5 bytes of the last record
+sleep 1
+size=$(wc -c < ../testwal.wal)
+truncate -s $((size - 5)) ../testwal.wal
+
+out=$(otdb open -j testwal)
+case "$out" in *'"err":-'*) echo "open failed: $out"; exit 1;; esac
+replayed=$(otdb r -i $DEV 0)
+
+if [ "$replayed" != "$first" ]; then
+  echo "replay of a cut log did not stop at its last complete record"
+  echo "expected: $first"
+  echo "got:      $replayed"
+  [ "$replayed" = "$second" ] && echo "(the cut record was replayed)"
+  exit 1
+fi
+echo "ok"